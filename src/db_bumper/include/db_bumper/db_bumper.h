@@ -8,19 +8,31 @@
 #include "ros/ros.h"
 #include "ros/console.h"
 #include <sensor_msgs/LaserScan.h>
+#include <boost/make_shared.hpp>
 
 #include "db_parsing/DodobotBumper.h"
+#include "db_bumper/DodobotBumperGeometry.h"
+
+#include "db_bumper/ray_cast.h"
 
 
 using namespace std;
 
-#define point pair<double, double>
 #define THROW_EXCEPTION(msg)  throw std::runtime_error(msg)
 
+// bumper states. Index into DodobotBumper::state_scans
+#define BUMPER_STATE_LEFT 0x1
+#define BUMPER_STATE_RIGHT 0x2
+#define NUM_BUMPER_STATES 4
+
+// largest scan_count the geometry service accepts (a tenth of a degree per beam). Caps what each state's scan can allocate
+#define MAX_SCAN_COUNT 3600
+
 
 class DodobotBumper {
 private:
     ros::NodeHandle nh;  // ROS node handle
+    ros::NodeHandle private_nh;  // parameters. The node's private namespace or the nodelet's
 
     ros::Publisher scan_pub;
 
@@ -29,35 +41,42 @@ private:
     string bumper_frame;
     int scan_count;
     double range_max;
+    double keepalive_rate;
     vector<double> left_bumper_x_points;
     vector<double> left_bumper_y_points;
     vector<double> right_bumper_x_points;
     vector<double> right_bumper_y_points;
+
+    // geometry. Rebuilt by init_scan_msg whenever the points or scan_count change
+    BeamSet beams;
+    SegmentSet left_segments;
+    SegmentSet right_segments;
     vector<double> left_occupied_scan;
     vector<double> right_occupied_scan;
+    bool check_points(const vector<double>& x_points, const vector<double>& y_points, string name, string* error);
 
     // Subscribers
     ros::Subscriber bumper_sub;
 
     // Sub callbacks
-    void bumper_callback(db_parsing::DodobotBumper msg);
-
-    // messages
-    sensor_msgs::LaserScan scan;
+    void bumper_callback(const db_parsing::DodobotBumper::ConstPtr& msg);
+
+    // messages. A scan only goes out when the bumper state changes, plus a
+    // keepalive at keepalive_rate so late subscribers and costmaps stay current
+    sensor_msgs::LaserScanPtr state_scans[NUM_BUMPER_STATES];  // built once by init_scan_msg
+    int current_state;  // -1 until the first bumper message
+    ros::Timer keepalive_timer;
+    void keepalive_callback(const ros::TimerEvent& event);
+    void publish_state(int state);
     void init_scan_msg();
-    double get_min_value(vector<double>* points);
-    double get_max_value(vector<double>* points);
-
-    double cross(point p1, point p2);
-    double dot(point p1, point p2);
+    void apply_scan(bool left, bool right, sensor_msgs::LaserScan* scan);
 
-    point get_line_intersection(point l11, point l12, point l21, point l22);
-    void to_points_vector(vector<double>* input_x, vector<double>* input_y, vector<point>* output);
-    double get_scan_dist(point p);
-    void apply_scan(bool left, bool right);
+    // Services
+    ros::ServiceServer geometry_srv;
+    bool geometry_callback(db_bumper::DodobotBumperGeometry::Request &req, db_bumper::DodobotBumperGeometry::Response &resp);
 
 public:
-    DodobotBumper(ros::NodeHandle* nodehandle);
+    DodobotBumper(ros::NodeHandle* nodehandle, ros::NodeHandle* private_nodehandle);
     int run();
 };
 
@@ -0,0 +1,44 @@
+#ifndef _DODOBOT_RAY_CAST_H_
+#define _DODOBOT_RAY_CAST_H_
+
+#include <stddef.h>
+#include <vector>
+
+
+// Line segments stored as structure of arrays
+class SegmentSet
+{
+public:
+    // consecutive points form a polyline. The x and y lists must be equal in length
+    void add_polyline(const std::vector<double>& x, const std::vector<double>& y);
+    void clear();
+    size_t size() const { return _x0.size(); }
+
+private:
+    friend class BeamSet;
+    std::vector<double> _x0, _y0;  // segment start
+    std::vector<double> _dx, _dy;  // segment end minus start
+};
+
+/**
+ * Beams from the origin cast against a SegmentSet.
+ *
+ * The beam directions are precomputed as structure of arrays. cast() runs
+ * the beams in the inner loop with no branches so the compiler can
+ * vectorize it, and each beam keeps its nearest hit across all segments.
+ */
+class BeamSet
+{
+public:
+    // count beams, evenly spaced starting at angle_min
+    void set_angles(double angle_min, double angle_increment, size_t count);
+    size_t size() const { return _cos.size(); }
+
+    // out[i] is the distance to the nearest segment along beam i, or range_max if nothing is closer
+    void cast(const SegmentSet& segments, double range_max, double* out) const;
+
+private:
+    std::vector<double> _cos, _sin;
+};
+
+#endif  // _DODOBOT_RAY_CAST_H_
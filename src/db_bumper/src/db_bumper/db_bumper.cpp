@@ -1,55 +1,58 @@
 #include <db_bumper/db_bumper.h>
 
 
-DodobotBumper::DodobotBumper(ros::NodeHandle* nodehandle):nh(*nodehandle)
+DodobotBumper::DodobotBumper(ros::NodeHandle* nodehandle, ros::NodeHandle* private_nodehandle):nh(*nodehandle),private_nh(*private_nodehandle)
 {
-    ros::param::param<string>("~bumper_scan_topic", bumper_scan_topic, "bumper_occupancy");
-    ros::param::param<string>("~bumper_frame", bumper_frame, "bumper");
-    ros::param::param<int>("~scan_count", scan_count, 25);
-    ros::param::param<double>("~range_max", range_max, 100.0);
+    private_nh.param<string>("bumper_scan_topic", bumper_scan_topic, "bumper_occupancy");
+    private_nh.param<string>("bumper_frame", bumper_frame, "bumper");
+    private_nh.param<int>("scan_count", scan_count, 25);
+    private_nh.param<double>("range_max", range_max, 100.0);
+    private_nh.param<double>("keepalive_rate", keepalive_rate, 1.0);
 
     ROS_INFO("bumper_scan_topic: %s", bumper_scan_topic.c_str());
     ROS_INFO("bumper_frame: %s", bumper_frame.c_str());
     ROS_DEBUG("scan_count: %d", scan_count);
     ROS_DEBUG("range_max: %f", range_max);
 
+    if (scan_count <= 0) {
+        THROW_EXCEPTION("scan_count must be positive!");
+    }
+    if (scan_count > MAX_SCAN_COUNT) {
+        THROW_EXCEPTION("scan_count can't be more than " + std::to_string(MAX_SCAN_COUNT));
+    }
+
     string key;
     // Bumper dimension parameters
-    if (!ros::param::search("left_bumper_x_points", key)) {
+    if (!private_nh.searchParam("left_bumper_x_points", key)) {
         THROW_EXCEPTION("Failed to find left_bumper_x_points parameter");
     }
     ROS_DEBUG("left_bumper_x_points: %s", key.c_str());
     nh.getParam(key, left_bumper_x_points);
 
-    if (!ros::param::search("left_bumper_y_points", key)) {
+    if (!private_nh.searchParam("left_bumper_y_points", key)) {
         THROW_EXCEPTION("Failed to find left_bumper_y_points parameter");
     }
     ROS_DEBUG("left_bumper_y_points: %s", key.c_str());
     nh.getParam(key, left_bumper_y_points);
 
-    if (!ros::param::search("right_bumper_x_points", key)) {
+    if (!private_nh.searchParam("right_bumper_x_points", key)) {
         THROW_EXCEPTION("Failed to find right_bumper_x_points parameter");
     }
     ROS_DEBUG("right_bumper_x_points: %s", key.c_str());
     nh.getParam(key, right_bumper_x_points);
 
-    if (!ros::param::search("right_bumper_y_points", key)) {
+    if (!private_nh.searchParam("right_bumper_y_points", key)) {
         THROW_EXCEPTION("Failed to find right_bumper_y_points parameter");
     }
     ROS_DEBUG("right_bumper_y_points: %s", key.c_str());
     nh.getParam(key, right_bumper_y_points);
 
-    if (left_bumper_x_points.size() != left_bumper_y_points.size()) {
-        THROW_EXCEPTION("Left bumper points are not equal in size!");
-    }
-    if (left_bumper_x_points.size() == 0) {
-        THROW_EXCEPTION("Left bumper points has zero length!");
-    }
-    if (right_bumper_x_points.size() != right_bumper_y_points.size()) {
-        THROW_EXCEPTION("Right bumper points are not equal in size!");
+    string error;
+    if (!check_points(left_bumper_x_points, left_bumper_y_points, "Left", &error)) {
+        THROW_EXCEPTION(error);
     }
-    if (right_bumper_x_points.size() == 0) {
-        THROW_EXCEPTION("Right bumper points has zero length!");
+    if (!check_points(right_bumper_x_points, right_bumper_y_points, "Right", &error)) {
+        THROW_EXCEPTION(error);
     }
 
     ROS_DEBUG_STREAM("left_bumper_x_points len: " << left_bumper_x_points.size());
@@ -65,48 +68,38 @@ DodobotBumper::DodobotBumper(ros::NodeHandle* nodehandle):nh(*nodehandle)
 
     // "laser scan" init
     init_scan_msg();
+    current_state = -1;
 
-    ROS_INFO("db_bumper init done");
-}
+    // Services
+    geometry_srv = nh.advertiseService("bumper_geometry", &DodobotBumper::geometry_callback, this);
 
-double DodobotBumper::get_min_value(vector<double>* points)
-{
-    vector<double>::iterator result = std::min_element(points->begin(), points->end());
-    int index = std::distance(points->begin(), result);
-    return points->at(index);
+    if (keepalive_rate > 0.0) {
+        keepalive_timer = nh.createTimer(ros::Duration(1.0 / keepalive_rate), &DodobotBumper::keepalive_callback, this);
+    }
+
+    ROS_INFO("db_bumper init done");
 }
 
-double DodobotBumper::get_max_value(vector<double>* points)
+bool DodobotBumper::check_points(const vector<double>& x_points, const vector<double>& y_points, string name, string* error)
 {
-    vector<double>::iterator result = std::max_element(points->begin(), points->end());
-    int index = std::distance(points->begin(), result);
-    return points->at(index);
+    if (x_points.size() != y_points.size()) {
+        *error = name + " bumper points are not equal in size!";
+        return false;
+    }
+    if (x_points.size() < 2) {
+        *error = name + " bumper needs at least two points!";
+        return false;
+    }
+    return true;
 }
 
 void DodobotBumper::init_scan_msg()
 {
-    double min_x = std::min(
-        get_min_value(&left_bumper_x_points),
-        get_min_value(&right_bumper_x_points)
-    );
-    double max_x = std::max(
-        get_max_value(&left_bumper_x_points),
-        get_max_value(&right_bumper_x_points)
-    );
-
-    double min_y = std::min(
-        get_min_value(&left_bumper_y_points),
-        get_min_value(&right_bumper_y_points)
-    );
-    double max_y = std::max(
-        get_max_value(&left_bumper_y_points),
-        get_max_value(&right_bumper_y_points)
-    );
-
-    double angle_min = -M_PI; //atan2(min_y, min_x);
-    double angle_max = M_PI; //atan2(max_y, max_x);
+    double angle_min = -M_PI;
+    double angle_max = M_PI;
     double angle_increment = 2 * M_PI / scan_count;
 
+    sensor_msgs::LaserScan scan;
     scan.header.frame_id = bumper_frame;
     scan.angle_min = angle_min;
     scan.angle_max = angle_max;
@@ -119,147 +112,60 @@ void DodobotBumper::init_scan_msg()
     scan.ranges.resize(scan_count, range_max);
     scan.intensities.assign(scan_count, 100.0);
 
-    left_occupied_scan.assign(scan_count, range_max);
-    right_occupied_scan.assign(scan_count, range_max);
-
-    vector<point> left_bumper_points;
-    vector<point> right_bumper_points;
-    to_points_vector(&left_bumper_x_points, &left_bumper_y_points, &left_bumper_points);
-    to_points_vector(&right_bumper_x_points, &right_bumper_y_points, &right_bumper_points);
-
-    point origin = std::make_pair(0.0, 0.0);
-    double scan_angle = angle_min;
-    for (size_t scan_index = 0; scan_index < scan_count; scan_index++)
-    {
-        point scan_point;
-        scan_point.first = range_max * cos(scan_angle);
-        scan_point.second = range_max * sin(scan_angle);
-
-        for (size_t point_index = 0; point_index < left_bumper_points.size() - 1; point_index++)
-        {
-            point p1 = left_bumper_points[point_index];
-            point p2 = left_bumper_points[point_index + 1];
-            point intersect_p = get_line_intersection(origin, scan_point, p1, p2);
-            double dist = get_scan_dist(intersect_p);
-            if (dist != FLT_MAX) {
-                left_occupied_scan[scan_index] = dist;
-            }
-        }
-
-        for (size_t point_index = 0; point_index < right_bumper_points.size() - 1; point_index++)
-        {
-            point p1 = right_bumper_points[point_index];
-            point p2 = right_bumper_points[point_index + 1];
-            point intersect_p = get_line_intersection(origin, scan_point, p1, p2);
-            double dist = get_scan_dist(intersect_p);
-            if (dist != FLT_MAX) {
-                right_occupied_scan[scan_index] = dist;
-            }
-        }
-
-        scan_angle += angle_increment;
+    if (beams.size() != (size_t)scan_count) {
+        beams.set_angles(angle_min, angle_increment, scan_count);
     }
-}
-
-double DodobotBumper::cross(point p1, point p2) {
-    return p1.first * p2.second - p1.second * p2.first;
-}
-
-double DodobotBumper::dot(point p1, point p2) {
-    return p1.first * p1.second + p1.first * p2.second;
-}
-
-point DodobotBumper::get_line_intersection(point l11, point l12, point l21, point l22)
-{
-    // source: https://stackoverflow.com/questions/563198/how-do-you-detect-where-two-line-segments-intersect
-    point p = l11;
-    point q = l21;
-
-    point r = std::make_pair(l12.first - l11.first, l12.second - l11.second);
-    point s = std::make_pair(l22.first - l21.first, l22.second - l21.second);
 
-    point a = std::make_pair(q.first - p.first, q.second - p.second);
+    left_segments.clear();
+    left_segments.add_polyline(left_bumper_x_points, left_bumper_y_points);
+    right_segments.clear();
+    right_segments.add_polyline(right_bumper_x_points, right_bumper_y_points);
 
-    point nan_point = std::make_pair(FLT_MAX, FLT_MAX);
+    left_occupied_scan.resize(scan_count);
+    right_occupied_scan.resize(scan_count);
+    beams.cast(left_segments, range_max, left_occupied_scan.data());
+    beams.cast(right_segments, range_max, right_occupied_scan.data());
 
-    if (cross(r, s) == 0.0 && cross(a, r) == 0.0)  // colinear case
-    {
-        double t0 = dot(a, r) / dot(r, r);
-        double t1 = t0 + dot(s, r) / dot(r, r);
-        if (dot(s, r) >= 0.0)
-        {
-            if (t0 <= 0.0 && 0.0 <= t1) {
-                return l11;
-            }
-            else {
-                return nan_point;
-            }
-        }
-        else {
-            if (t1 <= 0.0 && 0.0 <= t0) {
-                return l11;
-            }
-            else {
-                return nan_point;
-            }
-        }
-    }
-    else if (cross(r, s) == 0.0 && cross(a, r) != 0.0) {  // parallel case
-        return nan_point;
-    }
-
-    double t = cross(a, s) / cross(r, s);
-    double u = cross(a, r) / cross(r, s);
-
-    if (0.0 <= t && t <= 1.0 && 0.0 <= u && u <= 1.0) {
-        point intersect_p = std::make_pair(p.first + t * r.first, p.second + t * r.second);
-        return intersect_p;
-    }
-    else {
-        return nan_point;
-    }
-}
-
-void DodobotBumper::to_points_vector(vector<double>* input_x, vector<double>* input_y, vector<point>* output)
-{
-    ROS_ASSERT_MSG(input_x->size() == input_y->size(), "X and Y points are not equal in size!");
-    output->resize(input_x->size());
-    for (size_t i = 0; i < input_x->size(); i++) {
-        (*output)[i] = std::make_pair(input_x->at(i), input_y->at(i));
-    }
-}
-
-double DodobotBumper::get_scan_dist(point p)
-{
-    if (p.first == FLT_MAX || p.second == FLT_MAX) {
-        return FLT_MAX;
-    }
-    else {
-        return sqrt(pow(p.first, 2) + pow(p.second, 2));
+    // there are only four possible scans. Build them all now
+    for (int state = 0; state < NUM_BUMPER_STATES; state++) {
+        state_scans[state] = boost::make_shared<sensor_msgs::LaserScan>(scan);
+        apply_scan(state & BUMPER_STATE_LEFT, state & BUMPER_STATE_RIGHT, state_scans[state].get());
     }
 }
 
-void DodobotBumper::apply_scan(bool left, bool right)
+void DodobotBumper::apply_scan(bool left, bool right, sensor_msgs::LaserScan* scan)
 {
-    for (size_t i = 0; i < scan.ranges.size(); i++) {
-        scan.ranges[i] = range_max;
+    for (size_t i = 0; i < scan->ranges.size(); i++) {
+        scan->ranges[i] = range_max;
     }
     if (left) {
         for (size_t scan_index = 0; scan_index < left_occupied_scan.size(); scan_index++) {
             if (left_occupied_scan[scan_index] < range_max) {
-                scan.ranges[scan_index] = left_occupied_scan[scan_index];
+                scan->ranges[scan_index] = left_occupied_scan[scan_index];
             }
         }
     }
     if (right) {
         for (size_t scan_index = 0; scan_index < right_occupied_scan.size(); scan_index++) {
             if (right_occupied_scan[scan_index] < range_max) {
-                scan.ranges[scan_index] = right_occupied_scan[scan_index];
+                scan->ranges[scan_index] = right_occupied_scan[scan_index];
             }
         }
     }
 }
 
+void DodobotBumper::publish_state(int state)
+{
+    sensor_msgs::LaserScanPtr& cached = state_scans[state];
+    if (!cached.unique()) {
+        // a subscriber in this process may still be reading the last one sent. Don't restamp it under them
+        cached = boost::make_shared<sensor_msgs::LaserScan>(*cached);
+    }
+    cached->header.stamp = ros::Time::now();
+    scan_pub.publish(cached);
+    current_state = state;
+}
+
 
 
 int DodobotBumper::run()
@@ -292,10 +198,67 @@ int DodobotBumper::run()
 // Sub callbacks
 //
 
-void DodobotBumper::bumper_callback(db_parsing::DodobotBumper msg)
+void DodobotBumper::bumper_callback(const db_parsing::DodobotBumper::ConstPtr& msg)
 {
-    apply_scan(msg.left, msg.right);
+    int state = (msg->left ? BUMPER_STATE_LEFT : 0) | (msg->right ? BUMPER_STATE_RIGHT : 0);
+    if (state != current_state) {
+        publish_state(state);
+    }
+}
+
+void DodobotBumper::keepalive_callback(const ros::TimerEvent& event)
+{
+    if (current_state >= 0) {
+        publish_state(current_state);
+    }
+}
+
+//
+// Services
+//
+
+bool DodobotBumper::geometry_callback(db_bumper::DodobotBumperGeometry::Request &req, db_bumper::DodobotBumperGeometry::Response &resp)
+{
+    string error;
+    if (!check_points(req.left_bumper_x_points, req.left_bumper_y_points, "Left", &error) ||
+            !check_points(req.right_bumper_x_points, req.right_bumper_y_points, "Right", &error)) {
+        ROS_WARN("Rejected bumper geometry: %s", error.c_str());
+        resp.success = false;
+        resp.message = error;
+        return true;
+    }
+    if (req.scan_count < 0) {
+        ROS_WARN("Rejected bumper geometry: scan_count %d is negative", req.scan_count);
+        resp.success = false;
+        resp.message = "scan_count can't be negative";
+        return true;
+    }
+    if (req.scan_count > MAX_SCAN_COUNT) {
+        ROS_WARN("Rejected bumper geometry: scan_count %d is over %d", req.scan_count, MAX_SCAN_COUNT);
+        resp.success = false;
+        resp.message = "scan_count can't be more than " + std::to_string(MAX_SCAN_COUNT);
+        return true;
+    }
+
+    left_bumper_x_points = req.left_bumper_x_points;
+    left_bumper_y_points = req.left_bumper_y_points;
+    right_bumper_x_points = req.right_bumper_x_points;
+    right_bumper_y_points = req.right_bumper_y_points;
+    if (req.scan_count > 0) {
+        scan_count = req.scan_count;
+    }
+
+    ros::WallTime start_time = ros::WallTime::now();
+    init_scan_msg();
+    double build_time_us = (ros::WallTime::now() - start_time).toSec() * 1e6;
+    ROS_INFO("Rebuilt bumper scans (%d beams) in %0.1f us", scan_count, build_time_us);
+
+    // subscribers shouldn't wait for the next state change to see the new geometry
+    if (current_state >= 0) {
+        publish_state(current_state);
+    }
 
-    scan.header.stamp = ros::Time::now();
-    scan_pub.publish(scan);
+    resp.success = true;
+    resp.message = "";
+    return true;
 }
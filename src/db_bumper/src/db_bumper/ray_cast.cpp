@@ -0,0 +1,71 @@
+#include <db_bumper/ray_cast.h>
+
+#include <algorithm>
+#include <math.h>
+
+
+void BeamSet::set_angles(double angle_min, double angle_increment, size_t count)
+{
+    _cos.resize(count);
+    _sin.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        double angle = angle_min + angle_increment * (double)i;
+        _cos[i] = cos(angle);
+        _sin[i] = sin(angle);
+    }
+}
+
+void BeamSet::cast(const SegmentSet& segments, double range_max, double* out) const
+{
+    const size_t count = _cos.size();
+    const double* beam_cos = _cos.data();
+    const double* beam_sin = _sin.data();
+
+    std::fill(out, out + count, range_max);
+
+    for (size_t seg = 0; seg < segments.size(); seg++)
+    {
+        const double x0 = segments._x0[seg];
+        const double y0 = segments._y0[seg];
+        const double dx = segments._dx[seg];
+        const double dy = segments._dy[seg];
+        const double start_cross = x0 * dy - y0 * dx;
+
+        // beam: t * (c, s). segment: (x0, y0) + u * (dx, dy).
+        // Solve both for t and u scaled by the denominator so parallel
+        // beams (denominator 0) fall out of the range checks instead of branching
+        for (size_t i = 0; i < count; i++)
+        {
+            double denom = beam_cos[i] * dy - beam_sin[i] * dx;
+            double sign = denom < 0.0 ? -1.0 : 1.0;
+            double abs_denom = denom * sign;
+            double t_scaled = start_cross * sign;
+            double u_scaled = (x0 * beam_sin[i] - y0 * beam_cos[i]) * sign;
+
+            bool hit = abs_denom > 0.0 &&
+                t_scaled >= 0.0 && t_scaled <= range_max * abs_denom &&
+                u_scaled >= 0.0 && u_scaled <= abs_denom;
+            double dist = t_scaled / (abs_denom > 0.0 ? abs_denom : 1.0);
+            out[i] = hit ? std::min(out[i], dist) : out[i];
+        }
+    }
+}
+
+void SegmentSet::add_polyline(const std::vector<double>& x, const std::vector<double>& y)
+{
+    size_t count = std::min(x.size(), y.size());
+    for (size_t i = 0; i + 1 < count; i++) {
+        _x0.push_back(x[i]);
+        _y0.push_back(y[i]);
+        _dx.push_back(x[i + 1] - x[i]);
+        _dy.push_back(y[i + 1] - y[i]);
+    }
+}
+
+void SegmentSet::clear()
+{
+    _x0.clear();
+    _y0.clear();
+    _dx.clear();
+    _dy.clear();
+}
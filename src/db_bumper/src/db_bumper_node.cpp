@@ -5,8 +5,9 @@ int main(int argc, char **argv)
 {
     ros::init(argc, argv, "db_bumper");
     ros::NodeHandle nh;
+    ros::NodeHandle private_nh("~");
 
-    DodobotBumper broadcaster(&nh);
+    DodobotBumper broadcaster(&nh, &private_nh);
     int err = broadcaster.run();
 
     return err;
@@ -0,0 +1,28 @@
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+#include "db_bumper/db_bumper.h"
+
+namespace db_bumper
+{
+
+// Runs DodobotBumper inside a nodelet manager, next to db_parsing, so bumper
+// states are passed by pointer
+class DodobotBumperNodelet : public nodelet::Nodelet
+{
+public:
+    DodobotBumperNodelet() : bumper(NULL) {}
+    ~DodobotBumperNodelet() { delete bumper; }
+
+private:
+    DodobotBumper* bumper;
+
+    virtual void onInit()
+    {
+        bumper = new DodobotBumper(&getNodeHandle(), &getPrivateNodeHandle());
+    }
+};
+
+}  // namespace db_bumper
+
+PLUGINLIB_EXPORT_CLASS(db_bumper::DodobotBumperNodelet, nodelet::Nodelet)
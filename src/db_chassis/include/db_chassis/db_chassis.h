@@ -9,13 +9,17 @@
 #include "ros/console.h"
 #include <tf2/convert.h>
 #include <tf2/LinearMath/Quaternion.h>
-#include <tf2_ros/transform_broadcaster.h>
+#include <tf2_msgs/TFMessage.h>
 #include "tf2_geometry_msgs/tf2_geometry_msgs.h"
 #include <geometry_msgs/TransformStamped.h>
 #include <geometry_msgs/Twist.h>
 #include <nav_msgs/Odometry.h>
 #include <sensor_msgs/JointState.h>
 #include <dynamic_reconfigure/server.h>
+#include <boost/make_shared.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 #include "db_parsing/DodobotPidSrv.h"
 
@@ -32,11 +36,27 @@
 #include "db_chassis/LinearVelocity.h"
 
 #include "db_chassis/DodobotOdomReset.h"
+#include "db_chassis/DodobotSpeedCapture.h"
+#include "db_chassis/DodobotSpeedCaptureDump.h"
 #include "db_chassis/DodobotChassisConfig.h"
 
+#include "db_chassis/interpolation_table.h"
+#include "db_chassis/speed_capture.h"
+
 
 using namespace std;
 
+// DodobotChassis.cfg levels
+#define CHASSIS_CFG_PID 0x1  // forwarded to the microcontroller
+#define CHASSIS_CFG_CONVERSIONS 0x2  // servo and gripper geometry. Rebuilds the conversion tables
+
+// positions in the combined joint state message
+enum ChassisJoint {
+    LINEAR_JOINT = 0,
+    TILTER_JOINT,
+    NUM_CHASSIS_JOINTS
+};
+
 struct OdomState {
     double x;  // x position
     double y;  // y position
@@ -49,7 +69,7 @@ struct OdomState {
     double vy;  // y component of velocity
 };
 
-void reset_odom_state(OdomState* state)
+inline void reset_odom_state(OdomState* state)
 {
     state->x = 0.0;
     state->y = 0.0;
@@ -61,7 +81,7 @@ void reset_odom_state(OdomState* state)
 }
 
 
-OdomState* init_odom_state()
+inline OdomState* init_odom_state()
 {
     OdomState* state = new OdomState;
     reset_odom_state(state);
@@ -71,6 +91,7 @@ OdomState* init_odom_state()
 class DodobotChassis {
 private:
     ros::NodeHandle nh;  // ROS node handle
+    ros::NodeHandle private_nh;  // parameters and dynamic reconfigure. The node's private namespace or the nodelet's
 
     // launch parameters
     double wheel_radius_mm;
@@ -148,21 +169,22 @@ private:
     double stepper_z_pos;
 
     ros::Time odom_timestamp;
-    ros::Time prev_odom_time;
+    ros::Time prev_odom_time;  // header.stamp of the previous encoder sample
+    bool has_prev_drive_sample;
     int64_t prev_left_ticks;
     int64_t prev_right_ticks;
     ros::Duration odom_idle_timeout;
+    double joint_state_rate;
 
     // Publishers
-    tf2_ros::TransformBroadcaster tf_broadcaster;
+    ros::Publisher tf_pub;
     ros::Publisher odom_pub;
     ros::Publisher drive_pub;
     ros::Publisher gripper_pub;
     ros::Publisher parallel_gripper_pub;
     ros::Publisher linear_pub;
     ros::Publisher linear_pos_pub;
-    ros::Publisher linear_joint_pub;
-    ros::Publisher tilter_joint_pub;
+    ros::Publisher joint_state_pub;
     ros::Publisher tilter_pub;
 
     // Subscribers
@@ -177,19 +199,18 @@ private:
     ros::Subscriber tilter_orientation_sub;
 
     // Sub callbacks
-    void twist_callback(geometry_msgs::Twist msg);
-    void drive_callback(db_parsing::DodobotDrive msg);
-    void tilter_callback(db_parsing::DodobotTilter msg);
-    void linear_callback(db_parsing::DodobotLinear msg);
-    void gripper_callback(db_parsing::DodobotGripper msg);
-    void parallel_gripper_callback(db_parsing::DodobotParallelGripper msg);
-    void linear_pos_callback(db_chassis::LinearPosition msg);
-    void linear_vel_callback(db_chassis::LinearVelocity msg);
-    void tilter_orientation_callback(geometry_msgs::Quaternion msg);
+    void twist_callback(const geometry_msgs::Twist::ConstPtr& msg);
+    void drive_callback(const db_parsing::DodobotDrive::ConstPtr& msg);
+    void tilter_callback(const db_parsing::DodobotTilter::ConstPtr& msg);
+    void linear_callback(const db_parsing::DodobotLinear::ConstPtr& msg);
+    void gripper_callback(const db_parsing::DodobotGripper::ConstPtr& msg);
+    void parallel_gripper_callback(const db_parsing::DodobotParallelGripper::ConstPtr& msg);
+    void linear_pos_callback(const db_chassis::LinearPosition::ConstPtr& msg);
+    void linear_vel_callback(const db_chassis::LinearVelocity::ConstPtr& msg);
+    void tilter_orientation_callback(const geometry_msgs::Quaternion::ConstPtr& msg);
 
     // messages
-    db_parsing::DodobotDrive drive_sub_msg;
-    db_parsing::DodobotDrive drive_pub_msg;
+    db_parsing::DodobotDrive::ConstPtr drive_sub_msg;  // latest encoder sample. Shared with the publisher, never modified
 
     db_parsing::DodobotParallelGripper parallel_gripper_msg;
     db_parsing::DodobotGripper gripper_msg;
@@ -207,44 +228,94 @@ private:
     string odom_reset_service_name;
     bool odom_reset_callback(db_chassis::DodobotOdomReset::Request &req, db_chassis::DodobotOdomReset::Response &resp);
 
+    // Speed profile capture for PID tuning. The profile is driven and
+    // recorded from drive_callback, one step per encoder sample.
+    // speed_capture_timer ends it speed_capture_margin seconds after the
+    // profile should have finished, in case the encoder samples stop coming
+    SpeedCapture speed_capture;
+    ros::Time speed_capture_start;  // header.stamp of the first captured sample. Zero until it arrives
+    double speed_capture_margin;
+    ros::Timer speed_capture_timer;
+    ros::ServiceServer speed_capture_srv;
+    ros::ServiceServer speed_capture_dump_srv;
+    bool speed_capture_callback(db_chassis::DodobotSpeedCapture::Request &req, db_chassis::DodobotSpeedCapture::Response &resp);
+    bool speed_capture_dump_callback(db_chassis::DodobotSpeedCaptureDump::Request &req, db_chassis::DodobotSpeedCaptureDump::Response &resp);
+    void speed_capture_update(const db_parsing::DodobotDrive::ConstPtr& msg);
+    void speed_capture_timeout(const ros::TimerEvent& event);
+    void stop_speed_capture();  // stops the wheels too
+
     ros::ServiceClient set_pid_srv;
     string pid_service_name;
     bool first_time_pid_setup;
 
+    // PID gains are sent from their own thread so a slow dodobot_pid call
+    // never holds up the encoder callbacks. Only the latest gains are sent
+    boost::thread* pid_thread;
+    boost::mutex pid_mutex;
+    boost::condition_variable pid_cond;
+    bool pid_pending;
+    bool pid_stop_flag;
+    db_parsing::DodobotPidSrv pid_request;
+    void pid_thread_task();
+
     void setup();
     void loop();
     void stop();
+    ros::Timer loop_timer;
+    void loop_timer_callback(const ros::TimerEvent& event);
 
-    // Joint states
-    sensor_msgs::JointState linear_joint;
-    sensor_msgs::JointState tilter_joint;
+    // Joint states. Both joints share one message. It's only published when a joint moves
+    sensor_msgs::JointState joint_state_msg;
+    bool joint_states_changed;
+    void set_joint_position(ChassisJoint joint, double position);
     void publish_joint_states();
 
-    // Data handling/conversion
-    size_t num_dist_samples;
-    vector<double> angle_samples;
-    vector<double> dist_samples;
+    // TF. Each encoder sample sends odom and the joint frames as one TFMessage.
+    // While odometry is idle the timer sends the joint frames on their own
+    bool publish_joint_tf;
+    tf2_msgs::TFMessage tf_msg;  // odom (if publish_odom_tf), then the joints (if publish_joint_tf)
+    tf2_msgs::TFMessage joint_tf_msg;
+    ros::Time last_tf_time;
+    ros::Duration joint_tf_timeout;
+    void init_joint_transforms(vector<geometry_msgs::TransformStamped>* transforms);
+    void update_joint_transforms(geometry_msgs::TransformStamped* transforms, ros::Time stamp);
+
+    // Data handling/conversion. The tables are rebuilt by
+    // compute_conversions() whenever the parameters behind them change
+    int conversion_table_resolution;
+    InterpolationTable parallel_dist_to_angle_table;
+    InterpolationTable gripper_command_to_angle_table;
+    InterpolationTable gripper_angle_to_command_table;
+    InterpolationTable tilter_command_to_angle_table;
+    InterpolationTable tilter_angle_to_command_table;
+    void compute_conversions();
     double angle_to_parallel_dist(double angle_rad);
     double parallel_dist_to_angle(double parallel_dist);
     void compute_parallel_dist_to_angle_lookup();
 
-    double servo_to_angle(int command, int max_command, int min_command, double min_angle, double max_angle);
-    int angle_to_servo(double angle, int max_command, int min_command, double min_angle, double max_angle);
+    double gripper_command_to_angle(int command);
+    int gripper_angle_to_command(double angle);
     double tilt_command_to_angle_rad(int command);
     int tilt_angle_rad_to_command(double angle_rad);
 
     double bound_speed(double value, double lower, double upper, double epsilon);
+    void publish_drive_command(int64_t left_command, int64_t right_command);
+    int64_t last_left_command, last_right_command;  // last published by publish_drive_command
 
     double ticks_to_m(int64_t ticks);
     int64_t m_to_ticks(double dist_m);
 
     // Compute odometry
     void odom_estimator_update(double delta_left, double delta_right, double left_speed, double right_speed, double dt);
-    void compute_odometry();
+    bool compute_odometry();
     void publish_chassis_data();
 
 public:
-    DodobotChassis(ros::NodeHandle* nodehandle);
+    DodobotChassis(ros::NodeHandle* nodehandle, ros::NodeHandle* private_nodehandle);
+    ~DodobotChassis();
+
+    // start() sets up timers and returns. run() also spins until ROS shuts down
+    void start();
     int run();
 };
 
@@ -0,0 +1,67 @@
+#ifndef _DODOBOT_INTERPOLATION_TABLE_H_
+#define _DODOBOT_INTERPOLATION_TABLE_H_
+
+#include <stddef.h>
+#include <vector>
+
+
+/**
+ * Piecewise linear y = f(x) sampled on a uniform grid of x.
+ *
+ * Because the grid is uniform, a lookup is one multiply to find the cell
+ * and one interpolation inside it, whatever the resolution. Build it either
+ * from a function (sample) or from measured points that may be unevenly
+ * spaced and in either order (resample). Queries past either end are
+ * extrapolated from the end cell, so a two point table reproduces a linear
+ * mapping exactly.
+ */
+class InterpolationTable
+{
+public:
+    InterpolationTable() : _xMin(0.0), _xMax(0.0), _step(0.0), _invStep(0.0) {}
+
+    // resolution is the number of grid points, at least 2
+    template <typename Function> void sample(Function f, double x_min, double x_max, size_t resolution)
+    {
+        set_grid(x_min, x_max, resolution);
+        for (size_t i = 0; i < _y.size(); i++) {
+            _y[i] = f(grid_x(i));
+        }
+    }
+
+    // x and y are paired samples. x needs to be monotonic but may be decreasing
+    void resample(const std::vector<double>& x, const std::vector<double>& y, size_t resolution);
+
+    double evaluate(double x) const
+    {
+        double position = (x - _xMin) * _invStep;
+        size_t index = 0;
+        if (position >= _y.size() - 1) {
+            index = _y.size() - 2;
+        }
+        else if (position > 0.0) {
+            index = (size_t)position;
+        }
+        double t = position - (double)index;
+        return _y[index] + t * (_y[index + 1] - _y[index]);
+    }
+
+    // out[i] = evaluate(x[i])
+    void evaluate(const double* x, double* out, size_t count) const;
+
+    bool contains(double x) const { return _xMin <= x && x <= _xMax; }
+    bool empty() const { return _y.size() < 2; }
+    size_t size() const { return _y.size(); }
+    double x_min() const { return _xMin; }
+    double x_max() const { return _xMax; }
+
+private:
+    double _xMin, _xMax;
+    double _step, _invStep;
+    std::vector<double> _y;
+
+    void set_grid(double x_min, double x_max, size_t resolution);
+    double grid_x(size_t index) const { return _xMin + _step * (double)index; }
+};
+
+#endif  // _DODOBOT_INTERPOLATION_TABLE_H_
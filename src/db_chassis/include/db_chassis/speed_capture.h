@@ -0,0 +1,80 @@
+#ifndef _DODOBOT_SPEED_CAPTURE_H_
+#define _DODOBOT_SPEED_CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+enum SpeedProfileType {
+    SPEED_PROFILE_STEP = 0,
+    SPEED_PROFILE_RAMP
+};
+
+struct SpeedProfile {
+    SpeedProfileType type;
+    double left_tps;  // final setpoints, ticks per second
+    double right_tps;
+    double delay;  // seconds at zero before the step or ramp
+    double ramp_time;  // seconds from zero to the final setpoint (ramp only)
+    double duration;  // seconds of capture in total
+};
+
+struct SpeedSample {
+    double time;  // seconds since the first sample of the capture
+    float left_setpoint;
+    float right_setpoint;
+    int64_t left_enc_pos;
+    int64_t right_enc_pos;
+    float left_enc_speed;
+    float right_enc_speed;
+};
+
+#define SPEED_SAMPLE_BINARY_SIZE 40  // bytes per sample in to_binary()
+
+/**
+ * Runs a step or ramp speed profile and records the encoder samples it
+ * produces in a ring buffer.
+ *
+ * The buffer is allocated by reserve() up front, so record() never
+ * allocates. Once it's full the oldest samples are overwritten and
+ * counted in dropped().
+ */
+class SpeedCapture
+{
+public:
+    SpeedCapture() : _head(0), _count(0), _dropped(0), _active(false) {}
+
+    void reserve(size_t capacity);
+    size_t capacity() const { return _samples.size(); }
+
+    // clears the previous capture
+    void start(const SpeedProfile& profile);
+    void stop() { _active = false; }
+    bool active() const { return _active; }
+
+    // setpoints at time since the start of the capture. Zero once the profile is over
+    void setpoint(double time, double* left_tps, double* right_tps) const;
+    bool finished(double time) const { return time >= _profile.duration; }
+
+    void record(const SpeedSample& sample);
+
+    // oldest first
+    size_t size() const { return _count; }
+    size_t dropped() const { return _dropped; }
+    const SpeedSample& at(size_t index) const { return _samples[(_head + index) % _samples.size()]; }
+
+    void to_csv(std::string* out) const;
+    void to_binary(std::vector<uint8_t>* out) const;
+
+private:
+    SpeedProfile _profile;
+    std::vector<SpeedSample> _samples;
+    size_t _head;  // index of the oldest sample
+    size_t _count;
+    size_t _dropped;
+    bool _active;
+};
+
+#endif  // _DODOBOT_SPEED_CAPTURE_H_
@@ -0,0 +1,63 @@
+'''
+Runs a speed profile on the robot and saves the capture as a csv.
+
+db_chassis drives the wheels and records every encoder sample itself, so no
+bag is needed. Combine with dynamic_reconfigure to change the PID constants
+between runs.
+
+Usage:
+	python speed_profiler.py step 0.3 [duration] [output.csv]
+	python speed_profiler.py ramp 0.3 [duration] [output.csv]
+'''
+
+import sys
+import time
+
+import rospy
+from db_chassis.srv import DodobotSpeedCapture, DodobotSpeedCaptureDump
+
+
+def main():
+	if len(sys.argv) < 3:
+		print(__doc__)
+		sys.exit(1)
+	profile = sys.argv[1]
+	speed = float(sys.argv[2])
+	duration = float(sys.argv[3]) if len(sys.argv) > 3 else 3.0
+	path = sys.argv[4] if len(sys.argv) > 4 else "speed_%s_%d.csv" % (profile, int(time.time()))
+
+	rospy.init_node("speed_profiler", anonymous=True)
+	rospy.wait_for_service("/dodobot/dodobot_speed_capture")
+	capture = rospy.ServiceProxy("/dodobot/dodobot_speed_capture", DodobotSpeedCapture)
+	dump = rospy.ServiceProxy("/dodobot/dodobot_speed_capture_dump", DodobotSpeedCaptureDump)
+
+	resp = capture(profile=profile, left_speed=speed, right_speed=speed, delay=0.5, ramp_time=duration / 3.0, duration=duration)
+	if not resp.success:
+		print("Capture failed: " + resp.message)
+		sys.exit(1)
+
+	# db_chassis ends the capture on its own shortly after duration, even if the encoders stop reporting
+	deadline = time.time() + duration + 5.0
+	try:
+		time.sleep(duration + 0.5)
+		while True:
+			resp = dump("csv")
+			if resp.success:
+				break
+			if time.time() > deadline:
+				capture(abort=True)
+				print("Capture didn't finish: " + resp.message)
+				sys.exit(1)
+			time.sleep(0.1)
+	except (KeyboardInterrupt, rospy.ROSInterruptException):
+		capture(abort=True)
+		print("Capture aborted")
+		sys.exit(1)
+
+	with open(path, "w") as file:
+		file.write(bytearray(resp.data).decode())
+	print("Wrote %d samples (%d dropped) to %s" % (resp.sample_count, resp.dropped_count, path))
+
+
+if __name__ == "__main__":
+	main()
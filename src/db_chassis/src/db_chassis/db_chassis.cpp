@@ -1,66 +1,72 @@
 #include <db_chassis/db_chassis.h>
 
 
-DodobotChassis::DodobotChassis(ros::NodeHandle* nodehandle):nh(*nodehandle)
+DodobotChassis::DodobotChassis(ros::NodeHandle* nodehandle, ros::NodeHandle* private_nodehandle):nh(*nodehandle),private_nh(*private_nodehandle),dyn_cfg(private_nh)
 {
     string drive_cmd_topic_name = "";
 
     // Odometry parameters
-    ros::param::param<double>("~wheel_radius_mm", wheel_radius_mm, 30.0) ;
-    ros::param::param<double>("~wheel_distance_mm", wheel_distance_mm, 183.21);
-    ros::param::param<double>("~ticks_per_rotation", ticks_per_rotation, 341.2 * 4.0);
-    ros::param::param<double>("~max_speed_tps", max_speed_tps, 5000.0);
+    private_nh.param<double>("wheel_radius_mm", wheel_radius_mm, 30.0) ;
+    private_nh.param<double>("wheel_distance_mm", wheel_distance_mm, 183.21);
+    private_nh.param<double>("ticks_per_rotation", ticks_per_rotation, 341.2 * 4.0);
+    private_nh.param<double>("max_speed_tps", max_speed_tps, 5000.0);
 
     // Odometry speed parameters
-    ros::param::param<double>("~min_angular_speed", min_angular_speed, 0.0);
-    ros::param::param<double>("~max_angular_speed", max_angular_speed, 0.0);
-    ros::param::param<double>("~min_linear_speed", min_linear_speed, 0.0);
-    ros::param::param<double>("~max_linear_speed", max_linear_speed, 0.0);
-    ros::param::param<double>("~zero_speed_epsilon", zero_speed_epsilon, 0.01);
+    private_nh.param<double>("min_angular_speed", min_angular_speed, 0.0);
+    private_nh.param<double>("max_angular_speed", max_angular_speed, 0.0);
+    private_nh.param<double>("min_linear_speed", min_linear_speed, 0.0);
+    private_nh.param<double>("max_linear_speed", max_linear_speed, 0.0);
+    private_nh.param<double>("zero_speed_epsilon", zero_speed_epsilon, 0.01);
 
     // Topic parameters
-    ros::param::param<string>("~drive_pub_name", drive_pub_name, "drive_cmd");
-    ros::param::param<bool>("~services_enabled", services_enabled, true);
-    ros::param::param<bool>("~publish_odom_tf", publish_odom_tf, true);
-    ros::param::param<bool>("~use_sensor_msg_time", use_sensor_msg_time, false);
+    private_nh.param<string>("drive_pub_name", drive_pub_name, "drive_cmd");
+    private_nh.param<bool>("services_enabled", services_enabled, true);
+    private_nh.param<bool>("publish_odom_tf", publish_odom_tf, true);
+    private_nh.param<bool>("publish_joint_tf", publish_joint_tf, true);
+    private_nh.param<bool>("use_sensor_msg_time", use_sensor_msg_time, false);
     double idle_timeout;
-    ros::param::param<double>("~idle_timeout", idle_timeout, 0.0);
+    private_nh.param<double>("idle_timeout", idle_timeout, 0.0);
     odom_idle_timeout = ros::Duration(idle_timeout);
+    private_nh.param<double>("joint_state_rate", joint_state_rate, 60.0);
+    int speed_capture_samples;
+    private_nh.param<int>("speed_capture_samples", speed_capture_samples, 6000);
+    private_nh.param<double>("speed_capture_margin", speed_capture_margin, 1.0);
 
     // Tilter parameters
-    ros::param::param<double>("~tilter_lower_angle_deg", tilter_lower_angle_deg, -60.0);
-    ros::param::param<double>("~tilter_upper_angle_deg", tilter_upper_angle_deg, 0.0);
-    ros::param::param<int>("~tilter_lower_command", tilter_lower_command, 5);
-    ros::param::param<int>("~tilter_upper_command", tilter_upper_command, 180);
+    private_nh.param<double>("tilter_lower_angle_deg", tilter_lower_angle_deg, -60.0);
+    private_nh.param<double>("tilter_upper_angle_deg", tilter_upper_angle_deg, 0.0);
+    private_nh.param<int>("tilter_lower_command", tilter_lower_command, 5);
+    private_nh.param<int>("tilter_upper_command", tilter_upper_command, 180);
 
     // Linear parameters
-    ros::param::param<double>("~stepper_ticks_per_R_no_gearbox", stepper_ticks_per_R_no_gearbox, 200.0);
-    ros::param::param<double>("~microsteps", microsteps, 8.0);
-    ros::param::param<double>("~stepper_gearbox_ratio", stepper_gearbox_ratio, 26.0 + 103.0 / 121.0);
-    ros::param::param<double>("~belt_pulley_radius_m", belt_pulley_radius_m, 0.0121);
+    private_nh.param<double>("stepper_ticks_per_R_no_gearbox", stepper_ticks_per_R_no_gearbox, 200.0);
+    private_nh.param<double>("microsteps", microsteps, 8.0);
+    private_nh.param<double>("stepper_gearbox_ratio", stepper_gearbox_ratio, 26.0 + 103.0 / 121.0);
+    private_nh.param<double>("belt_pulley_radius_m", belt_pulley_radius_m, 0.0121);
 
     // Gripper parameters
-    ros::param::param<int>("~gripper_open_cmd", gripper_open_cmd, 0);
-    ros::param::param<int>("~gripper_closed_cmd", gripper_closed_cmd, 180);
-    ros::param::param<double>("~gripper_open_angle_deg", gripper_open_angle_deg, 0);
-    ros::param::param<double>("~gripper_closed_angle_deg", gripper_closed_angle_deg, 90);
+    private_nh.param<int>("gripper_open_cmd", gripper_open_cmd, 0);
+    private_nh.param<int>("gripper_closed_cmd", gripper_closed_cmd, 180);
+    private_nh.param<double>("gripper_open_angle_deg", gripper_open_angle_deg, 0);
+    private_nh.param<double>("gripper_closed_angle_deg", gripper_closed_angle_deg, 90);
 
     // Gripper geometry parameters
-    ros::param::param<double>("~armature_length", armature_length, 0.06);
-    ros::param::param<double>("~armature_width", armature_width, 0.01);
-    ros::param::param<double>("~hinge_pin_to_armature_end", hinge_pin_to_armature_end, 0.004);
-    ros::param::param<double>("~hinge_pin_diameter", hinge_pin_diameter, 0.0028575);
-    ros::param::param<double>("~hinge_pin_to_pad_plane", hinge_pin_to_pad_plane, 0.0);
-    ros::param::param<double>("~pad_extension_offset", pad_extension_offset, 0.0);
-    ros::param::param<double>("~central_axis_dist", central_axis_dist, 0.015);
+    private_nh.param<double>("armature_length", armature_length, 0.06);
+    private_nh.param<double>("armature_width", armature_width, 0.01);
+    private_nh.param<double>("hinge_pin_to_armature_end", hinge_pin_to_armature_end, 0.004);
+    private_nh.param<double>("hinge_pin_diameter", hinge_pin_diameter, 0.0028575);
+    private_nh.param<double>("hinge_pin_to_pad_plane", hinge_pin_to_pad_plane, 0.0);
+    private_nh.param<double>("pad_extension_offset", pad_extension_offset, 0.0);
+    private_nh.param<double>("central_axis_dist", central_axis_dist, 0.015);
+    private_nh.param<int>("conversion_table_resolution", conversion_table_resolution, 256);
 
     // TF parameters
-    ros::param::param<string>("~child_frame", child_frame, "base_link");
-    ros::param::param<string>("~odom_parent_frame", odom_parent_frame, "odom");
-    ros::param::param<string>("~tilt_base_frame", tilt_base_frame, "tilt_base_link");
-    ros::param::param<string>("~camera_rotate_frame", camera_rotate_frame, "camera_rotate_link");
-    ros::param::param<string>("~linear_frame", linear_frame, "linear_link");
-    ros::param::param<string>("~linear_base_frame", linear_base_frame, "linear_base_link");
+    private_nh.param<string>("child_frame", child_frame, "base_link");
+    private_nh.param<string>("odom_parent_frame", odom_parent_frame, "odom");
+    private_nh.param<string>("tilt_base_frame", tilt_base_frame, "tilt_base_link");
+    private_nh.param<string>("camera_rotate_frame", camera_rotate_frame, "camera_rotate_link");
+    private_nh.param<string>("linear_frame", linear_frame, "linear_link");
+    private_nh.param<string>("linear_base_frame", linear_base_frame, "linear_base_link");
 
     // Odometry conversions
     wheel_radius_m = wheel_radius_mm / 1000.0;
@@ -69,21 +75,10 @@ DodobotChassis::DodobotChassis(ros::NodeHandle* nodehandle):nh(*nodehandle)
     m_to_tick_factor = ticks_per_rotation / (2.0 * wheel_radius_m * M_PI);
     tick_to_m_factor = 1.0 / m_to_tick_factor;
 
-    // Tilt conversions
+    // Tilt and gripper conversions
+    compute_conversions();
     camera_tilt_angle = tilter_upper_angle;
 
-    tilter_lower_angle = tilter_lower_angle_deg * M_PI/180.0;
-    tilter_upper_angle = tilter_upper_angle_deg * M_PI/180.0;
-
-    // Gripper conversions
-    gripper_open_angle = gripper_open_angle_deg * M_PI/180.0;
-    gripper_closed_angle = gripper_closed_angle_deg * M_PI/180.0;
-
-    rotation_offset_x = armature_length + hinge_pin_to_armature_end;
-    rotation_offset_y = (armature_width + hinge_pin_diameter) / 2.0;
-
-    compute_parallel_dist_to_angle_lookup();
-
     // Linear conversions
     stepper_ticks_per_R = stepper_ticks_per_R_no_gearbox * microsteps * stepper_gearbox_ratio;
     stepper_R_per_tick = 1.0 / stepper_ticks_per_R;
@@ -108,6 +103,7 @@ DodobotChassis::DodobotChassis(ros::NodeHandle* nodehandle):nh(*nodehandle)
     // Odometry state
     odom_timestamp = ros::Time::now();
     prev_odom_time = ros::Time::now();
+    has_prev_drive_sample = false;
     prev_left_ticks = 0;
     prev_right_ticks = 0;
 
@@ -143,16 +139,35 @@ DodobotChassis::DodobotChassis(ros::NodeHandle* nodehandle):nh(*nodehandle)
     linear_speed_cmd = 0.0;
     angular_speed_cmd = 0.0;
 
-    // JointState messages
-    linear_joint.header.frame_id = "base_link";
-    linear_joint.name.push_back("linear_to_linear_base_link");
-    linear_joint.position.push_back(0.0);
-
-    tilter_joint.header.frame_id = "base_link";
-    tilter_joint.name.push_back("tilt_base_to_camera_rotate_joint");
-    tilter_joint.position.push_back(0.0);
+    // allocated once so capturing never allocates
+    speed_capture.reserve(speed_capture_samples);
+    last_left_command = 0;
+    last_right_command = 0;
+
+    // JointState message
+    joint_state_msg.header.frame_id = "base_link";
+    joint_state_msg.name.resize(NUM_CHASSIS_JOINTS);
+    joint_state_msg.position.assign(NUM_CHASSIS_JOINTS, 0.0);
+    joint_state_msg.name[LINEAR_JOINT] = "linear_to_linear_base_link";
+    joint_state_msg.name[TILTER_JOINT] = "tilt_base_to_camera_rotate_joint";
+    joint_states_changed = true;  // send the starting positions
+
+    // TF messages. Frame names are filled in once here and reused
+    if (publish_odom_tf) {
+        geometry_msgs::TransformStamped odom_tf;
+        odom_tf.header.frame_id = odom_parent_frame;
+        odom_tf.child_frame_id = child_frame;
+        tf_msg.transforms.push_back(odom_tf);
+    }
+    if (publish_joint_tf) {
+        init_joint_transforms(&tf_msg.transforms);
+        init_joint_transforms(&joint_tf_msg.transforms);
+    }
+    last_tf_time = ros::Time(0);
+    joint_tf_timeout = ros::Duration(2.0 / joint_state_rate);
 
     // Publishers
+    tf_pub = nh.advertise<tf2_msgs::TFMessage>("/tf", 100);
     odom_pub = nh.advertise<nav_msgs::Odometry>("odom", 50);
     drive_pub = nh.advertise<db_parsing::DodobotDrive>(drive_pub_name, 50);
     gripper_pub = nh.advertise<db_parsing::DodobotGripper>("gripper_cmd", 50);
@@ -160,12 +175,11 @@ DodobotChassis::DodobotChassis(ros::NodeHandle* nodehandle):nh(*nodehandle)
     parallel_gripper_pub = nh.advertise<db_parsing::DodobotParallelGripper>("parallel_gripper", 50);
     linear_pub = nh.advertise<db_parsing::DodobotLinear>("linear_cmd", 50);
     linear_pos_pub = nh.advertise<db_chassis::LinearPosition>("linear_pos", 50);
-    linear_joint_pub = nh.advertise<sensor_msgs::JointState>("linear_joint_state", 10);
-    tilter_joint_pub = nh.advertise<sensor_msgs::JointState>("tilter_joint_state", 10);
+    joint_state_pub = nh.advertise<sensor_msgs::JointState>("joint_states", 10, true);  // latched. Unchanged joints aren't resent
 
     // Subscribers
     twist_sub = nh.subscribe<geometry_msgs::Twist>("cmd_vel", 50, &DodobotChassis::twist_callback, this);
-    drive_sub = nh.subscribe<db_parsing::DodobotDrive>("drive", 50, &DodobotChassis::drive_callback, this);
+    drive_sub = nh.subscribe<db_parsing::DodobotDrive>("drive", 50, &DodobotChassis::drive_callback, this, ros::TransportHints().tcpNoDelay());
     tilter_sub = nh.subscribe<db_parsing::DodobotTilter>("tilter", 50, &DodobotChassis::tilter_callback, this);
     linear_sub = nh.subscribe<db_parsing::DodobotLinear>("linear", 50, &DodobotChassis::linear_callback, this);
     gripper_sub = nh.subscribe<db_parsing::DodobotGripper>("gripper", 50, &DodobotChassis::gripper_callback, this);
@@ -177,9 +191,13 @@ DodobotChassis::DodobotChassis(ros::NodeHandle* nodehandle):nh(*nodehandle)
     pid_service_name = "dodobot_pid";
     odom_reset_service_name = "dodobot_odom_reset";
     first_time_pid_setup = false;
+    pid_thread = NULL;
+    pid_pending = false;
+    pid_stop_flag = false;
 
     if (services_enabled) {
         set_pid_srv = nh.serviceClient<db_parsing::DodobotPidSrv>(pid_service_name);
+        pid_thread = new boost::thread(boost::bind(&DodobotChassis::pid_thread_task, this));
         // set_pid_srv.waitForExistence();
         ROS_INFO("%s service is ready", pid_service_name.c_str());
 
@@ -188,6 +206,9 @@ DodobotChassis::DodobotChassis(ros::NodeHandle* nodehandle):nh(*nodehandle)
 
         odom_reset_srv = nh.advertiseService(odom_reset_service_name, &DodobotChassis::odom_reset_callback, this);
         ROS_INFO("%s service is ready", odom_reset_service_name.c_str());
+
+        speed_capture_srv = nh.advertiseService("dodobot_speed_capture", &DodobotChassis::speed_capture_callback, this);
+        speed_capture_dump_srv = nh.advertiseService("dodobot_speed_capture_dump", &DodobotChassis::speed_capture_dump_callback, this);
     }
 
     ROS_INFO("db_chassis init done");
@@ -201,38 +222,84 @@ void DodobotChassis::setup()
 
 void DodobotChassis::loop()
 {
-    compute_odometry();
-    publish_chassis_data();
+    // odometry is published from drive_callback as encoder samples arrive
     publish_joint_states();
+
+    // the joint frames normally ride along with odometry. Keep them fresh while it's idle
+    if (publish_joint_tf && ros::Time::now() - last_tf_time > joint_tf_timeout) {
+        update_joint_transforms(&joint_tf_msg.transforms[0], ros::Time::now());
+        tf_pub.publish(joint_tf_msg);
+        last_tf_time = ros::Time::now();
+    }
+}
+
+void DodobotChassis::loop_timer_callback(const ros::TimerEvent& event)
+{
+    loop();
 }
 
 void DodobotChassis::stop()
 {
+    if (pid_thread != NULL) {
+        {
+            boost::lock_guard<boost::mutex> lock(pid_mutex);
+            pid_stop_flag = true;
+            pid_cond.notify_one();
+        }
+        pid_thread->join();
+        delete pid_thread;
+        pid_thread = NULL;
+    }
+}
+
+DodobotChassis::~DodobotChassis()
+{
+    stop();
+}
+
+void DodobotChassis::pid_thread_task()
+{
+    while (true)
+    {
+        db_parsing::DodobotPidSrv srv;
+        {
+            boost::unique_lock<boost::mutex> lock(pid_mutex);
+            while (!pid_pending && !pid_stop_flag) {
+                pid_cond.wait(lock);
+            }
+            if (pid_stop_flag) {
+                break;
+            }
+            srv = pid_request;
+            pid_pending = false;
+        }
 
+        if (!set_pid_srv.call(srv) || !srv.response.resp) {
+            ROS_WARN("Failed to send PID gains to %s", pid_service_name.c_str());
+        }
+    }
 }
 
 
-int DodobotChassis::run()
+void DodobotChassis::start()
 {
     setup();
 
-    ros::Rate clock_rate(60);  // run loop at 60 Hz
+    // callbacks run as soon as messages arrive. Only the joint states are on a fixed rate
+    loop_timer = nh.createTimer(ros::Duration(1.0 / joint_state_rate), &DodobotChassis::loop_timer_callback, this);
+}
 
-    int exit_code = 0;
-    while (ros::ok())
-    {
-        // let ROS process any events
-        ros::spinOnce();
-        clock_rate.sleep();
+int DodobotChassis::run()
+{
+    start();
 
-        try {
-            loop();
-        }
-        catch (exception& e) {
-            ROS_ERROR_STREAM("Exception in main loop: " << e.what());
-            exit_code = 1;
-            break;
-        }
+    int exit_code = 0;
+    try {
+        ros::spin();
+    }
+    catch (exception& e) {
+        ROS_ERROR_STREAM("Exception in main loop: " << e.what());
+        exit_code = 1;
     }
     stop();
 
@@ -245,21 +312,46 @@ void DodobotChassis::dynamic_callback(db_chassis::DodobotChassisConfig &config,
         ROS_WARN("Services for this node aren't enabled!");
         return;
     }
+    if (level & CHASSIS_CFG_CONVERSIONS) {
+        tilter_lower_angle_deg = config.tilter_lower_angle_deg;
+        tilter_upper_angle_deg = config.tilter_upper_angle_deg;
+        tilter_lower_command = config.tilter_lower_command;
+        tilter_upper_command = config.tilter_upper_command;
+
+        gripper_open_cmd = config.gripper_open_cmd;
+        gripper_closed_cmd = config.gripper_closed_cmd;
+        gripper_open_angle_deg = config.gripper_open_angle_deg;
+        gripper_closed_angle_deg = config.gripper_closed_angle_deg;
+
+        armature_length = config.armature_length;
+        armature_width = config.armature_width;
+        hinge_pin_to_armature_end = config.hinge_pin_to_armature_end;
+        hinge_pin_diameter = config.hinge_pin_diameter;
+        hinge_pin_to_pad_plane = config.hinge_pin_to_pad_plane;
+        pad_extension_offset = config.pad_extension_offset;
+        central_axis_dist = config.central_axis_dist;
+        conversion_table_resolution = config.conversion_table_resolution;
+
+        compute_conversions();
+    }
+    if (!(level & CHASSIS_CFG_PID)) {
+        return;
+    }
     // if (!first_time_pid_setup) {
     //     first_time_pid_setup = true;
     //     return;
     // }
-    db_parsing::DodobotPidSrv srv;
-    srv.request.kp_A = config.kp_A;
-    srv.request.ki_A = config.ki_A;
-    srv.request.kd_A = config.kd_A;
-    srv.request.kp_B = config.kp_B;
-    srv.request.ki_B = config.ki_B;
-    srv.request.kd_B = config.kd_B;
-    srv.request.speed_kA = config.speed_kA;
-    srv.request.speed_kB = config.speed_kB;
-
-    set_pid_srv.call(srv);
+    boost::lock_guard<boost::mutex> lock(pid_mutex);
+    pid_request.request.kp_A = config.kp_A;
+    pid_request.request.ki_A = config.ki_A;
+    pid_request.request.kd_A = config.kd_A;
+    pid_request.request.kp_B = config.kp_B;
+    pid_request.request.ki_B = config.ki_B;
+    pid_request.request.kd_B = config.kd_B;
+    pid_request.request.speed_kA = config.speed_kA;
+    pid_request.request.speed_kB = config.speed_kB;
+    pid_pending = true;
+    pid_cond.notify_one();
 }
 
 bool DodobotChassis::odom_reset_callback(db_chassis::DodobotOdomReset::Request &req, db_chassis::DodobotOdomReset::Response &resp)
@@ -270,14 +362,154 @@ bool DodobotChassis::odom_reset_callback(db_chassis::DodobotOdomReset::Request &
     return true;
 }
 
+bool DodobotChassis::speed_capture_callback(db_chassis::DodobotSpeedCapture::Request &req, db_chassis::DodobotSpeedCapture::Response &resp)
+{
+    if (req.abort) {
+        resp.success = true;
+        if (!speed_capture.active()) {
+            resp.message = "No capture is running";
+            return true;
+        }
+        stop_speed_capture();
+        ROS_WARN("Speed capture aborted. %lu samples, %lu dropped", speed_capture.size(), speed_capture.dropped());
+        resp.message = "";
+        return true;
+    }
+
+    SpeedProfile profile;
+    if (req.profile == "step") {
+        profile.type = SPEED_PROFILE_STEP;
+    }
+    else if (req.profile == "ramp") {
+        profile.type = SPEED_PROFILE_RAMP;
+    }
+    else {
+        resp.success = false;
+        resp.message = "Unknown profile '" + req.profile + "'. Use step or ramp";
+        return true;
+    }
+    if (req.duration <= 0.0 || req.delay < 0.0 || req.ramp_time < 0.0) {
+        resp.success = false;
+        resp.message = "duration must be positive. delay and ramp_time can't be negative";
+        return true;
+    }
+    if (speed_capture.active()) {
+        resp.success = false;
+        resp.message = "A capture is already running";
+        return true;
+    }
+
+    profile.left_tps = (double)m_to_ticks(req.left_speed);
+    profile.right_tps = (double)m_to_ticks(req.right_speed);
+    profile.delay = req.delay;
+    profile.ramp_time = req.ramp_time;
+    profile.duration = req.duration;
+    if (fabs(profile.left_tps) > max_speed_tps || fabs(profile.right_tps) > max_speed_tps) {
+        resp.success = false;
+        resp.message = "Requested speed is above max_speed_tps";
+        return true;
+    }
+
+    speed_capture.start(profile);
+    speed_capture_start = ros::Time(0);
+    speed_capture_timer = nh.createTimer(ros::Duration(profile.duration + std::max(speed_capture_margin, 0.0)),
+        &DodobotChassis::speed_capture_timeout, this, true);
+    ROS_INFO("Starting %s speed capture: %0.1f, %0.1f ticks/s for %0.2fs",
+        req.profile.c_str(), profile.left_tps, profile.right_tps, profile.duration);
+
+    resp.success = true;
+    resp.message = "";
+    return true;
+}
+
+bool DodobotChassis::speed_capture_dump_callback(db_chassis::DodobotSpeedCaptureDump::Request &req, db_chassis::DodobotSpeedCaptureDump::Response &resp)
+{
+    if (speed_capture.active()) {
+        resp.success = false;
+        resp.message = "Capture is still running";
+        return true;
+    }
+
+    resp.sample_count = speed_capture.size();
+    resp.dropped_count = speed_capture.dropped();
+    if (req.format == "binary") {
+        speed_capture.to_binary(&resp.data);
+    }
+    else if (req.format == "csv" || req.format.empty()) {
+        string csv;
+        speed_capture.to_csv(&csv);
+        resp.data.assign(csv.begin(), csv.end());
+    }
+    else {
+        resp.success = false;
+        resp.message = "Unknown format '" + req.format + "'. Use csv or binary";
+        return true;
+    }
+
+    resp.success = true;
+    resp.message = "";
+    return true;
+}
+
+void DodobotChassis::speed_capture_update(const db_parsing::DodobotDrive::ConstPtr& msg)
+{
+    if (speed_capture_start.isZero()) {
+        speed_capture_start = msg->header.stamp;
+    }
+    double time = (msg->header.stamp - speed_capture_start).toSec();
+
+    SpeedSample sample;
+    sample.time = time;
+    // the encoder message's setpoints aren't filled in. Record the command the wheels were following
+    sample.left_setpoint = (float)last_left_command;
+    sample.right_setpoint = (float)last_right_command;
+    sample.left_enc_pos = msg->left_enc_pos;
+    sample.right_enc_pos = msg->right_enc_pos;
+    sample.left_enc_speed = msg->left_enc_speed;
+    sample.right_enc_speed = msg->right_enc_speed;
+    speed_capture.record(sample);
+
+    if (speed_capture.finished(time)) {
+        stop_speed_capture();
+        ROS_INFO("Speed capture done. %lu samples, %lu dropped", speed_capture.size(), speed_capture.dropped());
+        return;
+    }
+
+    double left_tps, right_tps;
+    speed_capture.setpoint(time, &left_tps, &right_tps);
+    publish_drive_command((int64_t)left_tps, (int64_t)right_tps);
+}
+
+void DodobotChassis::speed_capture_timeout(const ros::TimerEvent& event)
+{
+    if (!speed_capture.active()) {
+        return;
+    }
+    // the profile only advances on encoder samples, so without them the last setpoint would hold forever
+    stop_speed_capture();
+    ROS_WARN("Speed capture timed out waiting for encoder samples. %lu samples, %lu dropped", speed_capture.size(), speed_capture.dropped());
+}
+
+void DodobotChassis::stop_speed_capture()
+{
+    speed_capture.stop();
+    speed_capture_timer.stop();
+    publish_drive_command(0, 0);
+}
+
 //
 // Sub callbacks
 //
 
-void DodobotChassis::twist_callback(geometry_msgs::Twist msg)
+void DodobotChassis::twist_callback(const geometry_msgs::Twist::ConstPtr& msg)
 {
-    double linear_speed_mps = msg.linear.x;  // m/s
-    double angular_speed_radps = msg.angular.z;  // rad/s
+    if (speed_capture.active()) {
+        ROS_WARN_THROTTLE(1.0, "Ignoring cmd_vel during speed capture");
+        return;
+    }
+
+    double linear_speed_mps = msg->linear.x;  // m/s
+    double angular_speed_radps = msg->angular.z;  // rad/s
 
     linear_speed_mps = bound_speed(linear_speed_mps, min_linear_speed, max_linear_speed, zero_speed_epsilon);
     angular_speed_radps = bound_speed(
@@ -311,28 +543,43 @@ void DodobotChassis::twist_callback(geometry_msgs::Twist msg)
         }
     }
 
-    drive_pub_msg.header.stamp = ros::Time::now();
-    drive_pub_msg.left_setpoint = left_command;
-    drive_pub_msg.right_setpoint = right_command;
+    publish_drive_command(left_command, right_command);
+}
+
+void DodobotChassis::publish_drive_command(int64_t left_command, int64_t right_command)
+{
+    // a new message each time. Subscribers in the same process keep the pointer instead of a copy
+    db_parsing::DodobotDrive::Ptr drive_pub_msg = boost::make_shared<db_parsing::DodobotDrive>();
+    drive_pub_msg->header.stamp = ros::Time::now();
+    drive_pub_msg->left_setpoint = left_command;
+    drive_pub_msg->right_setpoint = right_command;
+    last_left_command = left_command;
+    last_right_command = right_command;
 
     drive_pub.publish(drive_pub_msg);
 }
 
-void DodobotChassis::drive_callback(db_parsing::DodobotDrive msg) {
+void DodobotChassis::drive_callback(const db_parsing::DodobotDrive::ConstPtr& msg) {
     drive_sub_msg = msg;
+    if (compute_odometry()) {
+        publish_chassis_data();
+    }
+    if (speed_capture.active()) {
+        speed_capture_update(msg);
+    }
 }
 
-void DodobotChassis::tilter_callback(db_parsing::DodobotTilter msg)
+void DodobotChassis::tilter_callback(const db_parsing::DodobotTilter::ConstPtr& msg)
 {
-    camera_tilt_angle = tilt_command_to_angle_rad(msg.position);
-    tilter_joint.position[0] = -camera_tilt_angle;
+    camera_tilt_angle = tilt_command_to_angle_rad(msg->position);
+    set_joint_position(TILTER_JOINT, -camera_tilt_angle);
 }
 
-void DodobotChassis::tilter_orientation_callback(geometry_msgs::Quaternion msg)
+void DodobotChassis::tilter_orientation_callback(const geometry_msgs::Quaternion::ConstPtr& msg)
 {
     db_parsing::DodobotTilter tilter_msg;
     tf2::Quaternion quat;
-    tf2::convert(msg, quat);
+    tf2::convert(*msg, quat);
     tf2::Matrix3x3 tf_matrix(quat);
     double roll, pitch, yaw;
     tf_matrix.getRPY(roll, pitch, yaw);
@@ -342,26 +589,19 @@ void DodobotChassis::tilter_orientation_callback(geometry_msgs::Quaternion msg)
     tilter_pub.publish(tilter_msg);
 }
 
-void DodobotChassis::linear_callback(db_parsing::DodobotLinear msg)
+void DodobotChassis::linear_callback(const db_parsing::DodobotLinear::ConstPtr& msg)
 {
-    stepper_z_pos = msg.position * step_ticks_to_linear_m;
-
-    ros::Time now = ros::Time::now();
-
-    linear_joint.position[0] = stepper_z_pos;
-    linear_joint.header.stamp = now;
+    stepper_z_pos = msg->position * step_ticks_to_linear_m;
+    set_joint_position(LINEAR_JOINT, stepper_z_pos);
 
     db_chassis::LinearPosition linear_msg;
     linear_msg.position = stepper_z_pos;
     linear_pos_pub.publish(linear_msg);
 }
 
-void DodobotChassis::gripper_callback(db_parsing::DodobotGripper msg)
+void DodobotChassis::gripper_callback(const db_parsing::DodobotGripper::ConstPtr& msg)
 {
-    double angle = servo_to_angle(msg.position,
-        gripper_closed_cmd, gripper_open_cmd,
-        gripper_closed_angle, gripper_open_angle
-    );
+    double angle = gripper_command_to_angle(msg->position);
     double parallel_dist = angle_to_parallel_dist(angle);
     parallel_gripper_msg.header.stamp = ros::Time::now();
     parallel_gripper_msg.distance = parallel_dist;
@@ -369,14 +609,11 @@ void DodobotChassis::gripper_callback(db_parsing::DodobotGripper msg)
     parallel_gripper_pub.publish(parallel_gripper_msg);
 }
 
-void DodobotChassis::parallel_gripper_callback(db_parsing::DodobotParallelGripper msg)
+void DodobotChassis::parallel_gripper_callback(const db_parsing::DodobotParallelGripper::ConstPtr& msg)
 {
-    double angle = parallel_dist_to_angle(msg.distance);
-    int servo_pos = angle_to_servo(angle,
-        gripper_closed_cmd, gripper_open_cmd,
-        gripper_closed_angle, gripper_open_angle
-    );
-    ROS_DEBUG("gripper dist cmd: %f m -> %f deg -> %d", msg.distance, angle * 180 / M_PI, servo_pos);
+    double angle = parallel_dist_to_angle(msg->distance);
+    int servo_pos = gripper_angle_to_command(angle);
+    ROS_DEBUG("gripper dist cmd: %f m -> %f deg -> %d", msg->distance, angle * 180 / M_PI, servo_pos);
 
     gripper_msg.header.stamp = ros::Time::now();
     gripper_msg.position = servo_pos;
@@ -385,63 +622,137 @@ void DodobotChassis::parallel_gripper_callback(db_parsing::DodobotParallelGrippe
     gripper_pub.publish(gripper_msg);
 }
 
-void DodobotChassis::linear_pos_callback(db_chassis::LinearPosition msg)
+void DodobotChassis::linear_pos_callback(const db_chassis::LinearPosition::ConstPtr& msg)
 {
     db_parsing::DodobotLinear linear_msg;
 
-    if (isnan(msg.position)) {
+    if (isnan(msg->position)) {
         linear_msg.command_type = -1;
         linear_msg.command_value = 0;
     }
     else {
         linear_msg.command_type = 0;
-        linear_msg.command_value = (int)(msg.position * step_linear_m_to_ticks);
+        linear_msg.command_value = (int)(msg->position * step_linear_m_to_ticks);
     }
 
-    if (isnan(msg.max_speed)) {
+    if (isnan(msg->max_speed)) {
         linear_msg.max_speed = -1;
     }
     else {
-        linear_msg.max_speed = (int)(msg.max_speed * step_linear_m_to_speed_ticks);
+        linear_msg.max_speed = (int)(msg->max_speed * step_linear_m_to_speed_ticks);
     }
 
-    if (isnan(msg.acceleration)) {
+    if (isnan(msg->acceleration)) {
         linear_msg.acceleration = -1;
     }
     else {
-        linear_msg.acceleration = (int)(msg.acceleration * step_linear_m_to_speed_ticks);
+        linear_msg.acceleration = (int)(msg->acceleration * step_linear_m_to_speed_ticks);
     }
 
     linear_pub.publish(linear_msg);
 }
 
-void DodobotChassis::linear_vel_callback(db_chassis::LinearVelocity msg)
+void DodobotChassis::linear_vel_callback(const db_chassis::LinearVelocity::ConstPtr& msg)
 {
     db_parsing::DodobotLinear linear_msg;
     linear_msg.command_type = 1;
-    linear_msg.command_value = (int)(msg.velocity * step_linear_m_to_speed_ticks);
+    linear_msg.command_value = (int)(msg->velocity * step_linear_m_to_speed_ticks);
     linear_msg.max_speed = -1;
 
-    if (isnan(msg.acceleration)) {
+    if (isnan(msg->acceleration)) {
         linear_msg.acceleration = -1;
     }
     else {
-        linear_msg.acceleration = (int)(msg.acceleration * step_linear_m_to_speed_ticks);
+        linear_msg.acceleration = (int)(msg->acceleration * step_linear_m_to_speed_ticks);
     }
 
     linear_pub.publish(linear_msg);
 }
 
+void DodobotChassis::set_joint_position(ChassisJoint joint, double position)
+{
+    if (joint_state_msg.position[joint] != position) {
+        joint_state_msg.position[joint] = position;
+        joint_states_changed = true;
+    }
+}
+
 void DodobotChassis::publish_joint_states()
 {
-    linear_joint_pub.publish(linear_joint);
-    tilter_joint_pub.publish(tilter_joint);
+    if (!joint_states_changed) {
+        return;
+    }
+    joint_state_msg.header.stamp = ros::Time::now();
+    joint_state_pub.publish(joint_state_msg);
+    joint_states_changed = false;
+}
+
+void DodobotChassis::init_joint_transforms(vector<geometry_msgs::TransformStamped>* transforms)
+{
+    // same order as update_joint_transforms
+    geometry_msgs::TransformStamped tilter_tf;
+    tilter_tf.header.frame_id = tilt_base_frame;
+    tilter_tf.child_frame_id = camera_rotate_frame;
+    tilter_tf.transform.rotation.w = 1.0;
+    transforms->push_back(tilter_tf);
+
+    geometry_msgs::TransformStamped linear_tf;
+    linear_tf.header.frame_id = linear_base_frame;
+    linear_tf.child_frame_id = linear_frame;
+    linear_tf.transform.rotation.w = 1.0;
+    transforms->push_back(linear_tf);
+}
+
+void DodobotChassis::update_joint_transforms(geometry_msgs::TransformStamped* transforms, ros::Time stamp)
+{
+    // the URDF's tilt_base_to_camera_rotate_joint (revolute about y) and
+    // linear_to_linear_base_link (prismatic along z). Both have zero origins
+    tf2::Quaternion q;
+    q.setRPY(0.0, joint_state_msg.position[TILTER_JOINT], 0.0);
+    transforms[0].header.stamp = stamp;
+    transforms[0].transform.rotation.x = q.x();
+    transforms[0].transform.rotation.y = q.y();
+    transforms[0].transform.rotation.z = q.z();
+    transforms[0].transform.rotation.w = q.w();
+
+    transforms[1].header.stamp = stamp;
+    transforms[1].transform.translation.z = joint_state_msg.position[LINEAR_JOINT];
 }
 
 //
 // Data handling/conversion
 //
 
+void DodobotChassis::compute_conversions()
+{
+    tilter_lower_angle = tilter_lower_angle_deg * M_PI/180.0;
+    tilter_upper_angle = tilter_upper_angle_deg * M_PI/180.0;
+
+    gripper_open_angle = gripper_open_angle_deg * M_PI/180.0;
+    gripper_closed_angle = gripper_closed_angle_deg * M_PI/180.0;
+
+    rotation_offset_x = armature_length + hinge_pin_to_armature_end;
+    rotation_offset_y = (armature_width + hinge_pin_diameter) / 2.0;
+
+    // servo mappings are linear. Two point tables hold just the slope and offset
+    vector<double> commands(2), angles(2);
+    commands[0] = gripper_open_cmd;
+    commands[1] = gripper_closed_cmd;
+    angles[0] = gripper_closed_angle;
+    angles[1] = gripper_open_angle;
+    gripper_command_to_angle_table.resample(commands, angles, 2);
+    gripper_angle_to_command_table.resample(angles, commands, 2);
+
+    commands[0] = tilter_lower_command;
+    commands[1] = tilter_upper_command;
+    angles[0] = tilter_lower_angle;
+    angles[1] = tilter_upper_angle;
+    tilter_command_to_angle_table.resample(commands, angles, 2);
+    tilter_angle_to_command_table.resample(angles, commands, 2);
+
+    compute_parallel_dist_to_angle_lookup();
+}
+
 double DodobotChassis::angle_to_parallel_dist(double angle_rad)
 {
     double hinge_pin_x = rotation_offset_x * cos(angle_rad) - rotation_offset_y * sin(angle_rad);
@@ -452,69 +763,54 @@ double DodobotChassis::angle_to_parallel_dist(double angle_rad)
 
 double DodobotChassis::parallel_dist_to_angle(double parallel_dist)
 {
-    for (size_t i = 0; i < num_dist_samples - 1; i++) {
-        double low_dist = dist_samples[i + 1];
-        double high_dist = dist_samples[i];
-        if (low_dist <= parallel_dist && parallel_dist < high_dist) {
-            double low_angle = angle_samples[i];
-            double high_angle = angle_samples[i + 1];
-
-            return (high_angle - low_angle) / (high_dist - low_dist) * (parallel_dist - low_dist) + low_angle;
-        }
+    if (!parallel_dist_to_angle_table.contains(parallel_dist)) {
+        ROS_WARN("Requested parallel dist '%f' exceeds interpolation range %f...%f",
+            parallel_dist,
+            parallel_dist_to_angle_table.x_min(),
+            parallel_dist_to_angle_table.x_max()
+        );
+        return gripper_open_angle;
     }
-    ROS_WARN("Requested parallel dist '%f' exceeds interpolation range %f...%f",
-        parallel_dist,
-        dist_samples.front(),
-        dist_samples.back()
-    );
-    return gripper_open_angle;
+    return parallel_dist_to_angle_table.evaluate(parallel_dist);
 }
 
 void DodobotChassis::compute_parallel_dist_to_angle_lookup()
 {
-    num_dist_samples = 100;
-    dist_samples.resize(num_dist_samples);
-    angle_samples.resize(num_dist_samples);
+    // angle_to_parallel_dist has no simple inverse. Sample it across the
+    // gripper's range, then resample the pairs evenly spaced in distance
+    size_t num_samples = (size_t)max(conversion_table_resolution, 2);
+    vector<double> angle_samples(num_samples);
+    vector<double> dist_samples(num_samples);
 
     double angle_buffer = 10.0 * M_PI / 180.0;
     double angle_sample_start = gripper_open_angle - angle_buffer;
     double angle_sample_stop = gripper_closed_angle + angle_buffer;
 
-    size_t counter = 0;
-    double angle = angle_sample_start;
-    double interval = (angle_sample_stop - angle_sample_start) / num_dist_samples;
+    double interval = (angle_sample_stop - angle_sample_start) / (num_samples - 1);
     ROS_DEBUG("Generating gripper table:");
-    while (angle < angle_sample_stop && counter < num_dist_samples) {
-        double dist = angle_to_parallel_dist(angle);
-        dist_samples[counter] = dist;
-        angle_samples[counter] = angle;
-        angle += interval;
-        counter++;
-        ROS_DEBUG("\t%f deg -> %f m", angle * 180/M_PI, dist);
+    for (size_t i = 0; i < num_samples; i++) {
+        angle_samples[i] = angle_sample_start + interval * i;
+        dist_samples[i] = angle_to_parallel_dist(angle_samples[i]);
+        ROS_DEBUG("\t%f deg -> %f m", angle_samples[i] * 180/M_PI, dist_samples[i]);
     }
+    parallel_dist_to_angle_table.resample(dist_samples, angle_samples, num_samples);
 }
 
 
-double DodobotChassis::servo_to_angle(int command, int max_command, int min_command, double min_angle, double max_angle) {
-    return (max_angle - min_angle) / (double)(max_command - min_command) * ((double)(command) - min_command) + min_angle;
+double DodobotChassis::gripper_command_to_angle(int command) {
+    return gripper_command_to_angle_table.evaluate((double)command);
 }
 
-int DodobotChassis::angle_to_servo(double angle, int max_command, int min_command, double min_angle, double max_angle) {
-    return (int)((double)(max_command - min_command) / (max_angle - min_angle) * ((double)angle - min_angle) + (double)min_command);
+int DodobotChassis::gripper_angle_to_command(double angle) {
+    return (int)gripper_angle_to_command_table.evaluate(angle);
 }
 
 double DodobotChassis::tilt_command_to_angle_rad(int command) {
-    return servo_to_angle(command,
-        tilter_upper_command, tilter_lower_command,
-        tilter_lower_angle, tilter_upper_angle
-    );
+    return tilter_command_to_angle_table.evaluate((double)command);
 }
 
 int DodobotChassis::tilt_angle_rad_to_command(double angle_rad) {
-    return angle_to_servo(angle_rad,
-        tilter_upper_command, tilter_lower_command,
-        tilter_lower_angle, tilter_upper_angle
-    );
+    return (int)tilter_angle_to_command_table.evaluate(angle_rad);
 }
 
 double DodobotChassis::bound_speed(double value, double lower, double upper, double epsilon)
@@ -587,20 +883,34 @@ void DodobotChassis::odom_estimator_update(double delta_left, double delta_right
     odom_state->w = w;
 }
 
-void DodobotChassis::compute_odometry()
+bool DodobotChassis::compute_odometry()
 {
-    ros::Time now = ros::Time::now();
-    odom_timestamp = now;
-    double dt = (now - prev_odom_time).toSec();
-    prev_odom_time = now;
+    // integrate once per encoder sample over the time between sample stamps.
+    // Returns false if the sample was skipped
+    ros::Time stamp = drive_sub_msg->header.stamp;
+    if (!has_prev_drive_sample) {
+        // nothing to take a delta from yet
+        has_prev_drive_sample = true;
+        prev_odom_time = stamp;
+        prev_left_ticks = drive_sub_msg->left_enc_pos;
+        prev_right_ticks = drive_sub_msg->right_enc_pos;
+        return false;
+    }
+    double dt = (stamp - prev_odom_time).toSec();
+    if (dt <= 0.0) {
+        ROS_WARN_THROTTLE(1.0, "Skipping repeated or out of order encoder sample (dt = %f)", dt);
+        return false;
+    }
+    odom_timestamp = stamp;
+    prev_odom_time = stamp;
 
-    double delta_left = ticks_to_m(drive_sub_msg.left_enc_pos - prev_left_ticks);
-    double delta_right = ticks_to_m(drive_sub_msg.right_enc_pos - prev_right_ticks);
-    double left_speed = ticks_to_m(drive_sub_msg.left_enc_speed);
-    double right_speed = ticks_to_m(drive_sub_msg.right_enc_speed);
+    double delta_left = ticks_to_m(drive_sub_msg->left_enc_pos - prev_left_ticks);
+    double delta_right = ticks_to_m(drive_sub_msg->right_enc_pos - prev_right_ticks);
+    double left_speed = ticks_to_m(drive_sub_msg->left_enc_speed);
+    double right_speed = ticks_to_m(drive_sub_msg->right_enc_speed);
 
-    prev_left_ticks = drive_sub_msg.left_enc_pos;
-    prev_right_ticks = drive_sub_msg.right_enc_pos;
+    prev_left_ticks = drive_sub_msg->left_enc_pos;
+    prev_right_ticks = drive_sub_msg->right_enc_pos;
 
     odom_estimator_update(
         delta_left,
@@ -609,17 +919,18 @@ void DodobotChassis::compute_odometry()
         right_speed,
         dt
     );
+    return true;
 }
 
 void DodobotChassis::publish_chassis_data()
 {
     ros::Time now = ros::Time::now();
-    if (odom_idle_timeout != ros::Duration(0.0) && now - drive_sub_msg.header.stamp > odom_idle_timeout) {
+    if (odom_idle_timeout != ros::Duration(0.0) && now - drive_sub_msg->header.stamp > odom_idle_timeout) {
         return;
     }
 
     if (use_sensor_msg_time) {
-        now = drive_sub_msg.header.stamp;
+        now = drive_sub_msg->header.stamp;
     }
 
     tf2::Quaternion q;
@@ -628,21 +939,25 @@ void DodobotChassis::publish_chassis_data()
     geometry_msgs::Quaternion quat_msg;
     tf2::convert(q, quat_msg);
 
-    if (publish_odom_tf)
+    if (!tf_msg.transforms.empty())
     {
-        geometry_msgs::TransformStamped transformStamped;
-        transformStamped.header.stamp = now;
-        transformStamped.header.frame_id = odom_parent_frame;
-        transformStamped.child_frame_id = child_frame;
-        transformStamped.transform.translation.x = odom_state->x;
-        transformStamped.transform.translation.y = odom_state->y;
-        transformStamped.transform.translation.z = 0.0;
-        transformStamped.transform.rotation.x = q.x();
-        transformStamped.transform.rotation.y = q.y();
-        transformStamped.transform.rotation.z = q.z();
-        transformStamped.transform.rotation.w = q.w();
-
-        tf_broadcaster.sendTransform(transformStamped);
+        size_t tf_index = 0;
+        if (publish_odom_tf) {
+            geometry_msgs::TransformStamped& transformStamped = tf_msg.transforms[tf_index++];
+            transformStamped.header.stamp = now;
+            transformStamped.transform.translation.x = odom_state->x;
+            transformStamped.transform.translation.y = odom_state->y;
+            transformStamped.transform.translation.z = 0.0;
+            transformStamped.transform.rotation.x = q.x();
+            transformStamped.transform.rotation.y = q.y();
+            transformStamped.transform.rotation.z = q.z();
+            transformStamped.transform.rotation.w = q.w();
+        }
+        if (publish_joint_tf) {
+            update_joint_transforms(&tf_msg.transforms[tf_index], now);
+        }
+        tf_pub.publish(tf_msg);
+        last_tf_time = ros::Time::now();
     }
 
     odom_msg.header.stamp = now;
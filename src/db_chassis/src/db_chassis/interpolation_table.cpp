@@ -0,0 +1,62 @@
+#include <db_chassis/interpolation_table.h>
+
+#include <algorithm>
+#include <utility>
+
+
+void InterpolationTable::set_grid(double x_min, double x_max, size_t resolution)
+{
+    if (resolution < 2) {
+        resolution = 2;
+    }
+    if (x_max < x_min) {
+        std::swap(x_min, x_max);
+    }
+    _xMin = x_min;
+    _xMax = x_max;
+    _step = (x_max - x_min) / (double)(resolution - 1);
+    _invStep = _step > 0.0 ? 1.0 / _step : 0.0;
+    _y.resize(resolution);
+}
+
+void InterpolationTable::resample(const std::vector<double>& x, const std::vector<double>& y, size_t resolution)
+{
+    size_t count = std::min(x.size(), y.size());
+    if (count < 2) {
+        _y.clear();
+        return;
+    }
+
+    // walk the samples in increasing x
+    std::vector<std::pair<double, double> > points(count);
+    for (size_t i = 0; i < count; i++) {
+        points[i] = std::make_pair(x[i], y[i]);
+    }
+    if (points.front().first > points.back().first) {
+        std::reverse(points.begin(), points.end());
+    }
+
+    set_grid(points.front().first, points.back().first, resolution);
+
+    // both the grid and the samples are sorted, so one pass finds every grid point's segment
+    size_t segment = 0;
+    for (size_t i = 0; i < _y.size(); i++)
+    {
+        double grid = grid_x(i);
+        while (segment < count - 2 && points[segment + 1].first < grid) {
+            segment++;
+        }
+        const std::pair<double, double>& p0 = points[segment];
+        const std::pair<double, double>& p1 = points[segment + 1];
+        double width = p1.first - p0.first;
+        double t = width != 0.0 ? (grid - p0.first) / width : 0.0;
+        _y[i] = p0.second + t * (p1.second - p0.second);
+    }
+}
+
+void InterpolationTable::evaluate(const double* x, double* out, size_t count) const
+{
+    for (size_t i = 0; i < count; i++) {
+        out[i] = evaluate(x[i]);
+    }
+}
@@ -0,0 +1,96 @@
+#include <db_chassis/speed_capture.h>
+
+#include <stdio.h>
+#include <string.h>
+
+
+void SpeedCapture::reserve(size_t capacity)
+{
+    if (capacity < 1) {
+        capacity = 1;
+    }
+    _samples.resize(capacity);
+    _head = 0;
+    _count = 0;
+    _dropped = 0;
+}
+
+void SpeedCapture::start(const SpeedProfile& profile)
+{
+    _profile = profile;
+    _head = 0;
+    _count = 0;
+    _dropped = 0;
+    _active = true;
+}
+
+void SpeedCapture::setpoint(double time, double* left_tps, double* right_tps) const
+{
+    double scale = 0.0;
+    if (time >= _profile.delay && time < _profile.duration)
+    {
+        if (_profile.type == SPEED_PROFILE_RAMP && _profile.ramp_time > 0.0) {
+            scale = (time - _profile.delay) / _profile.ramp_time;
+            if (scale > 1.0) {
+                scale = 1.0;
+            }
+        }
+        else {
+            scale = 1.0;
+        }
+    }
+    *left_tps = scale * _profile.left_tps;
+    *right_tps = scale * _profile.right_tps;
+}
+
+void SpeedCapture::record(const SpeedSample& sample)
+{
+    size_t capacity = _samples.size();
+    if (_count < capacity) {
+        _samples[(_head + _count) % capacity] = sample;
+        _count++;
+    }
+    else {
+        _samples[_head] = sample;
+        _head = (_head + 1) % capacity;
+        _dropped++;
+    }
+}
+
+void SpeedCapture::to_csv(std::string* out) const
+{
+    out->clear();
+    out->reserve(96 * (_count + 1));
+    out->append("time,left_setpoint,right_setpoint,left_enc_pos,right_enc_pos,left_enc_speed,right_enc_speed\n");
+
+    char line[256];
+    for (size_t i = 0; i < _count; i++)
+    {
+        const SpeedSample& sample = at(i);
+        int length = snprintf(line, sizeof(line), "%0.6f,%0.2f,%0.2f,%lld,%lld,%0.2f,%0.2f\n",
+            sample.time, sample.left_setpoint, sample.right_setpoint,
+            (long long)sample.left_enc_pos, (long long)sample.right_enc_pos,
+            sample.left_enc_speed, sample.right_enc_speed
+        );
+        out->append(line, length);
+    }
+}
+
+void SpeedCapture::to_binary(std::vector<uint8_t>* out) const
+{
+    out->resize(_count * SPEED_SAMPLE_BINARY_SIZE);
+
+    // copied field by field so the layout doesn't depend on struct padding
+    uint8_t* dest = out->data();
+    for (size_t i = 0; i < _count; i++)
+    {
+        const SpeedSample& sample = at(i);
+        memcpy(dest, &sample.time, 8);  dest += 8;
+        memcpy(dest, &sample.left_setpoint, 4);  dest += 4;
+        memcpy(dest, &sample.right_setpoint, 4);  dest += 4;
+        memcpy(dest, &sample.left_enc_pos, 8);  dest += 8;
+        memcpy(dest, &sample.right_enc_pos, 8);  dest += 8;
+        memcpy(dest, &sample.left_enc_speed, 4);  dest += 4;
+        memcpy(dest, &sample.right_enc_speed, 4);  dest += 4;
+    }
+}
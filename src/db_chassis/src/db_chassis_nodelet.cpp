@@ -0,0 +1,30 @@
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+#include "db_chassis/db_chassis.h"
+
+namespace db_chassis
+{
+
+// Runs DodobotChassis inside a nodelet manager, next to db_parsing, so
+// encoder samples and drive commands are passed by pointer.
+// Everything is callback driven, so the manager's threads do all the work
+class DodobotChassisNodelet : public nodelet::Nodelet
+{
+public:
+    DodobotChassisNodelet() : chassis(NULL) {}
+    ~DodobotChassisNodelet() { delete chassis; }
+
+private:
+    DodobotChassis* chassis;
+
+    virtual void onInit()
+    {
+        chassis = new DodobotChassis(&getNodeHandle(), &getPrivateNodeHandle());
+        chassis->start();
+    }
+};
+
+}  // namespace db_chassis
+
+PLUGINLIB_EXPORT_CLASS(db_chassis::DodobotChassisNodelet, nodelet::Nodelet)
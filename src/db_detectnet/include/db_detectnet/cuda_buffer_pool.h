@@ -0,0 +1,52 @@
+#ifndef _DODOBOT_CUDA_BUFFER_POOL_H_
+#define _DODOBOT_CUDA_BUFFER_POOL_H_
+
+#include <stddef.h>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+
+enum CudaBufferType {
+    CUDA_BUFFER_MAPPED = 0,  // zero-copy. Host and device share it
+    CUDA_BUFFER_DEVICE  // device only. cpu is NULL
+};
+
+struct CudaBuffer {
+    void* cpu;
+    void* gpu;
+    size_t size;
+    CudaBufferType type;
+};
+
+/**
+ * Image buffers shared by the imageConverters.
+ *
+ * The Jetson's CPU and GPU share one DRAM, so a mapped buffer needs no
+ * copies, but the GPU reads it uncached. That suits data streamed through
+ * once (an upload or the final download). Images the GPU works on stay in
+ * device memory. Released buffers are kept and handed out again, so
+ * converters that resize or take turns don't go back to the allocator.
+ * Everything is freed with the pool.
+ */
+class CudaBufferPool
+{
+public:
+    CudaBufferPool() {}
+    ~CudaBufferPool();
+
+    // reuses the smallest free buffer of the type that fits without wasting half of it
+    bool acquire(CudaBufferType type, size_t size, CudaBuffer* buffer);
+    void release(const CudaBuffer& buffer);
+
+    size_t allocated_bytes() const;
+
+private:
+    mutable boost::mutex _mutex;
+    std::vector<CudaBuffer> _free;
+    std::vector<CudaBuffer> _allocated;
+
+    static void free_buffer(const CudaBuffer& buffer);
+};
+
+#endif  // _DODOBOT_CUDA_BUFFER_POOL_H_
@@ -4,6 +4,12 @@
 #include <iostream>
 #include <ctime>
 #include <math.h>
+#include <fstream>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
 
 #include "ros/ros.h"
 #include "ros/console.h"
@@ -15,6 +21,7 @@
 #include <message_filters/subscriber.h>
 #include <message_filters/time_synchronizer.h>
 #include <message_filters/sync_policies/approximate_time.h>
+#include <message_filters/sync_policies/exact_time.h>
 
 #include <sensor_msgs/Image.h>
 #include <sensor_msgs/CameraInfo.h>
@@ -40,14 +47,24 @@
 
 #include <sensor_msgs/image_encodings.h>
 
+#include <std_srvs/Trigger.h>
+
 #include <jetson-inference/detectNet.h>
 #include <db_detectnet/image_converter.h>
+#include <db_detectnet/depth_sampler.h>
+#include <db_detectnet/detection_tracker.h>
+#include <db_detectnet/frame_queue.h>
+#include <db_detectnet/pipeline_stats.h>
+
+#include <boost/thread/thread.hpp>
 
 using namespace std;
 using namespace sensor_msgs;
 
 #define THROW_EXCEPTION(msg)  throw std::runtime_error(msg)
 
+#define BENCHMARK_STATS_WINDOW 100000  // frames kept for the percentiles at the end of a benchmark
+
 
 typedef struct {
     string label;
@@ -90,6 +107,24 @@ ObjPoseDescription init_obj_desc()
     };
 }
 
+// one synchronized set of camera messages
+struct RgbdFrame {
+    ImageConstPtr color_image;
+    CameraInfoConstPtr color_info;
+    ImageConstPtr depth_image;
+    CameraInfoConstPtr depth_info;
+    ros::SteadyTime receive_time;
+};
+
+// a frame on its way through the pipeline
+struct DetectionJob {
+    RgbdFrame frame;
+    int cvt_index;  // input converter holding the frame. -1 once inference is done with it
+    vision_msgs::Detection2DArray msg;
+    int num_detections;
+    std::vector<int> track_ids;  // stable per label, lined up with msg.detections
+};
+
 class DodobotDetectNet {
 private:
     ros::NodeHandle nh;  // ROS node handle
@@ -100,6 +135,13 @@ private:
     string _prototxt_path;
     string _class_labels_path;
 
+    string _precision_str;  // fastest, fp32, fp16 or int8
+    string _engine_cache_dir;  // empty keeps TensorRT's engines next to the model
+    int _warmup_frames;
+    int _warmup_width;
+    int _warmup_height;
+    string _warmup_encoding;  // what the camera sends, so the warm up sizes the buffers it will use
+
     string _input_blob;
     string _output_cvg;
     string _output_bbox;
@@ -123,6 +165,10 @@ private:
     double _min_valid_dist;
     double _max_valid_dist;
 
+    string _depth_statistic_str;  // mean, median or percentile
+    double _depth_percentile;
+    double _depth_histogram_bin_mm;
+
     XmlRpc::XmlRpcValue _marker_colors_param;
     std::map<std::string, std_msgs::ColorRGBA> _marker_colors;
     std::map<std::string, double> _z_depth_estimations;
@@ -133,28 +179,63 @@ private:
     // detectnet variables
     detectNet* _net;
 
-    imageConverter* _input_cvt;
+    CudaBufferPool _buffer_pool;  // shared by the converters
     imageConverter* _overlay_cvt;
 
     void load_detectnet_model();
     void load_labels();
+    precisionType select_precision();
+    string cached_model_path(const string& model_path, precisionType precision);
+    void warm_up();
+
+    ros::ServiceServer _ready_srv;
+    bool ready_callback(std_srvs::Trigger::Request &req, std_srvs::Trigger::Response &resp);
 
     // bbox to pose variables
     image_geometry::PinholeCameraModel _camera_model;
-    std::map<std::string, int> _label_counter;
+
+    // Detections are read straight off the depth image, at its own resolution.
+    // _depth_matches_color skips the mapping when the two cameras agree
+    image_geometry::PinholeCameraModel _depth_camera_model;
+    bool _depth_matches_color;
+    std::map<std::string, int> _label_counter;  // fallback labels when a frame has no track ids
+    DepthSampler _depth_sampler;  // keeps its histogram between frames
+
+    // The detector runs every _detect_interval frames, or sooner on a scene
+    // change or a lost track. The tracker moves the boxes in between and
+    // keeps the object ids stable. Only the inference thread touches it
+    int _detect_interval;
+    double _scene_change_threshold;
+    int _tracking_width;
+    DetectionTracker _tracker;
+    bool track(imageConverter* input_cvt, DetectionJob* job);
 
 
     // Subscribers
     message_filters::Subscriber<Image> color_sub;
     message_filters::Subscriber<CameraInfo> color_info_sub;
     message_filters::Subscriber<Image> depth_sub;
-
-    typedef message_filters::sync_policies::ApproximateTime<Image, CameraInfo, Image> ApproxSyncPolicy;
-    // typedef message_filters::sync_policies::ExactTime<Image, CameraInfo, Image> ExactSyncPolicy;
+    message_filters::Subscriber<CameraInfo> depth_info_sub;
+
+    // ~sync_policy. approximate and exact match the messages by stamp and
+    // queue matched sets into the pipeline, where each handoff drops its
+    // oldest entry when the next stage is behind. latest subscribes and
+    // matches with a queue depth of 1, so only the newest message on each
+    // topic is ever considered. It drops every matched set that arrives while
+    // a frame is still being converted or run through the detector
+    // (_latest_dropped), so inference always starts on the newest frame
+    string _sync_policy;
+    bool _latest_only;
+    std::atomic<bool> _frame_in_flight;
+    std::atomic<uint64_t> _latest_dropped;
+    void finish_frame() { _frame_in_flight = false; }
+    typedef message_filters::sync_policies::ApproximateTime<Image, CameraInfo, Image, CameraInfo> ApproxSyncPolicy;
+    typedef message_filters::sync_policies::ExactTime<Image, CameraInfo, Image, CameraInfo> ExactSyncPolicy;
 
     typedef message_filters::Synchronizer<ApproxSyncPolicy> Sync;
-    // typedef message_filters::Synchronizer<ExactSyncPolicy> Sync;
+    typedef message_filters::Synchronizer<ExactSyncPolicy> ExactSync;
     boost::shared_ptr<Sync> sync;
+    boost::shared_ptr<ExactSync> exact_sync;
 
     // Publishers
     image_transport::ImageTransport _image_transport;
@@ -163,20 +244,67 @@ private:
     ros::Publisher _marker_pub;
     image_transport::Publisher _overlay_pub;
 
-    // ROS TF
+    // ROS TF. One lookup per frame, and it never waits. Frames from the same
+    // camera frame whose stamps fall in one bucket can reuse a transform
     tf2_ros::Buffer tfBuffer;
     tf2_ros::TransformListener tfListener;
 
+    double _tf_cache_bucket_s;  // 0 disables the cache
+    double _tf_fallback_tolerance_s;  // how far off the latest transform may be when the exact one isn't there yet
+    bool _tf_cache_valid;
+    string _tf_cache_frame;
+    int64_t _tf_cache_bucket;
+    geometry_msgs::TransformStamped _tf_cache_transform;
+
+    // Pipeline. The sync callback only queues frames. One thread converts the
+    // newest frame into a free input converter, one runs inference (and the
+    // overlay) on converted frames, one does depth, TF and publishing. Each
+    // queue drops its oldest entry when a later stage falls behind
+    int _pipeline_buffers;  // input converters. 2 lets conversion overlap inference
+    int _pipeline_queue_size;
+    std::vector<imageConverter*> _input_cvts;
+
+    FrameQueue<RgbdFrame> _frame_queue;
+    FrameQueue<int> _free_cvts;  // indices into _input_cvts
+    FrameQueue<DetectionJob> _infer_queue;
+    FrameQueue<DetectionJob> _post_queue;
+
+    boost::thread* _convert_thread;
+    boost::thread* _infer_thread;
+    boost::thread* _post_thread;
+    void start_pipeline();
+    void stop_pipeline();
+    void convert_thread_task();
+    void infer_thread_task();
+    void post_thread_task();
+    void process_detections(DetectionJob& job);
+
+    // Stage latencies, published on detectnet_stats. In benchmark mode a
+    // summary over the whole run is printed on shutdown
+    double _stats_rate;
+    int _stats_window;
+    bool _benchmark;
+    PipelineStats _stats;
+    ros::Publisher _stats_pub;
+    ros::Timer _stats_timer;
+    void stats_timer_callback(const ros::TimerEvent& event);
+    uint64_t dropped_frames();
+    uint64_t _prev_dropped_frames;
+
     // Sub callbacks
-    void rgbd_callback(const ImageConstPtr& color_image, const CameraInfoConstPtr& color_info, const ImageConstPtr& depth_image);
-    int detect(const ImageConstPtr& color_image, vision_msgs::Detection2DArray* msg);
-    bool publish_overlay(detectNet::Detection* detections, int num_detections);
+    void rgbd_callback(const ImageConstPtr& color_image, const CameraInfoConstPtr& color_info,
+        const ImageConstPtr& depth_image, const CameraInfoConstPtr& depth_info);
+    int detect(imageConverter* input_cvt, const ImageConstPtr& color_image, vision_msgs::Detection2DArray* msg);
+    void add_detection_msgs(const detectNet::Detection* detections, int num_detections, vision_msgs::Detection2DArray* msg);
+    bool publish_overlay(imageConverter* input_cvt, detectNet::Detection* detections, int num_detections);
 
     void reset_label_counter();
-    ObjPoseDescription bbox_to_pose(cv::Mat depth_cv_image, vision_msgs::BoundingBox2D bbox, ros::Time stamp, string label, int label_index);
+    ObjPoseDescription bbox_to_pose(const cv::Mat& depth_cv_image, vision_msgs::BoundingBox2D bbox, ros::Time stamp, string label, int label_index);
     visualization_msgs::Marker make_marker(ObjPoseDescription* desc);
-    double get_z_dist(cv::Mat depth_cv_image, ObjPoseDescription* desc);
-    void tf_obj_to_target(const CameraInfoConstPtr color_info, ObjPoseDescription& obj_desc);
+    double get_z_dist(const cv::Mat& depth_cv_image, ObjPoseDescription* desc);
+    void color_to_depth_circle(ObjPoseDescription* desc, int* depth_x, int* depth_y, int* depth_radius);
+    void tf_objs_to_target(const std_msgs::Header& camera_header, std::vector<ObjPoseDescription>& obj_descs);
+    bool lookup_target_transform(const std_msgs::Header& camera_header, geometry_msgs::TransformStamped* transform);
 
 public:
     DodobotDetectNet(ros::NodeHandle* nodehandle);
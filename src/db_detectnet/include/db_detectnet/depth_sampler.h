@@ -0,0 +1,63 @@
+#ifndef _DODOBOT_DEPTH_SAMPLER_H_
+#define _DODOBOT_DEPTH_SAMPLER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+
+enum DepthStatistic {
+    DEPTH_MEAN = 0,
+    DEPTH_PERCENTILE
+};
+
+/**
+ * Depth of an object from the pixels inside a circle on a depth image.
+ *
+ * Only the circle's rows are read. Each row is one contiguous span clipped
+ * to the image, so every pixel in the circle is visited once and nothing
+ * outside it is touched. Zero pixels (no depth) are skipped. The mean is
+ * the same value the old full-frame masks produced. The percentile (a
+ * median at 0.5) comes from a histogram of fixed width bins that's kept
+ * between calls, so it ignores background pixels at the edge of the circle
+ * without sorting or allocating. Depths past max_depth share one overflow
+ * bin. A percentile that lands there reads as beyond max_depth.
+ *
+ * Images are CV_16UC1 or CV_32FC1. Results are in the image's units.
+ */
+class DepthSampler
+{
+public:
+    DepthSampler();
+
+    // "mean", "median" or "percentile". false if the name isn't one of those
+    static bool statistic_from_str(const std::string& name, DepthStatistic* statistic);
+
+    // percentile is 0..1. max_depth and bin_width are in the image's units
+    void configure(DepthStatistic statistic, double percentile, double max_depth, double bin_width);
+
+    // 0.0 if the circle has no valid pixels or the image type isn't supported
+    double sample(const cv::Mat& depth, int center_x, int center_y, int radius);
+
+    // valid pixels behind the last sample
+    size_t count() const { return _count; }
+
+private:
+    DepthStatistic _statistic;
+    double _percentile;
+    double _max_depth;
+    double _bin_width;
+    double _inv_bin_width;
+
+    std::vector<uint32_t> _histogram;  // last bin is the overflow bin
+    double _sum;
+    size_t _count;
+
+    template <typename T> void accumulate(const cv::Mat& depth, int center_x, int center_y, int radius);
+    double histogram_percentile() const;
+};
+
+#endif  // _DODOBOT_DEPTH_SAMPLER_H_
@@ -0,0 +1,98 @@
+#ifndef _DODOBOT_DETECTION_TRACKER_H_
+#define _DODOBOT_DETECTION_TRACKER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/video/tracking.hpp>
+
+#include <jetson-inference/detectNet.h>
+
+
+/**
+ * Follows detectNet's objects between detector runs.
+ *
+ * Every frame is handed over as a grayscale image. That image is shrunk to
+ * the tracking width, and begin_frame says whether the detector is due. It
+ * is due when the interval is up, when the scene has changed too much since
+ * the last detection (mean absolute difference in gray levels), or when a
+ * track was lost. On the other frames propagate moves each box by median
+ * flow. A grid of points inside the box is tracked with pyramidal
+ * Lucas-Kanade, forward and then back again. Points that don't come back
+ * to where they started are thrown out. The box then moves by the median
+ * of the remaining points' motion and scales by the median change in their
+ * pairwise distances. A box keeps its detection's class and confidence.
+ *
+ * update takes the detector's results and matches each one to the track of
+ * the same class it overlaps most (IoU). Matched detections keep the
+ * track's id, and the others get the next free id for their class, so ids
+ * stay stable for as long as an object stays in view. Tracks that no
+ * detection matched are dropped.
+ */
+class DetectionTracker
+{
+public:
+    DetectionTracker();
+
+    // detect_interval 1 runs the detector on every frame and only keeps the ids stable.
+    // scene_change_threshold 0 disables the scene check
+    void configure(int detect_interval, double scene_change_threshold, int tracking_width);
+
+    bool tracking() const { return _detect_interval > 1; }
+
+    // gray is CV_8UC1 at the detector's resolution. true if the detector should run on it
+    bool begin_frame(const cv::Mat& gray);
+
+    // moves the tracks onto the current frame. false if one was lost, so the detector should run
+    bool propagate();
+
+    // the detector's results for the current frame, in the order they'll be published
+    void update(const detectNet::Detection* detections, int num_detections);
+
+    // tracks that are still in view, lined up with ids()
+    const std::vector<detectNet::Detection>& detections() const { return _detections; }
+    const std::vector<int>& ids() const { return _ids; }
+
+private:
+    struct Track {
+        detectNet::Detection detection;
+        int id;
+        bool lost;
+    };
+
+    int _detect_interval;
+    double _scene_change_threshold;
+    int _tracking_width;
+
+    double _scale;  // tracking image pixels per detector pixel
+    cv::Mat _prev;
+    cv::Mat _curr;
+    cv::Mat _key;  // image of the last detector run
+    cv::Mat _diff;
+    int _frames_since_detection;
+    bool _track_lost;
+
+    std::vector<Track> _tracks;
+    std::map<uint32_t, int> _next_id;  // per class id
+    std::vector<detectNet::Detection> _detections;
+    std::vector<int> _ids;
+
+    std::vector<cv::Point2f> _points;
+    std::vector<cv::Point2f> _next_points;
+    std::vector<cv::Point2f> _back_points;
+    std::vector<uint8_t> _status;
+    std::vector<uint8_t> _back_status;
+    std::vector<float> _error;
+    std::vector<float> _dx;
+    std::vector<float> _dy;
+    std::vector<float> _ratios;
+
+    bool move_box(size_t first_point, detectNet::Detection* detection);
+    void refresh_outputs();
+};
+
+#endif  // _DODOBOT_DETECTION_TRACKER_H_
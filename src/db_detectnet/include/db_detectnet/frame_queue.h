@@ -0,0 +1,93 @@
+#ifndef _DODOBOT_FRAME_QUEUE_H_
+#define _DODOBOT_FRAME_QUEUE_H_
+
+#include <stddef.h>
+#include <deque>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+
+/**
+ * Bounded queue between two pipeline stages.
+ *
+ * A push onto a full queue drops the oldest item, so a stage that falls
+ * behind always works on the newest frames instead of a growing backlog.
+ * pop blocks until there's an item or the queue is closed.
+ */
+template <typename T> class FrameQueue
+{
+public:
+    FrameQueue() : _capacity(1), _closed(false), _dropped(0) {}
+
+    void set_capacity(size_t capacity)
+    {
+        boost::mutex::scoped_lock lock(_mutex);
+        _capacity = capacity > 0 ? capacity : 1;
+    }
+
+    // true if the oldest item was dropped to make room. It's copied into dropped if given
+    bool push(const T& item, T* dropped = NULL)
+    {
+        bool was_full = false;
+        {
+            boost::mutex::scoped_lock lock(_mutex);
+            if (_closed) {
+                return false;
+            }
+            if (_items.size() >= _capacity) {
+                if (dropped != NULL) {
+                    *dropped = _items.front();
+                }
+                _items.pop_front();
+                _dropped++;
+                was_full = true;
+            }
+            _items.push_back(item);
+        }
+        _cond.notify_one();
+        return was_full;
+    }
+
+    // false once the queue is closed
+    bool pop(T* item)
+    {
+        boost::mutex::scoped_lock lock(_mutex);
+        while (_items.empty() && !_closed) {
+            _cond.wait(lock);
+        }
+        if (_closed) {
+            return false;
+        }
+        *item = _items.front();
+        _items.pop_front();
+        return true;
+    }
+
+    // wakes every pop. Items still queued are discarded
+    void close()
+    {
+        {
+            boost::mutex::scoped_lock lock(_mutex);
+            _closed = true;
+            _items.clear();
+        }
+        _cond.notify_all();
+    }
+
+    size_t dropped() const
+    {
+        boost::mutex::scoped_lock lock(_mutex);
+        return _dropped;
+    }
+
+private:
+    mutable boost::mutex _mutex;
+    boost::condition_variable _cond;
+    std::deque<T> _items;
+    size_t _capacity;
+    bool _closed;
+    size_t _dropped;
+};
+
+#endif  // _DODOBOT_FRAME_QUEUE_H_
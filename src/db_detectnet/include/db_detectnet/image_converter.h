@@ -34,8 +34,14 @@
 #include <vision_msgs/VisionInfo.h>
 #include <image_transport/image_transport.h>
 
+#include <db_detectnet/cuda_buffer_pool.h>
+
 /**
  * GPU image conversion
+ *
+ * Messages pass through a mapped staging buffer. The converted image lives
+ * in device memory, where the GPU caches its reads. Both come from a
+ * CudaBufferPool that converters can share.
  */
 class imageConverter
 {
@@ -56,9 +62,9 @@ public:
 	static const imageFormat ROSOutputFormat = IMAGE_BGR8;
 
 	/**
-	 * Constructor
+	 * Constructor. Buffers come from pool, or from a pool of its own if NULL
 	 */
-	imageConverter();
+	imageConverter( CudaBufferPool* pool = NULL );
 
 	/**
 	 * Destructor
@@ -66,7 +72,7 @@ public:
 	~imageConverter();
 
 	/**
-	 * Free the memory
+	 * Return the memory to the pool
 	 */
 	void Free();
 
@@ -101,11 +107,9 @@ public:
 	inline uint32_t GetHeight() const		{ return mHeight; }
 
 	/**
-	 * Retrieve the GPU pointer of the converted image
+	 * Retrieve the GPU pointer of the converted image (device memory)
 	 */
-	inline PixelType* ImageGPU() const		{ return mOutputGPU; }
-
-    inline PixelType* ImageCPU() const		{ return (PixelType*)mInputCPU; }
+	inline PixelType* ImageGPU() const		{ return (PixelType*)mImage.gpu; }
 
 private:
 
@@ -114,11 +118,11 @@ private:
 	size_t   mSizeInput;
 	size_t   mSizeOutput;
 
-	void* mInputCPU;
-	void* mInputGPU;
+	CudaBufferPool* mPool;
+	bool mOwnPool;
 
-	PixelType* mOutputCPU;
-	PixelType* mOutputGPU;
+	CudaBuffer mStaging;	// mapped. Input messages are copied in, output messages out
+	CudaBuffer mImage;		// device. The image in InternalFormat
 };
 
 #endif
@@ -0,0 +1,71 @@
+#ifndef _DODOBOT_PIPELINE_STATS_H_
+#define _DODOBOT_PIPELINE_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+#include "ros/ros.h"
+
+#include "db_detectnet/DetectNetStats.h"
+
+
+enum PipelineStage {
+    STAGE_CONVERT = 0,
+    STAGE_INFER,
+    STAGE_TRACK,  // frames between detector runs
+    STAGE_OVERLAY,
+    STAGE_DEPTH,
+    STAGE_TF,
+    STAGE_PUBLISH,
+    STAGE_END_TO_END,  // image stamp to publish
+    NUM_PIPELINE_STAGES
+};
+
+/**
+ * Rolling latency percentiles for the detectnet pipeline stages.
+ *
+ * Each stage keeps its last window_size samples in a ring. The pipeline
+ * threads record into it under a short lock. Percentiles are only sorted
+ * out when a report is made, at the stats rate or once at the end of a
+ * benchmark.
+ */
+class PipelineStats
+{
+public:
+    PipelineStats();
+
+    void set_window(size_t window_size);
+
+    void record(PipelineStage stage, double seconds);
+    void count_frame();  // a frame made it through inference or tracking
+    void count_received();  // a matched set of camera messages arrived
+
+    // fps is since the previous report
+    void report(uint64_t dropped, db_detectnet::DetectNetStats* msg);
+
+    // FPS since start and p50/p99 per stage, one stage per line
+    std::string summary(uint64_t dropped);
+
+private:
+    boost::mutex _mutex;
+    size_t _window_size;
+    std::vector<float> _samples[NUM_PIPELINE_STAGES];  // ms
+    size_t _next[NUM_PIPELINE_STAGES];  // oldest sample once the ring is full
+    std::vector<float> _sorted;
+
+    uint64_t _frames;
+    uint64_t _prev_frames;
+    uint64_t _received;
+    uint64_t _prev_received;
+    ros::SteadyTime _start_time;
+    ros::SteadyTime _prev_report_time;
+
+    void sort_stage(size_t stage);
+    float percentile(double fraction) const;  // of _sorted
+};
+
+#endif  // _DODOBOT_PIPELINE_STATS_H_
@@ -0,0 +1,81 @@
+#include <db_detectnet/cuda_buffer_pool.h>
+
+#include <jetson-utils/cudaUtility.h>
+#include <jetson-utils/cudaMappedMemory.h>
+
+
+CudaBufferPool::~CudaBufferPool()
+{
+    for (size_t i = 0; i < _allocated.size(); i++) {
+        free_buffer(_allocated[i]);
+    }
+}
+
+bool CudaBufferPool::acquire(CudaBufferType type, size_t size, CudaBuffer* buffer)
+{
+    boost::mutex::scoped_lock lock(_mutex);
+
+    // best fit among the free buffers
+    size_t best = _free.size();
+    for (size_t i = 0; i < _free.size(); i++)
+    {
+        const CudaBuffer& candidate = _free[i];
+        if (candidate.type != type || candidate.size < size || candidate.size / 2 > size) {
+            continue;
+        }
+        if (best == _free.size() || candidate.size < _free[best].size) {
+            best = i;
+        }
+    }
+    if (best < _free.size()) {
+        *buffer = _free[best];
+        _free.erase(_free.begin() + best);
+        return true;
+    }
+
+    CudaBuffer allocated;
+    allocated.cpu = NULL;
+    allocated.gpu = NULL;
+    allocated.size = size;
+    allocated.type = type;
+    if (type == CUDA_BUFFER_MAPPED) {
+        if (!cudaAllocMapped(&allocated.cpu, &allocated.gpu, size)) {
+            return false;
+        }
+    }
+    else if (CUDA_FAILED(cudaMalloc(&allocated.gpu, size))) {
+        return false;
+    }
+    _allocated.push_back(allocated);
+    *buffer = allocated;
+    return true;
+}
+
+void CudaBufferPool::release(const CudaBuffer& buffer)
+{
+    if (buffer.gpu == NULL) {
+        return;
+    }
+    boost::mutex::scoped_lock lock(_mutex);
+    _free.push_back(buffer);
+}
+
+size_t CudaBufferPool::allocated_bytes() const
+{
+    boost::mutex::scoped_lock lock(_mutex);
+    size_t total = 0;
+    for (size_t i = 0; i < _allocated.size(); i++) {
+        total += _allocated[i].size;
+    }
+    return total;
+}
+
+void CudaBufferPool::free_buffer(const CudaBuffer& buffer)
+{
+    if (buffer.type == CUDA_BUFFER_MAPPED) {
+        CUDA(cudaFreeHost(buffer.cpu));
+    }
+    else {
+        CUDA(cudaFree(buffer.gpu));
+    }
+}
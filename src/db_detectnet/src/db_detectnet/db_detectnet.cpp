@@ -10,6 +10,12 @@ DodobotDetectNet::DodobotDetectNet(ros::NodeHandle* nodehandle) :
     ros::param::param<string>("~model_path", _model_path, "");
     ros::param::param<string>("~prototxt_path", _prototxt_path, "");
     ros::param::param<string>("~class_labels_path", _class_labels_path, "");
+    ros::param::param<string>("~precision", _precision_str, "fastest");
+    ros::param::param<string>("~engine_cache_dir", _engine_cache_dir, "");
+    ros::param::param<int>("~warmup_frames", _warmup_frames, 3);
+    ros::param::param<int>("~warmup_width", _warmup_width, 640);
+    ros::param::param<int>("~warmup_height", _warmup_height, 480);
+    ros::param::param<string>("~warmup_encoding", _warmup_encoding, sensor_msgs::image_encodings::RGB8);
 
     ros::param::param<string>("~input_blob", _input_blob, DETECTNET_DEFAULT_INPUT);
     ros::param::param<string>("~output_cvg", _output_cvg, DETECTNET_DEFAULT_COVERAGE);
@@ -29,12 +35,50 @@ DodobotDetectNet::DodobotDetectNet(ros::NodeHandle* nodehandle) :
     ros::param::param<double>("~min_valid_dist", _min_valid_dist, 0.05);
     ros::param::param<double>("~max_valid_dist", _max_valid_dist, 4.0);
 
+    ros::param::param<string>("~depth_statistic", _depth_statistic_str, "mean");
+    ros::param::param<double>("~depth_percentile", _depth_percentile, 0.5);
+    ros::param::param<double>("~depth_histogram_bin_mm", _depth_histogram_bin_mm, 2.0);
+
     ros::param::param<bool>("~publish_with_frame", _publish_with_frame, true);
+
+    ros::param::param<int>("~detect_interval", _detect_interval, 1);
+    ros::param::param<double>("~scene_change_threshold", _scene_change_threshold, 8.0);
+    ros::param::param<int>("~tracking_width", _tracking_width, 320);
+
+    ros::param::param<int>("~pipeline_buffers", _pipeline_buffers, 2);
+    ros::param::param<int>("~pipeline_queue_size", _pipeline_queue_size, 1);
+    ros::param::param<string>("~sync_policy", _sync_policy, "approximate");
+
+    ros::param::param<double>("~stats_rate", _stats_rate, 1.0);
+    ros::param::param<int>("~stats_window", _stats_window, 300);
+    ros::param::param<bool>("~benchmark", _benchmark, false);
     ros::param::param<string>("~target_frame", _target_frame, "base_link");
+    ros::param::param<double>("~tf_cache_bucket_s", _tf_cache_bucket_s, 0.0);
+    ros::param::param<double>("~tf_fallback_tolerance_s", _tf_fallback_tolerance_s, 0.1);
 
     _marker_persistance = ros::Duration(_marker_persistance_s);
     _overlay_flags = detectNet::OverlayFlagsFromStr(_overlay_str.c_str());
 
+    if (_sync_policy != "approximate" && _sync_policy != "exact" && _sync_policy != "latest") {
+        THROW_EXCEPTION("sync_policy must be approximate, exact or latest. Got " + _sync_policy);
+    }
+    _latest_only = _sync_policy == "latest";
+    _frame_in_flight = false;
+    _latest_dropped = 0;
+
+    DepthStatistic depth_statistic;
+    if (!DepthSampler::statistic_from_str(_depth_statistic_str, &depth_statistic)) {
+        THROW_EXCEPTION("depth_statistic must be mean, median or percentile. Got " + _depth_statistic_str);
+    }
+    if (_depth_statistic_str == "median") {
+        _depth_percentile = 0.5;
+    }
+    // depth values are in mm
+    _depth_sampler.configure(depth_statistic, _depth_percentile, _max_valid_dist * 1000.0, _depth_histogram_bin_mm);
+
+    // grayscale levels, 0..255
+    _tracker.configure(_detect_interval, _scene_change_threshold, _tracking_width);
+
     string key;
     if (!ros::param::search("detectnet_marker_colors", key)) {
         THROW_EXCEPTION("Failed to find detectnet_marker_colors parameter");
@@ -79,24 +123,59 @@ DodobotDetectNet::DodobotDetectNet(ros::NodeHandle* nodehandle) :
     load_labels();
 
     reset_label_counter();
+    _depth_matches_color = true;
+    _tf_cache_valid = false;
+    _tf_cache_bucket = 0;
+
+    // image converter objects. Frames are converted into one while another is being inferred
+    _pipeline_buffers = std::max(_pipeline_buffers, 1);
+    for (int i = 0; i < _pipeline_buffers; i++) {
+        _input_cvts.push_back(new imageConverter(&_buffer_pool));
+    }
+	_overlay_cvt = new imageConverter(&_buffer_pool);
+
+    _frame_queue.set_capacity(_pipeline_queue_size);
+    _free_cvts.set_capacity(_pipeline_buffers);
+    _infer_queue.set_capacity(_pipeline_buffers);
+    _post_queue.set_capacity(_pipeline_queue_size);
+    for (int i = 0; i < _pipeline_buffers; i++) {
+        _free_cvts.push(i);
+    }
+    _convert_thread = NULL;
+    _infer_thread = NULL;
+    _post_thread = NULL;
+    _prev_dropped_frames = 0;
 
-    // image converter objects
-	_input_cvt = new imageConverter();
-	_overlay_cvt = new imageConverter();
+    // first inferences are slow while CUDA and TensorRT finish initializing. Get them out of the way before any frames arrive
+    warm_up();
 
     // Publishers
     _detection_pub = nh.advertise<vision_msgs::Detection2DArray>("detections", 25);
     _marker_pub = nh.advertise<visualization_msgs::MarkerArray>("obj_markers", 25);
     _overlay_pub = _image_transport.advertise("detect_overlay", 2);
+    _stats_pub = nh.advertise<db_detectnet::DetectNetStats>("detectnet_stats", 5);
 
-    // Subscribers
-    color_sub.subscribe(nh, _color_topic, 10);
-    color_info_sub.subscribe(nh, _color_info_topic, 10);
-    depth_sub.subscribe(nh, _depth_topic, 10);
+    // a benchmark reports over the whole run
+    _stats.set_window(_benchmark ? std::max(_stats_window, BENCHMARK_STATS_WINDOW) : _stats_window);
+    if (_stats_rate > 0.0) {
+        _stats_timer = nh.createTimer(ros::Duration(1.0 / _stats_rate), &DodobotDetectNet::stats_timer_callback, this);
+    }
 
-    sync.reset(new Sync(ApproxSyncPolicy(10), color_sub, color_info_sub, depth_sub));
-    // sync.reset(new Sync(ExactSyncPolicy(10), color_sub, color_info_sub, depth_sub));
-    sync->registerCallback(boost::bind(&DodobotDetectNet::rgbd_callback, this, _1, _2, _3));
+    // Subscribers
+    int sync_queue_size = _latest_only ? 1 : 10;
+    color_sub.subscribe(nh, _color_topic, sync_queue_size);
+    color_info_sub.subscribe(nh, _color_info_topic, sync_queue_size);
+    depth_sub.subscribe(nh, _depth_topic, sync_queue_size);
+    depth_info_sub.subscribe(nh, _depth_info_topic, sync_queue_size);
+
+    if (_sync_policy == "exact") {
+        exact_sync.reset(new ExactSync(ExactSyncPolicy(sync_queue_size), color_sub, color_info_sub, depth_sub, depth_info_sub));
+        exact_sync->registerCallback(boost::bind(&DodobotDetectNet::rgbd_callback, this, _1, _2, _3, _4));
+    }
+    else {
+        sync.reset(new Sync(ApproxSyncPolicy(sync_queue_size), color_sub, color_info_sub, depth_sub, depth_info_sub));
+        sync->registerCallback(boost::bind(&DodobotDetectNet::rgbd_callback, this, _1, _2, _3, _4));
+    }
 
     ROS_INFO("db_detectnet init done");
 }
@@ -104,15 +183,21 @@ DodobotDetectNet::DodobotDetectNet(ros::NodeHandle* nodehandle) :
 
 void DodobotDetectNet::load_detectnet_model()
 {
+    precisionType precision = select_precision();
+
     /*
 	 * load object detection network
 	 */
     if (_model_path.size() > 0)
 	{
-		// create network using custom model paths
-		_net = detectNet::Create(_prototxt_path.c_str(), _model_path.c_str(),
+		// create network using custom model paths. TensorRT serializes the
+		// engine next to the model path it's given, so with a cache
+		// directory that's a link named after the model and GPU
+		string model_path = cached_model_path(_model_path, precision);
+		_net = detectNet::Create(_prototxt_path.c_str(), model_path.c_str(),
 						    _mean_pixel, _class_labels_path.c_str(), _threshold,
-						    _input_blob.c_str(), _output_cvg.c_str(), _output_bbox.c_str());
+						    _input_blob.c_str(), _output_cvg.c_str(), _output_bbox.c_str(),
+						    DEFAULT_MAX_BATCH_SIZE, precision);
 	}
 	else
 	{
@@ -126,10 +211,151 @@ void DodobotDetectNet::load_detectnet_model()
 		}
 
 		// create network using the built-in model
-		_net = detectNet::Create(model, _threshold);
+		// built-in models keep their engines with the jetson-inference networks
+		_net = detectNet::Create(model, _threshold, DEFAULT_MAX_BATCH_SIZE, precision);
 	}
+
+    // Inference gets a non-blocking stream so conversions on the default
+    // stream can run alongside it
+    if (_net) {
+        _net->CreateStream(true);
+    }
+}
+
+
+precisionType DodobotDetectNet::select_precision()
+{
+    precisionType precision = precisionTypeFromStr(_precision_str.c_str());
+    if (precision == TYPE_DISABLED) {
+        THROW_EXCEPTION("precision must be fastest, fp32, fp16 or int8. Got " + _precision_str);
+    }
+    if (precision == TYPE_FASTEST) {
+        return precision;
+    }
+
+    if (!tensorNet::DetectNativePrecision(tensorNet::DetectNativePrecisions(DEVICE_GPU), precision)) {
+        ROS_WARN("This GPU has no native %s support. Using the fastest precision it has", precisionTypeToStr(precision));
+        return TYPE_FASTEST;
+    }
+    if (precision == TYPE_INT8) {
+        ROS_WARN("INT8 without a calibration cache is calibrated on random data by jetson-inference. Check the detections");
+    }
+    return precision;
 }
 
+string DodobotDetectNet::cached_model_path(const string& model_path, precisionType precision)
+{
+    if (_engine_cache_dir.empty()) {
+        return model_path;
+    }
+
+    // the model's contents, so a retrained model gets a new engine
+    std::ifstream model_file(model_path.c_str(), std::ios::binary);
+    if (!model_file) {
+        ROS_WARN("Can't read %s to hash it. Not using the engine cache", model_path.c_str());
+        return model_path;
+    }
+    uint64_t model_hash = 14695981039346656037ULL;  // FNV-1a
+    std::vector<char> chunk(1 << 20);
+    while (model_file)
+    {
+        model_file.read(chunk.data(), chunk.size());
+        std::streamsize count = model_file.gcount();
+        for (std::streamsize i = 0; i < count; i++) {
+            model_hash = (model_hash ^ (uint8_t)chunk[i]) * 1099511628211ULL;
+        }
+    }
+
+    int device = 0;
+    cudaDeviceProp properties;
+    if (CUDA_FAILED(cudaGetDevice(&device)) || CUDA_FAILED(cudaGetDeviceProperties(&properties, device))) {
+        ROS_WARN("Can't identify the GPU. Not using the engine cache");
+        return model_path;
+    }
+    string gpu_name(properties.name);
+    for (size_t i = 0; i < gpu_name.size(); i++) {
+        if (!isalnum(gpu_name[i])) {
+            gpu_name[i] = '_';
+        }
+    }
+
+    // TensorRT picks the parser from the extension, so the link keeps it
+    size_t slash = model_path.find_last_of('/');
+    string file_name = slash == string::npos ? model_path : model_path.substr(slash + 1);
+    size_t dot = file_name.find_last_of('.');
+    string stem = dot == string::npos ? file_name : file_name.substr(0, dot);
+    string extension = dot == string::npos ? "" : file_name.substr(dot);
+
+    char key[64];
+    snprintf(key, sizeof(key), "-%016llx-sm%d%d-", (unsigned long long)model_hash, properties.major, properties.minor);
+    string link_path = _engine_cache_dir + "/" + stem + key + gpu_name + "-" + precisionTypeToStr(precision) + extension;
+
+    if (mkdir(_engine_cache_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        ROS_WARN("Can't create engine cache directory %s: %s", _engine_cache_dir.c_str(), strerror(errno));
+        return model_path;
+    }
+    struct stat link_stat;
+    if (lstat(link_path.c_str(), &link_stat) != 0)
+    {
+        char* absolute_path = realpath(model_path.c_str(), NULL);
+        int result = symlink(absolute_path != NULL ? absolute_path : model_path.c_str(), link_path.c_str());
+        free(absolute_path);
+        if (result != 0) {
+            ROS_WARN("Can't link %s into the engine cache: %s", model_path.c_str(), strerror(errno));
+            return model_path;
+        }
+        ROS_INFO("No cached engine for %s yet. TensorRT will build one in %s", model_path.c_str(), _engine_cache_dir.c_str());
+    }
+    return link_path;
+}
+
+void DodobotDetectNet::warm_up()
+{
+    if (!_net || _warmup_frames <= 0 || _input_cvts.empty()) {
+        return;
+    }
+
+    // a blank frame through the first input converter, the same way a camera
+    // frame goes. If the camera matches the warmup size and encoding, its
+    // first frame reuses these buffers
+    sensor_msgs::ImagePtr blank(new sensor_msgs::Image);
+    blank->width = _warmup_width;
+    blank->height = _warmup_height;
+    blank->encoding = _warmup_encoding;
+    try {
+        blank->step = _warmup_width * sensor_msgs::image_encodings::numChannels(_warmup_encoding) *
+            sensor_msgs::image_encodings::bitDepth(_warmup_encoding) / 8;
+    }
+    catch (std::runtime_error& e) {
+        ROS_WARN("Unknown warmup_encoding %s. Skipping warm up", _warmup_encoding.c_str());
+        return;
+    }
+    blank->data.assign((size_t)blank->step * _warmup_height, 0);
+
+    imageConverter* cvt = _input_cvts[0];
+    if (!cvt->Convert(blank)) {
+        ROS_WARN("Failed to convert the %s warm up frame. Skipping warm up", _warmup_encoding.c_str());
+        return;
+    }
+
+    ros::SteadyTime t0 = ros::SteadyTime::now();
+    for (int i = 0; i < _warmup_frames; i++)
+    {
+        detectNet::Detection* detections = NULL;
+        if (_net->Detect(cvt->ImageGPU(), _warmup_width, _warmup_height, &detections, detectNet::OVERLAY_NONE) < 0) {
+            ROS_WARN("Warm up inference failed");
+            return;
+        }
+    }
+    ROS_INFO("Warmed up with %d inferences in %0.2fs", _warmup_frames, (ros::SteadyTime::now() - t0).toSec());
+}
+
+bool DodobotDetectNet::ready_callback(std_srvs::Trigger::Request &req, std_srvs::Trigger::Response &resp)
+{
+    resp.success = true;
+    resp.message = "db_detectnet is ready";
+    return true;
+}
 
 void DodobotDetectNet::load_labels()
 {
@@ -166,11 +392,24 @@ int DodobotDetectNet::run()
 		return 0;
 	}
 
-    if (!_input_cvt || !_overlay_cvt)
+    for (size_t i = 0; i < _input_cvts.size(); i++)
+    {
+        if (!_input_cvts[i]) {
+            ROS_ERROR("failed to create imageConverter objects");
+            return 0;
+        }
+    }
+    if (!_overlay_cvt)
 	{
 		ROS_ERROR("failed to create imageConverter objects");
 		return 0;
 	}
+    start_pipeline();
+
+    // only advertised once the model is loaded and warm. Clients wait for it with wait_for_service
+    _ready_srv = nh.advertiseService("detectnet_ready", &DodobotDetectNet::ready_callback, this);
+    ROS_INFO("db_detectnet is ready");
+
     // ros::Rate clock_rate(60);  // run loop at 60 Hz
     //
     // int exit_code = 0;
@@ -192,10 +431,17 @@ int DodobotDetectNet::run()
     //
     // return exit_code;
     ros::spin();
+    stop_pipeline();
+
+    if (_benchmark) {
+        cout << "db_detectnet benchmark" << endl << _stats.summary(dropped_frames()) << flush;
+    }
 
     // free resources
     delete _net;
-	delete _input_cvt;
+    for (size_t i = 0; i < _input_cvts.size(); i++) {
+        delete _input_cvts[i];
+    }
 	delete _overlay_cvt;
 
     return 0;
@@ -207,34 +453,171 @@ int DodobotDetectNet::run()
 
 void DodobotDetectNet::rgbd_callback(
     const ImageConstPtr& color_image, const CameraInfoConstPtr& color_info,
-    const ImageConstPtr& depth_image)
+    const ImageConstPtr& depth_image, const CameraInfoConstPtr& depth_info)
 {
-    ros::Time t0 = ros::Time::now();
+    RgbdFrame frame;
+    frame.color_image = color_image;
+    frame.color_info = color_info;
+    frame.depth_image = depth_image;
+    frame.depth_info = depth_info;
+    frame.receive_time = ros::SteadyTime::now();
+    _stats.count_received();
+
+    if (_latest_only && _frame_in_flight.exchange(true)) {
+        _latest_dropped++;
+        ROS_DEBUG("A frame is still in flight. Dropped this one (%lu so far)", (unsigned long)_latest_dropped.load());
+        return;
+    }
+    if (_frame_queue.push(frame)) {
+        ROS_DEBUG("Converter is busy. Dropped the oldest frame (%zu so far)", _frame_queue.dropped());
+    }
+}
 
-    // convert the image to reside on GPU
-	if (!_input_cvt || !_input_cvt->Convert(color_image))
-	{
-		ROS_INFO("failed to convert %ux%u %s image", color_image->width, color_image->height, color_image->encoding.c_str());
-		return;
-	}
+void DodobotDetectNet::stats_timer_callback(const ros::TimerEvent& event)
+{
+    db_detectnet::DetectNetStats msg;
+    uint64_t dropped = dropped_frames();
+    _stats.report(dropped, &msg);
+    _stats_pub.publish(msg);
+
+    if (dropped > _prev_dropped_frames) {
+        ROS_INFO_THROTTLE(30.0, "Camera frames arrive at %0.1f FPS, inference keeps up with %0.1f FPS. %lu dropped so far",
+            msg.camera_fps, msg.fps, (unsigned long)dropped);
+    }
+    _prev_dropped_frames = dropped;
+}
 
-    //
-    // Detect bounding boxes in color image
-    //
-    vision_msgs::Detection2DArray msg;
-    int num_detections = detect(color_image, &msg);
-    if (num_detections <= 0) {
-        return;
+uint64_t DodobotDetectNet::dropped_frames()
+{
+    return _frame_queue.dropped() + _post_queue.dropped() + _latest_dropped;
+}
+
+//
+// Pipeline
+//
+
+void DodobotDetectNet::start_pipeline()
+{
+    _convert_thread = new boost::thread(boost::bind(&DodobotDetectNet::convert_thread_task, this));
+    _infer_thread = new boost::thread(boost::bind(&DodobotDetectNet::infer_thread_task, this));
+    _post_thread = new boost::thread(boost::bind(&DodobotDetectNet::post_thread_task, this));
+}
+
+void DodobotDetectNet::stop_pipeline()
+{
+    _frame_queue.close();
+    _free_cvts.close();
+    _infer_queue.close();
+    _post_queue.close();
+
+    boost::thread** threads[] = {&_convert_thread, &_infer_thread, &_post_thread};
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++)
+    {
+        if (*threads[i] != NULL) {
+            (*threads[i])->join();
+            delete *threads[i];
+            *threads[i] = NULL;
+        }
     }
+}
+
+void DodobotDetectNet::convert_thread_task()
+{
+    int cvt_index;
+    RgbdFrame frame;
+    while (_free_cvts.pop(&cvt_index))
+    {
+        // wait for a converter first so the frame taken is the newest one
+        if (!_frame_queue.pop(&frame)) {
+            break;
+        }
+
+        // convert the image to reside on GPU
+        ros::SteadyTime t0 = ros::SteadyTime::now();
+        bool converted = _input_cvts[cvt_index]->Convert(frame.color_image);
+        _stats.record(STAGE_CONVERT, (ros::SteadyTime::now() - t0).toSec());
+        if (!converted)
+        {
+            ROS_INFO("failed to convert %ux%u %s image", frame.color_image->width, frame.color_image->height, frame.color_image->encoding.c_str());
+            _free_cvts.push(cvt_index);
+            finish_frame();
+            continue;
+        }
+
+        DetectionJob job;
+        job.frame = frame;
+        job.cvt_index = cvt_index;
+        job.num_detections = 0;
+        _infer_queue.push(job);  // one slot per converter, so it never drops
+    }
+}
+
+void DodobotDetectNet::infer_thread_task()
+{
+    DetectionJob job;
+    while (_infer_queue.pop(&job))
+    {
+        //
+        // Detect bounding boxes in color image, or follow the last ones
+        //
+        imageConverter* input_cvt = _input_cvts[job.cvt_index];
+        if (!_tracker.tracking() || !track(input_cvt, &job))
+        {
+            job.num_detections = detect(input_cvt, job.frame.color_image, &job.msg);
+            if (job.num_detections > 0) {
+                job.track_ids = _tracker.ids();
+            }
+        }
+        _free_cvts.push(job.cvt_index);
+        job.cvt_index = -1;
+        finish_frame();  // post-processing overlaps the next frame
+
+        if (job.num_detections <= 0) {
+            continue;
+        }
+        if (_post_queue.push(job)) {
+            ROS_DEBUG("Post-processing is busy. Dropped the oldest detections (%zu so far)", _post_queue.dropped());
+        }
+    }
+}
+
+void DodobotDetectNet::post_thread_task()
+{
+    DetectionJob job;
+    while (_post_queue.pop(&job)) {
+        process_detections(job);
+    }
+}
+
+void DodobotDetectNet::process_detections(DetectionJob& job)
+{
+    const ImageConstPtr& color_image = job.frame.color_image;
+    const CameraInfoConstPtr& color_info = job.frame.color_info;
+    const ImageConstPtr& depth_image = job.frame.depth_image;
+    const CameraInfoConstPtr& depth_info = job.frame.depth_info;
+    vision_msgs::Detection2DArray& msg = job.msg;
+    int num_detections = job.num_detections;
 
     //
     // Get Z values of bounding boxes
     //
+    ros::SteadyTime t0 = ros::SteadyTime::now();
     _camera_model.fromCameraInfo(color_info);
+    _depth_camera_model.fromCameraInfo(depth_info);
+    _depth_matches_color = (
+        color_info->width == depth_info->width &&
+        color_info->height == depth_info->height &&
+        color_info->P == depth_info->P
+    );
+    if (color_info->header.frame_id != depth_info->header.frame_id) {
+        ROS_WARN_ONCE("Depth frame %s isn't registered to color frame %s. Object depths ignore the offset between the cameras",
+            depth_info->header.frame_id.c_str(), color_info->header.frame_id.c_str());
+    }
 
-    cv_bridge::CvImagePtr cv_ptr;
+    // shares the message's buffer. Only the detection circles are read from it
+    cv_bridge::CvImageConstPtr cv_ptr;
     try {
-        cv_ptr = cv_bridge::toCvCopy(depth_image);  // encoding: passthrough
+        cv_ptr = cv_bridge::toCvShare(depth_image);  // encoding: passthrough
     }
     catch (cv_bridge::Exception& e)
     {
@@ -242,41 +625,58 @@ void DodobotDetectNet::rgbd_callback(
         return;
     }
 
-    cv::Mat depth_cv_image;
+    const cv::Mat& depth_cv_image = cv_ptr->image;
     ROS_ASSERT_MSG(color_image->width != 0, "Color image width is zero!");
     ROS_ASSERT_MSG(color_image->height != 0, "Color image height is zero!");
-    if (color_image->width != depth_image->width || color_image->height != depth_image->height) {
-        cv::resize(cv_ptr->image, depth_cv_image, cv::Size(color_image->width, color_image->height));
-    }
-    else {
-        depth_cv_image = cv_ptr->image;
-    }
 
 
     visualization_msgs::MarkerArray markers;
 
     reset_label_counter();
+    std::vector<int>& track_ids = job.track_ids;
+    bool has_track_ids = (int)track_ids.size() == num_detections;
+    std::vector<ObjPoseDescription> obj_descs;
     for (int n = 0; n < num_detections; n++)
     {
         int class_index = msg.detections[n].results[0].id;
         string label = _class_descriptions[class_index];
         int label_index = _label_counter[label];
         _label_counter[label]++;
-
-        geometry_msgs::PoseWithCovariance pose_with_covar;
+        if (has_track_ids) {
+            label_index = track_ids[n];  // the marker id follows the object between frames
+        }
 
         ObjPoseDescription obj_desc = bbox_to_pose(depth_cv_image, msg.detections[n].bbox, depth_image->header.stamp, label, label_index);
         if (obj_desc.z_dist < _min_valid_dist || obj_desc.z_dist > _max_valid_dist)
         {
             ROS_DEBUG("Object is outside acceptable bounds for Z: %f. Ignoring", obj_desc.z_dist);
             msg.detections.erase(msg.detections.begin() + n);
+            if (has_track_ids) {
+                track_ids.erase(track_ids.begin() + n);
+            }
             n--;
             num_detections--;
             continue;
         }
-        tf_obj_to_target(color_info, obj_desc);
-        // obj_desc now contains the object position in the target frame (if _publish_with_frame is true)
+        obj_descs.push_back(obj_desc);
+    }
+
+    ros::SteadyTime t1 = ros::SteadyTime::now();
+    _stats.record(STAGE_DEPTH, (t1 - t0).toSec());
+
+    tf_objs_to_target(color_info->header, obj_descs);
+    // obj_descs now contain the object positions in the target frame (if _publish_with_frame is true and TF had it)
 
+    ros::SteadyTime t2 = ros::SteadyTime::now();
+    _stats.record(STAGE_TF, (t2 - t1).toSec());
+
+    for (int n = 0; n < num_detections; n++)
+    {
+        ObjPoseDescription& obj_desc = obj_descs[n];
+        const string& label = obj_desc.label;
+        int label_index = obj_desc.index;
+
+        geometry_msgs::PoseWithCovariance pose_with_covar;
         pose_with_covar.pose = obj_desc.pose_stamped.pose;
         msg.detections[n].results[0].pose = pose_with_covar;
         msg.detections[n].header = obj_desc.pose_stamped.header;
@@ -304,14 +704,18 @@ void DodobotDetectNet::rgbd_callback(
     _detection_pub.publish(msg);
     _marker_pub.publish(markers);
 
-    ros::Time now = ros::Time::now();
-    ros::Duration dt_camera = now - color_image->header.stamp;
-    ros::Duration dt_process = now - t0;
+    _stats.record(STAGE_PUBLISH, (ros::SteadyTime::now() - t2).toSec());
+
+    ros::Duration dt_camera = ros::Time::now() - color_image->header.stamp;
+    double dt_process = (ros::SteadyTime::now() - job.frame.receive_time).toSec();
 
-    ROS_DEBUG("Callback took %fs, %fs since image", dt_process.toSec(), dt_camera.toSec());
+    // a bag replayed faster than real time stretches the stamps, so benchmarks time from arrival
+    _stats.record(STAGE_END_TO_END, _benchmark ? dt_process : dt_camera.toSec());
+
+    ROS_DEBUG("Frame took %fs since it arrived, %fs since image", dt_process, dt_camera.toSec());
 }
 
-ObjPoseDescription DodobotDetectNet::bbox_to_pose(cv::Mat depth_cv_image, vision_msgs::BoundingBox2D bbox, ros::Time stamp, string label, int label_index)
+ObjPoseDescription DodobotDetectNet::bbox_to_pose(const cv::Mat& depth_cv_image, vision_msgs::BoundingBox2D bbox, ros::Time stamp, string label, int label_index)
 {
     ObjPoseDescription desc = init_obj_desc();
     desc.label = label;
@@ -368,29 +772,68 @@ ObjPoseDescription DodobotDetectNet::bbox_to_pose(cv::Mat depth_cv_image, vision
     return desc;
 }
 
-void DodobotDetectNet::tf_obj_to_target(const CameraInfoConstPtr color_info, ObjPoseDescription& obj_desc)
+void DodobotDetectNet::tf_objs_to_target(const std_msgs::Header& camera_header, std::vector<ObjPoseDescription>& obj_descs)
 {
-    if (!_publish_with_frame) {
+    if (!_publish_with_frame || obj_descs.empty()) {
         return;
     }
+
+    // every object in the frame shares the camera's frame and stamp
     geometry_msgs::TransformStamped transform_camera_to_target;
-    geometry_msgs::PoseStamped object_pose;
+    if (!lookup_target_transform(camera_header, &transform_camera_to_target)) {
+        return;  // the poses stay in the camera frame
+    }
 
-    try {
-        transform_camera_to_target = tfBuffer.lookupTransform(
-            _target_frame, color_info->header.frame_id,
-            color_info->header.stamp, ros::Duration(1.0)
-        );
-        tf2::doTransform(obj_desc.pose_stamped, obj_desc.pose_stamped, transform_camera_to_target);
-        // obj_desc now contains the object position in the target frame
+    for (size_t i = 0; i < obj_descs.size(); i++)
+    {
+        tf2::doTransform(obj_descs[i].pose_stamped, obj_descs[i].pose_stamped, transform_camera_to_target);
+        obj_descs[i].pose_stamped.header.frame_id = _target_frame;
+    }
+}
 
-        obj_desc.pose_stamped.header.frame_id = _target_frame;
+bool DodobotDetectNet::lookup_target_transform(const std_msgs::Header& camera_header, geometry_msgs::TransformStamped* transform)
+{
+    int64_t bucket = 0;
+    if (_tf_cache_bucket_s > 0.0)
+    {
+        bucket = (int64_t)floor(camera_header.stamp.toSec() / _tf_cache_bucket_s);
+        if (_tf_cache_valid && _tf_cache_bucket == bucket && _tf_cache_frame == camera_header.frame_id) {
+            *transform = _tf_cache_transform;
+            return true;
+        }
+    }
+
+    // no timeout. The lookup never waits for TF to catch up
+    try {
+        *transform = tfBuffer.lookupTransform(_target_frame, camera_header.frame_id, camera_header.stamp);
     }
     catch (tf2::TransformException &ex) {
-        ROS_WARN("%s", ex.what());
-        ros::Duration(1.0).sleep();
-        return;
+        // usually the image is newer than the latest transform. Settle for that one if it's close
+        try {
+            *transform = tfBuffer.lookupTransform(_target_frame, camera_header.frame_id, ros::Time(0));
+        }
+        catch (tf2::TransformException &latest_ex) {
+            ROS_WARN_THROTTLE(1.0, "%s", ex.what());
+            return false;
+        }
+
+        double age = fabs((camera_header.stamp - transform->header.stamp).toSec());
+        if (age > _tf_fallback_tolerance_s) {
+            ROS_WARN_THROTTLE(1.0, "%s. Latest transform is %0.3fs off", ex.what(), age);
+            return false;
+        }
+        ROS_DEBUG("Using the latest transform to %s, %0.3fs off the image", _target_frame.c_str(), age);
+        return true;  // not cached. The next frame may get an exact one
+    }
+
+    if (_tf_cache_bucket_s > 0.0)
+    {
+        _tf_cache_valid = true;
+        _tf_cache_bucket = bucket;
+        _tf_cache_frame = camera_header.frame_id;
+        _tf_cache_transform = *transform;
     }
+    return true;
 }
 
 visualization_msgs::Marker DodobotDetectNet::make_marker(ObjPoseDescription* desc)
@@ -414,94 +857,155 @@ visualization_msgs::Marker DodobotDetectNet::make_marker(ObjPoseDescription* des
 }
 
 
-double DodobotDetectNet::get_z_dist(cv::Mat depth_cv_image, ObjPoseDescription* desc)
+double DodobotDetectNet::get_z_dist(const cv::Mat& depth_cv_image, ObjPoseDescription* desc)
 {
-    ROS_DEBUG("Depth image size: w=%d, h=%d", depth_cv_image.rows, depth_cv_image.cols);
-    cv::Mat circle_mask = cv::Mat::zeros(depth_cv_image.rows, depth_cv_image.cols, CV_8UC1);
-    cv::circle(circle_mask, cv::Size(desc->center_x, desc->center_y), desc->detect_radius, cv::Scalar(255, 255, 255), cv::FILLED);
-    ROS_DEBUG("Created circle mask");
-
-    cv::Mat nonzero_mask = (depth_cv_image > 0.0);
-    nonzero_mask.convertTo(nonzero_mask, CV_8U);
-    ROS_DEBUG("Created nonzero mask");
+    int depth_x, depth_y, depth_radius;
+    color_to_depth_circle(desc, &depth_x, &depth_y, &depth_radius);
 
-    cv::Mat target_mask;
-    cv::bitwise_and(circle_mask, nonzero_mask, target_mask);
-    ROS_DEBUG("Created target mask");
-
-    double z_dist = cv::mean(depth_cv_image, target_mask)[0];  // depth values are in mm
-    ROS_DEBUG("z_dist mm: %f", z_dist);
+    double z_dist = _depth_sampler.sample(depth_cv_image, depth_x, depth_y, depth_radius);  // depth values are in mm
+    ROS_DEBUG("z_dist mm: %f from %zu pixels", z_dist, _depth_sampler.count());
 
     z_dist /= 1000.0;
 
     return z_dist;
 }
 
+void DodobotDetectNet::color_to_depth_circle(ObjPoseDescription* desc, int* depth_x, int* depth_y, int* depth_radius)
+{
+    if (_depth_matches_color) {
+        *depth_x = desc->center_x;
+        *depth_y = desc->center_y;
+        *depth_radius = desc->detect_radius;
+        return;
+    }
+
+    // Follow the center's ray into the depth camera. Exact when the depth image
+    // is registered to the color camera and only the intrinsics differ
+    // (aligned or decimated images). The radius scales with the focal length
+    cv::Point2d color_point(desc->center_x, desc->center_y);
+    cv::Point3d ray = _camera_model.projectPixelTo3dRay(color_point);
+    cv::Point2d depth_point = _depth_camera_model.project3dToPixel(ray);
+
+    *depth_x = (int)round(depth_point.x);
+    *depth_y = (int)round(depth_point.y);
+    *depth_radius = std::max((int)round(desc->detect_radius * _depth_camera_model.fx() / _camera_model.fx()), 1);
+}
+
 // classify the image
-int DodobotDetectNet::detect(const ImageConstPtr& color_image, vision_msgs::Detection2DArray* msg)
+int DodobotDetectNet::detect(imageConverter* input_cvt, const ImageConstPtr& color_image, vision_msgs::Detection2DArray* msg)
 {
     detectNet::Detection* detections = NULL;
 
-    ros::Time t0 = ros::Time::now();
+    ros::SteadyTime t0 = ros::SteadyTime::now();
 
-    // was _input_cvt->ImageGPU(). Is now _input_cvt->ImageCPU().
-    // Using the GPU stored image added ~0.03s of latency on Jetson Nano for some reason...
-    const int num_detections = _net->Detect(_input_cvt->ImageCPU(), _input_cvt->GetWidth(), _input_cvt->GetHeight(), &detections, detectNet::OVERLAY_NONE);
+    // The converted image is in device memory. When it was zero-copy memory the
+    // Nano's GPU read it uncached, which cost ~0.03s, so the raw message buffer
+    // was passed instead. That only had the right colours for rgb8 messages
+    const int num_detections = _net->Detect(input_cvt->ImageGPU(), input_cvt->GetWidth(), input_cvt->GetHeight(), &detections, detectNet::OVERLAY_NONE);
 
-    ros::Duration dt = ros::Time::now() - t0;
-    ROS_DEBUG("Detect took %fs", dt.toSec());
+    double dt = (ros::SteadyTime::now() - t0).toSec();
+    _stats.record(STAGE_INFER, dt);
+    _stats.count_frame();
+    ROS_DEBUG("Detect took %fs", dt);
 
 	// verify success
 	if (num_detections < 0)	{
 		ROS_ERROR("failed to run object detection on %ux%u image", color_image->width, color_image->height);
 	}
+	else {
+		_tracker.update(detections, num_detections);
+	}
 
 	// if objects were detected, update message
 	if (num_detections > 0)
 	{
 		ROS_DEBUG("detected %i objects in %ux%u image", num_detections, color_image->width, color_image->height);
 
-		// create a detection for each bounding box
-		for (int n = 0; n < num_detections; n++)
-		{
-			detectNet::Detection* det = detections + n;
+		add_detection_msgs(detections, num_detections, msg);
 
-			ROS_DEBUG("object %i class #%u (%s)  confidence=%f", n, det->ClassID, _net->GetClassDesc(det->ClassID), det->Confidence);
-			ROS_DEBUG("object %i bounding box (%f, %f)  (%f, %f)  w=%f  h=%f", n, det->Left, det->Top, det->Right, det->Bottom, det->Width(), det->Height());
+        // generate the overlay (if there are subscribers)
+    	if (_overlay_pub.getNumSubscribers() > 0) {
+            ros::SteadyTime overlay_t0 = ros::SteadyTime::now();
+            publish_overlay(input_cvt, detections, num_detections);
+            _stats.record(STAGE_OVERLAY, (ros::SteadyTime::now() - overlay_t0).toSec());
+        }
+	}
 
-			// create a detection sub-message
-			vision_msgs::Detection2D detMsg;
+    return num_detections;
+}
 
-			detMsg.bbox.size_x = det->Width();
-			detMsg.bbox.size_y = det->Height();
 
-			float cx, cy;
-			det->Center(&cx, &cy);
+// move the last detections onto this frame. false if the detector should run instead
+bool DodobotDetectNet::track(imageConverter* input_cvt, DetectionJob* job)
+{
+    ros::SteadyTime t0 = ros::SteadyTime::now();
 
-			detMsg.bbox.center.x = cx;
-			detMsg.bbox.center.y = cy;
+    // the color image at the detector's resolution
+    cv_bridge::CvImageConstPtr gray_ptr;
+    try {
+        gray_ptr = cv_bridge::toCvShare(job->frame.color_image, image_encodings::MONO8);
+    }
+    catch (cv_bridge::Exception& e)
+    {
+        ROS_ERROR_THROTTLE(1.0, "cv_bridge exception: %s. Detecting on every frame", e.what());
+        return false;
+    }
 
-			detMsg.bbox.center.theta = 0.0f;
+    if (_tracker.begin_frame(gray_ptr->image) || !_tracker.propagate()) {
+        return false;
+    }
 
-			// create classification hypothesis
-			vision_msgs::ObjectHypothesisWithPose hyp;
+    std::vector<detectNet::Detection> detections = _tracker.detections();
+    job->num_detections = (int)detections.size();
+    job->track_ids = _tracker.ids();
+    add_detection_msgs(detections.data(), job->num_detections, &job->msg);
 
-			hyp.id = det->ClassID;
-			hyp.score = det->Confidence;
+    _stats.record(STAGE_TRACK, (ros::SteadyTime::now() - t0).toSec());
+    _stats.count_frame();
+    ROS_DEBUG("tracked %i objects", job->num_detections);
 
-			detMsg.results.push_back(hyp);
-			msg->detections.push_back(detMsg);
-		}
+    if (job->num_detections > 0 && _overlay_pub.getNumSubscribers() > 0) {
+        ros::SteadyTime overlay_t0 = ros::SteadyTime::now();
+        publish_overlay(input_cvt, detections.data(), job->num_detections);
+        _stats.record(STAGE_OVERLAY, (ros::SteadyTime::now() - overlay_t0).toSec());
+    }
+    return true;
+}
 
-        // generate the overlay (if there are subscribers)
-    	if (_overlay_pub.getNumSubscribers() > 0) {
-            publish_overlay(detections, num_detections);
-        }
-	}
+void DodobotDetectNet::add_detection_msgs(const detectNet::Detection* detections, int num_detections, vision_msgs::Detection2DArray* msg)
+{
+	// create a detection for each bounding box
+	for (int n = 0; n < num_detections; n++)
+	{
+		const detectNet::Detection* det = detections + n;
 
-    return num_detections;
-}
+		ROS_DEBUG("object %i class #%u (%s)  confidence=%f", n, det->ClassID, _net->GetClassDesc(det->ClassID), det->Confidence);
+		ROS_DEBUG("object %i bounding box (%f, %f)  (%f, %f)  w=%f  h=%f", n, det->Left, det->Top, det->Right, det->Bottom, det->Width(), det->Height());
+
+		// create a detection sub-message
+		vision_msgs::Detection2D detMsg;
+
+		detMsg.bbox.size_x = det->Width();
+		detMsg.bbox.size_y = det->Height();
+
+		float cx, cy;
+		det->Center(&cx, &cy);
+
+		detMsg.bbox.center.x = cx;
+		detMsg.bbox.center.y = cy;
 
+		detMsg.bbox.center.theta = 0.0f;
+
+		// create classification hypothesis
+		vision_msgs::ObjectHypothesisWithPose hyp;
+
+		hyp.id = det->ClassID;
+		hyp.score = det->Confidence;
+
+		detMsg.results.push_back(hyp);
+		msg->detections.push_back(detMsg);
+	}
+}
 
 void DodobotDetectNet::reset_label_counter()
 {
@@ -511,25 +1015,27 @@ void DodobotDetectNet::reset_label_counter()
 }
 
 // publish overlay image
-bool DodobotDetectNet::publish_overlay(detectNet::Detection* detections, int num_detections)
+bool DodobotDetectNet::publish_overlay(imageConverter* input_cvt, detectNet::Detection* detections, int num_detections)
 {
 	// get the image dimensions
-	const uint32_t width  = _input_cvt->GetWidth();
-	const uint32_t height = _input_cvt->GetHeight();
+	const uint32_t width  = input_cvt->GetWidth();
+	const uint32_t height = input_cvt->GetHeight();
 
 	// assure correct image size
 	if (!_overlay_cvt->Resize(width, height, imageConverter::ROSOutputFormat))
 		return false;
 
-	// generate the overlay
-    // was _input_cvt->ImageGPU(). Is now _input_cvt->ImageCPU().
-    // Using the GPU stored image added ~0.03s of latency on Jetson Nano for some reason...
-	if (!_net->Overlay(_input_cvt->ImageCPU(), _overlay_cvt->ImageGPU(), width, height,
+	// generate the overlay. It's drawn and converted to BGR on the GPU. Only
+	// the finished message is copied out
+	if (!_net->Overlay(input_cvt->ImageGPU(), _overlay_cvt->ImageGPU(), width, height,
 				   imageConverter::InternalFormat, detections, num_detections, _overlay_flags))
 	{
 		return false;
 	}
 
+	// the overlay ran on the inference stream. The conversion below doesn't
+	CUDA(cudaStreamSynchronize(_net->GetStream()));
+
 	// populate the message
 	sensor_msgs::Image msg;
 
@@ -0,0 +1,135 @@
+#include <db_detectnet/depth_sampler.h>
+
+#include <algorithm>
+#include <math.h>
+
+
+DepthSampler::DepthSampler() :
+    _statistic(DEPTH_MEAN),
+    _percentile(0.5),
+    _max_depth(0.0),
+    _bin_width(1.0),
+    _inv_bin_width(1.0),
+    _sum(0.0),
+    _count(0)
+{
+
+}
+
+bool DepthSampler::statistic_from_str(const std::string& name, DepthStatistic* statistic)
+{
+    if (name == "mean") {
+        *statistic = DEPTH_MEAN;
+    }
+    else if (name == "median" || name == "percentile") {
+        *statistic = DEPTH_PERCENTILE;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+void DepthSampler::configure(DepthStatistic statistic, double percentile, double max_depth, double bin_width)
+{
+    _statistic = statistic;
+    _percentile = std::min(std::max(percentile, 0.0), 1.0);
+    _max_depth = std::max(max_depth, 0.0);
+    _bin_width = bin_width > 0.0 ? bin_width : 1.0;
+    _inv_bin_width = 1.0 / _bin_width;
+
+    if (_statistic == DEPTH_PERCENTILE) {
+        _histogram.assign((size_t)ceil(_max_depth * _inv_bin_width) + 1, 0);
+    }
+    else {
+        _histogram.clear();
+    }
+}
+
+double DepthSampler::sample(const cv::Mat& depth, int center_x, int center_y, int radius)
+{
+    _sum = 0.0;
+    _count = 0;
+    if (_statistic == DEPTH_PERCENTILE) {
+        std::fill(_histogram.begin(), _histogram.end(), 0);
+    }
+
+    switch (depth.type()) {
+        case CV_16UC1: accumulate<uint16_t>(depth, center_x, center_y, radius); break;
+        case CV_32FC1: accumulate<float>(depth, center_x, center_y, radius); break;
+        default: return 0.0;
+    }
+
+    if (_count == 0) {
+        return 0.0;
+    }
+    if (_statistic == DEPTH_PERCENTILE) {
+        return histogram_percentile();
+    }
+    return _sum / (double)_count;
+}
+
+template <typename T> void DepthSampler::accumulate(const cv::Mat& depth, int center_x, int center_y, int radius)
+{
+    if (radius < 0) {
+        return;
+    }
+    int row_start = std::max(center_y - radius, 0);
+    int row_end = std::min(center_y + radius, depth.rows - 1);
+    size_t overflow_bin = _histogram.size() - 1;
+
+    for (int y = row_start; y <= row_end; y++)
+    {
+        int dy = y - center_y;
+        int half_width = (int)sqrt((double)(radius * radius - dy * dy));
+        int col_start = std::max(center_x - half_width, 0);
+        int col_end = std::min(center_x + half_width, depth.cols - 1);
+        if (col_start > col_end) {
+            continue;
+        }
+
+        const T* row = depth.ptr<T>(y);
+        if (_statistic == DEPTH_PERCENTILE)
+        {
+            for (int x = col_start; x <= col_end; x++)
+            {
+                double value = (double)row[x];
+                if (value > 0.0) {
+                    size_t bin = (size_t)std::min(value * _inv_bin_width, (double)overflow_bin);
+                    _histogram[bin]++;
+                    _count++;
+                }
+            }
+        }
+        else
+        {
+            // select rather than branch so the span vectorizes. NaN fails the compare
+            double sum = 0.0;
+            size_t count = 0;
+            for (int x = col_start; x <= col_end; x++)
+            {
+                double value = (double)row[x];
+                bool valid = value > 0.0;
+                sum += valid ? value : 0.0;
+                count += valid;
+            }
+            _sum += sum;
+            _count += count;
+        }
+    }
+}
+
+double DepthSampler::histogram_percentile() const
+{
+    // first bin whose cumulative count passes the rank
+    size_t rank = (size_t)(_percentile * (double)(_count - 1));
+    size_t cumulative = 0;
+    for (size_t bin = 0; bin < _histogram.size() - 1; bin++)
+    {
+        cumulative += _histogram[bin];
+        if (cumulative > rank) {
+            return ((double)bin + 0.5) * _bin_width;
+        }
+    }
+    return _max_depth + _bin_width;
+}
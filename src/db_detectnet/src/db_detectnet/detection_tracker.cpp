@@ -0,0 +1,247 @@
+#include <db_detectnet/detection_tracker.h>
+
+#include <algorithm>
+#include <math.h>
+
+
+#define TRACK_GRID_SIZE 6  // points per side of a box
+#define TRACK_GRID_POINTS (TRACK_GRID_SIZE * TRACK_GRID_SIZE)
+#define TRACK_MIN_GOOD_POINTS (TRACK_GRID_POINTS / 2)
+#define TRACK_MAX_FB_ERROR 1.0f  // tracking image pixels a point may miss its start by on the way back
+#define TRACK_WINDOW 11
+#define TRACK_PYRAMID_LEVELS 2
+#define TRACK_MIN_IOU 0.3f
+
+
+static float box_iou(const detectNet::Detection& a, const detectNet::Detection& b)
+{
+    float width = std::min(a.Right, b.Right) - std::max(a.Left, b.Left);
+    float height = std::min(a.Bottom, b.Bottom) - std::max(a.Top, b.Top);
+    if (width <= 0.0f || height <= 0.0f) {
+        return 0.0f;
+    }
+    float overlap = width * height;
+    return overlap / (a.Width() * a.Height() + b.Width() * b.Height() - overlap);
+}
+
+static float point_distance(const cv::Point2f& a, const cv::Point2f& b)
+{
+    float dx = a.x - b.x;
+    float dy = a.y - b.y;
+    return sqrtf(dx * dx + dy * dy);
+}
+
+// reorders values
+static float median(std::vector<float>& values)
+{
+    std::vector<float>::iterator middle = values.begin() + values.size() / 2;
+    std::nth_element(values.begin(), middle, values.end());
+    return *middle;
+}
+
+
+DetectionTracker::DetectionTracker() :
+    _detect_interval(1),
+    _scene_change_threshold(0.0),
+    _tracking_width(320),
+    _scale(1.0),
+    _frames_since_detection(0),
+    _track_lost(false)
+{
+    _points.reserve(TRACK_GRID_POINTS * 8);
+    _dx.reserve(TRACK_GRID_POINTS);
+    _dy.reserve(TRACK_GRID_POINTS);
+    _ratios.reserve(TRACK_GRID_POINTS * (TRACK_GRID_POINTS - 1) / 2);
+}
+
+void DetectionTracker::configure(int detect_interval, double scene_change_threshold, int tracking_width)
+{
+    _detect_interval = std::max(detect_interval, 1);
+    _scene_change_threshold = std::max(scene_change_threshold, 0.0);
+    _tracking_width = tracking_width;
+}
+
+bool DetectionTracker::begin_frame(const cv::Mat& gray)
+{
+    _scale = (_tracking_width > 0 && gray.cols > _tracking_width) ? (double)_tracking_width / gray.cols : 1.0;
+
+    // _curr takes over the older buffer. _key is always a copy, so nothing else holds it
+    std::swap(_prev, _curr);
+    if (_scale < 1.0) {
+        cv::resize(gray, _curr, cv::Size(_tracking_width, (int)round(gray.rows * _scale)), 0, 0, cv::INTER_AREA);
+    }
+    else {
+        gray.copyTo(_curr);  // gray may share the message's buffer
+    }
+    _frames_since_detection++;
+
+    if (!tracking() || _key.empty() || _prev.size() != _curr.size() || _key.size() != _curr.size()) {
+        return true;
+    }
+    if (_track_lost || _frames_since_detection >= _detect_interval) {
+        return true;
+    }
+    if (_scene_change_threshold > 0.0)
+    {
+        cv::absdiff(_curr, _key, _diff);
+        if (cv::mean(_diff)[0] > _scene_change_threshold) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool DetectionTracker::propagate()
+{
+    // one grid per track, all tracked in one pass so the pyramids are built once
+    _points.clear();
+    for (size_t i = 0; i < _tracks.size(); i++)
+    {
+        if (_tracks[i].lost) {
+            continue;
+        }
+        const detectNet::Detection& detection = _tracks[i].detection;
+        for (int gy = 0; gy < TRACK_GRID_SIZE; gy++) {
+            for (int gx = 0; gx < TRACK_GRID_SIZE; gx++) {
+                _points.push_back(cv::Point2f(
+                    (float)((detection.Left + detection.Width() * (gx + 0.5f) / TRACK_GRID_SIZE) * _scale),
+                    (float)((detection.Top + detection.Height() * (gy + 0.5f) / TRACK_GRID_SIZE) * _scale)
+                ));
+            }
+        }
+    }
+    if (_points.empty()) {
+        return true;
+    }
+
+    cv::calcOpticalFlowPyrLK(_prev, _curr, _points, _next_points, _status, _error,
+        cv::Size(TRACK_WINDOW, TRACK_WINDOW), TRACK_PYRAMID_LEVELS);
+    cv::calcOpticalFlowPyrLK(_curr, _prev, _next_points, _back_points, _back_status, _error,
+        cv::Size(TRACK_WINDOW, TRACK_WINDOW), TRACK_PYRAMID_LEVELS);
+
+    bool all_tracked = true;
+    size_t first_point = 0;
+    for (size_t i = 0; i < _tracks.size(); i++)
+    {
+        if (_tracks[i].lost) {
+            continue;
+        }
+        if (!move_box(first_point, &_tracks[i].detection))
+        {
+            _tracks[i].lost = true;  // kept until the next update, which may pick its id up again
+            all_tracked = false;
+        }
+        first_point += TRACK_GRID_POINTS;
+    }
+
+    _track_lost = !all_tracked;
+    refresh_outputs();
+    return all_tracked;
+}
+
+bool DetectionTracker::move_box(size_t first_point, detectNet::Detection* detection)
+{
+    size_t good[TRACK_GRID_POINTS];
+    size_t num_good = 0;
+    _dx.clear();
+    _dy.clear();
+    for (size_t i = first_point; i < first_point + TRACK_GRID_POINTS; i++)
+    {
+        if (!_status[i] || !_back_status[i] || point_distance(_back_points[i], _points[i]) > TRACK_MAX_FB_ERROR) {
+            continue;
+        }
+        good[num_good++] = i;
+        _dx.push_back(_next_points[i].x - _points[i].x);
+        _dy.push_back(_next_points[i].y - _points[i].y);
+    }
+    if (num_good < TRACK_MIN_GOOD_POINTS) {
+        return false;
+    }
+
+    _ratios.clear();
+    for (size_t a = 0; a < num_good; a++)
+    {
+        for (size_t b = a + 1; b < num_good; b++)
+        {
+            float before = point_distance(_points[good[a]], _points[good[b]]);
+            if (before > 1.0f) {
+                _ratios.push_back(point_distance(_next_points[good[a]], _next_points[good[b]]) / before);
+            }
+        }
+    }
+    float scale = _ratios.empty() ? 1.0f : median(_ratios);
+
+    float center_x, center_y;
+    detection->Center(&center_x, &center_y);
+    center_x += (float)(median(_dx) / _scale);
+    center_y += (float)(median(_dy) / _scale);
+    float half_width = detection->Width() * scale / 2.0f;
+    float half_height = detection->Height() * scale / 2.0f;
+
+    float image_width = (float)(_curr.cols / _scale);
+    float image_height = (float)(_curr.rows / _scale);
+    if (center_x < 0.0f || center_y < 0.0f || center_x >= image_width || center_y >= image_height) {
+        return false;  // left the image
+    }
+
+    detection->Left = std::max(center_x - half_width, 0.0f);
+    detection->Right = std::min(center_x + half_width, image_width - 1.0f);
+    detection->Top = std::max(center_y - half_height, 0.0f);
+    detection->Bottom = std::min(center_y + half_height, image_height - 1.0f);
+    return detection->Width() >= 2.0f && detection->Height() >= 2.0f;
+}
+
+void DetectionTracker::update(const detectNet::Detection* detections, int num_detections)
+{
+    std::vector<Track> tracks;
+    std::vector<bool> matched(_tracks.size(), false);
+    for (int n = 0; n < num_detections; n++)
+    {
+        int best = -1;
+        float best_iou = TRACK_MIN_IOU;
+        for (size_t i = 0; i < _tracks.size(); i++)
+        {
+            if (matched[i] || _tracks[i].detection.ClassID != detections[n].ClassID) {
+                continue;
+            }
+            float iou = box_iou(_tracks[i].detection, detections[n]);
+            if (iou >= best_iou) {
+                best = (int)i;
+                best_iou = iou;
+            }
+        }
+
+        Track track;
+        track.detection = detections[n];
+        track.lost = false;
+        if (best >= 0) {
+            matched[best] = true;
+            track.id = _tracks[best].id;
+        }
+        else {
+            track.id = _next_id[detections[n].ClassID]++;
+        }
+        tracks.push_back(track);
+    }
+    _tracks.swap(tracks);
+
+    if (!_curr.empty()) {
+        _curr.copyTo(_key);
+    }
+    _frames_since_detection = 0;
+    _track_lost = false;
+    refresh_outputs();
+}
+
+void DetectionTracker::refresh_outputs()
+{
+    _detections.clear();
+    _ids.clear();
+    for (size_t i = 0; i < _tracks.size(); i++)
+    {
+        if (!_tracks[i].lost) {
+            _detections.push_back(_tracks[i].detection);
+            _ids.push_back(_tracks[i].id);
+        }
+    }
+}
@@ -23,7 +23,6 @@
 #include "db_detectnet/image_converter.h"
 
 #include <jetson-utils/cudaColorspace.h>
-#include <jetson-utils/cudaMappedMemory.h>
 
 
 
@@ -73,19 +72,28 @@ static std::string imageFormatToEncoding( imageFormat fmt )
 }
 
 
+static void clearBuffer( CudaBuffer& buffer, CudaBufferType type )
+{
+	buffer.cpu  = NULL;
+	buffer.gpu  = NULL;
+	buffer.size = 0;
+	buffer.type = type;
+}
+
+
 // constructor
-imageConverter::imageConverter()
+imageConverter::imageConverter( CudaBufferPool* pool )
 {
 	mWidth  	  = 0;
 	mHeight 	  = 0;
 	mSizeInput  = 0;
 	mSizeOutput = 0;
 
-	mInputCPU = NULL;
-	mInputGPU = NULL;
+	mOwnPool = (pool == NULL);
+	mPool    = mOwnPool ? new CudaBufferPool() : pool;
 
-	mOutputCPU = NULL;
-	mOutputGPU = NULL;
+	clearBuffer(mStaging, CUDA_BUFFER_MAPPED);
+	clearBuffer(mImage, CUDA_BUFFER_DEVICE);
 }
 
 
@@ -93,27 +101,25 @@ imageConverter::imageConverter()
 imageConverter::~imageConverter()
 {
 	Free();
+
+	if( mOwnPool )
+		delete mPool;
 }
 
 
 // Free
 void imageConverter::Free()
 {
-	if( mInputCPU != NULL )
-	{
-		CUDA(cudaFreeHost(mInputCPU));
+	mPool->release(mStaging);
+	mPool->release(mImage);
 
-		mInputCPU = NULL;
-		mInputGPU = NULL;
-	}
-
-	if( mOutputCPU != NULL )
-	{
-		CUDA(cudaFreeHost(mOutputCPU));
+	clearBuffer(mStaging, CUDA_BUFFER_MAPPED);
+	clearBuffer(mImage, CUDA_BUFFER_DEVICE);
 
-		mOutputCPU = NULL;
-		mOutputGPU = NULL;
-	}
+	mWidth      = 0;
+	mHeight     = 0;
+	mSizeInput  = 0;
+	mSizeOutput = 0;
 }
 
 // Convert
@@ -135,15 +141,19 @@ bool imageConverter::Convert( const sensor_msgs::ImageConstPtr& input )
 		return false;
 
 	// copy input to shared memory
-	memcpy(mInputCPU, input->data.data(), imageFormatSize(input_format, input->width, input->height));
+	memcpy(mStaging.cpu, input->data.data(), imageFormatSize(input_format, input->width, input->height));
 
 	// convert image format
-	if( CUDA_FAILED(cudaConvertColor(mInputGPU, input_format, mOutputGPU, InternalFormat, input->width, input->height)) )
+	if( CUDA_FAILED(cudaConvertColor(mStaging.gpu, input_format, mImage.gpu, InternalFormat, input->width, input->height)) )
 	{
 		ROS_ERROR("failed to convert %ux%u image (from %s to %s) with CUDA", mWidth, mHeight, imageFormatToStr(input_format), imageFormatToStr(InternalFormat));
 		return false;
 	}
 
+	// finish before the image is used on another stream. Inference doesn't run on this one
+	if( CUDA_FAILED(cudaStreamSynchronize(NULL)) )
+		return false;
+
 	return true;
 }
 
@@ -158,25 +168,35 @@ bool imageConverter::Convert( sensor_msgs::Image& msg, imageFormat format )
 // Convert
 bool imageConverter::Convert( sensor_msgs::Image& msg, imageFormat format, PixelType* imageGPU )
 {
-	if( !mInputCPU || !imageGPU || mWidth == 0 || mHeight == 0 || mSizeInput == 0 || mSizeOutput == 0 )
+	if( !mStaging.cpu || !imageGPU || mWidth == 0 || mHeight == 0 || mSizeInput == 0 || mSizeOutput == 0 )
+		return false;
+
+	// calculate size of the msg
+	const size_t msg_size = imageFormatSize(format, mWidth, mHeight);
+
+	if( msg_size > mSizeInput )
+	{
+		ROS_ERROR("%ux%u %s image doesn't fit the staging buffer for %ux%u conversion", mWidth, mHeight, imageFormatToStr(format), mWidth, mHeight);
 		return false;
+	}
 
 	// perform colorspace conversion into the desired encoding
 	// in this direction, we reverse use of input/output pointers
-	if( CUDA_FAILED(cudaConvertColor(imageGPU, InternalFormat, mInputGPU, format, mWidth, mHeight)) )
+	if( CUDA_FAILED(cudaConvertColor(imageGPU, InternalFormat, mStaging.gpu, format, mWidth, mHeight)) )
 	{
 		ROS_ERROR("failed to convert %ux%u image (from %s to %s) with CUDA", mWidth, mHeight, imageFormatToStr(InternalFormat), imageFormatToStr(format));
 		return false;
 	}
 
-	// calculate size of the msg
-	const size_t msg_size = imageFormatSize(format, mWidth, mHeight);
+	// the conversion has to land before the CPU reads the staging buffer
+	if( CUDA_FAILED(cudaStreamSynchronize(NULL)) )
+		return false;
 
 	// allocate msg storage
 	msg.data.resize(msg_size);
 
 	// copy the converted image into the msg
-	memcpy(msg.data.data(), mInputCPU, msg_size);
+	memcpy(msg.data.data(), mStaging.cpu, msg_size);
 
 	// populate metadata
 	msg.width  = mWidth;
@@ -200,14 +220,15 @@ bool imageConverter::Resize( uint32_t width, uint32_t height, imageFormat inputF
 	{
 		Free();
 
-		if( !cudaAllocMapped((void**)&mInputCPU, (void**)&mInputGPU, input_size) ||
-		    !cudaAllocMapped((void**)&mOutputCPU, (void**)&mOutputGPU, output_size) )
+		if( !mPool->acquire(CUDA_BUFFER_MAPPED, input_size, &mStaging) ||
+		    !mPool->acquire(CUDA_BUFFER_DEVICE, output_size, &mImage) )
 		{
 			ROS_ERROR("failed to allocate memory for %ux%u image conversion", width, height);
+			Free();
 			return false;
 		}
 
-		ROS_INFO("allocated CUDA memory for %ux%u image conversion", width, height);
+		ROS_INFO("using CUDA memory for %ux%u image conversion (%zu bytes in the pool)", width, height, mPool->allocated_bytes());
 
 		mWidth      = width;
 		mHeight     = height;
@@ -0,0 +1,128 @@
+#include <db_detectnet/pipeline_stats.h>
+
+#include <algorithm>
+#include <stdio.h>
+
+
+static const char* PIPELINE_STAGE_NAMES[NUM_PIPELINE_STAGES] = {
+    "convert", "infer", "track", "overlay", "depth", "tf", "publish", "end_to_end"
+};
+
+
+PipelineStats::PipelineStats() :
+    _window_size(300),
+    _frames(0),
+    _prev_frames(0),
+    _received(0),
+    _prev_received(0)
+{
+    for (size_t i = 0; i < NUM_PIPELINE_STAGES; i++) {
+        _next[i] = 0;
+    }
+    _start_time = ros::SteadyTime::now();
+    _prev_report_time = _start_time;
+}
+
+void PipelineStats::set_window(size_t window_size)
+{
+    boost::mutex::scoped_lock lock(_mutex);
+    _window_size = std::max(window_size, (size_t)1);
+    for (size_t i = 0; i < NUM_PIPELINE_STAGES; i++) {
+        _samples[i].clear();
+        _samples[i].reserve(std::min(_window_size, (size_t)4096));
+        _next[i] = 0;
+    }
+}
+
+void PipelineStats::record(PipelineStage stage, double seconds)
+{
+    float ms = (float)(seconds * 1000.0);
+    boost::mutex::scoped_lock lock(_mutex);
+    std::vector<float>& samples = _samples[stage];
+    if (samples.size() < _window_size) {
+        samples.push_back(ms);
+    }
+    else {
+        samples[_next[stage]] = ms;
+        _next[stage] = (_next[stage] + 1) % _window_size;
+    }
+}
+
+void PipelineStats::count_frame()
+{
+    boost::mutex::scoped_lock lock(_mutex);
+    _frames++;
+}
+
+void PipelineStats::count_received()
+{
+    boost::mutex::scoped_lock lock(_mutex);
+    _received++;
+}
+
+void PipelineStats::sort_stage(size_t stage)
+{
+    _sorted = _samples[stage];
+    std::sort(_sorted.begin(), _sorted.end());
+}
+
+float PipelineStats::percentile(double fraction) const
+{
+    if (_sorted.empty()) {
+        return 0.0f;
+    }
+    return _sorted[(size_t)(fraction * (double)(_sorted.size() - 1) + 0.5)];
+}
+
+void PipelineStats::report(uint64_t dropped, db_detectnet::DetectNetStats* msg)
+{
+    boost::mutex::scoped_lock lock(_mutex);
+    ros::SteadyTime now = ros::SteadyTime::now();
+    double dt = (now - _prev_report_time).toSec();
+    _prev_report_time = now;
+
+    msg->header.stamp = ros::Time::now();
+    msg->stages.resize(NUM_PIPELINE_STAGES);
+    msg->p50_ms.resize(NUM_PIPELINE_STAGES);
+    msg->p90_ms.resize(NUM_PIPELINE_STAGES);
+    msg->p99_ms.resize(NUM_PIPELINE_STAGES);
+    msg->max_ms.resize(NUM_PIPELINE_STAGES);
+    msg->samples.resize(NUM_PIPELINE_STAGES);
+    for (size_t i = 0; i < NUM_PIPELINE_STAGES; i++)
+    {
+        sort_stage(i);
+        msg->stages[i] = PIPELINE_STAGE_NAMES[i];
+        msg->p50_ms[i] = percentile(0.5);
+        msg->p90_ms[i] = percentile(0.9);
+        msg->p99_ms[i] = percentile(0.99);
+        msg->max_ms[i] = _sorted.empty() ? 0.0f : _sorted.back();
+        msg->samples[i] = _sorted.size();
+    }
+
+    msg->fps = dt > 0.0 ? (float)((_frames - _prev_frames) / dt) : 0.0f;
+    msg->camera_fps = dt > 0.0 ? (float)((_received - _prev_received) / dt) : 0.0f;
+    msg->frames = _frames;
+    msg->received = _received;
+    msg->dropped = dropped;
+    _prev_frames = _frames;
+    _prev_received = _received;
+}
+
+std::string PipelineStats::summary(uint64_t dropped)
+{
+    boost::mutex::scoped_lock lock(_mutex);
+    double elapsed = (ros::SteadyTime::now() - _start_time).toSec();
+
+    char line[128];
+    snprintf(line, sizeof(line), "%lu of %lu frames inferred, %0.2f FPS, %lu dropped\n",
+        (unsigned long)_frames, (unsigned long)_received, elapsed > 0.0 ? _frames / elapsed : 0.0, (unsigned long)dropped);
+    std::string text(line);
+    for (size_t i = 0; i < NUM_PIPELINE_STAGES; i++)
+    {
+        sort_stage(i);
+        snprintf(line, sizeof(line), "%12s: p50 %8.2f ms, p99 %8.2f ms (%zu samples)\n",
+            PIPELINE_STAGE_NAMES[i], percentile(0.5), percentile(0.99), _sorted.size());
+        text += line;
+    }
+    return text;
+}
@@ -4,16 +4,26 @@
 #include <iostream>
 #include <ctime>
 #include <queue>
+#include <deque>
 #include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/crc.hpp>
+#include <boost/function.hpp>
+#include <atomic>
 #include <iterator>
 #include <fstream>
+#include <chrono>
 
 #include "ros/ros.h"
 #include "ros/console.h"
+#include "ros/callback_queue.h"
 #include "std_msgs/Int64.h"
 #include "std_msgs/Int16MultiArray.h"
 #include "sensor_msgs/Imu.h"
 #include "sensor_msgs/BatteryState.h"
+#include "diagnostic_msgs/DiagnosticArray.h"
 #include "serial/serial.h"
 
 #include <image_transport/image_transport.h>
@@ -35,6 +45,8 @@
 #include "db_parsing/DodobotFunctions.h"
 #include "db_parsing/DodobotFunctionsListing.h"
 #include "db_parsing/DodobotNotify.h"
+#include "db_parsing/DodobotUploadProgress.h"
+#include "db_parsing/DodobotConfigResult.h"
 
 #include "db_parsing/DodobotPidSrv.h"
 #include "db_parsing/DodobotUploadFile.h"
@@ -44,25 +56,31 @@
 
 #include "keyboard_listener/KeyEvent.h"
 
+#include "db_parsing/packet_framer.h"
+#include "db_parsing/packet_dispatch.h"
+#include "db_parsing/packet_cursor.h"
+#include "db_parsing/packet_schema.h"
+#include "db_parsing/packet_checksum.h"
+#include "db_parsing/packet_tx_ring.h"
+#include "db_parsing/mapped_file.h"
+#include "db_parsing/link_stats.h"
+#include "db_parsing/serial_capture.h"
 
-using namespace std;
-
-#define CHECK_SEGMENT(PARAM)  if (!getNextSegment(PARAM)) {  ROS_ERROR_STREAM("Not enough segments supplied for #" << getSegmentNum() + 1 << ". Buffer: " << formatPacketToPrint(_recvCharBuffer, _readPacketLen));  return;  }
 
-char PACKET_START_0 = '\x12';
-char PACKET_START_1 = '\x34';
-char PACKET_STOP = '\n';
+using namespace std;
 
 struct StructReadyState {
     uint32_t time_ms;
     string robot_name;
-    bool is_ready;
+    std::atomic<bool> is_ready;  // read by callbacks on other threads
+    uint32_t protocol_version;  // highest version the device supports
+    std::atomic<uint32_t> rx_segments;  // large transfer segments the device can buffer. 1 unless it says otherwise
 };
 
 struct StructRobotState {
     uint32_t time_ms;
     bool battery_ok;
-    bool motors_active;
+    std::atomic<bool> motors_active;  // read by callbacks on other threads
     double loop_rate;
 };
 
@@ -97,25 +115,166 @@ typedef union float_union
 
 
 #define SERIAL_BUFFER_SIZE 0x4000
+#define SERIAL_RX_RING_SIZE 0x10000
+#define SERIAL_TX_SLOT_SIZE 0x400
+#define SERIAL_TX_BULK_SLOT_SIZE 0x1100  // fits a full large_packet_len segment plus header
+#define SERIAL_TX_MAILBOX_SIZE 0x40
+#define SERIAL_TX_BATCH_SIZE 0x2000
+#define SERIAL_TX_LARGE_PACKET 50  // packets this long are followed by a short pause
+#define TX_TICKET_HISTORY 0x400  // power of two
+#define TX_TICKET_INVALID 0
+
+// Outgoing packet classes. Real time packets always go out ahead of bulk
+// transfers. The TX_LATEST_* classes are setpoints where only the newest
+// value matters: a new one replaces a packet of the same class that hasn't
+// been sent yet.
+enum TxClass {
+    TX_REALTIME = 0,
+    TX_BULK,
+    TX_LATEST_DRIVE,
+    TX_LATEST_TILT,
+    TX_LATEST_GRIP,
+    NUM_TX_CLASSES
+};
+
+#define TX_FIRST_MAILBOX TX_LATEST_DRIVE
+
+const char* const TX_CLASS_NAMES[NUM_TX_CLASSES] = {"realtime", "bulk", "drive", "tilt", "grip"};
+
+struct UploadResumeState {
+    string path;
+    size_t size;
+    time_t mtime;
+    size_t acked_segments;  // every segment before this one made it to the device
+};
+
+struct BenchmarkStat {
+    uint64_t packets;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+struct TxMailbox {
+    boost::mutex mutex;
+    std::atomic<bool> pending;
+    uint32_t ticket;
+    size_t length;
+    char packet[SERIAL_TX_MAILBOX_SIZE];
+};
+
+// A packet that needs an ok from the device. Sent and retried by
+// serviceConfigRequests() on the RX thread, so no callback waits for the
+// response. Requests go out one at a time, in the order they were queued.
+// Pipelined requests (a configuration batch) go out together and are
+// retried independently
+struct ConfigRequest {
+    string name;
+    boost::function<uint32_t()> send;  // writes the packet and returns its ticket
+    ros::Duration timeout;  // per attempt
+    int attempts;  // total attempts before giving up
+    bool pipelined;  // may be sent while earlier pipelined requests wait for their ok
+
+    uint32_t ticket;
+    ros::Time sent_time;
+    int attempt;  // 0 until the first send
+    int error_code;
+};
 
-class ReadyTimeoutExceptionClass : public exception {
-    virtual const char* what() const throw() { return "Timeout reached. Never got ready signal from serial device"; }
-} ReadyTimeoutException;
+class ReplayOpenExceptionClass : public exception {
+    virtual const char* what() const throw() { return "Failed to open the serial capture to replay"; }
+};
+static ReplayOpenExceptionClass ReplayOpenException;
+
+class DodobotParsing;
+typedef void (DodobotParsing::*PacketHandler)();
+
+struct PacketRoute {
+    PacketHandler handler;
+    const PacketSchema* schema;
+    size_t stats_index;  // LinkStats RX category
+};
 
 class DodobotParsing {
 private:
     ros::NodeHandle nh;  // ROS node handle
+    ros::NodeHandle private_nh;  // parameters. The node's private namespace or the nodelet's
+
+    // Callbacks are split by how urgent they are, each queue with its own
+    // spinner thread, so a slow file upload can't hold up a drive command
+    // and neither holds up the RX thread. Timers stay on nh's queue, which
+    // run() services between serial reads. ~threaded_callbacks false services
+    // all of them there instead
+    bool threaded_callbacks;
+    ros::CallbackQueue realtime_queue;  // drive, tilter, gripper, linear
+    ros::CallbackQueue bulk_queue;  // display images, keys, notifications, robot functions
+    ros::CallbackQueue service_queue;  // every service
+    ros::NodeHandle realtime_nh;
+    ros::NodeHandle bulk_nh;
+    ros::NodeHandle service_nh;
 
     serial::Serial _serialRef;
     string _serialPort;
     int _serialBaud;
-
-    int _serialBufferIndex;
-    char* _currentBufferSegment;
-    int _currentSegmentNum;
+    int _rxTimeoutMs;
+    PacketFramer* _rxFramer;
+
+    // Link bring-up never blocks. serviceLink() runs between serial reads: it
+    // reopens the port after an error, asks for ready until the device
+    // answers and starts over if a reporting device goes quiet. parseReady
+    // pushes the startup configuration
+    std::atomic<bool> serial_open;
+    boost::mutex serial_write_mutex;  // the write thread vs opening and closing the port
+    ros::Duration reconnect_interval;
+    ros::Duration ready_retry_interval;
+    ros::Duration ready_timeout;  // warns once it's been this long without a ready
+    ros::Duration link_timeout;  // 0 disables the check
+    ros::Time last_open_attempt_time;
+    ros::Time link_open_time;
+    ros::Time last_ready_request_time;
+    ros::Time last_rx_time;
+    std::atomic<size_t> link_reconnects;
+    void serviceLink();
+    void requestReady();
+    void closeSerial(string reason);
+    void linkDown();
+    void pushStartupConfig();
+
+    PacketCursor _rxCursor;
+
+    // ~capture_path records the raw byte stream. ~replay_path feeds a
+    // recording back through the parser instead of opening the serial port
+    string capture_path, replay_path;
+    bool replay_realtime;
+    SerialCaptureWriter* _capture;
+    SerialCaptureReader* _replay;
+    const uint8_t* _replayData;  // rest of the current record
+    size_t _replayRemaining;
+    uint64_t _replayFirstStamp;
+    ros::WallTime _replayStartTime;
+    size_t pollReplay();
+    void finishReplay();
+
+    // ~benchmark times readSerial per category. Reported when a replay ends
+    bool benchmark_mode;
+    vector<BenchmarkStat> benchmark_stats;  // indexed by LinkStats RX category
+    size_t _rxStatsIndex;  // category of the packet being parsed
+    ros::WallTime benchmark_start_time;
+    void reportBenchmark();
 
     uint32_t _readPacketNum;
-    uint32_t _writePacketNum;
+    uint32_t _writePacketNum;  // only touched by the write thread
+
+    // ~protocol_version is the highest version to negotiate (see packet_schema.h).
+    // Packets are formatted in _txProtocol when they're queued. The write
+    // thread re-encodes any that were queued in the other one
+    int protocol_version;
+    std::atomic<int> _txProtocol;
+    int _rxProtocol;  // what the device is currently sending. RX thread only
+    std::atomic<uint32_t> _protocolTicket;  // the "proto" request waiting for an ack
+    ros::Time _protocolRequestTime;
+    int _protocolAttempts;  // unanswered requests since the last answer
+    bool negotiateProtocol();  // true if the startup config should wait for the answer
+    bool txHeld();  // true once "proto" is out, until the device answers
 
     ros::Time deviceStartTime;
     uint32_t offsetTimeMs;
@@ -124,18 +283,25 @@ private:
     size_t _recvCharIndex;
     char* _recvCharBuffer;
 
-    size_t _writeCharIndex;
-    char* _writeCharBuffer;
-
     size_t large_packet_len;
 
-    std::map<uint32_t, int> wait_for_ok_reqs;
+    int large_packet_window;  // most segments of a large transfer in flight at once. Capped by what the device reports
+    int large_packet_attempts;
+
+    // txrx responses, ticket << 32 | error code, indexed by ticket. Written
+    // by whichever thread parses packets, read by anything waiting for an ok
+    std::atomic<uint64_t>* _okResults;
+    boost::mutex ok_mutex;
+    boost::condition_variable ok_cond;
+    std::atomic<int> ok_waiters;
+    std::atomic<uint32_t> ok_generation;  // bumped on every response
+    boost::thread::id _rxThreadId;  // the thread that calls loop()
     ros::Duration packet_ok_timeout;
     ros::Duration linear_ok_packet_timeout;
 
     bool use_sensor_msg_time;
     bool active_on_start, reporting_on_start;
-    bool was_reporting;
+    std::atomic<bool> was_reporting;
 
     StructRobotState* robotState;
     StructReadyState* readyState;
@@ -148,7 +314,7 @@ private:
     ros::Publisher gripper_pub;
     ros::Subscriber gripper_sub;
     db_parsing::DodobotGripper gripper_msg;
-    int gripper_position;
+    std::atomic<int> gripper_position;  // written by the RX thread, read by gripperCallback
     void parseGripper();
     void gripperCallback(const db_parsing::DodobotGripper::ConstPtr& msg);
     void writeGripper(int command, int force_threshold);
@@ -167,6 +333,7 @@ private:
     ros::Publisher linear_pub;
     ros::Subscriber linear_sub;
     uint32_t stepper_max_speed, stepper_max_accel, stepper_low_speed, stepper_low_accel;
+    std::atomic<int> stepper_speed_setting, stepper_accel_setting;  // last lincfg values. 0 keeps the device's own
     db_parsing::DodobotLinear linear_msg;
     void parseLinear();
     void linearCallback(const db_parsing::DodobotLinear::ConstPtr& msg);
@@ -188,7 +355,16 @@ private:
     void driveCallback(const db_parsing::DodobotDrive::ConstPtr& msg);
     void writeDriveChassis(float speedA, float speedB);
 
-    bool ready_for_images;
+    // ~drive_cmd_max_rate caps how often drive commands are sent (Hz, 0 for no
+    // cap). Commands that come in early are held and only the newest is sent
+    double drive_cmd_max_rate;
+    boost::mutex drive_rate_mutex;
+    ros::Time next_drive_time;
+    bool drive_pending;
+    float pending_left_setpoint, pending_right_setpoint;
+    void serviceDriveRate();
+
+    std::atomic<bool> ready_for_images;
     string display_img_topic;
     image_transport::Subscriber image_sub;
     image_transport::ImageTransport image_transport;
@@ -198,7 +374,24 @@ private:
     int jpeg_image_quality;
     int image_resize_width, image_resize_height;
     void imgCallback(const sensor_msgs::ImageConstPtr& msg);
-    void writeImage(const cv::Mat& image);
+    bool writeImage(const cv::Mat& image);
+
+    // display images are encoded and sent on their own thread. imgCallback
+    // only swaps the newest frame into latest_image (older ones are dropped)
+    boost::thread* image_thread;
+    boost::mutex image_mutex;
+    boost::condition_variable image_cond;
+    sensor_msgs::ImageConstPtr latest_image;
+    bool image_stop_flag;
+    cv::Mat prev_display_img;
+    double image_change_threshold;  // mean absolute pixel difference below which a frame is skipped
+    double display_max_rate;  // Hz
+    double image_link_share;  // fraction of the serial link images may use
+    double image_throughput;  // measured bytes per second while sending images
+    ros::Time next_image_time;
+    void image_thread_task();
+
+    boost::mutex large_transfer_mutex;  // one setpath + writeSerialLarge at a time
 
     ros::Publisher bumper_pub;
     db_parsing::DodobotBumper bumper_msg;
@@ -222,13 +415,44 @@ private:
 
     ros::ServiceServer pid_service;
     PidKs* pidConstants;
+    bool pid_constants_set;  // by set_pid. Pushed again whenever the device says ready
+    boost::mutex pid_constants_mutex;  // set_pid writes them from the service thread
     ros::Timer pid_resend_timer;
     void resendPidKs();
     void resendPidKsTimed();
     bool set_pid(db_parsing::DodobotPidSrv::Request &req, db_parsing::DodobotPidSrv::Response &res);
 
+    // configuration traffic. Results are published on config_result
+    std::deque<ConfigRequest> config_requests;
+    boost::mutex config_requests_mutex;
+    int config_request_attempts;
+    std::atomic<size_t> config_requests_failed;
+    ros::Publisher config_result_pub;
+    ConfigRequest makeConfigRequest(string name, boost::function<uint32_t()> send, ros::Duration timeout, int attempts);
+    void queueConfigRequest(string name, boost::function<uint32_t()> send, ros::Duration timeout, int attempts);
+    void queueConfigBatch(std::vector<ConfigRequest>& batch);
+    void serviceConfigRequests();
+    void finishConfigRequest(const ConfigRequest& request, bool success);
+    void abandonConfigRequests();
+    uint32_t writeSetting(string name, int value);
+    uint32_t writeKPacket(PidKs constants);
+    uint32_t writeLinearConfig(int setting, int value);
+    uint32_t writeLinearCommand(int command_type, int command_value);
+
     ros::ServiceServer file_service;
     bool upload_file(db_parsing::DodobotUploadFile::Request &req, db_parsing::DodobotUploadFile::Response &res);
+    ros::Publisher upload_progress_pub;
+    std::map<string, UploadResumeState> upload_resume_states;  // keyed by destination path
+
+    // filecrc responses. Older firmware doesn't answer these, so a timeout just means "upload it"
+    boost::mutex file_checksum_mutex;
+    string file_checksum_path;
+    bool file_checksum_received;
+    int32_t file_checksum_size;  // -1 if the file doesn't exist on the device
+    uint32_t file_checksum_crc;
+    ros::Duration file_checksum_timeout;
+    bool requestFileChecksum(string dest, int32_t* size, uint32_t* crc);
+    void parseFileChecksum();
 
     ros::ServiceServer listdir_service;
     bool db_listdir(db_parsing::DodobotListDir::Request &req, db_parsing::DodobotListDir::Response &res);
@@ -239,41 +463,86 @@ private:
     ros::ServiceServer get_state_service;
     bool get_state(db_parsing::DodobotGetState::Request &req, db_parsing::DodobotGetState::Response &res);
 
-    void configure();
-    void checkReady();
+    bool configure();
     void setStartTime(uint32_t time_ms);
     ros::Time getDeviceTime(uint32_t time_ms);
-    bool getNextSegment(int length);
-    bool getNextSegment();
-    int getSegmentNum();
-    bool waitForPacketStart();
-    void processSerialPacket(string category);
-
-    uint16_t segment_as_uint16();
-    uint32_t segment_as_uint32();
-    int32_t segment_as_int32();
-    float segment_as_float();
-    string segment_as_string();
+    void processSerialPacket(const PacketRoute* route);
 
+    size_t pollSerial();
     bool readline();
     bool readSerial();
-    void writeSerialLarge(string name, vector<unsigned char>* data);
-    void writeSerial(string name, const char *formats, ...);
-    bool waitForOK(uint32_t packet_num, ros::Duration ok_timeout = ros::Duration(0.0));  // 0.0 -> use default (packet_ok_timeout)
-    bool waitForOK(ros::Duration ok_timeout = ros::Duration(0.0));
-
-    bool write_stop_flag;
-    int write_thread_rate;
-    queue<string> write_queue;
+    bool verifyPacket(int protocol, bool log_errors);
+    void checkPacketNum(uint32_t recv_packet_num, uint32_t mask);
+    bool readSerialV1();
+    bool readSerialV2();
+    bool dispatchPacket(const PacketRoute* route);
+    bool writeSerialLarge(string name, vector<unsigned char>* data);
+    bool writeSerialLarge(string name, const unsigned char* data, size_t data_len,
+        size_t start_segment = 0, size_t* acked_prefix = NULL, db_parsing::DodobotUploadProgress* progress = NULL);
+    // both return a ticket for waitForOK. Packet numbers are assigned when the packet is sent
+    uint32_t writeSerial(string name, const char *formats, ...);
+    uint32_t writeSerialClass(TxClass tx_class, string name, const char *formats, ...);
+    uint32_t queuePacket(TxClass tx_class, string name, const char *formats, va_list args);
+    bool waitForOK(uint32_t ticket, ros::Duration ok_timeout = ros::Duration(0.0));  // 0.0 -> use default (packet_ok_timeout)
+    bool pollOK(uint32_t ticket, int* error_code);  // true if a response arrived
+    void waitForResponse(ros::Duration timeout, uint32_t generation);  // returns early once ok_generation moves past generation
+    void notifyResponse();
+    bool isOKCode(int error_code) { return error_code == 0 || error_code == 6; }
+
+    PacketDispatchTable<PacketRoute> packet_handlers;
+    PacketRoute _routesById[256];  // v2 packets by id. handler is NULL for unused ids
+    PacketDispatchTable<const PacketSchema*> host_packet_schemas;
+    void addPacketHandler(const char* category, PacketHandler handler);
+    // handler should decode with _rxCursor.read_fields<Packet>
+    template <typename Packet> void addPacketHandler(PacketHandler handler) { addPacketHandler(Packet::category(), handler); }
+    void parseTxRx();
+    void parsePidKs();
+    void parseListDir();
+    void parseRecvImage();
+
+    std::atomic<bool> write_stop_flag;
+    int tx_queue_size;
+    int tx_bulk_queue_size;
+    ros::Duration tx_full_timeout;
+    PacketTxRing* _txRing;
+    PacketTxRing* _txBulkRing;
+    TxMailbox _txMailboxes[NUM_TX_CLASSES - TX_FIRST_MAILBOX];
+    char* _txBatchBuffer;
+    std::atomic<uint32_t> _txTicket;
+    std::atomic<uint64_t>* _sentTickets;  // packet num << 32 | ticket, indexed by packet num
+    std::atomic<double>* _ticketQueuedTimes;  // wall time each ticket was queued, indexed by ticket
+    std::atomic<double>* _sentTimes;  // wall time each packet was written, indexed by packet num
+    uint8_t* _ticketProtocols;  // protocol each ticket was formatted in. Handed over with the packet
+    std::atomic<uint32_t>* _writtenTickets;  // each ticket once the writer has taken it, indexed by ticket
+    bool ticketWritten(uint32_t ticket);
+    void waitForWritten(const vector<uint32_t>& tickets, ros::Duration timeout);
+    uint32_t lookupTicket(uint32_t packet_num);
+    char* _txTranscodeBuffer;
+    size_t transcodePacket(char* dest, size_t max_length, const char* packet, size_t length, int protocol);
+    const char* packetInProtocol(const char* packet, size_t* length, uint32_t ticket, int protocol, TxClass tx_class);
+    size_t stampPacket(char* dest, const char* packet, size_t length, uint32_t ticket, TxClass tx_class, int protocol);
+    bool batchFromRing(PacketTxRing* ring, TxClass tx_class, int protocol, size_t* batch_len, size_t* count);
+    void batchFromMailboxes(int protocol, size_t* batch_len, size_t* count);
+    std::atomic<size_t> tx_replaced[NUM_TX_CLASSES];
+    std::atomic<size_t> tx_dropped[NUM_TX_CLASSES];
+    std::atomic<bool> write_waiting;
+    boost::mutex write_mutex;
+    boost::condition_variable write_cond;
     boost::thread* write_thread;
-    void write_packet_from_queue();
+    void notifyWriter();
+    size_t write_packets_from_queue();
     void write_thread_task();
 
-    ros::Time write_timer;
+    LinkStats link_stats;
+    ros::Publisher diagnostics_pub;
+    ros::Timer diagnostics_timer;
+    double diagnostics_rate;
+    void publishDiagnostics(const ros::TimerEvent& event);
 
     void setup();
     void loop();
     void stop();
+    std::atomic<bool> stop_requested;
 
     void setActive(bool state);
     void softRestart();
@@ -293,8 +562,15 @@ private:
     void parseINA();
     void parseIR();
 public:
-    DodobotParsing(ros::NodeHandle* nodehandle);
-    int run();
+    DodobotParsing(ros::NodeHandle* nodehandle, ros::NodeHandle* private_nodehandle);
+
+    // Blocks until ROS shuts down or requestStop() is called. The calling
+    // thread reads the serial port and, between reads, services timers from
+    // the global queue, or from callback_queue if nodehandle was given its own.
+    // Publishers, subscribers and services are live from the start. Anything
+    // that needs the device is refused until it has said it's ready
+    int run(ros::CallbackQueue* callback_queue = NULL);
+    void requestStop();
 };
 
 #endif  // _DODOBOT_PARSING_H_
@@ -0,0 +1,88 @@
+#ifndef _DODOBOT_LINK_STATS_H_
+#define _DODOBOT_LINK_STATS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "ros/ros.h"
+#include "diagnostic_msgs/DiagnosticStatus.h"
+
+#define LINK_STATS_MAX_CATEGORIES 64
+#define LINK_STATS_LATENCY_BUCKETS 16  // bucket i counts latencies under 2^i * 100us
+
+
+/**
+ * Counters for the serial link.
+ *
+ * Categories are registered once at startup. After that every update is a
+ * relaxed atomic add or compare, so the counters can be bumped from the RX,
+ * TX and callback threads without locks. report() is the only reader. It
+ * turns the totals into rates since its previous call.
+ */
+class LinkStats
+{
+public:
+    LinkStats();
+
+    // startup only. Returns the index to pass to countRx/countTx
+    size_t addRxCategory(const std::string& name);
+    size_t addTxCategory(const std::string& name);
+    std::string rxCategoryName(size_t category) const;
+
+    void countRx(size_t category, size_t bytes);
+    void countTx(size_t category, size_t bytes);
+    void countUnknownRx(size_t bytes);
+
+    void recordLatency(double seconds);  // txrx round trip
+    void recordTxAge(double seconds);  // time from writeSerial to the serial write
+    void recordQueueDepth(size_t depth);
+    void recordClockSkew(double seconds);  // host time - device time
+
+    std::atomic<uint64_t> rx_checksum_errors;
+    std::atomic<uint64_t> rx_framing_errors;
+    std::atomic<uint64_t> rx_packet_num_errors;
+    std::atomic<uint64_t> rx_schema_errors;
+    std::atomic<uint64_t> rx_device_messages;
+    std::atomic<uint64_t> tx_write_errors;
+
+    void report(diagnostic_msgs::DiagnosticStatus& status);
+
+private:
+    struct Counter {
+        std::atomic<uint64_t> packets;
+        std::atomic<uint64_t> bytes;
+        uint64_t prev_packets;  // only touched by report()
+        uint64_t prev_bytes;
+    };
+
+    std::vector<std::string> _rxNames, _txNames;
+    Counter _rx[LINK_STATS_MAX_CATEGORIES + 1];  // last entry is for unknown categories
+    Counter _tx[LINK_STATS_MAX_CATEGORIES];
+
+    std::atomic<uint64_t> _latencyBuckets[LINK_STATS_LATENCY_BUCKETS];
+    std::atomic<uint64_t> _latencyCount;
+    std::atomic<int64_t> _latencyMaxUs;
+
+    std::atomic<uint64_t> _txAgeCount;
+    std::atomic<int64_t> _txAgeTotalUs;
+    std::atomic<int64_t> _txAgeMaxUs;
+
+    std::atomic<uint64_t> _queueDepth;
+    std::atomic<uint64_t> _queueDepthMax;
+
+    std::atomic<int64_t> _clockSkewUs;
+    std::atomic<bool> _hasClockSkew;
+
+    ros::Time _prevReportTime;
+
+    static void resetCounter(Counter* counter);
+    static void updateMax(std::atomic<int64_t>* value, int64_t sample);
+    static void addValue(diagnostic_msgs::DiagnosticStatus& status, const std::string& key, const std::string& value);
+    static void addValue(diagnostic_msgs::DiagnosticStatus& status, const std::string& key, double value);
+    void reportCounter(diagnostic_msgs::DiagnosticStatus& status, const std::string& prefix, Counter* counter, double dt);
+};
+
+#endif  // _DODOBOT_LINK_STATS_H_
@@ -0,0 +1,42 @@
+#ifndef _DODOBOT_MAPPED_FILE_H_
+#define _DODOBOT_MAPPED_FILE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <string>
+
+
+/**
+ * Read-only memory mapping of a whole file. Pages are read in by the kernel
+ * as they're touched, so large files can be streamed out without copying
+ * them onto the heap first.
+ */
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    bool open(const std::string& path);
+    void close();
+
+    bool isOpen() const { return _fd >= 0; }
+    const unsigned char* data() const { return _data; }
+    size_t size() const { return _size; }
+    time_t modifiedTime() const { return _mtime; }
+
+    uint32_t crc32() const;
+
+private:
+    int _fd;
+    unsigned char* _data;
+    size_t _size;
+    time_t _mtime;
+
+    // not copyable
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+};
+
+#endif  // _DODOBOT_MAPPED_FILE_H_
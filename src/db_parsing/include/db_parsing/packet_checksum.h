@@ -0,0 +1,47 @@
+#ifndef _DODOBOT_PACKET_CHECKSUM_H_
+#define _DODOBOT_PACKET_CHECKSUM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <boost/crc.hpp>
+
+#include "db_parsing/packet_schema.h"
+
+// v1: at least 1 char for packet num, \t + at least 1 category char, 2 checksum chars
+// v2: 1 byte id, 2 byte packet num, 2 byte CRC16
+#define PACKET_MIN_LEN 5
+
+
+/**
+ * Checks the trailing checksum of a packet body handed out by PacketFramer.
+ * The body must be at least PACKET_MIN_LEN long.
+ *
+ * v1 ends in the 8 bit sum of every other byte as two hex characters. v2
+ * ends in a big endian CRC16 (CCITT) of every other byte. The received and
+ * calculated values are written out for logging either way.
+ */
+inline bool packetChecksumOk(int protocol, const char* body, size_t length, uint16_t* recv_checksum, uint16_t* calc_checksum)
+{
+    if (protocol == PROTOCOL_V2) {
+        boost::crc_ccitt_type crc;
+        crc.process_bytes(body, length - 2);
+        *calc_checksum = crc.checksum();
+        *recv_checksum = ((uint16_t)(uint8_t)body[length - 2] << 8) | (uint8_t)body[length - 1];
+        return *calc_checksum == *recv_checksum;
+    }
+
+    uint8_t sum = 0;
+    for (size_t index = 0; index < length - 2; index++) {
+        sum += (uint8_t)body[index];
+    }
+    char recv_checksum_array[3];  // extra character for null
+    recv_checksum_array[0] = body[length - 2];
+    recv_checksum_array[1] = body[length - 1];
+    recv_checksum_array[2] = '\0';
+    *calc_checksum = sum;
+    *recv_checksum = (uint8_t)strtol(recv_checksum_array, NULL, 16);
+    return *calc_checksum == *recv_checksum;
+}
+
+#endif  // _DODOBOT_PACKET_CHECKSUM_H_
@@ -0,0 +1,248 @@
+#ifndef _DODOBOT_PACKET_CURSOR_H_
+#define _DODOBOT_PACKET_CURSOR_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <boost/utility/string_ref.hpp>
+
+
+/**
+ * Read-only view over a received packet body.
+ *
+ * Call expect() once with the packet's schema (same format codes as
+ * writeSerial) to bounds check every field up front, then pull the fields
+ * out in order with read_fields<Packet>() (or read<T>() and
+ * read_string_view() for anything past the schema). The reads themselves
+ * aren't checked and never copy into intermediate buffers.
+ *
+ * Schema codes:
+ *   'u' uint32, 'd' int32, 'f' float (4 bytes each)
+ *   's' string with a 2 byte length prefix
+ *
+ * With FIELDS_FIXED (protocol v1) integers arrive big endian and string
+ * lengths are 2 bytes. With FIELDS_PACKED (protocol v2) 'u' is a LEB128
+ * varint, 'd' a zigzag varint and string lengths are varints. Floats arrive
+ * in the device's (little endian) memory order either way.
+ */
+
+// The read<T>() type for each schema code. 'b' and 'x' read like 's'
+template <typename T> struct PacketFieldCode;
+template <> struct PacketFieldCode<uint32_t> { static constexpr char value = 'u'; };
+template <> struct PacketFieldCode<int32_t> { static constexpr char value = 'd'; };
+template <> struct PacketFieldCode<float> { static constexpr char value = 'f'; };
+template <> struct PacketFieldCode<boost::string_ref> { static constexpr char value = 's'; };
+
+// FieldsMatchSchema<T...>::check(schema) is true if the types are exactly the schema's fields
+template <typename... Fields> struct FieldsMatchSchema;
+
+template <> struct FieldsMatchSchema<>
+{
+    static constexpr bool check(const char* schema) { return *schema == '\0'; }
+};
+
+template <typename Field, typename... Rest> struct FieldsMatchSchema<Field, Rest...>
+{
+    static constexpr bool check(const char* schema)
+    {
+        return *schema != '\0' &&
+            (*schema == 'b' || *schema == 'x' ? 's' : *schema) == PacketFieldCode<Field>::value &&
+            FieldsMatchSchema<Rest...>::check(schema + 1);
+    }
+};
+
+class PacketCursor
+{
+public:
+    enum FieldEncoding {
+        FIELDS_FIXED = 0,
+        FIELDS_PACKED
+    };
+
+    PacketCursor() : _begin(NULL), _pos(NULL), _end(NULL), _encoding(FIELDS_FIXED) {}
+    PacketCursor(const char* data, size_t length, FieldEncoding encoding = FIELDS_FIXED) { reset(data, length, encoding); }
+
+    void reset(const char* data, size_t length, FieldEncoding encoding = FIELDS_FIXED)
+    {
+        _begin = data;
+        _pos = data;
+        _end = data + length;
+        _encoding = encoding;
+    }
+
+    size_t remaining() const { return _end - _pos; }
+    size_t position() const { return _pos - _begin; }
+    const char* data() const { return _pos; }
+
+    bool expect(const char* schema) const
+    {
+        const char* pos = _pos;
+        for (; *schema != '\0'; schema++)
+        {
+            switch (*schema)
+            {
+                case 'u':
+                case 'd':
+                    if (_encoding == FIELDS_PACKED) {
+                        if (skip_varint(&pos) < 0) {
+                            return false;
+                        }
+                        break;
+                    }
+                    // fall through
+                case 'f':
+                    if ((size_t)(_end - pos) < 4) {
+                        return false;
+                    }
+                    pos += 4;
+                    break;
+                case 's':
+                case 'b':
+                case 'x': {
+                    size_t length;
+                    if (_encoding == FIELDS_PACKED) {
+                        int64_t varint = skip_varint(&pos);
+                        if (varint < 0) {
+                            return false;
+                        }
+                        length = (size_t)varint;
+                    }
+                    else {
+                        if ((size_t)(_end - pos) < 2) {
+                            return false;
+                        }
+                        length = ((size_t)(uint8_t)pos[0] << 8) | (uint8_t)pos[1];
+                        pos += 2;
+                    }
+                    if ((size_t)(_end - pos) < length) {
+                        return false;
+                    }
+                    pos += length;
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    template <typename T> T read();
+
+    // Reads every field of Packet's schema (a DevicePacket_* type, see
+    // packet_schema.h) in order. Doesn't compile unless the types of the
+    // fields passed in are exactly that schema
+    template <typename Packet, typename... Fields>
+    void read_fields(Fields&... fields)
+    {
+        static_assert(FieldsMatchSchema<Fields...>::check(Packet::schema()), "fields don't match the packet's schema");
+        read_each(fields...);
+    }
+
+    boost::string_ref read_string_view()
+    {
+        size_t length = _encoding == FIELDS_PACKED ? read_varint() : read_big_endian<uint16_t>();
+        return read_raw(length);
+    }
+
+    boost::string_ref read_raw(size_t length)
+    {
+        boost::string_ref view(_pos, length);
+        _pos += length;
+        return view;
+    }
+
+    // Checked. Returns everything up to separator (or the end of the packet,
+    // if there's no separator) and moves past the separator
+    boost::string_ref read_until(char separator)
+    {
+        const char* found = (const char*)memchr(_pos, separator, remaining());
+        if (found == NULL) {
+            return read_raw(remaining());
+        }
+        boost::string_ref view(_pos, found - _pos);
+        _pos = found + 1;
+        return view;
+    }
+
+private:
+    const char* _begin;
+    const char* _pos;
+    const char* _end;
+    FieldEncoding _encoding;
+
+    // Checked. Returns the value, or -1 if the varint runs off the end or past 5 bytes
+    int64_t skip_varint(const char** pos) const
+    {
+        uint32_t value = 0;
+        for (size_t i = 0; i < 5 && *pos < _end; i++) {
+            uint8_t byte = (uint8_t)*(*pos)++;
+            value |= (uint32_t)(byte & 0x7f) << (7 * i);
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+        return -1;
+    }
+
+    uint32_t read_varint()
+    {
+        uint32_t value = 0;
+        for (size_t i = 0; i < 5; i++) {
+            uint8_t byte = (uint8_t)*_pos++;
+            value |= (uint32_t)(byte & 0x7f) << (7 * i);
+            if ((byte & 0x80) == 0) {
+                break;
+            }
+        }
+        return value;
+    }
+
+    void read_each() {}
+
+    template <typename Field, typename... Rest>
+    void read_each(Field& field, Rest&... rest)
+    {
+        field = read<Field>();
+        read_each(rest...);
+    }
+
+    template <typename T> T read_big_endian()
+    {
+        T value = 0;
+        for (size_t i = 0; i < sizeof(T); i++) {
+            value = (T)((value << 8) | (uint8_t)_pos[i]);
+        }
+        _pos += sizeof(T);
+        return value;
+    }
+};
+
+template <> inline uint8_t PacketCursor::read<uint8_t>() { return (uint8_t)*_pos++; }
+template <> inline uint16_t PacketCursor::read<uint16_t>() { return read_big_endian<uint16_t>(); }
+
+template <> inline uint32_t PacketCursor::read<uint32_t>()
+{
+    return _encoding == FIELDS_PACKED ? read_varint() : read_big_endian<uint32_t>();
+}
+
+template <> inline int32_t PacketCursor::read<int32_t>()
+{
+    if (_encoding == FIELDS_PACKED) {
+        uint32_t zigzag = read_varint();
+        return (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+    }
+    return (int32_t)read_big_endian<uint32_t>();
+}
+
+template <> inline float PacketCursor::read<float>()
+{
+    float value;
+    memcpy(&value, _pos, sizeof(value));
+    _pos += sizeof(value);
+    return value;
+}
+
+template <> inline boost::string_ref PacketCursor::read<boost::string_ref>() { return read_string_view(); }
+
+#endif  // _DODOBOT_PACKET_CURSOR_H_
@@ -0,0 +1,123 @@
+#ifndef _DODOBOT_PACKET_DISPATCH_H_
+#define _DODOBOT_PACKET_DISPATCH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+#define MAX_CATEGORY_LEN 15
+
+
+/**
+ * Maps packet categories to handlers (or any small per-category value).
+ *
+ * Categories are registered once at startup. Every registration rebuilds a
+ * perfect hash over the registered keys (the hash seed is searched until no
+ * two keys share a slot), so a lookup is one hash of the category bytes, one
+ * slot and one compare. Nothing is allocated on the lookup path.
+ */
+template <typename Handler, size_t NumSlots = 64>
+class PacketDispatchTable
+{
+    static_assert((NumSlots & (NumSlots - 1)) == 0, "NumSlots must be a power of two");
+
+public:
+    PacketDispatchTable() : _seed(0)
+    {
+        clearSlots();
+    }
+
+    // Returns false if the category is too long, already registered or
+    // no collision free seed could be found for the current set of keys
+    bool add(const char* category, Handler handler)
+    {
+        size_t length = strlen(category);
+        if (length == 0 || length > MAX_CATEGORY_LEN || find(category, length) != NULL) {
+            return false;
+        }
+        Entry entry;
+        memcpy(entry.key, category, length);
+        entry.key[length] = '\0';
+        entry.length = (uint8_t)length;
+        entry.handler = handler;
+        _entries.push_back(entry);
+
+        if (!rebuild()) {
+            _entries.pop_back();
+            rebuild();
+            return false;
+        }
+        return true;
+    }
+
+    // Returns NULL if the category isn't registered
+    const Handler* find(const char* category, size_t length) const
+    {
+        if (length == 0 || length > MAX_CATEGORY_LEN) {
+            return NULL;
+        }
+        const Entry* entry = _slots[hash(category, length, _seed) & (NumSlots - 1)];
+        if (entry == NULL || entry->length != length || memcmp(entry->key, category, length) != 0) {
+            return NULL;
+        }
+        return &entry->handler;
+    }
+
+    size_t size() const { return _entries.size(); }
+
+private:
+    struct Entry {
+        char key[MAX_CATEGORY_LEN + 1];
+        uint8_t length;
+        Handler handler;
+    };
+
+    // _slots point into _entries and are recomputed after every add()
+    std::vector<Entry> _entries;
+    const Entry* _slots[NumSlots];
+    uint32_t _seed;
+
+    static uint32_t hash(const char* key, size_t length, uint32_t seed)
+    {
+        // FNV-1a, seeded
+        uint32_t value = 2166136261u ^ seed;
+        for (size_t i = 0; i < length; i++) {
+            value ^= (uint8_t)key[i];
+            value *= 16777619u;
+        }
+        return value ^ (value >> 15);
+    }
+
+    void clearSlots()
+    {
+        for (size_t i = 0; i < NumSlots; i++) {
+            _slots[i] = NULL;
+        }
+    }
+
+    bool rebuild()
+    {
+        for (uint32_t seed = 0; seed < 0x10000; seed++)
+        {
+            clearSlots();
+            bool collision = false;
+            for (size_t i = 0; i < _entries.size(); i++) {
+                size_t slot = hash(_entries[i].key, _entries[i].length, seed) & (NumSlots - 1);
+                if (_slots[slot] != NULL) {
+                    collision = true;
+                    break;
+                }
+                _slots[slot] = &_entries[i];
+            }
+            if (!collision) {
+                _seed = seed;
+                return true;
+            }
+        }
+        clearSlots();
+        return false;
+    }
+};
+
+#endif  // _DODOBOT_PACKET_DISPATCH_H_
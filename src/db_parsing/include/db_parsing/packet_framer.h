@@ -0,0 +1,82 @@
+#ifndef _DODOBOT_PACKET_FRAMER_H_
+#define _DODOBOT_PACKET_FRAMER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+
+/**
+ * Incremental receiver for the serial packet framing:
+ *
+ *     start_0 start_1 <length: 2 bytes, big endian> <body: length bytes> stop
+ *
+ * Raw bytes are written into a ring buffer in large chunks (ideally straight
+ * from the serial port via reserve/commit) and nextFrame() runs the framing
+ * state machine over whatever has arrived so far. Only complete packet bodies
+ * are ever handed back to the caller.
+ */
+class PacketFramer
+{
+public:
+    enum FrameResult {
+        FRAME_NEED_MORE = 0,  // not enough bytes for a complete frame yet
+        FRAME_PACKET,  // a complete packet body was copied out
+        FRAME_DEVICE_MESSAGE,  // a stop terminated line of plain text arrived between packets
+        FRAME_ERROR_LENGTH,  // the length field exceeds the frame buffer
+        FRAME_ERROR_STOP  // the body wasn't followed by the stop character
+    };
+
+    // ring_size is rounded up to a power of two
+    PacketFramer(size_t ring_size, size_t max_frame_len, char start_0, char start_1, char stop);
+    ~PacketFramer();
+
+    // Contiguous free space in the ring. Write up to *length bytes to the
+    // returned pointer then call commit with the number actually written.
+    uint8_t* reserve(size_t* length);
+    void commit(size_t length);
+
+    // Copies as much of data as fits. Returns the number of bytes accepted
+    size_t write(const uint8_t* data, size_t length);
+
+    // On FRAME_PACKET the body is copied into frame (null terminated, so frame
+    // must hold max_frame_len + 1 bytes) and its length is written to frame_len.
+    // A partially received body stays in frame between calls, so always pass
+    // the same buffer. On FRAME_DEVICE_MESSAGE, getDeviceMessage() holds the text.
+    FrameResult nextFrame(char* frame, size_t* frame_len);
+
+    const std::string& getDeviceMessage() const { return _deviceMessage; }
+
+    size_t buffered() const { return _head - _tail; }
+    size_t capacity() const { return _capacity; }
+    void reset();
+
+private:
+    enum FramerState {
+        STATE_START_0 = 0,
+        STATE_START_1,
+        STATE_LENGTH_0,
+        STATE_LENGTH_1,
+        STATE_BODY,
+        STATE_STOP
+    };
+
+    uint8_t* _ring;
+    size_t _capacity;
+    size_t _mask;
+    size_t _head;  // total bytes written
+    size_t _tail;  // total bytes consumed
+
+    size_t _maxFrameLen;
+    char _start0, _start1, _stop;
+
+    FramerState _state;
+    uint16_t _frameLen;
+    size_t _frameIndex;
+    std::string _deviceMessage;
+    std::string _pendingMessage;
+
+    uint8_t popByte();
+};
+
+#endif  // _DODOBOT_PACKET_FRAMER_H_
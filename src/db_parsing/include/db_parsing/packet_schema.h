@@ -0,0 +1,136 @@
+#ifndef _DODOBOT_PACKET_SCHEMA_H_
+#define _DODOBOT_PACKET_SCHEMA_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+
+/**
+ * Every packet category on the serial link, in one place.
+ *
+ * Both directions are listed as X(name, id, category, schema). The category
+ * name is what protocol v1 sends. Protocol v2 sends the one byte id instead.
+ * Schema codes are the writeSerial format codes ('b' and 'x' are written
+ * the same way as 's'). writeSerial rejects packets whose formats aren't a
+ * prefix of the listed schema, and received packets are checked against it
+ * before their parse* handler runs. Trailing fields may be left off.
+ *
+ * Each device packet also gets a DevicePacket_<name> type. parse* handlers
+ * decode with PacketCursor::read_fields<DevicePacket_<name>>, which checks
+ * the fields against the schema at compile time.
+ *
+ * Ids are on the wire, so they must never be reused or renumbered.
+ */
+
+// microcontroller -> ROS
+#define DODOBOT_DEVICE_PACKETS(X) \
+    X(TXRX,         0x01, "txrx",      "uu")     /* packet num, error code. Optionally followed by 4 raw message bytes */ \
+    X(STATE,        0x02, "state",     "uuuf")   /* time ms, battery ok, motors active, loop rate */ \
+    X(ENC,          0x03, "enc",       "uddff")  /* time ms, left ticks, right ticks, left speed, right speed */ \
+    X(BUMP,         0x04, "bump",      "uuu")    /* time ms, left, right */ \
+    X(FSR,          0x05, "fsr",       "uuu")    /* time ms, right, left */ \
+    X(GRIP,         0x06, "grip",      "ud")     /* time ms, position */ \
+    X(LINEAR,       0x07, "linear",    "uduuu")  /* time ms, position, has error, is homed, is active */ \
+    X(LINEAR_EVENT, 0x08, "le",        "uu")     /* time ms, event num */ \
+    X(BATT,         0x09, "batt",      "ufff")   /* time ms, current, power, voltage */ \
+    X(TILT,         0x0a, "tilt",      "ud")     /* time ms, position */ \
+    X(PIDKS,        0x0b, "pidks",     "u")      /* success */ \
+    X(READY,        0x0c, "ready",     "us")     /* time ms, robot name. Optionally followed by 'u' highest protocol version and 'u' file segments it can buffer */ \
+    X(LISTDIR,      0x0d, "listdir",   "sd")     /* file name, size */ \
+    X(FILECRC,      0x0e, "filecrc",   "sdu")    /* path, size (-1 if missing), crc32 */ \
+    X(RECVIMAGE,    0x0f, "recvimage", "d")      /* ready for images */ \
+    X(ROBOTFN,      0x10, "robotfn",   "s")      /* selected function name */
+
+// ROS -> microcontroller
+#define DODOBOT_HOST_PACKETS(X) \
+    X(READY_REQUEST, 0x81, "?",         "s")          /* ready request */ \
+    X(PROTO,         0x82, "proto",     "d")          /* protocol version. Always sent as v1 */ \
+    X(ROS,           0x83, "ros",       "d")          /* ROS ready flag */ \
+    X(ACTIVE,        0x84, "<>",        "d")          /* active state, or 2 for a soft restart */ \
+    X(REPORTING,     0x85, "[]",        "d")          /* reporting state */ \
+    X(DRIVE,         0x86, "drive",     "ff")         /* left setpoint, right setpoint */ \
+    X(LINCFG,        0x87, "lincfg",    "dd")         /* config type, value */ \
+    X(LINEAR,        0x88, "linear",    "dd")         /* command type, command value */ \
+    X(TILT,          0x89, "tilt",      "dd")         /* command, position */ \
+    X(GRIP,          0x8a, "grip",      "ddd")        /* command, position or force threshold, position */ \
+    X(KS,            0x8b, "ks",        "ffffffff")   /* kp, ki, kd for A and B, speed kA, speed kB */ \
+    X(SETPATH,       0x8c, "setpath",   "s")          /* destination of the next file transfer */ \
+    X(FILE,          0x8d, "file",      "ddb")        /* segment index, segment count, segment data */ \
+    X(FILECRC,       0x8e, "filecrc",   "s")          /* path */ \
+    X(LISTDIR,       0x8f, "listdir",   "s")          /* directory */ \
+    X(ROBOTFN,       0x90, "robotfn",   "ddsd")       /* index, total length, name, blank space */ \
+    X(NOTIFY,        0x91, "notify",    "dsu")        /* level, message, timeout */ \
+    X(KEY,           0x92, "key",       "sd")         /* key, event type */
+
+#define PROTOCOL_V1 1
+#define PROTOCOL_V2 2
+
+// frame delimiters, see PacketFramer
+const char PACKET_START_0 = '\x12';
+const char PACKET_START_1 = '\x34';
+const char PACKET_STOP = '\n';
+
+struct PacketSchema {
+    uint8_t id;
+    const char* category;
+    const char* schema;
+};
+
+#define DODOBOT_PACKET_SCHEMA_ENTRY(NAME, ID, CATEGORY, SCHEMA) {ID, CATEGORY, SCHEMA},
+
+const PacketSchema DEVICE_PACKET_SCHEMAS[] = { DODOBOT_DEVICE_PACKETS(DODOBOT_PACKET_SCHEMA_ENTRY) };
+const PacketSchema HOST_PACKET_SCHEMAS[] = { DODOBOT_HOST_PACKETS(DODOBOT_PACKET_SCHEMA_ENTRY) };
+const size_t NUM_DEVICE_PACKET_SCHEMAS = sizeof(DEVICE_PACKET_SCHEMAS) / sizeof(DEVICE_PACKET_SCHEMAS[0]);
+const size_t NUM_HOST_PACKET_SCHEMAS = sizeof(HOST_PACKET_SCHEMAS) / sizeof(HOST_PACKET_SCHEMAS[0]);
+
+#undef DODOBOT_PACKET_SCHEMA_ENTRY
+
+#define DODOBOT_DEVICE_PACKET_TYPE(NAME, ID, CATEGORY, SCHEMA) \
+    struct DevicePacket_##NAME { \
+        static constexpr uint8_t id() { return ID; } \
+        static constexpr const char* category() { return CATEGORY; } \
+        static constexpr const char* schema() { return SCHEMA; } \
+    };
+
+DODOBOT_DEVICE_PACKETS(DODOBOT_DEVICE_PACKET_TYPE)
+
+#undef DODOBOT_DEVICE_PACKET_TYPE
+
+// Startup only. Linear search, returns NULL if the category isn't listed
+inline const PacketSchema* findPacketSchema(const PacketSchema* schemas, size_t num_schemas, const char* category)
+{
+    for (size_t i = 0; i < num_schemas; i++) {
+        if (strcmp(schemas[i].category, category) == 0) {
+            return &schemas[i];
+        }
+    }
+    return NULL;
+}
+
+// Linear search by v2 id, returns NULL if the id isn't listed
+inline const PacketSchema* findPacketSchemaById(const PacketSchema* schemas, size_t num_schemas, uint8_t id)
+{
+    for (size_t i = 0; i < num_schemas; i++) {
+        if (schemas[i].id == id) {
+            return &schemas[i];
+        }
+    }
+    return NULL;
+}
+
+// True if formats (as passed to writeSerial) is a prefix of schema
+inline bool formatsMatchSchema(const char* formats, const char* schema)
+{
+    for (; *formats != '\0'; formats++, schema++)
+    {
+        char format = *formats == 'x' || *formats == 'b' ? 's' : *formats;
+        char expected = *schema == 'x' || *schema == 'b' ? 's' : *schema;
+        if (format != expected) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif  // _DODOBOT_PACKET_SCHEMA_H_
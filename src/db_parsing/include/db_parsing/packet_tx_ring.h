@@ -0,0 +1,65 @@
+#ifndef _DODOBOT_PACKET_TX_RING_H_
+#define _DODOBOT_PACKET_TX_RING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+
+/**
+ * Bounded multi-producer, single-consumer queue of outgoing packets.
+ *
+ * All memory is allocated up front as a power-of-two number of fixed size
+ * slots. Producers never lock: claim() reserves the next slot with a single
+ * compare-and-swap, the packet is written in place, and publish() hands it
+ * to the consumer. The consumer sees packets strictly in claim order, so a
+ * slot's position doubles as a sequence number for the packet inside it.
+ */
+class PacketTxRing
+{
+public:
+    // num_slots is rounded up to a power of two
+    PacketTxRing(size_t num_slots, size_t slot_size);
+    ~PacketTxRing();
+
+    // Any thread. Returns NULL if every slot is in use. Otherwise write up to
+    // slotSize() bytes to the returned pointer then publish() the same position.
+    // tag is an arbitrary value handed back to the consumer with the packet
+    char* claim(size_t* position);
+    void publish(size_t position, size_t length, uint32_t tag = 0);
+
+    // Consumer thread only. Returns the published packet offset slots past
+    // the oldest unreleased one, or NULL if it isn't published yet
+    const char* peek(size_t offset, size_t* length, uint32_t* tag = NULL) const;
+
+    // Consumer thread only. Frees the oldest count slots for producers
+    void release(size_t count);
+
+    // Slots claimed but not yet released
+    size_t depth() const;
+
+    size_t numSlots() const { return _numSlots; }
+    size_t slotSize() const { return _slotSize; }
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        size_t length;
+        uint32_t tag;
+    };
+
+    Slot* _slots;
+    char* _data;
+    size_t _numSlots;
+    size_t _mask;
+    size_t _slotSize;
+
+    // producers and the consumer each own one of these. Keep them on separate cache lines
+    std::atomic<size_t> _enqueuePos;
+    char _padding[64];
+    std::atomic<size_t> _dequeuePos;
+
+    char* slotData(size_t position) const { return _data + (position & _mask) * _slotSize; }
+};
+
+#endif  // _DODOBOT_PACKET_TX_RING_H_
@@ -0,0 +1,82 @@
+#ifndef _DODOBOT_SERIAL_CAPTURE_H_
+#define _DODOBOT_SERIAL_CAPTURE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+#include "db_parsing/mapped_file.h"
+
+#define SERIAL_CAPTURE_MAGIC "DBCAP\x01\n"  // 8 bytes with the null
+#define SERIAL_CAPTURE_MAGIC_LEN 8
+#define SERIAL_CAPTURE_RECORD_HEADER_LEN 13
+
+
+/**
+ * Append-only recording of the raw serial byte stream.
+ *
+ * The file starts with SERIAL_CAPTURE_MAGIC and is followed by records of
+ *
+ *     <stamp: uint64 ns, wall clock> <length: uint32> <direction: uint8> <bytes>
+ *
+ * in little endian. Each record is one chunk exactly as it was read from or
+ * written to the port, so replaying the RX records reproduces the framing
+ * the parser saw, split points included.
+ */
+class SerialCaptureWriter
+{
+public:
+    enum Direction {
+        CAPTURE_RX = 0,
+        CAPTURE_TX = 1
+    };
+
+    SerialCaptureWriter();
+    ~SerialCaptureWriter();
+
+    // appends to an existing capture. Starts a new one if path doesn't exist
+    bool open(const std::string& path);
+    void close();
+    bool isOpen() const { return _file != NULL; }
+
+    // Any thread
+    void append(uint64_t stamp_ns, Direction direction, const uint8_t* data, size_t length);
+    void flush();
+
+private:
+    FILE* _file;
+    boost::mutex _mutex;
+
+    SerialCaptureWriter(const SerialCaptureWriter&);
+    SerialCaptureWriter& operator=(const SerialCaptureWriter&);
+};
+
+/**
+ * Walks the records of a capture file in order. The file is memory mapped,
+ * so next() hands back pointers straight into it.
+ */
+class SerialCaptureReader
+{
+public:
+    SerialCaptureReader();
+
+    bool open(const std::string& path);
+    void close();
+    bool isOpen() const { return _file.isOpen(); }
+
+    // false at the end of the capture or on a truncated record
+    bool next(uint64_t* stamp_ns, SerialCaptureWriter::Direction* direction, const uint8_t** data, size_t* length);
+    void rewind();
+
+    size_t position() const { return _position; }
+    size_t size() const { return _file.size(); }
+
+private:
+    MappedFile _file;
+    size_t _position;
+};
+
+#endif  // _DODOBOT_SERIAL_CAPTURE_H_
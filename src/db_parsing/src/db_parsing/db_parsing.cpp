@@ -1,28 +1,85 @@
 #include <db_parsing/db_parsing.h>
 
 
-DodobotParsing::DodobotParsing(ros::NodeHandle* nodehandle):nh(*nodehandle),image_transport(nh)
+static size_t writeVarint(char* dest, uint32_t value)
+{
+    size_t length = 0;
+    while (value >= 0x80) {
+        dest[length++] = (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    dest[length++] = (char)value;
+    return length;
+}
+
+static ros::NodeHandle withCallbackQueue(ros::NodeHandle nh, ros::CallbackQueue* queue)
+{
+    nh.setCallbackQueue(queue);
+    return nh;
+}
+
+DodobotParsing::DodobotParsing(ros::NodeHandle* nodehandle, ros::NodeHandle* private_nodehandle):
+    nh(*nodehandle),private_nh(*private_nodehandle),
+    realtime_nh(withCallbackQueue(nh, &realtime_queue)),
+    bulk_nh(withCallbackQueue(nh, &bulk_queue)),
+    service_nh(withCallbackQueue(nh, &service_queue)),
+    image_transport(bulk_nh)
 {
     string drive_cmd_topic_name = "";
     int stepper_max_speed_param, stepper_max_accel_param;
 
-    ros::param::param<string>("~serial_port", _serialPort, "");
-    ros::param::param<int>("~serial_baud", _serialBaud, 115200);
-    ros::param::param<string>("~drive_cmd_topic", drive_cmd_topic_name, "drive_cmd");
-    ros::param::param<int>("~write_thread_rate", write_thread_rate, 60);
-    ros::param::param<bool>("~use_sensor_msg_time", use_sensor_msg_time, true);
-    ros::param::param<bool>("~active_on_start", active_on_start, true);
-    ros::param::param<bool>("~reporting_on_start", reporting_on_start, true);
-    ros::param::param<string>("~display_img_topic", display_img_topic, "image");
-    ros::param::param<int>("~jpeg_image_quality", jpeg_image_quality, 50);
-    ros::param::param<int>("~image_resize_width", image_resize_width, 160);
-    ros::param::param<int>("~image_resize_height", image_resize_height, 128 - 20);
-    ros::param::param<int>("~stepper_max_speed", stepper_max_speed_param, 420000000);
-    ros::param::param<int>("~stepper_max_accel", stepper_max_accel_param, 20000000);
+    private_nh.param<string>("serial_port", _serialPort, "");
+    private_nh.param<int>("serial_baud", _serialBaud, 115200);
+    private_nh.param<int>("rx_timeout_ms", _rxTimeoutMs, 3);
+    private_nh.param<string>("drive_cmd_topic", drive_cmd_topic_name, "drive_cmd");
+    private_nh.param<double>("drive_cmd_max_rate", drive_cmd_max_rate, 0.0);
+    private_nh.param<int>("tx_queue_size", tx_queue_size, 64);
+    private_nh.param<int>("tx_bulk_queue_size", tx_bulk_queue_size, 8);
+    private_nh.param<int>("large_packet_window", large_packet_window, 4);
+    private_nh.param<int>("large_packet_attempts", large_packet_attempts, 3);
+    private_nh.param<bool>("use_sensor_msg_time", use_sensor_msg_time, true);
+    private_nh.param<bool>("active_on_start", active_on_start, true);
+    private_nh.param<bool>("reporting_on_start", reporting_on_start, true);
+    private_nh.param<string>("display_img_topic", display_img_topic, "image");
+    private_nh.param<int>("jpeg_image_quality", jpeg_image_quality, 50);
+    private_nh.param<int>("image_resize_width", image_resize_width, 160);
+    private_nh.param<int>("image_resize_height", image_resize_height, 128 - 20);
+    private_nh.param<double>("image_change_threshold", image_change_threshold, 1.0);
+    private_nh.param<double>("display_max_rate", display_max_rate, 10.0);
+    private_nh.param<double>("image_link_share", image_link_share, 0.5);
+    private_nh.param<double>("diagnostics_rate", diagnostics_rate, 1.0);
+    private_nh.param<string>("capture_path", capture_path, "");
+    private_nh.param<string>("replay_path", replay_path, "");
+    private_nh.param<bool>("replay_realtime", replay_realtime, true);
+    private_nh.param<bool>("benchmark", benchmark_mode, false);
+    private_nh.param<int>("protocol_version", protocol_version, PROTOCOL_V1);
+    private_nh.param<int>("config_request_attempts", config_request_attempts, 5);
+    double reconnect_interval_s, ready_retry_interval_s, ready_timeout_s, link_timeout_s;
+    private_nh.param<double>("reconnect_interval", reconnect_interval_s, 1.0);
+    private_nh.param<double>("ready_retry_interval", ready_retry_interval_s, 0.25);
+    private_nh.param<double>("ready_timeout", ready_timeout_s, 5.0);
+    private_nh.param<double>("link_timeout", link_timeout_s, 2.0);
+    int stepper_speed_param, stepper_accel_param;
+    private_nh.param<int>("stepper_speed", stepper_speed_param, 0);
+    private_nh.param<int>("stepper_accel", stepper_accel_param, 0);
+    private_nh.param<bool>("threaded_callbacks", threaded_callbacks, true);
+    private_nh.param<int>("stepper_max_speed", stepper_max_speed_param, 420000000);
+    private_nh.param<int>("stepper_max_accel", stepper_max_accel_param, 20000000);
     stepper_max_speed = (uint32_t)stepper_max_speed_param;
     stepper_max_accel = (uint32_t)stepper_max_accel_param;
     stepper_low_speed = stepper_max_speed / 1000;
     stepper_low_accel = stepper_max_accel / 1000;
+    stepper_speed_setting = stepper_speed_param;
+    stepper_accel_setting = stepper_accel_param;
+
+    reconnect_interval = ros::Duration(reconnect_interval_s);
+    ready_retry_interval = ros::Duration(ready_retry_interval_s);
+    ready_timeout = ros::Duration(ready_timeout_s);
+    link_timeout = ros::Duration(link_timeout_s);
+    serial_open = false;
+    link_reconnects = 0;
+    last_open_attempt_time = ros::Time(0);
+    last_ready_request_time = ros::Time(0);
 
     ROS_INFO_STREAM("serial_port: " << _serialPort);
     ROS_INFO_STREAM("serial_baud: " << _serialBaud);
@@ -30,6 +87,9 @@ DodobotParsing::DodobotParsing(ros::NodeHandle* nodehandle):nh(*nodehandle),imag
 
     large_packet_len = 0x1000;
     ready_for_images = false;
+    drive_pending = false;
+    pending_left_setpoint = 0.0;
+    pending_right_setpoint = 0.0;
 
     was_reporting = false;
 
@@ -45,21 +105,86 @@ DodobotParsing::DodobotParsing(ros::NodeHandle* nodehandle):nh(*nodehandle),imag
     battery_msg.header.frame_id = "battery";
     battery_msg.power_supply_technology = sensor_msgs::BatteryState::POWER_SUPPLY_TECHNOLOGY_LION;
 
-    _serialBufferIndex = 0;
-    _currentSegmentNum = -1;
     _readPacketNum = -1;
     _writePacketNum = 0;
-    _currentBufferSegment = new char[SERIAL_BUFFER_SIZE];
+    _txProtocol = PROTOCOL_V1;
+    _rxProtocol = PROTOCOL_V1;
+    _protocolTicket = TX_TICKET_INVALID;
+    _protocolAttempts = 0;
     _recvCharIndex = 0;
     _readPacketLen = 0;
+
+    _capture = NULL;
+    if (capture_path.size() > 0) {
+        _capture = new SerialCaptureWriter();
+        if (_capture->open(capture_path)) {
+            ROS_INFO_STREAM("Capturing serial data to " << capture_path);
+        }
+        else {
+            ROS_ERROR_STREAM("Failed to open capture file " << capture_path);
+            delete _capture;
+            _capture = NULL;
+        }
+    }
+    _replay = NULL;
+    _replayData = NULL;
+    _replayRemaining = 0;
+    _replayFirstStamp = 0;
+    if (replay_path.size() > 0) {
+        _replay = new SerialCaptureReader();
+        if (!_replay->open(replay_path)) {
+            ROS_ERROR_STREAM("Failed to open capture " << replay_path << " for replay");
+            throw ReplayOpenException;
+        }
+        ROS_INFO_STREAM("Replaying " << replay_path << (replay_realtime ? " in real time" : " as fast as possible"));
+    }
+    _rxStatsIndex = LINK_STATS_MAX_CATEGORIES;
+    benchmark_stats.resize(LINK_STATS_MAX_CATEGORIES + 1);
+    for (size_t i = 0; i < benchmark_stats.size(); i++) {
+        benchmark_stats[i].packets = 0;
+        benchmark_stats[i].total_ns = 0;
+        benchmark_stats[i].max_ns = 0;
+    }
     _recvCharBuffer = new char[SERIAL_BUFFER_SIZE];
-    _writeCharIndex = 0;
-    _writeCharBuffer = new char[SERIAL_BUFFER_SIZE];
+    _rxFramer = new PacketFramer(SERIAL_RX_RING_SIZE, SERIAL_BUFFER_SIZE - 1, PACKET_START_0, PACKET_START_1, PACKET_STOP);
+    _txRing = new PacketTxRing(tx_queue_size, SERIAL_TX_SLOT_SIZE);
+    _txBulkRing = new PacketTxRing(tx_bulk_queue_size, SERIAL_TX_BULK_SLOT_SIZE);
+    _txBatchBuffer = new char[SERIAL_TX_BATCH_SIZE];
+    _txTranscodeBuffer = new char[SERIAL_TX_BATCH_SIZE];
+    for (size_t i = 0; i < NUM_TX_CLASSES - TX_FIRST_MAILBOX; i++) {
+        _txMailboxes[i].pending = false;
+        _txMailboxes[i].ticket = TX_TICKET_INVALID;
+        _txMailboxes[i].length = 0;
+    }
+    for (size_t i = 0; i < NUM_TX_CLASSES; i++) {
+        tx_replaced[i] = 0;
+        tx_dropped[i] = 0;
+    }
+    _txTicket = TX_TICKET_INVALID + 1;
+    _sentTickets = new std::atomic<uint64_t>[TX_TICKET_HISTORY];
+    _okResults = new std::atomic<uint64_t>[TX_TICKET_HISTORY];
+    _ticketQueuedTimes = new std::atomic<double>[TX_TICKET_HISTORY];
+    _sentTimes = new std::atomic<double>[TX_TICKET_HISTORY];
+    _ticketProtocols = new uint8_t[TX_TICKET_HISTORY];
+    _writtenTickets = new std::atomic<uint32_t>[TX_TICKET_HISTORY];
+    for (size_t i = 0; i < TX_TICKET_HISTORY; i++) {
+        _sentTickets[i] = 0;
+        _okResults[i] = 0;
+        _ticketQueuedTimes[i] = 0.0;
+        _sentTimes[i] = 0.0;
+        _ticketProtocols[i] = PROTOCOL_V1;
+        _writtenTickets[i] = TX_TICKET_INVALID;
+    }
+    ok_waiters = 0;
+    ok_generation = 0;
+    _rxThreadId = boost::this_thread::get_id();
 
     readyState = new StructReadyState;
     readyState->robot_name = "";
     readyState->is_ready = false;
     readyState->time_ms = 0;
+    readyState->protocol_version = PROTOCOL_V1;
+    readyState->rx_segments = 1;
 
     robotState = new StructRobotState;
     robotState->battery_ok = false;
@@ -84,11 +209,15 @@ DodobotParsing::DodobotParsing(ros::NodeHandle* nodehandle):nh(*nodehandle),imag
     pidConstants->kd_B = 0.0;
     pidConstants->speed_kA = 0.0;
     pidConstants->speed_kB = 0.0;
+    pid_constants_set = false;
 
     prev_left_setpoint = 0.0;
     prev_right_setpoint = 0.0;
 
     display_img_buf = new vector<unsigned char>();
+    image_stop_flag = false;
+    image_throughput = 0.0;
+    next_image_time = ros::Time::now();
 
     gripper_pub = nh.advertise<db_parsing::DodobotGripper>("gripper", 50);
     tilter_pub = nh.advertise<db_parsing::DodobotTilter>("tilter", 50);
@@ -100,60 +229,119 @@ DodobotParsing::DodobotParsing(ros::NodeHandle* nodehandle):nh(*nodehandle),imag
     fsr_pub = nh.advertise<db_parsing::DodobotFSRs>("fsrs", 50);
     state_pub = nh.advertise<db_parsing::DodobotState>("state", 50);
     robot_functions_pub = nh.advertise<db_parsing::DodobotFunctionsListing>("selected_fn", 10);
-
-    gripper_sub = nh.subscribe<db_parsing::DodobotGripper>("gripper_cmd", 50, &DodobotParsing::gripperCallback, this);
-    tilter_sub = nh.subscribe<db_parsing::DodobotTilter>("tilter_cmd", 50, &DodobotParsing::tilterCallback, this);
-    linear_sub = nh.subscribe<db_parsing::DodobotLinear>("linear_cmd", 50, &DodobotParsing::linearCallback, this);
-    drive_sub = nh.subscribe<db_parsing::DodobotDrive>(drive_cmd_topic_name, 50, &DodobotParsing::driveCallback, this);
+    upload_progress_pub = nh.advertise<db_parsing::DodobotUploadProgress>("upload_progress", 10);
+    diagnostics_pub = nh.advertise<diagnostic_msgs::DiagnosticArray>("diagnostics", 10);
+    config_result_pub = nh.advertise<db_parsing::DodobotConfigResult>("config_result", 10);
+
+    gripper_sub = realtime_nh.subscribe<db_parsing::DodobotGripper>("gripper_cmd", 50, &DodobotParsing::gripperCallback, this);
+    tilter_sub = realtime_nh.subscribe<db_parsing::DodobotTilter>("tilter_cmd", 50, &DodobotParsing::tilterCallback, this);
+    linear_sub = realtime_nh.subscribe<db_parsing::DodobotLinear>("linear_cmd", 50, &DodobotParsing::linearCallback, this);
+    drive_sub = realtime_nh.subscribe<db_parsing::DodobotDrive>(drive_cmd_topic_name, 50, &DodobotParsing::driveCallback, this);
     image_sub = image_transport.subscribe(display_img_topic, 1, &DodobotParsing::imgCallback, this);
 
-    keyboard_sub = nh.subscribe<keyboard_listener::KeyEvent>("keys", 50, &DodobotParsing::keyboardCallback, this);
-    robot_functions_sub = nh.subscribe<db_parsing::DodobotFunctionsListing>("functions", 50, &DodobotParsing::robotFunctionsCallback, this);
-    notification_sub = nh.subscribe<db_parsing::DodobotNotify>("notify", 50, &DodobotParsing::notifyCallback, this);
+    keyboard_sub = bulk_nh.subscribe<keyboard_listener::KeyEvent>("keys", 50, &DodobotParsing::keyboardCallback, this);
+    robot_functions_sub = bulk_nh.subscribe<db_parsing::DodobotFunctionsListing>("functions", 50, &DodobotParsing::robotFunctionsCallback, this);
+    notification_sub = bulk_nh.subscribe<db_parsing::DodobotNotify>("notify", 50, &DodobotParsing::notifyCallback, this);
 
-    pid_service = nh.advertiseService("dodobot_pid", &DodobotParsing::set_pid, this);
-    file_service = nh.advertiseService("dodobot_file", &DodobotParsing::upload_file, this);
-    listdir_service = nh.advertiseService("dodobot_listdir", &DodobotParsing::db_listdir, this);
-    set_state_service = nh.advertiseService("set_state", &DodobotParsing::set_state, this);
-    get_state_service = nh.advertiseService("get_state", &DodobotParsing::get_state, this);
+    // TX stats are kept per class. Registered in TxClass order so the class is the index
+    for (size_t i = 0; i < NUM_TX_CLASSES; i++) {
+        link_stats.addTxCategory(TX_CLASS_NAMES[i]);
+    }
 
+    for (size_t i = 0; i < NUM_HOST_PACKET_SCHEMAS; i++) {
+        if (!host_packet_schemas.add(HOST_PACKET_SCHEMAS[i].category, &HOST_PACKET_SCHEMAS[i])) {
+            ROS_ERROR("Failed to register packet schema for '%s'", HOST_PACKET_SCHEMAS[i].category);
+        }
+    }
+    for (size_t i = 0; i < 256; i++) {
+        _routesById[i].handler = NULL;
+        _routesById[i].schema = NULL;
+        _routesById[i].stats_index = LINK_STATS_MAX_CATEGORIES;
+    }
+
+    // Serial packet handlers
+    addPacketHandler<DevicePacket_TXRX>(&DodobotParsing::parseTxRx);
+    addPacketHandler<DevicePacket_STATE>(&DodobotParsing::parseState);
+    addPacketHandler<DevicePacket_ENC>(&DodobotParsing::parseDrive);
+    addPacketHandler<DevicePacket_BUMP>(&DodobotParsing::parseBumper);
+    addPacketHandler<DevicePacket_FSR>(&DodobotParsing::parseFSR);
+    addPacketHandler<DevicePacket_GRIP>(&DodobotParsing::parseGripper);
+    // addPacketHandler("ir", &DodobotParsing::parseIR);
+    addPacketHandler<DevicePacket_LINEAR>(&DodobotParsing::parseLinear);
+    addPacketHandler<DevicePacket_LINEAR_EVENT>(&DodobotParsing::parseLinearEvent);
+    addPacketHandler<DevicePacket_BATT>(&DodobotParsing::parseBattery);
+    addPacketHandler<DevicePacket_TILT>(&DodobotParsing::parseTilter);
+    addPacketHandler<DevicePacket_PIDKS>(&DodobotParsing::parsePidKs);
+    addPacketHandler<DevicePacket_READY>(&DodobotParsing::parseReady);
+    addPacketHandler<DevicePacket_LISTDIR>(&DodobotParsing::parseListDir);
+    addPacketHandler<DevicePacket_FILECRC>(&DodobotParsing::parseFileChecksum);
+    addPacketHandler<DevicePacket_RECVIMAGE>(&DodobotParsing::parseRecvImage);
+    addPacketHandler<DevicePacket_ROBOTFN>(&DodobotParsing::parseSelectedRobotFn);
+
+    pid_service = service_nh.advertiseService("dodobot_pid", &DodobotParsing::set_pid, this);
+    file_service = service_nh.advertiseService("dodobot_file", &DodobotParsing::upload_file, this);
+    listdir_service = service_nh.advertiseService("dodobot_listdir", &DodobotParsing::db_listdir, this);
+    set_state_service = service_nh.advertiseService("set_state", &DodobotParsing::set_state, this);
+    get_state_service = service_nh.advertiseService("get_state", &DodobotParsing::get_state, this);
+
+    stop_requested = false;
     write_stop_flag = false;
+    write_waiting = false;
+    tx_full_timeout = ros::Duration(0.1);
     write_thread = new boost::thread(boost::bind(&DodobotParsing::write_thread_task, this));
 
-    write_timer = ros::Time::now();
-
     packet_ok_timeout = ros::Duration(1.0);
+    file_checksum_timeout = ros::Duration(0.5);
+    file_checksum_received = false;
+    file_checksum_size = -1;
+    file_checksum_crc = 0;
     linear_ok_packet_timeout = ros::Duration(7.0);
+    config_requests_failed = 0;
 
     jpeg_params.push_back(cv::IMWRITE_JPEG_QUALITY);
     jpeg_params.push_back(jpeg_image_quality);
 
+    image_thread = new boost::thread(boost::bind(&DodobotParsing::image_thread_task, this));
+
+    if (diagnostics_rate > 0.0) {
+        diagnostics_timer = nh.createTimer(ros::Duration(1.0 / diagnostics_rate), &DodobotParsing::publishDiagnostics, this);
+    }
+
     ROS_INFO("Dodobot serial bridge init done");
 }
 
 
-void DodobotParsing::configure()
+bool DodobotParsing::configure()
 {
-    ROS_INFO("Configuring serial device.");
+    ROS_INFO("Opening serial device.");
     // attempt to open the serial port
     try
     {
+        boost::lock_guard<boost::mutex> lock(serial_write_mutex);
         ROS_DEBUG_STREAM("Selected port: " << _serialPort);
         _serialRef.setPort(_serialPort);
         ROS_DEBUG_STREAM("Selected baud: " << _serialBaud);
         _serialRef.setBaudrate(_serialBaud);
-        serial::Timeout timeout = serial::Timeout::simpleTimeout(1000);
+        // reads only ever block in waitReadable, so the read timeout sets how
+        // long loop() waits for new data before returning to ROS
+        serial::Timeout timeout(serial::Timeout::max(), _rxTimeoutMs, 0, 1000, 0);
         _serialRef.setTimeout(timeout);
         _serialRef.open();
-        ROS_INFO("Serial device configured.");
+        serial_open = true;
     }
-    catch (serial::IOException e)
+    catch (exception& e)
     {
-        ROS_ERROR_STREAM("Unable to open port: " << _serialPort);
-        ROS_ERROR_STREAM("Serial exception: " << e.what());
-        cerr << "Serial exception: " << e.what() << endl;
-        throw;
+        ROS_ERROR_STREAM_THROTTLE(10.0, "Unable to open port " << _serialPort << ": " << e.what()
+            << ". Retrying every " << reconnect_interval.toSec() << "s");
+        return false;
     }
+
+    // whatever was left of a packet from before the port closed is garbage now
+    _rxFramer->reset();
+    link_open_time = ros::Time::now();
+    last_rx_time = link_open_time;
+    ROS_INFO("Serial device configured.");
+    return true;
 }
 
 void DodobotParsing::setStartTime(uint32_t time_ms) {
@@ -162,226 +350,424 @@ void DodobotParsing::setStartTime(uint32_t time_ms) {
 }
 
 ros::Time DodobotParsing::getDeviceTime(uint32_t time_ms) {
-    return deviceStartTime + ros::Duration((double)(time_ms - offsetTimeMs) / 1000.0);
+    ros::Time device_time = deviceStartTime + ros::Duration((double)(time_ms - offsetTimeMs) / 1000.0);
+    link_stats.recordClockSkew((ros::Time::now() - device_time).toSec());
+    return device_time;
 }
 
-void DodobotParsing::checkReady()
+void DodobotParsing::serviceLink()
 {
-    ROS_INFO("Checking if the serial device is ready.");
-
-    ros::Time begin_time = ros::Time::now();
-    ros::Time write_time = ros::Time::now();
-    ros::Duration general_timeout = ros::Duration(5.0);
-    ros::Duration write_timeout = ros::Duration(1.0);
-
-    writeSerial("?", "s", "dodobot");
+    if (_replay != NULL) {
+        // the capture carries its own ready packet, if it was recorded from the start
+        return;
+    }
+    ros::Time now = ros::Time::now();
 
-    while (!readyState->is_ready)
+    if (!serial_open)
     {
-        if (!ros::ok()) {
-            break;
+        if (now - last_open_attempt_time < reconnect_interval) {
+            return;
         }
-        if ((ros::Time::now() - begin_time) > general_timeout) {
-            throw ReadyTimeoutException;
+        last_open_attempt_time = now;
+        if (configure()) {
+            requestReady();
         }
-        if ((ros::Time::now() - write_time) > write_timeout) {
-            ROS_INFO("Writing signal again");
-            writeSerial("?", "s", "dodobot");
-            write_time = ros::Time::now();
+        return;
+    }
+
+    if (!readyState->is_ready)
+    {
+        if (now - last_ready_request_time < ready_retry_interval) {
+            return;
         }
-        if (_serialRef.available() > 2) {
-            readSerial();
+        if (now - link_open_time > ready_timeout) {
+            ROS_WARN_THROTTLE(5.0, "No ready signal from the serial device after %0.1fs. Still asking", (now - link_open_time).toSec());
         }
+        requestReady();
+        return;
     }
 
-    if (readyState->is_ready) {
-        setStartTime(readyState->time_ms);
-        ROS_INFO_STREAM("Serial device is ready. Robot name is " << readyState->robot_name);
+    if (_protocolTicket != TX_TICKET_INVALID && now - _protocolRequestTime > packet_ok_timeout)
+    {
+        if (_rxProtocol == PROTOCOL_V2) {
+            // the answer was lost but the device is already sending v2, so it switched
+            ROS_WARN("No answer to the protocol v%d request, but the device is sending v%d. Switching", PROTOCOL_V2, PROTOCOL_V2);
+            _txProtocol = PROTOCOL_V2;
+            _protocolTicket = TX_TICKET_INVALID;
+            _protocolAttempts = 0;
+            notifyWriter();
+            pushStartupConfig();
+        }
+        else {
+            // can't tell which protocol the device is on. Saying ready puts it back on v1
+            ROS_WARN("No answer to the protocol v%d request. Asking the device for ready again", PROTOCOL_V2);
+            linkDown();
+            link_open_time = now;
+            requestReady();
+        }
+        return;
     }
-    else {
-        ROS_ERROR("Failed to receive ready signal!");
+
+    // a reporting device sends something every few milliseconds
+    if (link_timeout > ros::Duration(0.0) && was_reporting && now - last_rx_time > link_timeout)
+    {
+        ROS_WARN("Nothing from the serial device for %0.1fs. Waiting for it to be ready again", (now - last_rx_time).toSec());
+        linkDown();
+        link_open_time = now;
+        requestReady();
     }
 }
 
-bool DodobotParsing::waitForPacketStart()
+void DodobotParsing::requestReady()
 {
-    stringstream msg_buffer;
-    char c1, c2;
-    ros::Time wait_time = ros::Time::now();
-    ros::Duration wait_timeout = ros::Duration(0.05);
-    while (true) {
-        if (ros::Time::now() - wait_time > wait_timeout) {
-            return false;
-        }
-        if (_serialRef.available() < 2) {
-            continue;
-        }
-        c1 = _serialRef.read(1).at(0);
-        if (c1 == PACKET_START_0) {
-            c2 = _serialRef.read(1).at(0);
-            if (c2 == PACKET_START_1) {
-                return true;
-            }
-        }
+    ROS_DEBUG("Checking if the serial device is ready.");
+    writeSerial("?", "s", "dodobot");
+    last_ready_request_time = ros::Time::now();
+}
 
-        else if (c1 == PACKET_STOP || c2 == PACKET_STOP) {
-            ROS_INFO_STREAM("Device message: " << msg_buffer.str());
-            msg_buffer.str(std::string());
-            return false;
+void DodobotParsing::closeSerial(string reason)
+{
+    ROS_ERROR_STREAM("Lost the serial device on " << _serialPort << ": " << reason << ". Reconnecting");
+    {
+        boost::lock_guard<boost::mutex> lock(serial_write_mutex);
+        serial_open = false;
+        try {
+            _serialRef.close();
         }
-        else {
-            msg_buffer << c1;
+        catch (exception& e) {
+            ROS_DEBUG_STREAM("Error closing " << _serialPort << ": " << e.what());
         }
     }
+    link_reconnects++;
+    last_open_attempt_time = ros::Time::now();
+    _protocolAttempts = 0;
+    linkDown();
 }
 
-uint16_t DodobotParsing::segment_as_uint16() {
-    uint16_union u16_union;
-    u16_union.byte[1] = _currentBufferSegment[0];
-    u16_union.byte[0] = _currentBufferSegment[1];
-    return u16_union.integer;
+void DodobotParsing::linkDown()
+{
+    // the device comes back on v1 and has to say ready before anything else is sent
+    readyState->is_ready = false;
+    robotState->motors_active = false;
+    _txProtocol = PROTOCOL_V1;
+    _rxProtocol = PROTOCOL_V1;
+    _protocolTicket = TX_TICKET_INVALID;
+    _readPacketNum = -1;
+    _rxFramer->reset();
+
+    // a motion command from before the drop shouldn't run once it's back
+    abandonConfigRequests();
+
+    state_msg.header.stamp = ros::Time::now();
+    state_msg.is_ready = false;
+    state_pub.publish(state_msg);
 }
 
-uint32_t DodobotParsing::segment_as_uint32() {
-    uint32_union u32_union;
-    for (unsigned short i = 0; i < 4; i++) {
-        u32_union.byte[3 - i] = _currentBufferSegment[i];
+void DodobotParsing::pushStartupConfig()
+{
+    if (_replay != NULL) {
+        return;
     }
-    return u32_union.integer;
-}
 
-int32_t DodobotParsing::segment_as_int32() {
-    int32_union i32_union;
-    for (unsigned short i = 0; i < 4; i++) {
-        i32_union.byte[3 - i] = _currentBufferSegment[i];
+    // One batch, all queued and sent together. Each packet is retried on its
+    // own until the device acks it. The PID gains and stepper settings are
+    // only sent once they've been set, so a reconnect restores them
+    std::vector<ConfigRequest> batch;
+    batch.push_back(makeConfigRequest("ros", boost::bind(&DodobotParsing::writeSetting, this, string("ros"), 1), packet_ok_timeout, config_request_attempts));
+    if (reporting_on_start) {
+        was_reporting = true;
+        batch.push_back(makeConfigRequest("[]", boost::bind(&DodobotParsing::writeSetting, this, string("[]"), 1), packet_ok_timeout, config_request_attempts));
+    }
+    if (active_on_start) {
+        batch.push_back(makeConfigRequest("<>", boost::bind(&DodobotParsing::writeSetting, this, string("<>"), 1), packet_ok_timeout, config_request_attempts));
+    }
+    {
+        boost::lock_guard<boost::mutex> lock(pid_constants_mutex);
+        if (pid_constants_set) {
+            batch.push_back(makeConfigRequest("ks", boost::bind(&DodobotParsing::writeKPacket, this, *pidConstants), packet_ok_timeout, config_request_attempts));
+        }
+    }
+    if (stepper_speed_setting > 0) {
+        batch.push_back(makeConfigRequest("lincfg speed", boost::bind(&DodobotParsing::writeLinearConfig, this, 0, stepper_speed_setting.load()), packet_ok_timeout, config_request_attempts));
+    }
+    if (stepper_accel_setting > 0) {
+        batch.push_back(makeConfigRequest("lincfg accel", boost::bind(&DodobotParsing::writeLinearConfig, this, 1, stepper_accel_setting.load()), packet_ok_timeout, config_request_attempts));
     }
-    return i32_union.integer;
+    queueConfigBatch(batch);
 }
 
-float DodobotParsing::segment_as_float() {
-    float_union f_union;
-    for (unsigned short i = 0; i < 4; i++) {
-        f_union.byte[i] = _currentBufferSegment[i];
+size_t DodobotParsing::pollSerial()
+{
+    if (_replay != NULL) {
+        return pollReplay();
     }
-    return f_union.floating_point;
-}
+    if (!serial_open) {
+        // paces run() the way a read timeout would until serviceLink reopens the port
+        ros::WallDuration(_rxTimeoutMs / 1000.0).sleep();
+        return 0;
+    }
+
+    size_t total = 0;
+    try
+    {
+        // blocks for at most the serial read timeout
+        if (!_serialRef.waitReadable()) {
+            return 0;
+        }
 
-string DodobotParsing::segment_as_string() {
-    return _currentBufferSegment;
+        size_t available = _serialRef.available();
+        while (available > 0) {
+            size_t span = 0;
+            uint8_t* dest = _rxFramer->reserve(&span);
+            if (span == 0) {
+                ROS_WARN("Serial receive buffer is full. %lu bytes left in the port", available);
+                break;
+            }
+            size_t num_read = _serialRef.read(dest, std::min(span, available));
+            _rxFramer->commit(num_read);
+            if (_capture != NULL && num_read > 0) {
+                _capture->append(ros::WallTime::now().toNSec(), SerialCaptureWriter::CAPTURE_RX, dest, num_read);
+            }
+            total += num_read;
+            if (num_read == 0) {
+                break;
+            }
+            available -= num_read;
+        }
+    }
+    catch (exception& e)
+    {
+        // unplugged or reset. serviceLink reopens it
+        closeSerial(e.what());
+    }
+    if (total > 0) {
+        last_rx_time = ros::Time::now();
+    }
+    return total;
 }
 
-bool DodobotParsing::readline()
+size_t DodobotParsing::pollReplay()
 {
-    char c;
-    _recvCharIndex = 0;
-    char len_bytes[2];
-    short len_bytes_found = 0;
-    uint16_t packet_len = 0;
-    size_t counter = 0;
-    while (true) {
-        if (!_serialRef.available()) {
-            continue;
+    // stands in for the serial port. Hands the framer one recorded RX chunk at a time
+    while (_replayRemaining == 0)
+    {
+        uint64_t stamp_ns;
+        SerialCaptureWriter::Direction direction;
+        if (!_replay->next(&stamp_ns, &direction, &_replayData, &_replayRemaining)) {
+            finishReplay();
+            return 0;
         }
-        c = _serialRef.read(1).at(0);
-        if (len_bytes_found < 2) {
-            len_bytes[len_bytes_found++] = c;
-            if (len_bytes_found == 2) {
-                uint16_union u16_union;
-                u16_union.byte[1] = len_bytes[0];
-                u16_union.byte[0] = len_bytes[1];
-                packet_len = u16_union.integer;
-            }
+        if (direction != SerialCaptureWriter::CAPTURE_RX) {
+            _replayRemaining = 0;
             continue;
         }
+        if (_replayFirstStamp == 0) {
+            _replayFirstStamp = stamp_ns;
+            _replayStartTime = ros::WallTime::now();
+            benchmark_start_time = _replayStartTime;
+        }
 
-        counter++;
-        if (counter > packet_len) {
-            if (c != PACKET_STOP) {
-                _recvCharBuffer[_recvCharIndex] = '\0';
-                ROS_ERROR("Packet didn't end with stop character: %c, %s", c, _recvCharBuffer);
-                return false;
+        if (replay_realtime) {
+            // wait no longer than a serial read would so ROS events still get handled
+            ros::WallTime due = _replayStartTime + ros::WallDuration((double)(stamp_ns - _replayFirstStamp) * 1e-9);
+            ros::WallDuration wait = due - ros::WallTime::now();
+            ros::WallDuration max_wait = ros::WallDuration(_rxTimeoutMs / 1000.0);
+            if (wait > max_wait) {
+                max_wait.sleep();
+                return 0;  // _replayRemaining is kept for the next poll
+            }
+            if (wait > ros::WallDuration(0.0)) {
+                wait.sleep();
             }
-            break;
         }
+    }
+
+    size_t num_written = _rxFramer->write(_replayData, _replayRemaining);
+    _replayData += num_written;
+    _replayRemaining -= num_written;
+    return num_written;
+}
 
-        _recvCharBuffer[_recvCharIndex] = c;
-        _recvCharIndex++;
+void DodobotParsing::finishReplay()
+{
+    ROS_INFO_STREAM("Finished replaying " << replay_path << ". Read packet num: " << _readPacketNum);
+    if (benchmark_mode) {
+        reportBenchmark();
     }
-    _recvCharBuffer[_recvCharIndex] = '\0';
-    _readPacketLen = _recvCharIndex;
-    // ROS_DEBUG_STREAM("_recvCharBuffer: " << formatPacketToPrint(_recvCharBuffer, _readPacketLen));
-    return true;
+    // only this bridge stops. A nodelet manager it shares keeps running
+    requestStop();
 }
 
-bool DodobotParsing::readSerial()
+void DodobotParsing::reportBenchmark()
 {
-    if (!waitForPacketStart()) {
-        return false;
+    double elapsed = (ros::WallTime::now() - benchmark_start_time).toSec();
+    uint64_t total_packets = 0;
+    for (size_t i = 0; i < benchmark_stats.size(); i++) {
+        total_packets += benchmark_stats[i].packets;
+    }
+    ROS_INFO("Benchmark: %lu packets in %0.3fs (%0.1f packets/s including framing and ROS overhead)",
+        total_packets, elapsed, elapsed > 0.0 ? total_packets / elapsed : 0.0);
+    ROS_INFO("%-12s %10s %14s %12s %12s", "category", "packets", "packets/s", "ns/packet", "max ns");
+    for (size_t i = 0; i < benchmark_stats.size(); i++)
+    {
+        BenchmarkStat* stat = &benchmark_stats[i];
+        if (stat->packets == 0) {
+            continue;
+        }
+        double ns_per_packet = (double)stat->total_ns / stat->packets;
+        ROS_INFO("%-12s %10lu %14.1f %12.1f %12lu", link_stats.rxCategoryName(i).c_str(),
+            stat->packets, ns_per_packet > 0.0 ? 1e9 / ns_per_packet : 0.0, ns_per_packet, stat->max_ns);
     }
+}
 
-    if (!readline()) {
-        ROS_ERROR("Failed to read packet");
+bool DodobotParsing::readline()
+{
+    // pull the next complete packet out of the receive buffer, if there is one
+    while (true)
+    {
+        switch (_rxFramer->nextFrame(_recvCharBuffer, &_readPacketLen))
+        {
+            case PacketFramer::FRAME_PACKET:
+                // ROS_DEBUG_STREAM("_recvCharBuffer: " << formatPacketToPrint(_recvCharBuffer, _readPacketLen));
+                return true;
+            case PacketFramer::FRAME_DEVICE_MESSAGE:
+                link_stats.rx_device_messages++;
+                ROS_INFO_STREAM("Device message: " << _rxFramer->getDeviceMessage());
+                break;
+            case PacketFramer::FRAME_ERROR_LENGTH:
+                link_stats.rx_framing_errors++;
+                ROS_ERROR("Packet length %lu exceeds the receive buffer", _readPacketLen);
+                break;
+            case PacketFramer::FRAME_ERROR_STOP:
+                link_stats.rx_framing_errors++;
+                ROS_ERROR("Packet didn't end with stop character: %s", formatPacketToPrint(_recvCharBuffer, _readPacketLen).c_str());
+                break;
+            default:
+                return false;
+        }
     }
+}
 
-    // at least 1 char for packet num
-    // \t + at least 1 category char
-    // 2 chars for checksum
-    if (_readPacketLen < 5) {
-        ROS_ERROR_STREAM("Received packet has an invalid number of characters! " << formatPacketToPrint(_recvCharBuffer, _readPacketLen));
-        _readPacketNum++;
+bool DodobotParsing::verifyPacket(int protocol, bool log_errors)
+{
+    if (_readPacketLen < PACKET_MIN_LEN) {
+        if (log_errors) {
+            link_stats.rx_framing_errors++;
+            ROS_ERROR_STREAM("Received packet is too short! " << formatPacketToPrint(_recvCharBuffer, _readPacketLen));
+        }
         return false;
     }
 
-    _serialBufferIndex = 0;
-    uint8_t calc_checksum = 0;
-    // compute checksum using all characters except the checksum itself
-    for (size_t index = 0; index < _readPacketLen - 2; index++) {
-        calc_checksum += (uint8_t)_recvCharBuffer[index];
+    uint16_t recv_checksum, calc_checksum;
+    if (!packetChecksumOk(protocol, _recvCharBuffer, _readPacketLen, &recv_checksum, &calc_checksum)) {
+        if (log_errors) {
+            link_stats.rx_checksum_errors++;
+            if (protocol == PROTOCOL_V2) {
+                ROS_ERROR("CRC failed! recv %04x != calc %04x", recv_checksum, calc_checksum);
+            }
+            else {
+                ROS_ERROR("Checksum failed! recv %02x != calc %02x", recv_checksum, calc_checksum);
+            }
+            ROS_ERROR_STREAM("Buffer: " << formatPacketToPrint(_recvCharBuffer, _readPacketLen));
+        }
+        return false;
     }
+    return true;
+}
 
-    char recv_checksum_array[3];  // extra character for null
-    recv_checksum_array[0] = _recvCharBuffer[_readPacketLen - 2];
-    recv_checksum_array[1] = _recvCharBuffer[_readPacketLen - 1];
-    // memcpy(recv_checksum_array, _recvCharBuffer + _readPacketLen - 2, 2);
-    recv_checksum_array[2] = '\0';
-    uint8_t recv_checksum = strtol(recv_checksum_array, NULL, 16);
-
-    if (calc_checksum != recv_checksum) {
-        // checksum failed
-        ROS_ERROR("Checksum failed! recv %02x != calc %02x", recv_checksum, calc_checksum);
+void DodobotParsing::checkPacketNum(uint32_t recv_packet_num, uint32_t mask)
+{
+    // v2 only carries the low 16 bits of the packet number
+    if (_readPacketNum == -1) {
+        _readPacketNum = recv_packet_num;
+    }
+    else if (recv_packet_num != (_readPacketNum & mask)) {
+        link_stats.rx_packet_num_errors++;
+        ROS_ERROR("Received packet num doesn't match local count. recv %u != local %u", recv_packet_num, _readPacketNum & mask);
         ROS_ERROR_STREAM("Buffer: " << formatPacketToPrint(_recvCharBuffer, _readPacketLen));
-        _readPacketNum++;
-        return false;
+        _readPacketNum = (_readPacketNum & ~mask) | recv_packet_num;
     }
+}
+
+bool DodobotParsing::readSerial()
+{
+    // _recvCharBuffer holds a complete packet body (see readline)
+
+    // The device drops back to v1 whenever it sends a ready packet and a
+    // replayed capture may start in either protocol, so a packet that fails
+    // its integrity check is tried against the other protocol before giving up
+    int protocol = _rxProtocol;
+    if (!verifyPacket(protocol, false)) {
+        int other = protocol == PROTOCOL_V2 ? PROTOCOL_V1 : PROTOCOL_V2;
+        if (other > protocol_version || !verifyPacket(other, false)) {
+            verifyPacket(protocol, true);  // count and log the original failure
+            _readPacketNum++;
+            return false;
+        }
+        ROS_WARN("Device is sending protocol v%d packets", other);
+        _rxProtocol = other;
+        protocol = other;
+    }
+
+    if (protocol == PROTOCOL_V2) {
+        return readSerialV2();
+    }
+    return readSerialV1();
+}
+
+bool DodobotParsing::readSerialV1()
+{
+    // everything but the checksum is decoded in place
+    _rxCursor.reset(_recvCharBuffer, _readPacketLen - 2);
 
     // get packet num segment
-    if (!getNextSegment(4)) {
+    if (!_rxCursor.expect("u")) {
+        link_stats.rx_framing_errors++;
         ROS_ERROR_STREAM("Failed to find packet number segment! " << formatPacketToPrint(_recvCharBuffer, _readPacketLen));
         _readPacketNum++;
         return false;
     }
-    uint32_t recv_packet_num = segment_as_uint32();
-    if (_readPacketNum == -1) {
-        _readPacketNum = recv_packet_num;
-    }
-    else if (recv_packet_num != _readPacketNum) {
-        ROS_ERROR("Received packet num doesn't match local count. recv %d != local %d", recv_packet_num, _readPacketNum);
-        ROS_ERROR_STREAM("Buffer: " << formatPacketToPrint(_recvCharBuffer, _readPacketLen));
-        _readPacketNum = recv_packet_num;
-    }
+    checkPacketNum(_rxCursor.read<uint32_t>(), 0xffffffff);
 
     // find category segment
-    if (!getNextSegment()) {
+    boost::string_ref category = _rxCursor.read_until('\t');
+    if (category.empty()) {
+        link_stats.rx_framing_errors++;
         ROS_ERROR_STREAM("Failed to find category segment! Buffer: " << formatPacketToPrint(_recvCharBuffer, _readPacketLen));
         _readPacketNum++;
         return false;
     }
 
-    string category = string(_currentBufferSegment);
     // ROS_INFO_STREAM("category: " << category << ", Buffer: " << formatPacketToPrint(_recvCharBuffer, _readPacketLen));
 
+    const PacketRoute* route = packet_handlers.find(category.data(), category.size());
+    if (route == NULL) {
+        ROS_DEBUG("No handler for packet category '%.*s'", (int)category.size(), category.data());
+    }
+    return dispatchPacket(route);
+}
+
+bool DodobotParsing::readSerialV2()
+{
+    // <id> <packet num: 2 bytes> <packed fields> <CRC16>
+    uint8_t id = (uint8_t)_recvCharBuffer[0];
+    uint32_t recv_packet_num = ((uint32_t)(uint8_t)_recvCharBuffer[1] << 8) | (uint8_t)_recvCharBuffer[2];
+    checkPacketNum(recv_packet_num, 0xffff);
+
+    _rxCursor.reset(_recvCharBuffer + 3, _readPacketLen - 5, PacketCursor::FIELDS_PACKED);
+
+    const PacketRoute* route = &_routesById[id];
+    if (route->handler == NULL) {
+        ROS_DEBUG("No handler for packet id 0x%02x", id);
+        route = NULL;
+    }
+    return dispatchPacket(route);
+}
+
+bool DodobotParsing::dispatchPacket(const PacketRoute* route)
+{
     try {
-        processSerialPacket(category);
+        processSerialPacket(route);
     }
     catch (exception& e) {
         ROS_ERROR_STREAM("Exception in processSerialPacket: " << e.what());
@@ -392,345 +778,897 @@ bool DodobotParsing::readSerial()
     return true;
 }
 
-bool DodobotParsing::getNextSegment(int length)
+void DodobotParsing::addPacketHandler(const char* category, PacketHandler handler)
 {
-    if (_serialBufferIndex >= _readPacketLen) {
-        _currentSegmentNum = -1;
-        return false;
+    const PacketSchema* schema = findPacketSchema(DEVICE_PACKET_SCHEMAS, NUM_DEVICE_PACKET_SCHEMAS, category);
+    if (schema == NULL) {
+        ROS_ERROR("Packet category '%s' isn't in the packet schema table", category);
+        return;
     }
-    uint16_union u16_union;
-    if (length < 0) {
-        // assume first 2 bytes contain the length
-        u16_union.byte[1] = _recvCharBuffer[_serialBufferIndex++];
-        u16_union.byte[0] = _recvCharBuffer[_serialBufferIndex++];
-        length = (int)u16_union.integer;
-    }
-    memcpy(_currentBufferSegment, _recvCharBuffer + _serialBufferIndex, length);
-    _currentBufferSegment[length] = '\0';
-    _serialBufferIndex += length;
-    return true;
+    PacketRoute route;
+    route.handler = handler;
+    route.schema = schema;
+    route.stats_index = link_stats.addRxCategory(category);
+    if (!packet_handlers.add(category, route)) {
+        ROS_ERROR("Failed to register packet handler for '%s'", category);
+        return;
+    }
+    _routesById[schema->id] = route;
 }
 
-bool DodobotParsing::getNextSegment()
+void DodobotParsing::processSerialPacket(const PacketRoute* route)
 {
-    if (_serialBufferIndex >= _readPacketLen) {
-        _currentSegmentNum = -1;
-        return false;
-    }
-    int separator = -1;
-    for (size_t i = _serialBufferIndex; i < _readPacketLen; i++) {
-        if (_recvCharBuffer[i] == '\t') {
-            separator = i;
-            break;
-        }
-    }
-    _currentSegmentNum++;
-    if (separator < 0) {
-        int length = _readPacketLen - _serialBufferIndex;
-        memcpy(_currentBufferSegment, _recvCharBuffer + _serialBufferIndex, length);
-        _currentBufferSegment[length] = '\0';
-        _serialBufferIndex = length;
-        return true;
+    if (route == NULL) {
+        link_stats.countUnknownRx(_readPacketLen);
+        _rxStatsIndex = LINK_STATS_MAX_CATEGORIES;
+        return;
     }
-    else {
-        int length = separator - _serialBufferIndex;
-        memcpy(_currentBufferSegment, _recvCharBuffer + _serialBufferIndex, length);
-        _currentBufferSegment[length] = '\0';
-        _serialBufferIndex = separator + 1;
-        return true;
+    if (!_rxCursor.expect(route->schema->schema)) {
+        link_stats.rx_schema_errors++;
+        ROS_ERROR_STREAM("'" << route->schema->category << "' packet doesn't match schema '" << route->schema->schema << "'. Buffer: " << formatPacketToPrint(_recvCharBuffer, _readPacketLen));
+        return;
     }
+    link_stats.countRx(route->stats_index, _readPacketLen);
+    _rxStatsIndex = route->stats_index;
+    (this->*(route->handler))();
 }
 
-int DodobotParsing::getSegmentNum() {
-    return _currentSegmentNum;
-}
-
-void DodobotParsing::processSerialPacket(string category)
+void DodobotParsing::parseTxRx()
 {
-    if (category.compare("txrx") == 0) {
-        CHECK_SEGMENT(4); uint32_t packet_num = segment_as_uint32();
-        CHECK_SEGMENT(4); int error_code = segment_as_uint32();
-
-        if (wait_for_ok_reqs.find(packet_num) != wait_for_ok_reqs.end()) {
-            wait_for_ok_reqs[packet_num] = error_code;
-            ROS_INFO("txrx ok_req %u: %d", packet_num, error_code);
-        }
-
-        if (error_code != 0) {
-            if (getNextSegment(4)) {
-                logPacketErrorCode(error_code, packet_num, _currentBufferSegment);
+    uint32_t packet_num, error;
+    _rxCursor.read_fields<DevicePacket_TXRX>(packet_num, error);
+    int error_code = (int)error;
+
+    uint32_t ticket = lookupTicket(packet_num);
+    if (ticket != TX_TICKET_INVALID) {
+        link_stats.recordLatency(ros::WallTime::now().toSec() - _sentTimes[packet_num & (TX_TICKET_HISTORY - 1)]);
+        _okResults[ticket & (TX_TICKET_HISTORY - 1)] = ((uint64_t)ticket << 32) | (uint32_t)error_code;
+        notifyResponse();
+
+        if (ticket == _protocolTicket) {
+            // set the protocol before releasing the write thread, which stamps held packets in it
+            if (isOKCode(error_code)) {
+                _txProtocol = PROTOCOL_V2;
+                ROS_INFO("Device accepted protocol v%d", PROTOCOL_V2);
             }
             else {
-                logPacketErrorCode(error_code, packet_num);
+                ROS_WARN("Device rejected protocol v%d (error %d). Staying on v%d", PROTOCOL_V2, error_code, PROTOCOL_V1);
             }
+            _protocolTicket = TX_TICKET_INVALID;
+            _protocolAttempts = 0;
+            notifyWriter();
+            pushStartupConfig();
         }
     }
-    else if (category.compare("state") == 0) {
-        parseState();
-    }
-    else if (category.compare("enc") == 0) {
-        parseDrive();
-    }
-    else if (category.compare("bump") == 0) {
-        parseBumper();
-    }
-    else if (category.compare("fsr") == 0) {
-        parseFSR();
-    }
-    else if (category.compare("grip") == 0) {
-        parseGripper();
-    }
-    // else if (category.compare("ir") == 0) {
-    //     parseIR();
-    // }
-    else if (category.compare("linear") == 0) {
-        parseLinear();
-    }
-    else if (category.compare("le") == 0) {
-        parseLinearEvent();
-    }
-    else if (category.compare("batt") == 0) {
-        parseBattery();
-    }
-    else if (category.compare("tilt") == 0) {
-        parseTilter();
-    }
-    else if (category.compare("pidks") == 0) {
-        CHECK_SEGMENT(4); bool success = (bool)segment_as_uint32();
-        if (!success) {
-            ROS_WARN("Failed to set PID constants. Waiting 1.0s and writing again");
-            resendPidKsTimed();
+
+    if (error_code != 0) {
+        if (_rxCursor.remaining() >= 4) {
+            logPacketErrorCode(error_code, packet_num, _rxCursor.read_raw(4).to_string());
         }
         else {
-            ROS_INFO("PID constants set successfully!");
+            logPacketErrorCode(error_code, packet_num);
         }
     }
-    else if (category.compare("ready") == 0) {
-        parseReady();
-    }
-    else if (category.compare("listdir") == 0) {
-        CHECK_SEGMENT(-1);  string filename = segment_as_string();
-        CHECK_SEGMENT(4);  int32_t size = segment_as_int32();
-        ROS_INFO_STREAM("filename: " << filename << ", size: " << size);
+}
+
+void DodobotParsing::parsePidKs()
+{
+    uint32_t success;
+    _rxCursor.read_fields<DevicePacket_PIDKS>(success);
+    if (!success) {
+        ROS_WARN("Failed to set PID constants. Waiting 1.0s and writing again");
+        resendPidKsTimed();
     }
-    else if (category.compare("recvimage") == 0) {
-        CHECK_SEGMENT(4); ready_for_images = (bool)segment_as_int32();
-        ROS_INFO_STREAM("Receive images: " << ready_for_images);
+    else {
+        ROS_INFO("PID constants set successfully!");
     }
-    else if (category.compare("robotfn") == 0) {
-        parseSelectedRobotFn();
+}
+
+void DodobotParsing::parseListDir()
+{
+    boost::string_ref filename;
+    int32_t size;
+    _rxCursor.read_fields<DevicePacket_LISTDIR>(filename, size);
+    ROS_INFO_STREAM("filename: " << filename << ", size: " << size);
+}
+
+void DodobotParsing::parseFileChecksum()
+{
+    boost::string_ref path;
+    int32_t size;
+    uint32_t crc;
+    _rxCursor.read_fields<DevicePacket_FILECRC>(path, size, crc);
+    {
+        boost::lock_guard<boost::mutex> lock(file_checksum_mutex);
+        file_checksum_path = path.to_string();
+        file_checksum_size = size;
+        file_checksum_crc = crc;
+        file_checksum_received = true;
     }
+    notifyResponse();
 }
 
-void DodobotParsing::writeSerialLarge(string name, vector<unsigned char>* data)
+void DodobotParsing::parseRecvImage()
 {
-    vector<unsigned char> segment_buf;
-    size_t data_len = data->size();
+    int32_t ready;
+    _rxCursor.read_fields<DevicePacket_RECVIMAGE>(ready);
+    ready_for_images = (bool)ready;
+    ROS_INFO_STREAM("Receive images: " << ready_for_images);
+}
 
-    uint16_union u16_union;
-    size_t num_segments = 0;
-    for (size_t segment_index = 0; segment_index < data_len; segment_index += large_packet_len) {
-        num_segments++;
+bool DodobotParsing::writeSerialLarge(string name, vector<unsigned char>* data)
+{
+    return writeSerialLarge(name, data->data(), data->size());
+}
+
+bool DodobotParsing::writeSerialLarge(string name, const unsigned char* data, size_t data_len,
+    size_t start_segment, size_t* acked_prefix, db_parsing::DodobotUploadProgress* progress)
+{
+    // keeps as many segments in flight as the device can buffer, up to
+    // large_packet_window. Segments that get an error response or time out
+    // are sent again before any new ones
+    struct SegmentState {
+        uint32_t ticket;
+        ros::Time sent_time;
+        int attempts;
+        bool done;
+    };
+
+    size_t num_segments = (data_len + large_packet_len - 1) / large_packet_len;
+    size_t window = std::min((size_t)std::max(large_packet_window, 1), (size_t)readyState->rx_segments);
+
+    vector<SegmentState> segments(num_segments);
+    for (size_t index = 0; index < num_segments; index++) {
+        segments[index].ticket = TX_TICKET_INVALID;
+        segments[index].attempts = 0;
+        segments[index].done = false;
     }
 
-    size_t count = 0;
-    for (size_t segment_index = 0; segment_index < data_len; segment_index += large_packet_len)
+    // segments before start_segment are already on the device
+    start_segment = std::min(start_segment, num_segments);
+    for (size_t index = 0; index < start_segment; index++) {
+        segments[index].done = true;
+    }
+    size_t first_unacked = start_segment;
+    if (acked_prefix != NULL) {
+        *acked_prefix = first_unacked;
+    }
+
+    deque<size_t> to_send;
+    for (size_t index = start_segment; index < num_segments; index++) {
+        to_send.push_back(index);
+    }
+    vector<size_t> in_flight;
+    size_t num_done = start_segment;
+
+    while (num_done < num_segments)
     {
-        uint16_t offset = std::min(large_packet_len, data_len - segment_index);
-        ROS_INFO_STREAM("offset: " << offset);
-        u16_union.integer = offset;
-        segment_buf.assign(data->begin() + segment_index, data->begin() + segment_index + offset);
-        segment_buf.insert(segment_buf.begin(), u16_union.byte[0]);
-        segment_buf.insert(segment_buf.begin(), u16_union.byte[1]);
-        auto *bytes = reinterpret_cast<char*>(segment_buf.data());
-
-        writeSerial(name, "ddx", count, num_segments, bytes);
-        count++;
-        if (!waitForOK()) {
-            ROS_WARN("Failed to receive ok signal on segment %lu of %lu. %s", count, num_segments, name.c_str());
-            return;
+        if (!ros::ok()) {
+            return false;
+        }
+
+        while (in_flight.size() < window && !to_send.empty())
+        {
+            size_t index = to_send.front();
+            to_send.pop_front();
+            SegmentState* segment = &segments[index];
+            if (segment->attempts >= large_packet_attempts) {
+                ROS_WARN("Failed to receive ok signal on segment %lu of %lu. %s", index + 1, num_segments, name.c_str());
+                // segments can't be taken back out of the bulk ring. Let them go
+                // out now so they don't land after whatever the caller sends next
+                vector<uint32_t> queued;
+                for (size_t i = 0; i < in_flight.size(); i++) {
+                    queued.push_back(segments[in_flight[i]].ticket);
+                }
+                waitForWritten(queued, packet_ok_timeout);
+                return false;
+            }
+
+            size_t segment_index = index * large_packet_len;
+            uint16_t offset = std::min(large_packet_len, data_len - segment_index);
+            ROS_DEBUG_STREAM("offset: " << offset);
+            const char* bytes = reinterpret_cast<const char*>(data + segment_index);
+
+            segment->ticket = writeSerialClass(TX_BULK, name, "ddb", index, num_segments, bytes, (int)offset);
+            segment->sent_time = ros::Time::now();
+            segment->attempts++;
+            in_flight.push_back(index);
+        }
+
+        uint32_t generation = ok_generation;
+        bool progress_made = false;
+        ros::Time now = ros::Time::now();
+        for (size_t i = 0; i < in_flight.size(); )
+        {
+            size_t index = in_flight[i];
+            SegmentState* segment = &segments[index];
+            int error_code;
+            bool resend = false;
+            if (pollOK(segment->ticket, &error_code)) {
+                if (isOKCode(error_code)) {
+                    segment->done = true;
+                    num_done++;
+                }
+                else {
+                    ROS_WARN("Segment %lu of %lu got error %d. Resending. %s", index + 1, num_segments, error_code, name.c_str());
+                    resend = true;
+                }
+            }
+            else if (segment->ticket != TX_TICKET_INVALID && !ticketWritten(segment->ticket)) {
+                // still queued behind other traffic. Time it from when it goes out
+                // so a resend doesn't duplicate a segment that's still in the ring
+                segment->sent_time = now;
+                i++;
+                continue;
+            }
+            else if (segment->ticket == TX_TICKET_INVALID || now - segment->sent_time > packet_ok_timeout) {
+                ROS_WARN("Timed out waiting for segment %lu of %lu. Resending. %s", index + 1, num_segments, name.c_str());
+                resend = true;
+            }
+            else {
+                i++;
+                continue;
+            }
+            if (resend) {
+                to_send.push_front(index);
+            }
+            in_flight.erase(in_flight.begin() + i);
+            progress_made = true;
+        }
+
+        if (progress_made) {
+            while (first_unacked < num_segments && segments[first_unacked].done) {
+                first_unacked++;
+            }
+            if (acked_prefix != NULL) {
+                *acked_prefix = first_unacked;
+            }
+            if (progress != NULL) {
+                progress->segments_acked = num_done;
+                progress->num_segments = num_segments;
+                progress->bytes_acked = std::min(num_done * large_packet_len, data_len);
+                progress->total_bytes = data_len;
+                upload_progress_pub.publish(*progress);
+            }
+        }
+        else if (!in_flight.empty()) {
+            waitForResponse(packet_ok_timeout, generation);
         }
-        ros::Duration(0.05).sleep();
     }
+    return true;
 }
 
 
-void DodobotParsing::writeSerial(string name, const char *formats, ...)
+uint32_t DodobotParsing::writeSerial(string name, const char *formats, ...)
 {
     va_list args;
     va_start(args, formats);
-    // stringstream sstream;
-    // sstream << PACKET_START_0 << PACKET_START_1 << _writePacketNum << "\t" << name;
+    uint32_t ticket = queuePacket(TX_REALTIME, name, formats, args);
+    va_end(args);
+    return ticket;
+}
 
-    _writeCharBuffer[0] = PACKET_START_0;
-    _writeCharBuffer[1] = PACKET_START_1;
-    _writeCharIndex = 4;  // bytes 2 and 3 are for packet length
+uint32_t DodobotParsing::writeSerialClass(TxClass tx_class, string name, const char *formats, ...)
+{
+    va_list args;
+    va_start(args, formats);
+    uint32_t ticket = queuePacket(tx_class, name, formats, args);
+    va_end(args);
+    return ticket;
+}
+
+uint32_t DodobotParsing::queuePacket(TxClass tx_class, string name, const char *formats, va_list args)
+{
+    size_t max_length;
+    switch (tx_class) {
+        case TX_REALTIME: max_length = _txRing->slotSize(); break;
+        case TX_BULK: max_length = _txBulkRing->slotSize(); break;
+        default: max_length = SERIAL_TX_MAILBOX_SIZE; break;
+    }
+
+    const PacketSchema* const* schema = host_packet_schemas.find(name.c_str(), name.length());
+    if (schema == NULL || !formatsMatchSchema(formats, (*schema)->schema)) {
+        ROS_ERROR("Packet %s with formats '%s' doesn't match the packet schema table", name.c_str(), formats);
+        tx_dropped[tx_class]++;
+        return TX_TICKET_INVALID;
+    }
+    int protocol = _txProtocol;
+
+    // format into a local buffer so any thread can call this. The packet
+    // number and checksum are filled in by the write thread
+    char packet[SERIAL_TX_BULK_SLOT_SIZE];
+    size_t index = 0;
+    const size_t max_index = max_length - 3;  // leave room for the checksum and stop character
+
+    packet[index++] = PACKET_START_0;
+    packet[index++] = PACKET_START_1;
+    index += 2;  // bytes 2 and 3 are for packet length
 
     int32_union i32_union;
     uint32_union u32_union;
     uint16_union u16_union;
     float_union f_union;
 
-    u32_union.integer = _writePacketNum;
-    for (unsigned short i = 0; i < 4; i++) {
-        _writeCharBuffer[_writeCharIndex++] = u32_union.byte[3 - i];
+    if (protocol == PROTOCOL_V2) {
+        packet[index++] = (char)(*schema)->id;
+        index += 2;  // bytes 5 and 6 are for the packet number
+    }
+    else {
+        index += 4;  // bytes 4 to 7 are for the packet number
+        if (index + name.length() + 1 > max_index) {
+            ROS_ERROR("Packet name is too long: %s", name.c_str());
+            tx_dropped[tx_class]++;
+            return TX_TICKET_INVALID;
+        }
+        memcpy(packet + index, name.c_str(), name.length());
+        index += name.length();
+        packet[index++] = '\t';
     }
-    sprintf(_writeCharBuffer + _writeCharIndex, "%s", name.c_str());
-    _writeCharIndex += name.length();
-    _writeCharBuffer[_writeCharIndex++] = '\t';
 
     while (*formats != '\0') {
-        if (*formats == 'd') {
+        if (*formats == 'd' || *formats == 'u' || *formats == 'f') {
+            if (index + 5 > max_index) {  // 5 fits the longest varint
+                break;
+            }
+        }
+        if (protocol == PROTOCOL_V2 && *formats != 'f') {
+            // packed fields. Integers are varints, blobs have a varint length
+            if (*formats == 'd') {
+                int32_t value = va_arg(args, int32_t);
+                index += writeVarint(packet + index, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));  // zigzag
+            }
+            else if (*formats == 'u') {
+                index += writeVarint(packet + index, va_arg(args, uint32_t));
+            }
+            else {
+                // 's', 'x' or 'b'. Anything else was rejected by the schema check
+                const char *s = va_arg(args, const char*);
+                size_t length;
+                if (*formats == 's') {
+                    length = strlen(s);
+                }
+                else if (*formats == 'x') {
+                    length = ((size_t)(uint8_t)s[0] << 8) | (uint8_t)s[1];
+                    s += 2;
+                }
+                else {
+                    length = (size_t)va_arg(args, int);
+                }
+                if (index + 5 + length > max_index) {
+                    break;
+                }
+                index += writeVarint(packet + index, (uint32_t)length);
+                memcpy(packet + index, s, length);
+                index += length;
+            }
+        }
+        else if (*formats == 'd') {
             i32_union.integer = va_arg(args, int32_t);
             for (unsigned short i = 0; i < 4; i++) {
-                _writeCharBuffer[_writeCharIndex++] = i32_union.byte[3 - i];
+                packet[index++] = i32_union.byte[3 - i];
             }
         }
         else if (*formats == 'u') {
             u32_union.integer = va_arg(args, uint32_t);
             for (unsigned short i = 0; i < 4; i++) {
-                _writeCharBuffer[_writeCharIndex++] = u32_union.byte[3 - i];
+                packet[index++] = u32_union.byte[3 - i];
             }
         }
         else if (*formats == 's') {
             char *s = va_arg(args, char*);
-            u16_union.integer = (uint16_t)strlen(s);
-            _writeCharBuffer[_writeCharIndex++] = u16_union.byte[1];
-            _writeCharBuffer[_writeCharIndex++] = u16_union.byte[0];
-            sprintf(_writeCharBuffer + _writeCharIndex, "%s", s);
-            _writeCharIndex += strlen(s);
+            size_t length = strlen(s);
+            if (index + 2 + length > max_index) {
+                break;
+            }
+            u16_union.integer = (uint16_t)length;
+            packet[index++] = u16_union.byte[1];
+            packet[index++] = u16_union.byte[0];
+            memcpy(packet + index, s, length);
+            index += length;
+        }
+        else if (*formats == 'x') {
+            char *s = va_arg(args, char*);
+            u16_union.byte[1] = s[0];
+            u16_union.byte[0] = s[1];
+            size_t length = 2 + u16_union.integer;
+            if (index + length > max_index) {
+                break;
+            }
+            memcpy(packet + index, s, length);
+            index += length;
+        }
+        else if (*formats == 'b') {
+            // same as x but the length is passed as the next argument instead of a prefix
+            const char *s = va_arg(args, const char*);
+            size_t length = (size_t)va_arg(args, int);
+            if (index + 2 + length > max_index) {
+                break;
+            }
+            u16_union.integer = (uint16_t)length;
+            packet[index++] = u16_union.byte[1];
+            packet[index++] = u16_union.byte[0];
+            memcpy(packet + index, s, length);
+            index += length;
+        }
+        else if (*formats == 'f') {
+            f_union.floating_point = (float)va_arg(args, double);
+            for (unsigned short i = 0; i < 4; i++) {
+                packet[index++] = f_union.byte[i];
+            }
+        }
+        else {
+            ROS_ERROR("Invalid format %c", *formats);
+        }
+        ++formats;
+    }
+
+    if (*formats != '\0') {
+        ROS_ERROR("Packet %s doesn't fit in a TX slot (%lu bytes). Dropping it", name.c_str(), max_length);
+        tx_dropped[tx_class]++;
+        return TX_TICKET_INVALID;
+    }
+
+    size_t packet_len = index + 3;
+    u16_union.integer = packet_len - 5;  // subtract start, length, and stop bytes
+    packet[2] = u16_union.byte[1];
+    packet[3] = u16_union.byte[0];
+    packet[index + 2] = PACKET_STOP;
+
+    uint32_t ticket = _txTicket++;
+    if (ticket == TX_TICKET_INVALID) {
+        ticket = _txTicket++;
+    }
+    _ticketQueuedTimes[ticket & (TX_TICKET_HISTORY - 1)] = ros::WallTime::now().toSec();
+    _ticketProtocols[ticket & (TX_TICKET_HISTORY - 1)] = (uint8_t)protocol;
+
+    if (tx_class >= TX_FIRST_MAILBOX) {
+        // latest value wins. Replace whatever hasn't gone out yet
+        TxMailbox* mailbox = &_txMailboxes[tx_class - TX_FIRST_MAILBOX];
+        {
+            boost::lock_guard<boost::mutex> lock(mailbox->mutex);
+            if (mailbox->pending) {
+                tx_replaced[tx_class]++;
+            }
+            memcpy(mailbox->packet, packet, packet_len);
+            mailbox->length = packet_len;
+            mailbox->ticket = ticket;
+            mailbox->pending = true;
+        }
+        notifyWriter();
+        return ticket;
+    }
+
+    // claim a slot. If the writer is behind, give it a little time to catch up
+    PacketTxRing* ring = tx_class == TX_BULK ? _txBulkRing : _txRing;
+    size_t position = 0;
+    char* slot = ring->claim(&position);
+    if (slot == NULL) {
+        ros::Time full_timer = ros::Time::now();
+        notifyWriter();
+        while (slot == NULL && ros::Time::now() - full_timer < tx_full_timeout) {
+            boost::this_thread::yield();
+            slot = ring->claim(&position);
+        }
+        if (slot == NULL) {
+            ROS_ERROR_THROTTLE(1.0, "TX queue is full (%lu packets). Dropping %s", ring->depth(), name.c_str());
+            tx_dropped[tx_class]++;
+            return TX_TICKET_INVALID;
+        }
+    }
+
+    memcpy(slot, packet, packet_len);
+    ring->publish(position, packet_len, ticket);
+    notifyWriter();
+
+    return ticket;
+}
+
+bool DodobotParsing::pollOK(uint32_t ticket, int* error_code)
+{
+    uint64_t result = _okResults[ticket & (TX_TICKET_HISTORY - 1)];
+    if (ticket == TX_TICKET_INVALID || (uint32_t)(result >> 32) != ticket) {
+        return false;
+    }
+    *error_code = (int)(uint32_t)result;
+    return true;
+}
+
+bool DodobotParsing::ticketWritten(uint32_t ticket)
+{
+    // a newer ticket in the slot means this one went out long ago
+    uint32_t entry = _writtenTickets[ticket & (TX_TICKET_HISTORY - 1)];
+    return ticket != TX_TICKET_INVALID && (int32_t)(entry - ticket) >= 0;
+}
+
+void DodobotParsing::waitForWritten(const vector<uint32_t>& tickets, ros::Duration timeout)
+{
+    ros::Time start_timer = ros::Time::now();
+    for (size_t i = 0; i < tickets.size(); i++)
+    {
+        while (tickets[i] != TX_TICKET_INVALID && !ticketWritten(tickets[i]))
+        {
+            if (!ros::ok() || ros::Time::now() - start_timer > timeout) {
+                ROS_WARN("Timed out waiting for %lu queued packets to be written", tickets.size() - i);
+                return;
+            }
+            notifyWriter();
+            ros::WallDuration(0.001).sleep();
+        }
+    }
+}
+
+void DodobotParsing::notifyResponse()
+{
+    ok_generation++;
+    if (ok_waiters > 0) {
+        boost::lock_guard<boost::mutex> lock(ok_mutex);
+        ok_cond.notify_all();
+    }
+}
+
+void DodobotParsing::waitForResponse(ros::Duration timeout, uint32_t generation)
+{
+    if (boost::this_thread::get_id() == _rxThreadId) {
+        // nobody else is reading the serial port. Parse what's arrived
+        loop();
+        return;
+    }
+    boost::unique_lock<boost::mutex> lock(ok_mutex);
+    ok_waiters++;
+    if (ok_generation == generation) {
+        ok_cond.timed_wait(lock, boost::posix_time::microseconds((int64_t)(timeout.toSec() * 1e6)));
+    }
+    ok_waiters--;
+}
+
+bool DodobotParsing::waitForOK(uint32_t ticket, ros::Duration ok_timeout)
+{
+    if (ticket == TX_TICKET_INVALID) {
+        return false;
+    }
+    if (ok_timeout == ros::Duration(0.0)) {
+        ok_timeout = packet_ok_timeout;
+    }
+    ros::Time start_timer = ros::Time::now();
+    while (true)
+    {
+        uint32_t generation = ok_generation;
+        int error_code;
+        if (pollOK(ticket, &error_code)) {
+            ROS_INFO("Received response for ticket #%u: %d", ticket, error_code);
+            return isOKCode(error_code);
+        }
+        if (!ros::ok()) {
+            return false;
+        }
+        ros::Duration elapsed = ros::Time::now() - start_timer;
+        if (elapsed > ok_timeout) {
+            ROS_WARN_STREAM("Timed out while waiting for response from ticket #" << ticket);
+            return false;
+        }
+        waitForResponse(ok_timeout - elapsed, generation);
+    }
+}
+
+
+void DodobotParsing::setup()
+{
+    if (_replay != NULL) {
+        ROS_INFO("Replaying a capture. Not opening the serial port");
+        return;
+    }
+
+    // opens the port and asks if the device is ready. The answer comes in
+    // through parseReady while run() is already servicing callbacks
+    serviceLink();
+
+    // Send starter image
+    // ros::Duration(0.25).sleep();
+    // cv::Mat starter_image;
+    // starter_image = cv::imread(starter_image_path, cv::IMREAD_COLOR);
+    // writeImage(starter_image);
+}
+
+void DodobotParsing::notifyWriter()
+{
+    // only take the lock if the writer is actually asleep
+    if (write_waiting) {
+        boost::lock_guard<boost::mutex> lock(write_mutex);
+        write_cond.notify_one();
+    }
+}
+
+uint32_t DodobotParsing::lookupTicket(uint32_t packet_num)
+{
+    // v2 acks only carry the low 16 bits of the packet number
+    uint32_t mask = _rxProtocol == PROTOCOL_V2 ? 0xffff : 0xffffffff;
+    uint64_t entry = _sentTickets[packet_num & (TX_TICKET_HISTORY - 1)];
+    if (((uint32_t)(entry >> 32) & mask) != (packet_num & mask)) {
+        return TX_TICKET_INVALID;  // never sent or too old
+    }
+    return (uint32_t)entry;
+}
+
+size_t DodobotParsing::transcodePacket(char* dest, size_t max_length, const char* packet, size_t length, int protocol)
+{
+    // re-encodes a packet queued in the other protocol. Returns its new
+    // length, or 0 if it can't be. The packet number and checksum are left
+    // for stampPacket
+    const PacketSchema* schema;
+    PacketCursor cursor;
+    if (protocol == PROTOCOL_V2) {
+        cursor.reset(packet + 8, length - 11);
+        boost::string_ref name = cursor.read_until('\t');
+        const PacketSchema* const* found = host_packet_schemas.find(name.data(), name.size());
+        schema = found == NULL ? NULL : *found;
+    }
+    else {
+        schema = findPacketSchemaById(HOST_PACKET_SCHEMAS, NUM_HOST_PACKET_SCHEMAS, (uint8_t)packet[4]);
+        cursor.reset(packet + 7, length - 10, PacketCursor::FIELDS_PACKED);
+    }
+    if (schema == NULL) {
+        return 0;
+    }
+
+    size_t index = 4;  // bytes 2 and 3 are for packet length
+    const size_t max_index = max_length - 3;
+    dest[0] = PACKET_START_0;
+    dest[1] = PACKET_START_1;
+    if (protocol == PROTOCOL_V2) {
+        dest[index++] = (char)schema->id;
+        index += 2;
+    }
+    else {
+        size_t name_len = strlen(schema->category);
+        if (index + 4 + name_len + 1 > max_index) {
+            return 0;
+        }
+        index += 4;
+        memcpy(dest + index, schema->category, name_len);
+        index += name_len;
+        dest[index++] = '\t';
+    }
+
+    // writeSerial may have sent a prefix of the schema
+    char code[2] = {'\0', '\0'};
+    for (const char* field = schema->schema; *field != '\0' && cursor.remaining() > 0; field++)
+    {
+        code[0] = *field;
+        if (!cursor.expect(code) || index + 5 > max_index) {
+            return 0;
         }
-        else if (*formats == 'x') {
-            char *s = va_arg(args, char*);
-            u16_union.byte[1] = s[0];
-            u16_union.byte[0] = s[1];
-            for (size_t i = 0; i < 2 + u16_union.integer; i++) {
-                _writeCharBuffer[_writeCharIndex++] = s[i];
+        if (*field == 'd' || *field == 'u') {
+            uint32_t value = *field == 'd' ? (uint32_t)cursor.read<int32_t>() : cursor.read<uint32_t>();
+            if (protocol == PROTOCOL_V2) {
+                if (*field == 'd') {
+                    value = (value << 1) ^ (uint32_t)((int32_t)value >> 31);  // zigzag
+                }
+                index += writeVarint(dest + index, value);
             }
-        }
-        else if (*formats == 'f') {
-            f_union.floating_point = (float)va_arg(args, double);
-            for (unsigned short i = 0; i < 4; i++) {
-                _writeCharBuffer[_writeCharIndex++] = f_union.byte[i];
+            else {
+                for (unsigned short i = 0; i < 4; i++) {
+                    dest[index++] = (char)(value >> (24 - 8 * i));
+                }
             }
         }
+        else if (*field == 'f') {
+            memcpy(dest + index, cursor.read_raw(4).data(), 4);
+            index += 4;
+        }
         else {
-            ROS_ERROR("Invalid format %c", *formats);
+            // 's', 'x' and 'b' are all encoded as a length and the bytes
+            boost::string_ref bytes = cursor.read_string_view();
+            if (index + 5 + bytes.size() > max_index) {
+                return 0;
+            }
+            if (protocol == PROTOCOL_V2) {
+                index += writeVarint(dest + index, (uint32_t)bytes.size());
+            }
+            else {
+                dest[index++] = (char)(bytes.size() >> 8);
+                dest[index++] = (char)bytes.size();
+            }
+            memcpy(dest + index, bytes.data(), bytes.size());
+            index += bytes.size();
         }
-        ++formats;
-    }
-    va_end(args);
-
-    uint8_t calc_checksum = 0;
-    for (size_t index = 4; index < _writeCharIndex; index++) {
-        calc_checksum += (uint8_t)_writeCharBuffer[index];
     }
 
-    sprintf(_writeCharBuffer + _writeCharIndex, "%02x", calc_checksum);
-    _writeCharIndex += 2;
-    _writeCharBuffer[_writeCharIndex++] = '\n';
-    _writeCharBuffer[_writeCharIndex] = '\0';
-
-    u16_union.integer = _writeCharIndex - 5;  // subtract start, length, and stop bytes
-
-    _writeCharBuffer[2] = u16_union.byte[1];
-    _writeCharBuffer[3] = u16_union.byte[0];
+    size_t packet_len = index + 3;
+    dest[2] = (char)((packet_len - 5) >> 8);
+    dest[3] = (char)(packet_len - 5);
+    dest[index + 2] = PACKET_STOP;
+    return packet_len;
+}
 
-    _writePacketNum++;
+const char* DodobotParsing::packetInProtocol(const char* packet, size_t* length, uint32_t ticket, int protocol, TxClass tx_class)
+{
+    // queued before the protocol changed. NULL if it has to be dropped
+    if (_ticketProtocols[ticket & (TX_TICKET_HISTORY - 1)] == protocol) {
+        return packet;
+    }
+    *length = transcodePacket(_txTranscodeBuffer, SERIAL_TX_BATCH_SIZE, packet, *length, protocol);
+    if (*length == 0) {
+        ROS_ERROR("Couldn't re-encode ticket #%u for protocol v%d. Dropping it", ticket, protocol);
+        tx_dropped[tx_class]++;
+        return NULL;
+    }
+    return _txTranscodeBuffer;
+}
 
-    string packet = "";
-    for (size_t i = 0; i < _writeCharIndex; i++) {
-        packet += _writeCharBuffer[i];
+size_t DodobotParsing::stampPacket(char* dest, const char* packet, size_t length, uint32_t ticket, TxClass tx_class, int protocol)
+{
+    // packet numbers follow the order packets actually go out in
+    uint32_t packet_num = _writePacketNum++;
+    double now = ros::WallTime::now().toSec();
+    _sentTimes[packet_num & (TX_TICKET_HISTORY - 1)] = now;
+    _sentTickets[packet_num & (TX_TICKET_HISTORY - 1)] = ((uint64_t)packet_num << 32) | ticket;
+    _writtenTickets[ticket & (TX_TICKET_HISTORY - 1)] = ticket;
+    link_stats.countTx(tx_class, length);
+    link_stats.recordTxAge(now - _ticketQueuedTimes[ticket & (TX_TICKET_HISTORY - 1)]);
+
+    memcpy(dest, packet, length);
+    size_t checksum_index = length - 3;
+
+    if (protocol == PROTOCOL_V2) {
+        dest[5] = (char)(packet_num >> 8);
+        dest[6] = (char)packet_num;
+        boost::crc_ccitt_type crc;
+        crc.process_bytes(dest + 4, checksum_index - 4);
+        uint16_t checksum = crc.checksum();
+        dest[checksum_index] = (char)(checksum >> 8);
+        dest[checksum_index + 1] = (char)checksum;
+        return length;
     }
 
-    ROS_DEBUG_STREAM("Queuing: " << formatPacketToPrint(_writeCharBuffer, _writeCharIndex) << "\tlength: " << packet.length());
-    // _serialRef.write(packet);
-    // ros::Duration(0.0005).sleep();
-    write_queue.push(packet);
+    uint32_union u32_union;
+    u32_union.integer = packet_num;
+    for (unsigned short i = 0; i < 4; i++) {
+        dest[4 + i] = u32_union.byte[3 - i];
+    }
 
-    if (_writePacketNum % 100 == 0) {
-        ros::Duration dt = ros::Time::now() - write_timer;
-        ROS_INFO("Write rate: %f", 100.0 / dt.toSec());
-        write_timer = ros::Time::now();
+    uint8_t calc_checksum = 0;
+    for (size_t i = 4; i < checksum_index; i++) {
+        calc_checksum += (uint8_t)dest[i];
     }
+    char checksum_str[3];
+    sprintf(checksum_str, "%02x", calc_checksum);
+    dest[checksum_index] = checksum_str[0];
+    dest[checksum_index + 1] = checksum_str[1];
+    return length;
 }
 
-bool DodobotParsing::waitForOK(uint32_t packet_num, ros::Duration ok_timeout)
+bool DodobotParsing::batchFromRing(PacketTxRing* ring, TxClass tx_class, int protocol, size_t* batch_len, size_t* count)
 {
-    if (ok_timeout == ros::Duration(0.0)) {
-        ok_timeout = packet_ok_timeout;
-    }
-    wait_for_ok_reqs[packet_num] = -1;
-    ros::Time start_timer = ros::Time::now();
-    while (true)
+    // returns true if a large packet was added, which ends the batch
+    size_t num_packets = 0;
+    size_t length = 0;
+    uint32_t ticket = TX_TICKET_INVALID;
+    const char* packet = NULL;
+    bool large_packet = false;
+    while ((packet = ring->peek(num_packets, &length, &ticket)) != NULL)
     {
-        if (!ros::ok()) {
-            return false;
+        if (txHeld()) {
+            break;
         }
-        loop();
-        if (ros::Time::now() - start_timer > ok_timeout) {
-            ROS_WARN_STREAM("Timed out while waiting for response from packet #" << packet_num);
-            return false;
+        packet = packetInProtocol(packet, &length, ticket, protocol, tx_class);
+        if (packet == NULL) {
+            num_packets++;
+            continue;
+        }
+        if (*batch_len + length > SERIAL_TX_BATCH_SIZE) {
+            break;
         }
-        if (wait_for_ok_reqs[packet_num] != -1) {
-            int error_code = wait_for_ok_reqs[packet_num];
-            ROS_INFO("Received response for packet #%u: %d", packet_num, error_code);
-            wait_for_ok_reqs.erase(packet_num);
-            return error_code == 0 || error_code == 6;
+        *batch_len += stampPacket(_txBatchBuffer + *batch_len, packet, length, ticket, tx_class, protocol);
+        num_packets++;
+        if (length >= SERIAL_TX_LARGE_PACKET) {
+            large_packet = true;
+            break;
         }
     }
+    ring->release(num_packets);
+    *count += num_packets;
+    return large_packet;
 }
 
-bool DodobotParsing::waitForOK(ros::Duration ok_timeout) {
-    return waitForOK(_writePacketNum - 1, ok_timeout);
-}
-
-
-void DodobotParsing::setup()
+void DodobotParsing::batchFromMailboxes(int protocol, size_t* batch_len, size_t* count)
 {
-    configure();
-
-    // wait for startup messages from the microcontroller
-    checkReady();
-
-    // tell the microcontroller to start
-    if (reporting_on_start) {
-        setReporting(true);
-    }
-    if (active_on_start) {
-        setActive(true);
+    for (size_t i = 0; i < NUM_TX_CLASSES - TX_FIRST_MAILBOX; i++)
+    {
+        TxMailbox* mailbox = &_txMailboxes[i];
+        if (!mailbox->pending) {
+            continue;
+        }
+        if (txHeld()) {
+            break;
+        }
+        TxClass tx_class = (TxClass)(TX_FIRST_MAILBOX + i);
+        boost::lock_guard<boost::mutex> lock(mailbox->mutex);
+        size_t length = mailbox->length;
+        const char* packet = packetInProtocol(mailbox->packet, &length, mailbox->ticket, protocol, tx_class);
+        if (packet != NULL) {
+            if (*batch_len + length > SERIAL_TX_BATCH_SIZE) {
+                break;
+            }
+            *batch_len += stampPacket(_txBatchBuffer + *batch_len, packet, length, mailbox->ticket, tx_class, protocol);
+        }
+        mailbox->pending = false;
+        (*count)++;
     }
-    setReadyFlag(true);  // signal that ROS is ready
-
-    // Send starter image
-    // ros::Duration(0.25).sleep();
-    // cv::Mat starter_image;
-    // starter_image = cv::imread(starter_image_path, cv::IMREAD_COLOR);
-    // writeImage(starter_image);
 }
 
-void DodobotParsing::write_packet_from_queue()
+size_t DodobotParsing::write_packets_from_queue()
 {
-    if (write_queue.empty()) {
-        return;
+    // combine as many queued packets as fit into one write. Real time
+    // packets go first, then the latest setpoints, then bulk transfers
+    if (txHeld()) {
+        return 0;
+    }
+    // read after the hold check. parseTxRx sets it before releasing the hold
+    int protocol = _txProtocol;
+    size_t depth = _txRing->depth() + _txBulkRing->depth();
+    size_t batch_len = 0;
+    size_t count = 0;
+    bool large_packet = batchFromRing(_txRing, TX_REALTIME, protocol, &batch_len, &count);
+    if (!large_packet) {
+        batchFromMailboxes(protocol, &batch_len, &count);
+        large_packet = batchFromRing(_txBulkRing, TX_BULK, protocol, &batch_len, &count);
+    }
+    if (batch_len == 0) {
+        return count;  // nothing, or only dropped packets
     }
 
-    string packet = write_queue.front();
-    write_queue.pop();
-    ROS_DEBUG_STREAM("Writing: " << formatPacketToPrint(packet) << "\tlength: " << packet.length());
-    _serialRef.write(packet);
-    if (packet.size() >= 50) {
+    ROS_DEBUG_STREAM("Writing " << count << " packets: " << formatPacketToPrint(_txBatchBuffer, batch_len) << "\tlength: " << batch_len);
+    if (_capture != NULL) {
+        _capture->append(ros::WallTime::now().toNSec(), SerialCaptureWriter::CAPTURE_TX, (uint8_t*)_txBatchBuffer, batch_len);
+    }
+    try {
+        if (_replay == NULL) {
+            boost::lock_guard<boost::mutex> lock(serial_write_mutex);
+            if (serial_open) {
+                _serialRef.write((uint8_t*)_txBatchBuffer, batch_len);
+            }
+            else {
+                link_stats.tx_write_errors++;
+                ROS_DEBUG("Serial port is closed. Dropped %lu packets", count);
+            }
+        }
+    }
+    catch (exception& e) {
+        link_stats.tx_write_errors++;
+        ROS_ERROR_STREAM("Failed to write " << count << " packets: " << e.what());
+    }
+    if (large_packet) {
         ros::Duration(0.005).sleep();  // give microcontroller a chance to catch up to a large packet
     }
+
+    link_stats.recordQueueDepth(depth);
+    return count;
 }
 
 void DodobotParsing::write_thread_task()
 {
-    ros::Rate clock_rate(write_thread_rate);  // Hz
-    while (!write_stop_flag)
+    while (true)
     {
-        write_packet_from_queue();
-        clock_rate.sleep();
+        if (write_packets_from_queue() > 0) {
+            continue;
+        }
+        if (write_stop_flag) {
+            break;
+        }
+
+        // nothing to send, or held for the protocol answer. Sleep until notifyWriter
+        boost::unique_lock<boost::mutex> lock(write_mutex);
+        write_waiting = true;
+        size_t length;
+        bool mailbox_pending = false;
+        for (size_t i = 0; i < NUM_TX_CLASSES - TX_FIRST_MAILBOX; i++) {
+            mailbox_pending = mailbox_pending || _txMailboxes[i].pending;
+        }
+        bool queue_empty = _txRing->peek(0, &length) == NULL && _txBulkRing->peek(0, &length) == NULL && !mailbox_pending;
+        if ((queue_empty || txHeld()) && !write_stop_flag) {
+            write_cond.timed_wait(lock, boost::posix_time::milliseconds(100));
+        }
+        write_waiting = false;
     }
     ROS_INFO("Dodobot write thread task finished");
 }
@@ -738,14 +1676,71 @@ void DodobotParsing::write_thread_task()
 
 void DodobotParsing::loop()
 {
-    // if the serial buffer has data, parse it
-    if (_serialRef.available() > 2) {
-        while (_serialRef.available()) {
+    // wait for serial data, then parse every complete packet that came in
+    pollSerial();
+    while (readline())
+    {
+        if (!benchmark_mode) {
             readSerial();
+            continue;
+        }
+        _rxStatsIndex = LINK_STATS_MAX_CATEGORIES;  // stays "unknown" if the packet is rejected
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        readSerial();
+        uint64_t elapsed_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        BenchmarkStat* stat = &benchmark_stats[_rxStatsIndex];
+        stat->packets++;
+        stat->total_ns += elapsed_ns;
+        if (elapsed_ns > stat->max_ns) {
+            stat->max_ns = elapsed_ns;
+        }
+    }
+}
+
+void DodobotParsing::publishDiagnostics(const ros::TimerEvent& event)
+{
+    diagnostic_msgs::DiagnosticArray msg;
+    msg.header.stamp = ros::Time::now();
+
+    diagnostic_msgs::DiagnosticStatus status;
+    link_stats.report(status);
+
+    diagnostic_msgs::KeyValue key_value;
+    {
+        boost::lock_guard<boost::mutex> lock(config_requests_mutex);
+        key_value.key = "config requests pending";
+        key_value.value = std::to_string(config_requests.size());
+        status.values.push_back(key_value);
+    }
+    key_value.key = "config requests failed";
+    key_value.value = std::to_string(config_requests_failed.load());
+    status.values.push_back(key_value);
+
+    key_value.key = "serial open";
+    key_value.value = serial_open ? "true" : "false";
+    status.values.push_back(key_value);
+
+    key_value.key = "reconnects";
+    key_value.value = std::to_string(link_reconnects.load());
+    status.values.push_back(key_value);
+
+    key_value.key = "rx packet num";
+    key_value.value = std::to_string(_readPacketNum);
+    status.values.push_back(key_value);
+
+    for (size_t i = 0; i < NUM_TX_CLASSES; i++) {
+        if (i >= TX_FIRST_MAILBOX) {
+            key_value.key = string("tx ") + TX_CLASS_NAMES[i] + " replaced";
+            key_value.value = std::to_string(tx_replaced[i].load());
+            status.values.push_back(key_value);
         }
+        key_value.key = string("tx ") + TX_CLASS_NAMES[i] + " dropped";
+        key_value.value = std::to_string(tx_dropped[i].load());
+        status.values.push_back(key_value);
     }
 
-    ROS_INFO_THROTTLE(15, "Read packet num: %d", _readPacketNum);
+    msg.status.push_back(status);
+    diagnostics_pub.publish(msg);
 }
 
 void DodobotParsing::stop()
@@ -755,32 +1750,72 @@ void DodobotParsing::stop()
         setActive(false);
     }
 
+    {
+        boost::lock_guard<boost::mutex> lock(image_mutex);
+        image_stop_flag = true;
+        image_cond.notify_one();
+    }
+    image_thread->join();
+
+    // the write thread sends whatever is still queued before exiting
     write_stop_flag = true;
-    while (!write_queue.empty()) {
-        write_packet_from_queue();
+    {
+        boost::lock_guard<boost::mutex> lock(write_mutex);
+        write_cond.notify_one();
     }
+    write_thread->join();
 
     // leave reporting for other modules
     // setReporting(false);
-    _serialRef.close();
+    if (_replay == NULL && serial_open) {
+        boost::lock_guard<boost::mutex> lock(serial_write_mutex);
+        serial_open = false;
+        _serialRef.close();
+    }
+    if (_capture != NULL) {
+        _capture->close();
+    }
 }
 
 
-int DodobotParsing::run()
+int DodobotParsing::run(ros::CallbackQueue* callback_queue)
 {
+    // a nodelet calls this from its own thread rather than the one that constructed us
+    _rxThreadId = boost::this_thread::get_id();
     setup();
 
-    ros::Rate clock_rate(300);  // run loop at 300 Hz
+    // one thread per queue keeps each queue's callbacks in order
+    ros::AsyncSpinner realtime_spinner(1, &realtime_queue);
+    ros::AsyncSpinner bulk_spinner(1, &bulk_queue);
+    ros::AsyncSpinner service_spinner(1, &service_queue);
+    if (threaded_callbacks) {
+        realtime_spinner.start();
+        bulk_spinner.start();
+        service_spinner.start();
+    }
 
     int exit_code = 0;
-    while (ros::ok())
+    while (ros::ok() && !stop_requested)
     {
-        // let ROS process any events
-        ros::spinOnce();
-        clock_rate.sleep();
+        // let ROS process any events.
+        // loop() blocks on the serial port for up to rx_timeout_ms, which paces this loop
+        if (callback_queue != NULL) {
+            callback_queue->callAvailable();
+        }
+        else {
+            ros::spinOnce();
+        }
+        if (!threaded_callbacks) {
+            realtime_queue.callAvailable();
+            bulk_queue.callAvailable();
+            service_queue.callAvailable();
+        }
 
         try {
+            serviceLink();
             loop();
+            serviceConfigRequests();
+            serviceDriveRate();
         }
         catch (exception& e) {
             ROS_ERROR_STREAM("Exception in main loop: " << e.what());
@@ -788,13 +1823,23 @@ int DodobotParsing::run()
             break;
         }
     }
+    if (threaded_callbacks) {
+        // waits for callbacks in progress, so nothing writes to the port after stop()
+        realtime_spinner.stop();
+        bulk_spinner.stop();
+        service_spinner.stop();
+    }
     stop();
 
-    write_thread->join();
-
     return exit_code;
 }
 
+void DodobotParsing::requestStop()
+{
+    // run() notices within one serial read timeout
+    stop_requested = true;
+}
+
 bool DodobotParsing::motorsReady() {
     return readyState->is_ready && robotState->motors_active;
 }
@@ -807,11 +1852,43 @@ void DodobotParsing::driveCallback(const db_parsing::DodobotDrive::ConstPtr& msg
 {
     // motor commands in ticks per second
     ROS_DEBUG("left motor: %f, right motor: %f", msg->left_setpoint, msg->right_setpoint);
-    // if (prev_left_setpoint != msg->left_setpoint || prev_right_setpoint != msg->right_setpoint) {
+    if (drive_cmd_max_rate <= 0.0) {
+        // if (prev_left_setpoint != msg->left_setpoint || prev_right_setpoint != msg->right_setpoint) {
+        writeDriveChassis(msg->left_setpoint, msg->right_setpoint);
+        //     prev_left_setpoint = msg->left_setpoint;
+        //     prev_right_setpoint = msg->right_setpoint;
+        // }
+        return;
+    }
+    boost::lock_guard<boost::mutex> lock(drive_rate_mutex);
+    ros::Time now = ros::Time::now();
+    if (now < next_drive_time) {
+        // held for serviceDriveRate. A newer command replaces it
+        drive_pending = true;
+        pending_left_setpoint = msg->left_setpoint;
+        pending_right_setpoint = msg->right_setpoint;
+        return;
+    }
+    drive_pending = false;
+    next_drive_time = now + ros::Duration(1.0 / drive_cmd_max_rate);
     writeDriveChassis(msg->left_setpoint, msg->right_setpoint);
-    //     prev_left_setpoint = msg->left_setpoint;
-    //     prev_right_setpoint = msg->right_setpoint;
-    // }
+}
+
+void DodobotParsing::serviceDriveRate()
+{
+    // sends the command driveCallback held back once it's due, so the last one
+    // (usually a stop) always goes out
+    boost::lock_guard<boost::mutex> lock(drive_rate_mutex);
+    if (!drive_pending) {
+        return;
+    }
+    ros::Time now = ros::Time::now();
+    if (now < next_drive_time) {
+        return;
+    }
+    drive_pending = false;
+    next_drive_time = now + ros::Duration(1.0 / drive_cmd_max_rate);
+    writeDriveChassis(pending_left_setpoint, pending_right_setpoint);
 }
 
 void DodobotParsing::linearCallback(const db_parsing::DodobotLinear::ConstPtr& msg) {
@@ -827,8 +1904,8 @@ void DodobotParsing::linearCallback(const db_parsing::DodobotLinear::ConstPtr& m
                 ROS_WARN("Requested linear speed %d is very low (threshold: %d)", msg->max_speed, stepper_low_speed);
             }
             ROS_INFO("Setting linear max speed: %d", msg->max_speed);
-            writeSerial("lincfg", "dd", 0, msg->max_speed);
-            ros::Duration(0.005).sleep();
+            stepper_speed_setting = msg->max_speed;
+            queueConfigRequest("lincfg speed", boost::bind(&DodobotParsing::writeLinearConfig, this, 0, msg->max_speed), packet_ok_timeout, 1);
         }
         else {
             ROS_ERROR("Requested linear speed %d is out of bounds: %d", msg->max_speed, stepper_max_speed);
@@ -840,8 +1917,8 @@ void DodobotParsing::linearCallback(const db_parsing::DodobotLinear::ConstPtr& m
                 ROS_WARN("Requested linear speed %d is very low (threshold: %d)", msg->acceleration, stepper_low_accel);
             }
             ROS_INFO("Setting linear max acceleration: %d", msg->acceleration);
-            writeSerial("lincfg", "dd", 1, msg->acceleration);
-            ros::Duration(0.005).sleep();
+            stepper_accel_setting = msg->acceleration;
+            queueConfigRequest("lincfg accel", boost::bind(&DodobotParsing::writeLinearConfig, this, 1, msg->acceleration), packet_ok_timeout, 1);
         }
         else {
             ROS_ERROR("Requested linear accel %d is out of bounds: %d", msg->acceleration, stepper_max_accel);
@@ -851,20 +1928,12 @@ void DodobotParsing::linearCallback(const db_parsing::DodobotLinear::ConstPtr& m
     switch (msg->command_type) {
         case 0:  // position: 0
         case 1:  // velocity: 1
-            do {
-                writeSerial("linear", "dd", msg->command_type, msg->command_value);
-            }
-            while (!waitForOK(ros::Duration(linear_ok_packet_timeout)));
-            ROS_INFO("Linear command send successfully");
-            break;
         case 2:  // stop linear:  2
         case 3:  // reset linear: 3
         case 4:  // home linear:  4
-            do {
-                writeSerial("linear", "d", msg->command_type);
-            }
-            while (!waitForOK(ros::Duration(linear_ok_packet_timeout)));
-            ROS_INFO("Linear command send successfully");
+            // acknowledged in the background. The result goes out on config_result
+            queueConfigRequest("linear", boost::bind(&DodobotParsing::writeLinearCommand, this, msg->command_type, msg->command_value),
+                linear_ok_packet_timeout, config_request_attempts);
             break;
         default:
             // no operation: -1 (for only writing lincfg)
@@ -873,6 +1942,19 @@ void DodobotParsing::linearCallback(const db_parsing::DodobotLinear::ConstPtr& m
     }
 }
 
+uint32_t DodobotParsing::writeLinearConfig(int setting, int value) {
+    return writeSerial("lincfg", "dd", setting, value);
+}
+
+uint32_t DodobotParsing::writeLinearCommand(int command_type, int command_value) {
+    if (command_type <= 1) {
+        return writeSerial("linear", "dd", command_type, command_value);
+    }
+    else {
+        return writeSerial("linear", "d", command_type);
+    }
+}
+
 void DodobotParsing::tilterCallback(const db_parsing::DodobotTilter::ConstPtr& msg) {
     writeTilter(msg->command, msg->position);
 }
@@ -888,7 +1970,7 @@ void DodobotParsing::writeTilter(uint8_t command, int position) {
     }
     else {
         // Set with position
-        writeSerial("tilt", "dd", command, position);
+        writeSerialClass(TX_LATEST_TILT, "tilt", "dd", command, position);
     }
 }
 
@@ -904,11 +1986,11 @@ void DodobotParsing::writeGripper(int position, int force_threshold) {
 
     if (position < gripper_position) {
         // Open gripper
-        writeSerial("grip", "dd", 0, position);
+        writeSerialClass(TX_LATEST_GRIP, "grip", "dd", 0, position);
     }
     else {
         // Close gripper
-        writeSerial("grip", "ddd", 1, force_threshold, position);
+        writeSerialClass(TX_LATEST_GRIP, "grip", "ddd", 1, force_threshold, position);
     }
 }
 
@@ -938,7 +2020,7 @@ bool DodobotParsing::get_state(db_parsing::DodobotGetState::Request &req, db_par
     else
     {
         res.ready = true;
-        res.active = state_msg.motors_active;
+        res.active = robotState->motors_active;
         res.reporting = was_reporting;
     }
     return true;
@@ -951,6 +2033,7 @@ bool DodobotParsing::set_pid(db_parsing::DodobotPidSrv::Request  &req,
         ROS_WARN("Robot isn't ready! Skipping set_pid");
         return false;
     }
+    boost::lock_guard<boost::mutex> lock(pid_constants_mutex);
     pidConstants->kp_A = req.kp_A;
     pidConstants->ki_A = req.ki_A;
     pidConstants->kd_A = req.kd_A;
@@ -959,6 +2042,7 @@ bool DodobotParsing::set_pid(db_parsing::DodobotPidSrv::Request  &req,
     pidConstants->kd_B = req.kd_B;
     pidConstants->speed_kA = req.speed_kA;
     pidConstants->speed_kB = req.speed_kB;
+    pid_constants_set = true;
     writeK(pidConstants);
 
     res.resp = true;
@@ -972,33 +2056,97 @@ bool DodobotParsing::upload_file(db_parsing::DodobotUploadFile::Request &req, db
         return false;
     }
 
-    ifstream local_file(req.path, ios::in | ios::binary | ios::ate);
-    if (!local_file) {
+    MappedFile local_file;
+    if (!local_file.open(req.path)) {
         ROS_WARN("Local file '%s' failed to open", req.path.c_str());
         return false;
     }
+    ROS_INFO_STREAM("Size of file: " << local_file.size());
 
-    ifstream::pos_type size = local_file.tellg();
-	ROS_INFO_STREAM("Size of file: " << size);
-	local_file.seekg(0, ios::beg);
+    res.skipped = false;
+    res.segments_sent = 0;
 
-    char* temp = new char[1];
+    boost::lock_guard<boost::mutex> lock(large_transfer_mutex);
 
-    std::vector<unsigned char>* file_buf = new std::vector<unsigned char>();
+    if (req.skip_if_same) {
+        int32_t device_size;
+        uint32_t device_crc;
+        if (requestFileChecksum(req.dest, &device_size, &device_crc) &&
+                device_size == (int32_t)local_file.size() && device_crc == local_file.crc32()) {
+            ROS_INFO("'%s' is already on the device as '%s'. Skipping upload", req.path.c_str(), req.dest.c_str());
+            res.skipped = true;
+            res.resp = true;
+            return true;
+        }
+    }
 
-    for (size_t index = 0; index < size; index++) {
-        local_file.read(temp, 1);
-        file_buf->push_back(temp[0]);
+    // only resume if the last attempt was the same version of the same file
+    size_t start_segment = 0;
+    std::map<string, UploadResumeState>::iterator resume_state = upload_resume_states.find(req.dest);
+    if (req.resume && resume_state != upload_resume_states.end() &&
+            resume_state->second.path == req.path &&
+            resume_state->second.size == local_file.size() &&
+            resume_state->second.mtime == local_file.modifiedTime()) {
+        start_segment = resume_state->second.acked_segments;
+        ROS_INFO("Resuming upload of '%s' from segment %lu", req.path.c_str(), start_segment);
     }
 
+    db_parsing::DodobotUploadProgress progress;
+    progress.path = req.path;
+    progress.dest = req.dest;
+
     ROS_INFO("Uploading file '%s' to '%s'", req.path.c_str(), req.dest.c_str());
-    writeSerial("setpath", "s", req.dest.c_str());
-    writeSerialLarge("file", file_buf);
+    // bulk, so it can't overtake segments of a previous upload still in the ring
+    writeSerialClass(TX_BULK, "setpath", "s", req.dest.c_str());
+    size_t acked_prefix = start_segment;
+    res.resp = writeSerialLarge("file", local_file.data(), local_file.size(), start_segment, &acked_prefix, &progress);
+    res.segments_sent = acked_prefix - start_segment;
 
-    res.resp = true;
+    if (res.resp) {
+        upload_resume_states.erase(req.dest);
+    }
+    else {
+        UploadResumeState state;
+        state.path = req.path;
+        state.size = local_file.size();
+        state.mtime = local_file.modifiedTime();
+        state.acked_segments = acked_prefix;
+        upload_resume_states[req.dest] = state;
+        ROS_WARN("Upload of '%s' stopped after %lu segments. Call again with resume to continue", req.path.c_str(), acked_prefix);
+    }
     return true;
 }
 
+bool DodobotParsing::requestFileChecksum(string dest, int32_t* size, uint32_t* crc)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(file_checksum_mutex);
+        file_checksum_received = false;
+    }
+    writeSerial("filecrc", "s", dest.c_str());
+
+    ros::Time start_timer = ros::Time::now();
+    while (ros::ok())
+    {
+        uint32_t generation = ok_generation;
+        {
+            boost::lock_guard<boost::mutex> lock(file_checksum_mutex);
+            if (file_checksum_received && file_checksum_path == dest) {
+                *size = file_checksum_size;
+                *crc = file_checksum_crc;
+                return true;
+            }
+        }
+        ros::Duration elapsed = ros::Time::now() - start_timer;
+        if (elapsed > file_checksum_timeout) {
+            ROS_INFO("Device didn't report a checksum for '%s'", dest.c_str());
+            return false;
+        }
+        waitForResponse(file_checksum_timeout - elapsed, generation);
+    }
+    return false;
+}
+
 bool DodobotParsing::db_listdir(db_parsing::DodobotListDir::Request &req, db_parsing::DodobotListDir::Response &res)
 {
     if (!robotReady()) {
@@ -1052,7 +2200,7 @@ void DodobotParsing::writeDriveChassis(float speedA, float speedB) {
         ROS_WARN("Motors aren't ready! Skipping writeDriveChassis");
         return;
     }
-    writeSerial("drive", "ff", speedA, speedB);
+    writeSerialClass(TX_LATEST_DRIVE, "drive", "ff", speedA, speedB);
 }
 
 void DodobotParsing::writeK(PidKs* constants) {
@@ -1070,24 +2218,146 @@ void DodobotParsing::writeK(PidKs* constants) {
         constants->speed_kA,
         constants->speed_kB
     );
-    for (size_t attempts = 0; attempts < 5; attempts++) {
-        writeSerial("ks", "ffffffff",
-            constants->kp_A,
-            constants->ki_A,
-            constants->kd_A,
-            constants->kp_B,
-            constants->ki_B,
-            constants->kd_B,
-            constants->speed_kA,
-            constants->speed_kB
-        );
-        if (waitForOK()) {
-            break;
+    // the gains are copied so a later set_pid can't change a packet that's being retried
+    queueConfigRequest("ks", boost::bind(&DodobotParsing::writeKPacket, this, *constants), packet_ok_timeout, config_request_attempts);
+}
+
+uint32_t DodobotParsing::writeKPacket(PidKs constants) {
+    return writeSerial("ks", "ffffffff",
+        constants.kp_A,
+        constants.ki_A,
+        constants.kd_A,
+        constants.kp_B,
+        constants.ki_B,
+        constants.kd_B,
+        constants.speed_kA,
+        constants.speed_kB
+    );
+}
+
+ConfigRequest DodobotParsing::makeConfigRequest(string name, boost::function<uint32_t()> send, ros::Duration timeout, int attempts)
+{
+    ConfigRequest request;
+    request.name = name;
+    request.send = send;
+    request.timeout = timeout;
+    request.attempts = attempts < 1 ? 1 : attempts;
+    request.pipelined = false;
+    request.ticket = TX_TICKET_INVALID;
+    request.attempt = 0;
+    request.error_code = -1;
+    return request;
+}
+
+void DodobotParsing::queueConfigRequest(string name, boost::function<uint32_t()> send, ros::Duration timeout, int attempts)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(config_requests_mutex);
+        config_requests.push_back(makeConfigRequest(name, send, timeout, attempts));
+    }
+
+    // on the RX thread, send right away instead of after the next serial read
+    if (boost::this_thread::get_id() == _rxThreadId) {
+        serviceConfigRequests();
+    }
+}
+
+void DodobotParsing::queueConfigBatch(std::vector<ConfigRequest>& batch)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(config_requests_mutex);
+        for (size_t i = 0; i < batch.size(); i++) {
+            batch[i].pipelined = true;
+            config_requests.push_back(batch[i]);
+        }
+    }
+    if (boost::this_thread::get_id() == _rxThreadId) {
+        serviceConfigRequests();
+    }
+}
+
+void DodobotParsing::serviceConfigRequests()
+{
+    boost::lock_guard<boost::mutex> lock(config_requests_mutex);
+    ros::Time now = ros::Time::now();
+    std::deque<ConfigRequest>::iterator it = config_requests.begin();
+    while (it != config_requests.end())
+    {
+        ConfigRequest& request = *it;
+        bool send = request.attempt == 0;
+
+        if (request.attempt > 0)
+        {
+            int error_code;
+            if (pollOK(request.ticket, &error_code)) {
+                request.error_code = error_code;
+                if (isOKCode(error_code)) {
+                    finishConfigRequest(request, true);
+                    it = config_requests.erase(it);
+                    continue;
+                }
+                ROS_WARN("Device rejected %s (error %d)", request.name.c_str(), error_code);
+                send = true;
+            }
+            else if (now - request.sent_time >= request.timeout) {
+                ROS_WARN("Timed out waiting for an ok for %s (attempt %d of %d)", request.name.c_str(), request.attempt, request.attempts);
+                send = true;
+            }
+
+            if (send && request.attempt >= request.attempts) {
+                finishConfigRequest(request, false);
+                it = config_requests.erase(it);
+                continue;
+            }
+        }
+        else if (!request.pipelined && it != config_requests.begin()) {
+            return;  // waits for everything queued before it
+        }
+
+        if (send) {
+            request.attempt++;
+            request.ticket = request.send();
+            request.sent_time = now;
+        }
+        if (!request.pipelined) {
+            return;  // nothing queued after it goes out until it's done
         }
-        ROS_WARN("Failed to receive ok signal for PID. Trying again.");
+        ++it;
     }
 }
 
+void DodobotParsing::abandonConfigRequests()
+{
+    boost::lock_guard<boost::mutex> lock(config_requests_mutex);
+    for (size_t i = 0; i < config_requests.size(); i++) {
+        finishConfigRequest(config_requests[i], false);
+    }
+    config_requests.clear();
+}
+
+uint32_t DodobotParsing::writeSetting(string name, int value) {
+    return writeSerial(name, "d", value);
+}
+
+void DodobotParsing::finishConfigRequest(const ConfigRequest& request, bool success)
+{
+    if (success) {
+        ROS_INFO("%s sent successfully", request.name.c_str());
+    }
+    else {
+        ROS_ERROR("Giving up on %s after %d attempts", request.name.c_str(), request.attempt);
+        config_requests_failed++;
+    }
+
+    db_parsing::DodobotConfigResult result;
+    result.header.stamp = ros::Time::now();
+    result.name = request.name;
+    result.success = success;
+    result.error_code = request.error_code;
+    result.attempts = request.attempt;
+    config_result_pub.publish(result);
+}
+
 void DodobotParsing::robotFunctionsCallback(const db_parsing::DodobotFunctionsListing::ConstPtr& msg)
 {
     size_t total_length = 0;
@@ -1122,29 +2392,98 @@ void DodobotParsing::imgCallback(const sensor_msgs::ImageConstPtr& msg)
         return;
     }
 
-    cv_bridge::CvImagePtr cv_ptr;
-    try
-    {
-        cv_ptr = cv_bridge::toCvCopy(msg, sensor_msgs::image_encodings::BGR8);
-    }
-    catch (cv_bridge::Exception& e)
+    // hand the frame to the image thread. If it's still busy with the
+    // previous one, that frame is replaced
+    boost::lock_guard<boost::mutex> lock(image_mutex);
+    latest_image = msg;
+    image_cond.notify_one();
+}
+
+void DodobotParsing::image_thread_task()
+{
+    while (true)
     {
-        ROS_ERROR("cv_bridge exception: %s", e.what());
-        return;
+        sensor_msgs::ImageConstPtr msg;
+        {
+            boost::unique_lock<boost::mutex> lock(image_mutex);
+            while (!latest_image && !image_stop_flag) {
+                image_cond.wait(lock);
+            }
+
+            // wait out the rate limit. Frames that come in meanwhile replace this one
+            ros::Time now = ros::Time::now();
+            while (!image_stop_flag && now < next_image_time) {
+                image_cond.timed_wait(lock, boost::posix_time::microseconds((int64_t)((next_image_time - now).toSec() * 1e6)));
+                now = ros::Time::now();
+            }
+            if (image_stop_flag) {
+                break;
+            }
+            msg = latest_image;
+            latest_image.reset();
+        }
+        if (!ready_for_images) {
+            continue;
+        }
+
+        cv_bridge::CvImageConstPtr cv_ptr;
+        try
+        {
+            cv_ptr = cv_bridge::toCvShare(msg, sensor_msgs::image_encodings::BGR8);
+        }
+        catch (cv_bridge::Exception& e)
+        {
+            ROS_ERROR("cv_bridge exception: %s", e.what());
+            continue;
+        }
+
+        ros::Time start_time = ros::Time::now();
+        if (!writeImage(cv_ptr->image)) {
+            continue;
+        }
+        ros::Time end_time = ros::Time::now();
+
+        // limit images to image_link_share of the measured link throughput
+        double img_size = (double)display_img_buf->size();
+        double duration = (end_time - start_time).toSec();
+        if (duration > 0.0) {
+            double throughput = img_size / duration;
+            image_throughput = image_throughput == 0.0 ? throughput : 0.8 * image_throughput + 0.2 * throughput;
+        }
+        double link_gap = 0.0;
+        if (image_throughput > 0.0 && image_link_share > 0.0 && image_link_share < 1.0) {
+            link_gap = img_size / image_throughput * (1.0 / image_link_share - 1.0);
+        }
+        ros::Time rate_limit_time = start_time;
+        if (display_max_rate > 0.0) {
+            rate_limit_time += ros::Duration(1.0 / display_max_rate);
+        }
+        next_image_time = std::max(rate_limit_time, end_time + ros::Duration(link_gap));
+        ROS_DEBUG("Image throughput: %f bytes/s. Next image in %fs", image_throughput, (next_image_time - end_time).toSec());
     }
-    writeImage(cv_ptr->image);
+    ROS_INFO("Dodobot image thread task finished");
 }
-void DodobotParsing::writeImage(const cv::Mat& image)
+
+bool DodobotParsing::writeImage(const cv::Mat& image)
 {
     cv::Mat resized;
     cv::resize(image, resized, cv::Size(image_resize_width, image_resize_height));
 
+    // skip frames that look the same as the last one sent at display resolution
+    if (!prev_display_img.empty() && prev_display_img.size() == resized.size() && prev_display_img.type() == resized.type()) {
+        double difference = cv::norm(resized, prev_display_img, cv::NORM_L1) / (double)(resized.total() * resized.channels());
+        if (difference < image_change_threshold) {
+            ROS_DEBUG("Image unchanged (%f). Skipping image", difference);
+            return false;
+        }
+    }
+
     cv::imencode(".jpg", resized, *display_img_buf, jpeg_params);
 
     size_t img_size = display_img_buf->size();
     if (img_size == 0) {
         ROS_WARN("Image is too small, len: %lu. Skipping image", img_size);
-        return;
+        return false;
     }
     // if (img_size > SERIAL_BUFFER_SIZE) {
     //     ROS_WARN("Image is too large, len: %lu. Skipping image", img_size);
@@ -1152,11 +2491,17 @@ void DodobotParsing::writeImage(const cv::Mat& image)
     // }
 
     ROS_INFO("sending image: %d", (int)img_size);
-    writeSerial("setpath", "s", "CAMERA.JPG");
-    writeSerialLarge("file", display_img_buf);
+    boost::lock_guard<boost::mutex> lock(large_transfer_mutex);
+    writeSerialClass(TX_BULK, "setpath", "s", "CAMERA.JPG");
+    if (!writeSerialLarge("file", display_img_buf)) {
+        return false;
+    }
+    prev_display_img = resized;
+    return true;
 }
 
 void DodobotParsing::resendPidKs() {
+    boost::lock_guard<boost::mutex> lock(pid_constants_mutex);
     writeK(pidConstants);
 }
 
@@ -1384,10 +2729,12 @@ string DodobotParsing::formatPacketToPrint(char* packet, uint32_t length)
 }
 void DodobotParsing::parseState()
 {
-    CHECK_SEGMENT(4); robotState->time_ms = (uint32_t)segment_as_uint32();
-    CHECK_SEGMENT(4); robotState->battery_ok = (bool)segment_as_uint32();
-    CHECK_SEGMENT(4); robotState->motors_active = (bool)segment_as_uint32();
-    CHECK_SEGMENT(4); robotState->loop_rate = (double)segment_as_float();
+    uint32_t battery_ok, motors_active;
+    float loop_rate;
+    _rxCursor.read_fields<DevicePacket_STATE>(robotState->time_ms, battery_ok, motors_active, loop_rate);
+    robotState->battery_ok = (bool)battery_ok;
+    robotState->motors_active = (bool)motors_active;
+    robotState->loop_rate = (double)loop_rate;
 
     state_msg.header.stamp = getDeviceTime(robotState->time_ms);
     state_msg.battery_ok = robotState->battery_ok;
@@ -1398,10 +2745,23 @@ void DodobotParsing::parseState()
 }
 void DodobotParsing::parseReady()
 {
-    CHECK_SEGMENT(4); readyState->time_ms = segment_as_uint32();
-    CHECK_SEGMENT(-1); readyState->robot_name = segment_as_string();
+    boost::string_ref robot_name;
+    _rxCursor.read_fields<DevicePacket_READY>(readyState->time_ms, robot_name);
+    readyState->robot_name = robot_name.to_string();
+    readyState->protocol_version = PROTOCOL_V1;
+    readyState->rx_segments = 1;
+    if (_rxCursor.expect("u")) {
+        // older firmware doesn't send this
+        readyState->protocol_version = _rxCursor.read<uint32_t>();
+    }
+    if (_rxCursor.expect("u")) {
+        // nor this. Without it only one segment is sent at a time
+        readyState->rx_segments = std::max(_rxCursor.read<uint32_t>(), (uint32_t)1);
+    }
     readyState->is_ready = true;
-    ROS_INFO_STREAM("Received ready signal! Rover name: " << readyState->robot_name);
+    setStartTime(readyState->time_ms);
+    ROS_INFO_STREAM("Received ready signal! Rover name: " << readyState->robot_name << ", protocol v" << readyState->protocol_version
+        << ", buffers " << readyState->rx_segments << " file segments");
 
     state_msg.header.stamp = getDeviceTime(readyState->time_ms);
     state_msg.is_ready = readyState->is_ready;
@@ -1409,71 +2769,119 @@ void DodobotParsing::parseReady()
 
     state_pub.publish(state_msg);
 
-    setReadyFlag(true);  // signal that ROS is ready
+    // the device is back on v1 after sending ready
+    _txProtocol = PROTOCOL_V1;
+
+    // signal that ROS is ready and tell the device to start. If a protocol
+    // switch is being negotiated, that waits for the device's answer
+    if (!negotiateProtocol()) {
+        pushStartupConfig();
+    }
+}
+
+bool DodobotParsing::negotiateProtocol()
+{
+    if (protocol_version < PROTOCOL_V2 || readyState->protocol_version < PROTOCOL_V2 || _replay != NULL) {
+        return false;
+    }
+    if (_protocolAttempts >= config_request_attempts) {
+        // the device just said ready, so it's on v1
+        ROS_WARN("No answer to %d protocol v%d requests. Staying on v%d", _protocolAttempts, PROTOCOL_V2, PROTOCOL_V1);
+        _protocolAttempts = 0;
+        return false;
+    }
+    // The device answers "proto" in v1, then switches both directions
+    // (readSerial follows it). Once "proto" is written the write thread
+    // holds everything else until parseTxRx sees the answer, then sends what
+    // was held in whichever protocol the device ended up on. The startup
+    // config waits for the answer too. If it doesn't come within
+    // packet_ok_timeout, serviceLink asks for ready again
+    ROS_INFO("Switching to protocol v%d", PROTOCOL_V2);
+    _protocolAttempts++;
+    _protocolTicket = writeSerial("proto", "d", PROTOCOL_V2);
+    if (_protocolTicket == TX_TICKET_INVALID) {
+        return false;
+    }
+    _protocolRequestTime = ros::Time::now();
+    return true;
+}
+
+bool DodobotParsing::txHeld()
+{
+    uint32_t ticket = _protocolTicket;
+    return ticket != TX_TICKET_INVALID && ticketWritten(ticket);
 }
 
 void DodobotParsing::parseDrive()
 {
-    CHECK_SEGMENT(4);
+    uint32_t time_ms;
+    int32_t left_enc_pos, right_enc_pos;
+    float left_enc_speed, right_enc_speed;
+    _rxCursor.read_fields<DevicePacket_ENC>(time_ms, left_enc_pos, right_enc_pos, left_enc_speed, right_enc_speed);
     if (use_sensor_msg_time) {
-        drive_msg.header.stamp = getDeviceTime((uint32_t)segment_as_uint32());
+        drive_msg.header.stamp = getDeviceTime(time_ms);
     }
     else {
         drive_msg.header.stamp = ros::Time::now();
     }
 
-    CHECK_SEGMENT(4); drive_msg.left_enc_pos = segment_as_int32();
-    CHECK_SEGMENT(4); drive_msg.right_enc_pos = segment_as_int32();
-    CHECK_SEGMENT(4); drive_msg.left_enc_speed = segment_as_float();
-    CHECK_SEGMENT(4); drive_msg.right_enc_speed = segment_as_float();
+    drive_msg.left_enc_pos = left_enc_pos;
+    drive_msg.right_enc_pos = right_enc_pos;
+    drive_msg.left_enc_speed = left_enc_speed;
+    drive_msg.right_enc_speed = right_enc_speed;
 
     // double now = ros::Time::now().toSec();
     // double then = drive_msg.header.stamp.toSec();
     // ROS_INFO("current time: %f, sensor time: %f. diff: %f", now, then, now - then);
 
-    drive_pub.publish(drive_msg);
+    // publish a fresh copy by pointer so nodelets in the same process share it without serializing
+    drive_pub.publish(boost::make_shared<db_parsing::DodobotDrive>(drive_msg));
 }
 
 void DodobotParsing::parseBumper()
 {
-    CHECK_SEGMENT(4);
+    uint32_t time_ms, left, right;
+    _rxCursor.read_fields<DevicePacket_BUMP>(time_ms, left, right);
     if (use_sensor_msg_time) {
-        bumper_msg.header.stamp = getDeviceTime(segment_as_uint32());
+        bumper_msg.header.stamp = getDeviceTime(time_ms);
     }
     else {
         bumper_msg.header.stamp = ros::Time::now();
     }
-    CHECK_SEGMENT(4); bumper_msg.left = segment_as_uint32();
-    CHECK_SEGMENT(4); bumper_msg.right = segment_as_uint32();
+    bumper_msg.left = left;
+    bumper_msg.right = right;
 
-    bumper_pub.publish(bumper_msg);
+    bumper_pub.publish(boost::make_shared<db_parsing::DodobotBumper>(bumper_msg));
 }
 
 void DodobotParsing::parseFSR()
 {
-    CHECK_SEGMENT(4);
+    uint32_t time_ms, right, left;
+    _rxCursor.read_fields<DevicePacket_FSR>(time_ms, right, left);
     if (use_sensor_msg_time) {
-        fsr_msg.header.stamp = getDeviceTime(segment_as_uint32());
+        fsr_msg.header.stamp = getDeviceTime(time_ms);
     }
     else {
         fsr_msg.header.stamp = ros::Time::now();
     }
-    CHECK_SEGMENT(4); fsr_msg.right = (uint16_t)segment_as_uint32();
-    CHECK_SEGMENT(4); fsr_msg.left = (uint16_t)segment_as_uint32();
+    fsr_msg.right = (uint16_t)right;
+    fsr_msg.left = (uint16_t)left;
 
     fsr_pub.publish(fsr_msg);
 }
 
 void DodobotParsing::parseGripper()
 {
-    CHECK_SEGMENT(4);
+    uint32_t time_ms;
+    int32_t position;
+    _rxCursor.read_fields<DevicePacket_GRIP>(time_ms, position);
     if (use_sensor_msg_time) {
-        gripper_msg.header.stamp = getDeviceTime(segment_as_uint32());
+        gripper_msg.header.stamp = getDeviceTime(time_ms);
     }
     else {
         gripper_msg.header.stamp = ros::Time::now();
     }
-    CHECK_SEGMENT(4); gripper_position = (int)segment_as_int32();
+    gripper_position = (int)position;
 
     gripper_msg.position = gripper_position;
 
@@ -1482,31 +2890,34 @@ void DodobotParsing::parseGripper()
 
 void DodobotParsing::parseLinear()
 {
-    CHECK_SEGMENT(4);
+    uint32_t time_ms, has_error, is_homed, is_active;
+    int32_t position;
+    _rxCursor.read_fields<DevicePacket_LINEAR>(time_ms, position, has_error, is_homed, is_active);
     if (use_sensor_msg_time) {
-        linear_msg.header.stamp = getDeviceTime(segment_as_uint32());
+        linear_msg.header.stamp = getDeviceTime(time_ms);
     }
     else {
         linear_msg.header.stamp = ros::Time::now();
     }
-    CHECK_SEGMENT(4); linear_msg.position = segment_as_int32();
-    CHECK_SEGMENT(4); linear_msg.has_error = segment_as_uint32();
-    CHECK_SEGMENT(4); linear_msg.is_homed = segment_as_uint32();
-    CHECK_SEGMENT(4); linear_msg.is_active = segment_as_uint32();
+    linear_msg.position = position;
+    linear_msg.has_error = has_error;
+    linear_msg.is_homed = is_homed;
+    linear_msg.is_active = is_active;
 
     linear_pub.publish(linear_msg);
 }
 
 void DodobotParsing::parseLinearEvent()
 {
-    CHECK_SEGMENT(4);
+    uint32_t time_ms, event_num;
+    _rxCursor.read_fields<DevicePacket_LINEAR_EVENT>(time_ms, event_num);
     if (use_sensor_msg_time) {
-        linear_event_msg.stamp = getDeviceTime(segment_as_uint32());
+        linear_event_msg.stamp = getDeviceTime(time_ms);
     }
     else {
         linear_event_msg.stamp = ros::Time::now();
     }
-    CHECK_SEGMENT(4); linear_event_msg.event_num = segment_as_uint32();
+    linear_event_msg.event_num = event_num;
 
     switch (linear_event_msg.event_num) {
         case 1:  ROS_INFO("Linear event: ACTIVE_TRUE"); break;
@@ -1526,16 +2937,17 @@ void DodobotParsing::parseLinearEvent()
 
 void DodobotParsing::parseBattery()
 {
-    CHECK_SEGMENT(4);
+    uint32_t time_ms;
+    float current, power, voltage;  // battery_msg doesn't have a slot for power
+    _rxCursor.read_fields<DevicePacket_BATT>(time_ms, current, power, voltage);
     if (use_sensor_msg_time) {
-        battery_msg.header.stamp = getDeviceTime(segment_as_uint32());
+        battery_msg.header.stamp = getDeviceTime(time_ms);
     }
     else {
         battery_msg.header.stamp = ros::Time::now();
     }
-    CHECK_SEGMENT(4); battery_msg.current = segment_as_float();
-    CHECK_SEGMENT(4); // battery_msg doesn't have a slot for power
-    CHECK_SEGMENT(4); battery_msg.voltage = segment_as_float();
+    battery_msg.current = current;
+    battery_msg.voltage = voltage;
     ROS_INFO_THROTTLE(3, "Voltage (V): %f, Current (mA): %f", battery_msg.voltage, battery_msg.current);
 
     battery_pub.publish(battery_msg);
@@ -1543,27 +2955,29 @@ void DodobotParsing::parseBattery()
 
 void DodobotParsing::parseIR()
 {
-    // CHECK_SEGMENT(4);  // time ms
-    // CHECK_SEGMENT(4);  // remote type
-    // CHECK_SEGMENT(4);  // received value
+    // time ms, remote type, received value
 }
 
 void DodobotParsing::parseTilter()
 {
-    CHECK_SEGMENT(4);
+    uint32_t time_ms;
+    int32_t position;
+    _rxCursor.read_fields<DevicePacket_TILT>(time_ms, position);
     if (use_sensor_msg_time) {
-        tilter_msg.header.stamp = getDeviceTime(segment_as_uint32());
+        tilter_msg.header.stamp = getDeviceTime(time_ms);
     }
     else {
         tilter_msg.header.stamp = ros::Time::now();
     }
-    CHECK_SEGMENT(4); tilter_msg.position = segment_as_int32();
+    tilter_msg.position = position;
 
     tilter_pub.publish(tilter_msg);
 }
 
 void DodobotParsing::parseSelectedRobotFn()
 {
-    CHECK_SEGMENT(-1); selected_fn_msg.selected = segment_as_string();
+    boost::string_ref selected;
+    _rxCursor.read_fields<DevicePacket_ROBOTFN>(selected);
+    selected_fn_msg.selected = selected.to_string();
     robot_functions_pub.publish(selected_fn_msg);
 }
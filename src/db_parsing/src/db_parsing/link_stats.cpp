@@ -0,0 +1,221 @@
+#include <db_parsing/link_stats.h>
+
+#include <sstream>
+
+
+LinkStats::LinkStats()
+{
+    rx_checksum_errors = 0;
+    rx_framing_errors = 0;
+    rx_packet_num_errors = 0;
+    rx_schema_errors = 0;
+    rx_device_messages = 0;
+    tx_write_errors = 0;
+
+    for (size_t i = 0; i < LINK_STATS_MAX_CATEGORIES + 1; i++) {
+        resetCounter(&_rx[i]);
+    }
+    for (size_t i = 0; i < LINK_STATS_MAX_CATEGORIES; i++) {
+        resetCounter(&_tx[i]);
+    }
+    for (size_t i = 0; i < LINK_STATS_LATENCY_BUCKETS; i++) {
+        _latencyBuckets[i] = 0;
+    }
+    _latencyCount = 0;
+    _latencyMaxUs = 0;
+    _txAgeCount = 0;
+    _txAgeTotalUs = 0;
+    _txAgeMaxUs = 0;
+    _queueDepth = 0;
+    _queueDepthMax = 0;
+    _clockSkewUs = 0;
+    _hasClockSkew = false;
+
+    _prevReportTime = ros::Time::now();
+}
+
+void LinkStats::resetCounter(Counter* counter)
+{
+    counter->packets = 0;
+    counter->bytes = 0;
+    counter->prev_packets = 0;
+    counter->prev_bytes = 0;
+}
+
+size_t LinkStats::addRxCategory(const std::string& name)
+{
+    if (_rxNames.size() >= LINK_STATS_MAX_CATEGORIES) {
+        return LINK_STATS_MAX_CATEGORIES;  // lumped in with unknown
+    }
+    _rxNames.push_back(name);
+    return _rxNames.size() - 1;
+}
+
+size_t LinkStats::addTxCategory(const std::string& name)
+{
+    if (_txNames.size() >= LINK_STATS_MAX_CATEGORIES) {
+        return LINK_STATS_MAX_CATEGORIES - 1;
+    }
+    _txNames.push_back(name);
+    return _txNames.size() - 1;
+}
+
+std::string LinkStats::rxCategoryName(size_t category) const
+{
+    if (category >= _rxNames.size()) {
+        return "unknown";
+    }
+    return _rxNames[category];
+}
+
+void LinkStats::countRx(size_t category, size_t bytes)
+{
+    Counter* counter = &_rx[category < LINK_STATS_MAX_CATEGORIES ? category : LINK_STATS_MAX_CATEGORIES];
+    counter->packets.fetch_add(1, std::memory_order_relaxed);
+    counter->bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void LinkStats::countUnknownRx(size_t bytes)
+{
+    countRx(LINK_STATS_MAX_CATEGORIES, bytes);
+}
+
+void LinkStats::countTx(size_t category, size_t bytes)
+{
+    Counter* counter = &_tx[category < LINK_STATS_MAX_CATEGORIES ? category : LINK_STATS_MAX_CATEGORIES - 1];
+    counter->packets.fetch_add(1, std::memory_order_relaxed);
+    counter->bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void LinkStats::updateMax(std::atomic<int64_t>* value, int64_t sample)
+{
+    int64_t current = value->load(std::memory_order_relaxed);
+    while (sample > current && !value->compare_exchange_weak(current, sample, std::memory_order_relaxed));
+}
+
+void LinkStats::recordLatency(double seconds)
+{
+    int64_t latency_us = (int64_t)(seconds * 1e6);
+    size_t bucket = 0;
+    while (bucket < LINK_STATS_LATENCY_BUCKETS - 1 && latency_us >= ((int64_t)100 << bucket)) {
+        bucket++;
+    }
+    _latencyBuckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    _latencyCount.fetch_add(1, std::memory_order_relaxed);
+    updateMax(&_latencyMaxUs, latency_us);
+}
+
+void LinkStats::recordTxAge(double seconds)
+{
+    int64_t age_us = (int64_t)(seconds * 1e6);
+    _txAgeCount.fetch_add(1, std::memory_order_relaxed);
+    _txAgeTotalUs.fetch_add(age_us, std::memory_order_relaxed);
+    updateMax(&_txAgeMaxUs, age_us);
+}
+
+void LinkStats::recordQueueDepth(size_t depth)
+{
+    _queueDepth.store(depth, std::memory_order_relaxed);
+    uint64_t current = _queueDepthMax.load(std::memory_order_relaxed);
+    while (depth > current && !_queueDepthMax.compare_exchange_weak(current, depth, std::memory_order_relaxed));
+}
+
+void LinkStats::recordClockSkew(double seconds)
+{
+    _clockSkewUs.store((int64_t)(seconds * 1e6), std::memory_order_relaxed);
+    _hasClockSkew.store(true, std::memory_order_relaxed);
+}
+
+void LinkStats::addValue(diagnostic_msgs::DiagnosticStatus& status, const std::string& key, const std::string& value)
+{
+    diagnostic_msgs::KeyValue key_value;
+    key_value.key = key;
+    key_value.value = value;
+    status.values.push_back(key_value);
+}
+
+void LinkStats::addValue(diagnostic_msgs::DiagnosticStatus& status, const std::string& key, double value)
+{
+    std::ostringstream stream;
+    stream << value;
+    addValue(status, key, stream.str());
+}
+
+void LinkStats::reportCounter(diagnostic_msgs::DiagnosticStatus& status, const std::string& prefix, Counter* counter, double dt)
+{
+    uint64_t packets = counter->packets.load(std::memory_order_relaxed);
+    uint64_t bytes = counter->bytes.load(std::memory_order_relaxed);
+    if (packets == 0) {
+        return;
+    }
+    addValue(status, prefix + " packets", (double)packets);
+    addValue(status, prefix + " packets/s", (packets - counter->prev_packets) / dt);
+    addValue(status, prefix + " bytes/s", (bytes - counter->prev_bytes) / dt);
+    counter->prev_packets = packets;
+    counter->prev_bytes = bytes;
+}
+
+void LinkStats::report(diagnostic_msgs::DiagnosticStatus& status)
+{
+    ros::Time now = ros::Time::now();
+    double dt = (now - _prevReportTime).toSec();
+    _prevReportTime = now;
+    if (dt <= 0.0) {
+        dt = 1.0;
+    }
+
+    status.name = "db_parsing: serial link";
+    status.hardware_id = "dodobot";
+    status.values.clear();
+
+    uint64_t checksum_errors = rx_checksum_errors;
+    uint64_t framing_errors = rx_framing_errors;
+    if (checksum_errors > 0 || framing_errors > 0) {
+        status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+        status.message = "Receive errors";
+    }
+    else {
+        status.level = diagnostic_msgs::DiagnosticStatus::OK;
+        status.message = "OK";
+    }
+
+    addValue(status, "rx checksum errors", (double)checksum_errors);
+    addValue(status, "rx framing errors", (double)framing_errors);
+    addValue(status, "rx packet num errors", (double)rx_packet_num_errors);
+    addValue(status, "rx schema errors", (double)rx_schema_errors);
+    addValue(status, "rx device messages", (double)rx_device_messages);
+    addValue(status, "tx write errors", (double)tx_write_errors);
+
+    for (size_t i = 0; i < _rxNames.size(); i++) {
+        reportCounter(status, "rx " + _rxNames[i], &_rx[i], dt);
+    }
+    reportCounter(status, "rx unknown", &_rx[LINK_STATS_MAX_CATEGORIES], dt);
+    for (size_t i = 0; i < _txNames.size(); i++) {
+        reportCounter(status, "tx " + _txNames[i], &_tx[i], dt);
+    }
+
+    addValue(status, "tx queue depth", (double)_queueDepth.load(std::memory_order_relaxed));
+    addValue(status, "tx queue depth max", (double)_queueDepthMax.load(std::memory_order_relaxed));
+    uint64_t age_count = _txAgeCount.load(std::memory_order_relaxed);
+    if (age_count > 0) {
+        addValue(status, "tx age mean (ms)", _txAgeTotalUs.load(std::memory_order_relaxed) / 1000.0 / age_count);
+        addValue(status, "tx age max (ms)", _txAgeMaxUs.load(std::memory_order_relaxed) / 1000.0);
+    }
+
+    uint64_t latency_count = _latencyCount.load(std::memory_order_relaxed);
+    if (latency_count > 0) {
+        addValue(status, "txrx latency max (ms)", _latencyMaxUs.load(std::memory_order_relaxed) / 1000.0);
+        std::ostringstream histogram;
+        for (size_t i = 0; i < LINK_STATS_LATENCY_BUCKETS; i++) {
+            if (i > 0) {
+                histogram << " ";
+            }
+            histogram << _latencyBuckets[i].load(std::memory_order_relaxed);
+        }
+        addValue(status, "txrx latency histogram (<0.1ms, <0.2ms, <0.4ms, ...)", histogram.str());
+    }
+
+    if (_hasClockSkew.load(std::memory_order_relaxed)) {
+        addValue(status, "clock skew (ms)", _clockSkewUs.load(std::memory_order_relaxed) / 1000.0);
+    }
+}
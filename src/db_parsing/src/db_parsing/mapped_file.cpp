@@ -0,0 +1,76 @@
+#include <db_parsing/mapped_file.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/crc.hpp>
+
+
+MappedFile::MappedFile()
+{
+    _fd = -1;
+    _data = NULL;
+    _size = 0;
+    _mtime = 0;
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const std::string& path)
+{
+    close();
+
+    _fd = ::open(path.c_str(), O_RDONLY);
+    if (_fd < 0) {
+        return false;
+    }
+
+    struct stat file_stat;
+    if (fstat(_fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        close();
+        return false;
+    }
+    _size = (size_t)file_stat.st_size;
+    _mtime = file_stat.st_mtime;
+
+    if (_size == 0) {
+        // mmap doesn't accept empty mappings. Nothing to read anyway
+        return true;
+    }
+
+    void* mapping = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+    if (mapping == MAP_FAILED) {
+        close();
+        return false;
+    }
+    _data = (unsigned char*)mapping;
+    madvise(mapping, _size, MADV_SEQUENTIAL);
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (_data != NULL) {
+        munmap(_data, _size);
+        _data = NULL;
+    }
+    if (_fd >= 0) {
+        ::close(_fd);
+        _fd = -1;
+    }
+    _size = 0;
+    _mtime = 0;
+}
+
+uint32_t MappedFile::crc32() const
+{
+    boost::crc_32_type crc;
+    if (_data != NULL) {
+        crc.process_bytes(_data, _size);
+    }
+    return crc.checksum();
+}
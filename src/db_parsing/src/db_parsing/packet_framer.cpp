@@ -0,0 +1,150 @@
+#include <db_parsing/packet_framer.h>
+
+#include <string.h>
+#include <algorithm>
+
+#define MAX_DEVICE_MESSAGE_LEN 0x400
+
+
+PacketFramer::PacketFramer(size_t ring_size, size_t max_frame_len, char start_0, char start_1, char stop)
+{
+    _capacity = 1;
+    while (_capacity < ring_size) {
+        _capacity <<= 1;
+    }
+    _mask = _capacity - 1;
+    _ring = new uint8_t[_capacity];
+
+    _maxFrameLen = max_frame_len;
+    _start0 = start_0;
+    _start1 = start_1;
+    _stop = stop;
+
+    reset();
+}
+
+PacketFramer::~PacketFramer()
+{
+    delete[] _ring;
+}
+
+void PacketFramer::reset()
+{
+    _head = 0;
+    _tail = 0;
+    _state = STATE_START_0;
+    _frameLen = 0;
+    _frameIndex = 0;
+    _deviceMessage.clear();
+    _pendingMessage.clear();
+}
+
+uint8_t* PacketFramer::reserve(size_t* length)
+{
+    size_t free_space = _capacity - buffered();
+    size_t head_index = _head & _mask;
+    *length = std::min(free_space, _capacity - head_index);
+    return _ring + head_index;
+}
+
+void PacketFramer::commit(size_t length)
+{
+    _head += std::min(length, _capacity - buffered());
+}
+
+size_t PacketFramer::write(const uint8_t* data, size_t length)
+{
+    size_t written = 0;
+    while (written < length) {
+        size_t span = 0;
+        uint8_t* dest = reserve(&span);
+        if (span == 0) {
+            break;
+        }
+        span = std::min(span, length - written);
+        memcpy(dest, data + written, span);
+        commit(span);
+        written += span;
+    }
+    return written;
+}
+
+uint8_t PacketFramer::popByte()
+{
+    return _ring[_tail++ & _mask];
+}
+
+PacketFramer::FrameResult PacketFramer::nextFrame(char* frame, size_t* frame_len)
+{
+    while (_head != _tail)
+    {
+        switch (_state)
+        {
+            case STATE_START_0: {
+                char c = (char)popByte();
+                if (c == _start0) {
+                    _state = STATE_START_1;
+                }
+                else if (c == _stop) {
+                    if (_pendingMessage.size() > 0) {
+                        _deviceMessage.swap(_pendingMessage);
+                        _pendingMessage.clear();
+                        return FRAME_DEVICE_MESSAGE;
+                    }
+                }
+                else if (_pendingMessage.size() < MAX_DEVICE_MESSAGE_LEN) {
+                    _pendingMessage += c;
+                }
+                break;
+            }
+            case STATE_START_1:
+                if ((char)_ring[_tail & _mask] == _start1) {
+                    _tail++;
+                    _state = STATE_LENGTH_0;
+                }
+                else {
+                    // not a packet. Let the start state look at this byte again
+                    _state = STATE_START_0;
+                }
+                break;
+            case STATE_LENGTH_0:
+                _frameLen = (uint16_t)popByte() << 8;
+                _state = STATE_LENGTH_1;
+                break;
+            case STATE_LENGTH_1:
+                _frameLen |= (uint16_t)popByte();
+                _frameIndex = 0;
+                if (_frameLen > _maxFrameLen) {
+                    *frame_len = _frameLen;
+                    _state = STATE_START_0;
+                    return FRAME_ERROR_LENGTH;
+                }
+                _state = STATE_BODY;
+                break;
+            case STATE_BODY: {
+                // copy the largest contiguous run available
+                size_t tail_index = _tail & _mask;
+                size_t span = std::min(buffered(), _capacity - tail_index);
+                span = std::min(span, (size_t)_frameLen - _frameIndex);
+                memcpy(frame + _frameIndex, _ring + tail_index, span);
+                _tail += span;
+                _frameIndex += span;
+                if (_frameIndex >= _frameLen) {
+                    _state = STATE_STOP;
+                }
+                break;
+            }
+            case STATE_STOP: {
+                char c = (char)popByte();
+                frame[_frameIndex] = '\0';
+                *frame_len = _frameIndex;
+                _state = STATE_START_0;
+                if (c != _stop) {
+                    return FRAME_ERROR_STOP;
+                }
+                return FRAME_PACKET;
+            }
+        }
+    }
+    return FRAME_NEED_MORE;
+}
@@ -0,0 +1,96 @@
+#include <db_parsing/packet_tx_ring.h>
+
+
+PacketTxRing::PacketTxRing(size_t num_slots, size_t slot_size)
+{
+    _numSlots = 1;
+    while (_numSlots < num_slots) {
+        _numSlots <<= 1;
+    }
+    _mask = _numSlots - 1;
+    _slotSize = slot_size;
+
+    _slots = new Slot[_numSlots];
+    _data = new char[_numSlots * _slotSize];
+    for (size_t i = 0; i < _numSlots; i++) {
+        _slots[i].sequence.store(i, std::memory_order_relaxed);
+        _slots[i].length = 0;
+        _slots[i].tag = 0;
+    }
+    _enqueuePos.store(0, std::memory_order_relaxed);
+    _dequeuePos.store(0, std::memory_order_relaxed);
+}
+
+PacketTxRing::~PacketTxRing()
+{
+    delete[] _slots;
+    delete[] _data;
+}
+
+char* PacketTxRing::claim(size_t* position)
+{
+    size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+    while (true)
+    {
+        Slot* slot = &_slots[pos & _mask];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            // slot is free for this position. Try to take it
+            if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                *position = pos;
+                return slotData(pos);
+            }
+            // another producer got here first. pos now holds the latest position
+        }
+        else if (diff < 0) {
+            // the consumer hasn't released this slot from the previous lap
+            return NULL;
+        }
+        else {
+            pos = _enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void PacketTxRing::publish(size_t position, size_t length, uint32_t tag)
+{
+    Slot* slot = &_slots[position & _mask];
+    slot->length = length;
+    slot->tag = tag;
+    slot->sequence.store(position + 1, std::memory_order_release);
+}
+
+const char* PacketTxRing::peek(size_t offset, size_t* length, uint32_t* tag) const
+{
+    if (offset >= _numSlots) {
+        return NULL;
+    }
+    size_t pos = _dequeuePos.load(std::memory_order_relaxed) + offset;
+    const Slot* slot = &_slots[pos & _mask];
+    if (slot->sequence.load(std::memory_order_acquire) != pos + 1) {
+        return NULL;
+    }
+    *length = slot->length;
+    if (tag != NULL) {
+        *tag = slot->tag;
+    }
+    return slotData(pos);
+}
+
+void PacketTxRing::release(size_t count)
+{
+    size_t pos = _dequeuePos.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < count; i++) {
+        // mark the slot free for the producer one lap ahead
+        _slots[(pos + i) & _mask].sequence.store(pos + i + _numSlots, std::memory_order_release);
+    }
+    _dequeuePos.store(pos + count, std::memory_order_release);
+}
+
+size_t PacketTxRing::depth() const
+{
+    size_t dequeue_pos = _dequeuePos.load(std::memory_order_acquire);
+    size_t enqueue_pos = _enqueuePos.load(std::memory_order_acquire);
+    return enqueue_pos - dequeue_pos;
+}
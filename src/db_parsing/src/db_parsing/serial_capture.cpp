@@ -0,0 +1,127 @@
+#include <db_parsing/serial_capture.h>
+
+#include <string.h>
+
+
+static void writeLittleEndian(uint8_t* dest, uint64_t value, size_t num_bytes)
+{
+    for (size_t i = 0; i < num_bytes; i++) {
+        dest[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static uint64_t readLittleEndian(const uint8_t* src, size_t num_bytes)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < num_bytes; i++) {
+        value |= (uint64_t)src[i] << (8 * i);
+    }
+    return value;
+}
+
+
+SerialCaptureWriter::SerialCaptureWriter()
+{
+    _file = NULL;
+}
+
+SerialCaptureWriter::~SerialCaptureWriter()
+{
+    close();
+}
+
+bool SerialCaptureWriter::open(const std::string& path)
+{
+    close();
+
+    boost::lock_guard<boost::mutex> lock(_mutex);
+    _file = fopen(path.c_str(), "ab");
+    if (_file == NULL) {
+        return false;
+    }
+    setvbuf(_file, NULL, _IOFBF, 0x10000);
+    if (ftell(_file) == 0) {
+        fwrite(SERIAL_CAPTURE_MAGIC, 1, SERIAL_CAPTURE_MAGIC_LEN, _file);
+    }
+    return true;
+}
+
+void SerialCaptureWriter::close()
+{
+    boost::lock_guard<boost::mutex> lock(_mutex);
+    if (_file != NULL) {
+        fclose(_file);
+        _file = NULL;
+    }
+}
+
+void SerialCaptureWriter::append(uint64_t stamp_ns, Direction direction, const uint8_t* data, size_t length)
+{
+    uint8_t header[SERIAL_CAPTURE_RECORD_HEADER_LEN];
+    writeLittleEndian(header, stamp_ns, 8);
+    writeLittleEndian(header + 8, length, 4);
+    header[12] = (uint8_t)direction;
+
+    boost::lock_guard<boost::mutex> lock(_mutex);
+    if (_file == NULL) {
+        return;
+    }
+    fwrite(header, 1, sizeof(header), _file);
+    fwrite(data, 1, length, _file);
+}
+
+void SerialCaptureWriter::flush()
+{
+    boost::lock_guard<boost::mutex> lock(_mutex);
+    if (_file != NULL) {
+        fflush(_file);
+    }
+}
+
+
+SerialCaptureReader::SerialCaptureReader()
+{
+    _position = 0;
+}
+
+bool SerialCaptureReader::open(const std::string& path)
+{
+    if (!_file.open(path)) {
+        return false;
+    }
+    if (_file.size() < SERIAL_CAPTURE_MAGIC_LEN || memcmp(_file.data(), SERIAL_CAPTURE_MAGIC, SERIAL_CAPTURE_MAGIC_LEN) != 0) {
+        _file.close();
+        return false;
+    }
+    rewind();
+    return true;
+}
+
+void SerialCaptureReader::close()
+{
+    _file.close();
+    _position = 0;
+}
+
+void SerialCaptureReader::rewind()
+{
+    _position = SERIAL_CAPTURE_MAGIC_LEN;
+}
+
+bool SerialCaptureReader::next(uint64_t* stamp_ns, SerialCaptureWriter::Direction* direction, const uint8_t** data, size_t* length)
+{
+    if (!_file.isOpen() || _file.size() - _position < SERIAL_CAPTURE_RECORD_HEADER_LEN) {
+        return false;
+    }
+    const uint8_t* header = _file.data() + _position;
+    size_t record_len = (size_t)readLittleEndian(header + 8, 4);
+    if (_file.size() - _position - SERIAL_CAPTURE_RECORD_HEADER_LEN < record_len) {
+        return false;  // capture was cut off mid record
+    }
+    *stamp_ns = readLittleEndian(header, 8);
+    *direction = (SerialCaptureWriter::Direction)header[12];
+    *data = header + SERIAL_CAPTURE_RECORD_HEADER_LEN;
+    *length = record_len;
+    _position += SERIAL_CAPTURE_RECORD_HEADER_LEN + record_len;
+    return true;
+}
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "db_parsing/packet_framer.h"
+#include "db_parsing/packet_cursor.h"
+#include "db_parsing/packet_dispatch.h"
+#include "db_parsing/packet_schema.h"
+#include "db_parsing/packet_checksum.h"
+#include "db_parsing/serial_capture.h"
+
+#define BENCHMARK_RING_SIZE 0x10000
+#define BENCHMARK_FRAME_LEN 0x3fff
+
+using namespace std;
+
+// Replays the RX side of a serial capture through the framer, checksum, packet
+// dispatch and schema decode as fast as possible and reports throughput per
+// packet category. Doesn't need a roscore or the serial port. The parse*
+// handlers and their publishers aren't run. Replay the capture with the
+// node's ~replay_path and ~benchmark params to time those as well.
+//     rosrun db_parsing db_parsing_benchmark <capture file> [passes]
+
+struct CategoryStat {
+    uint64_t packets;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+enum {
+    CATEGORY_UNKNOWN = NUM_DEVICE_PACKET_SCHEMAS,  // no schema for the category or id
+    CATEGORY_REJECTED,  // failed its checksum, header or schema
+    NUM_CATEGORY_STATS
+};
+
+class ParserBenchmark
+{
+public:
+    ParserBenchmark() :
+        framer(BENCHMARK_RING_SIZE, BENCHMARK_FRAME_LEN, PACKET_START_0, PACKET_START_1, PACKET_STOP),
+        protocol(PROTOCOL_V1),
+        stats(NUM_CATEGORY_STATS),
+        digest(0),
+        fields(0),
+        framing_errors(0),
+        device_messages(0)
+    {
+        for (size_t i = 0; i < NUM_DEVICE_PACKET_SCHEMAS; i++) {
+            schemas_by_category.add(DEVICE_PACKET_SCHEMAS[i].category, i);
+        }
+        for (size_t i = 0; i < 0x100; i++) {
+            schemas_by_id[i] = CATEGORY_UNKNOWN;
+        }
+        for (size_t i = 0; i < NUM_DEVICE_PACKET_SCHEMAS; i++) {
+            schemas_by_id[DEVICE_PACKET_SCHEMAS[i].id] = i;
+        }
+        for (size_t i = 0; i < stats.size(); i++) {
+            stats[i].packets = 0;
+            stats[i].total_ns = 0;
+            stats[i].max_ns = 0;
+        }
+    }
+
+    // Feeds one recorded RX chunk to the framer and parses every packet it completes
+    void feed(const uint8_t* data, size_t length)
+    {
+        while (length > 0)
+        {
+            size_t num_written = framer.write(data, length);
+            data += num_written;
+            length -= num_written;
+            drain();
+        }
+    }
+
+    void reset()
+    {
+        framer.reset();
+        protocol = PROTOCOL_V1;
+    }
+
+    void report(double elapsed) const
+    {
+        uint64_t total_packets = 0;
+        for (size_t i = 0; i < stats.size(); i++) {
+            total_packets += stats[i].packets;
+        }
+        printf("%lu packets in %0.3fs (%0.1f packets/s including framing)\n",
+            total_packets, elapsed, elapsed > 0.0 ? total_packets / elapsed : 0.0);
+        printf("%lu fields decoded, digest %08x. %lu framing errors, %lu device messages\n",
+            fields, (uint32_t)(digest ^ (digest >> 32)), framing_errors, device_messages);
+        printf("%-12s %10s %14s %12s %12s\n", "category", "packets", "packets/s", "ns/packet", "max ns");
+        for (size_t i = 0; i < stats.size(); i++)
+        {
+            const CategoryStat* stat = &stats[i];
+            if (stat->packets == 0) {
+                continue;
+            }
+            double ns_per_packet = (double)stat->total_ns / stat->packets;
+            printf("%-12s %10lu %14.1f %12.1f %12lu\n", categoryName(i),
+                stat->packets, ns_per_packet > 0.0 ? 1e9 / ns_per_packet : 0.0, ns_per_packet, stat->max_ns);
+        }
+    }
+
+private:
+    PacketFramer framer;
+    char frame[BENCHMARK_FRAME_LEN + 1];
+    size_t frame_len;
+    PacketCursor cursor;
+    int protocol;
+
+    PacketDispatchTable<size_t> schemas_by_category;  // v1. Index into DEVICE_PACKET_SCHEMAS
+    size_t schemas_by_id[0x100];  // v2
+
+    vector<CategoryStat> stats;  // indexed like DEVICE_PACKET_SCHEMAS, then CATEGORY_*
+    uint64_t digest;  // keeps the decoded values live. Matches between builds that decode alike
+    uint64_t fields;
+    uint64_t framing_errors;
+    uint64_t device_messages;
+
+    static const char* categoryName(size_t index)
+    {
+        if (index == CATEGORY_UNKNOWN) {
+            return "(unknown)";
+        }
+        if (index == CATEGORY_REJECTED) {
+            return "(rejected)";
+        }
+        return DEVICE_PACKET_SCHEMAS[index].category;
+    }
+
+    void drain()
+    {
+        while (true)
+        {
+            switch (framer.nextFrame(frame, &frame_len))
+            {
+                case PacketFramer::FRAME_PACKET: {
+                    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                    size_t index = parse();
+                    uint64_t elapsed_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                    CategoryStat* stat = &stats[index];
+                    stat->packets++;
+                    stat->total_ns += elapsed_ns;
+                    if (elapsed_ns > stat->max_ns) {
+                        stat->max_ns = elapsed_ns;
+                    }
+                    break;
+                }
+                case PacketFramer::FRAME_DEVICE_MESSAGE:
+                    device_messages++;
+                    break;
+                case PacketFramer::FRAME_ERROR_LENGTH:
+                case PacketFramer::FRAME_ERROR_STOP:
+                    framing_errors++;
+                    break;
+                default:
+                    return;
+            }
+        }
+    }
+
+    // Same checks and lookups as DodobotParsing::readSerial. Returns the stats index
+    size_t parse()
+    {
+        if (frame_len < PACKET_MIN_LEN) {
+            return CATEGORY_REJECTED;
+        }
+        uint16_t recv_checksum, calc_checksum;
+        if (!packetChecksumOk(protocol, frame, frame_len, &recv_checksum, &calc_checksum)) {
+            int other = protocol == PROTOCOL_V2 ? PROTOCOL_V1 : PROTOCOL_V2;
+            if (!packetChecksumOk(other, frame, frame_len, &recv_checksum, &calc_checksum)) {
+                return CATEGORY_REJECTED;
+            }
+            protocol = other;
+        }
+
+        size_t index;
+        if (protocol == PROTOCOL_V2)
+        {
+            index = schemas_by_id[(uint8_t)frame[0]];
+            digest += ((uint32_t)(uint8_t)frame[1] << 8) | (uint8_t)frame[2];
+            cursor.reset(frame + 3, frame_len - 5, PacketCursor::FIELDS_PACKED);
+        }
+        else
+        {
+            cursor.reset(frame, frame_len - 2);
+            if (!cursor.expect("u")) {
+                return CATEGORY_REJECTED;
+            }
+            digest += cursor.read<uint32_t>();
+            boost::string_ref category = cursor.read_until('\t');
+            const size_t* found = schemas_by_category.find(category.data(), category.size());
+            index = found == NULL ? CATEGORY_UNKNOWN : *found;
+        }
+        if (index == CATEGORY_UNKNOWN) {
+            return CATEGORY_UNKNOWN;
+        }
+        return decode(DEVICE_PACKET_SCHEMAS[index].schema) ? index : CATEGORY_REJECTED;
+    }
+
+    bool decode(const char* schema)
+    {
+        if (!cursor.expect(schema)) {
+            return false;
+        }
+        for (; *schema != '\0'; schema++)
+        {
+            uint32_t bits;
+            switch (*schema)
+            {
+                case 'u':
+                    bits = cursor.read<uint32_t>();
+                    break;
+                case 'd':
+                    bits = (uint32_t)cursor.read<int32_t>();
+                    break;
+                case 'f': {
+                    float value = cursor.read<float>();
+                    memcpy(&bits, &value, sizeof(bits));
+                    break;
+                }
+                default: {
+                    boost::string_ref view = cursor.read_string_view();
+                    bits = (uint32_t)view.size() + (view.empty() ? 0 : (uint8_t)view[0]);
+                    break;
+                }
+            }
+            digest = digest * 31 + bits;
+            fields++;
+        }
+        return true;
+    }
+};
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: db_parsing_benchmark <capture file> [passes]\n");
+        return 1;
+    }
+    int passes = argc > 2 ? atoi(argv[2]) : 1;
+    if (passes < 1) {
+        passes = 1;
+    }
+
+    SerialCaptureReader reader;
+    if (!reader.open(argv[1])) {
+        fprintf(stderr, "Failed to open capture %s\n", argv[1]);
+        return 1;
+    }
+
+    // the capture is memory mapped. Touch it once so the first pass doesn't time page faults
+    uint64_t stamp_ns;
+    SerialCaptureWriter::Direction direction;
+    const uint8_t* data;
+    size_t length;
+    size_t rx_bytes = 0;
+    while (reader.next(&stamp_ns, &direction, &data, &length)) {
+        if (direction == SerialCaptureWriter::CAPTURE_RX) {
+            rx_bytes += length;
+        }
+    }
+    printf("%s: %lu RX bytes, %d pass(es)\n", argv[1], rx_bytes, passes);
+
+    ParserBenchmark benchmark;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; pass++)
+    {
+        reader.rewind();
+        benchmark.reset();
+        while (reader.next(&stamp_ns, &direction, &data, &length)) {
+            if (direction == SerialCaptureWriter::CAPTURE_RX) {
+                benchmark.feed(data, length);
+            }
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    benchmark.report(elapsed);
+
+    return 0;
+}
@@ -5,8 +5,9 @@ int main(int argc, char **argv)
 {
     ros::init(argc, argv, "db_parsing");
     ros::NodeHandle nh;
+    ros::NodeHandle private_nh("~");
 
-    DodobotParsing broadcaster(&nh);
+    DodobotParsing broadcaster(&nh, &private_nh);
     int err = broadcaster.run();
 
     return err;
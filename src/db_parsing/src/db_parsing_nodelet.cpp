@@ -0,0 +1,62 @@
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+#include "db_parsing/db_parsing.h"
+
+namespace db_parsing
+{
+
+// Runs DodobotParsing inside a nodelet manager so drive and bumper messages
+// reach db_chassis and db_bumper without being serialized.
+// The serial loop gets its own thread and services this nodelet's callback
+// queue (timers) between reads, just like the standalone node does with the
+// global queue. Subscribers and services run on DodobotParsing's own spinners
+class DodobotParsingNodelet : public nodelet::Nodelet
+{
+public:
+    DodobotParsingNodelet() : parsing(NULL), rx_thread(NULL) {}
+
+    ~DodobotParsingNodelet()
+    {
+        if (rx_thread != NULL) {
+            parsing->requestStop();
+            rx_thread->join();
+            delete rx_thread;
+        }
+        delete parsing;
+    }
+
+private:
+    ros::CallbackQueue callback_queue;
+    ros::NodeHandle nh;
+    ros::NodeHandle private_nh;
+    DodobotParsing* parsing;
+    boost::thread* rx_thread;
+
+    virtual void onInit()
+    {
+        nh = getNodeHandle();
+        nh.setCallbackQueue(&callback_queue);
+        private_nh = getPrivateNodeHandle();
+
+        parsing = new DodobotParsing(&nh, &private_nh);
+        rx_thread = new boost::thread(boost::bind(&DodobotParsingNodelet::rx_thread_task, this));
+    }
+
+    void rx_thread_task()
+    {
+        // the standalone node lets these end the process. Here they'd take the whole manager down
+        try {
+            if (parsing->run(&callback_queue) != 0) {
+                NODELET_ERROR("Serial loop exited with an error");
+            }
+        }
+        catch (exception& e) {
+            NODELET_FATAL_STREAM("Serial bridge failed: " << e.what());
+        }
+    }
+};
+
+}  // namespace db_parsing
+
+PLUGINLIB_EXPORT_CLASS(db_parsing::DodobotParsingNodelet, nodelet::Nodelet)